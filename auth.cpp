@@ -248,6 +248,7 @@ QcVerifyCertificate(
     _In_ const std::string& Password,
     _In_ QUIC_CERTIFICATE* Cert)
 {
+    QC_TRACE(QcTraceVerify, 0);
     EVP_PKEY* SigningKey = nullptr;
     X509* PeerCert = (X509*)Cert;
     BIGNUM* SaltBn = nullptr;
@@ -305,4 +306,21 @@ Error:
     }
 
     return Result;
-}
\ No newline at end of file
+}
+
+QUIC_CERTIFICATE*
+QcReferenceCertificate(
+    _In_ QUIC_CERTIFICATE* Cert)
+{
+    if (X509_up_ref((X509*)Cert) != 1) {
+        return nullptr;
+    }
+    return Cert;
+}
+
+void
+QcReleaseCertificate(
+    _In_ QUIC_CERTIFICATE* Cert)
+{
+    X509_free((X509*)Cert);
+}
@@ -12,3 +12,13 @@ bool
 QcVerifyCertificate(
     _In_ const std::string& Password,
     _In_ QUIC_CERTIFICATE* Cert);
+
+// Takes a reference on a peer certificate so it can be verified after the
+// PEER_CERTIFICATE_RECEIVED callback returns.
+QUIC_CERTIFICATE*
+QcReferenceCertificate(
+    _In_ QUIC_CERTIFICATE* Cert);
+
+void
+QcReleaseCertificate(
+    _In_ QUIC_CERTIFICATE* Cert);
@@ -0,0 +1,313 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+using namespace std;
+
+// Each thread caches up to this many bytes of each size class, and at least
+// one buffer.
+const size_t ThreadCacheBytes = 1024 * 1024;
+
+size_t
+QcBufferClass(
+    _In_ size_t Length
+    )
+{
+    if (Length <= ((size_t)1 << QcMinBufferClassShift)) {
+        return 0;
+    }
+    return (size_t)bit_width(Length - 1) - QcMinBufferClassShift;
+}
+
+size_t
+QcBufferClassSize(
+    _In_ size_t Class
+    )
+{
+    return (size_t)1 << (Class + QcMinBufferClassShift);
+}
+
+void
+QcRaiseHighWater(
+    _Inout_ atomic<uint64_t>& HighWater,
+    _In_ uint64_t Value
+    )
+{
+    uint64_t Current = HighWater.load(memory_order_relaxed);
+    while (Value > Current && !HighWater.compare_exchange_weak(Current, Value, memory_order_relaxed)) {
+    }
+}
+
+//
+// Buffers freed on a thread, handed back to the next allocation on it
+// without taking the pool's lock. Its own lock is only contended when the
+// pool trims, which takes back what every cache holds: a thread which only
+// frees buffers, as MsQuic's workers do, would otherwise keep them from the
+// cap for good. A thread's cache goes back to the pool's free lists when it
+// exits.
+//
+struct QcBufferCache {
+    mutex Lock;
+    array<vector<uint8_t*>, QcBufferClassCount> Free;
+    QcBufferCache();
+    ~QcBufferCache();
+};
+
+thread_local QcBufferCache BufferCache;
+// Buffers freed by the thread's other thread_local destructors, after its
+// cache's, go straight to the pool.
+thread_local bool BufferCacheDestroyed = false;
+
+QcBufferCache::QcBufferCache()
+{
+    auto& Pool = QcBufferPool::Get();
+    lock_guard<mutex> PoolLock(Pool.Lock);
+    Pool.Caches.push_back(this);
+}
+
+QcBufferCache::~QcBufferCache()
+{
+    BufferCacheDestroyed = true;
+    auto& Pool = QcBufferPool::Get();
+    lock_guard<mutex> PoolLock(Pool.Lock);
+    Pool.Caches.erase(find(Pool.Caches.begin(), Pool.Caches.end(), this));
+    for (size_t Class = 0; Class < QcBufferClassCount; ++Class) {
+        Pool.FreeLists[Class].insert(Pool.FreeLists[Class].end(), Free[Class].begin(), Free[Class].end());
+    }
+}
+
+void
+QcBufferDeleter::operator()(
+    _In_ uint8_t* Buffer
+    ) const
+{
+    QcBufferPool::Get().Free(Buffer, Length);
+}
+
+QcBufferPool&
+QcBufferPool::Get()
+{
+    static QcBufferPool Pool;
+    return Pool;
+}
+
+QcBufferPool::~QcBufferPool()
+{
+    lock_guard<mutex> Lock(this->Lock);
+    if (!HugePages) {
+        Trim();
+    }
+    for (auto& Slab : Slabs) {
+#ifdef __linux__
+        if (Slab.Mapped) {
+            munmap(Slab.Base, Slab.Length);
+        } else {
+            free(Slab.Base);
+        }
+#endif
+    }
+}
+
+bool
+QcBufferPool::EnableHugePages()
+{
+#ifdef __linux__
+    lock_guard<mutex> Lock(this->Lock);
+    if (BytesAllocated != 0) {
+        return false;
+    }
+    HugePages = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+QcBuffer
+QcBufferPool::Allocate(
+    _In_ size_t Length
+    )
+{
+    if (Length > QcBufferClassSize(QcBufferClassCount - 1)) {
+        uint8_t* Buffer = nullptr;
+        bool Reserved = ReserveBytes(Length);
+        if (!Reserved) {
+            lock_guard<mutex> Lock(this->Lock);
+            Trim();
+            Reserved = ReserveBytes(Length);
+        }
+        if (Reserved) {
+            Buffer = new(nothrow) uint8_t[Length];
+            if (Buffer == nullptr) {
+                BytesAllocated -= Length;
+            }
+        }
+        if (Buffer == nullptr) {
+            AllocationsFailed++;
+            return {};
+        }
+        AddInFlight((int64_t)Length);
+        return QcBuffer(Buffer, QcBufferDeleter{Length});
+    }
+
+    size_t Class = QcBufferClass(Length);
+    uint8_t* Buffer = nullptr;
+    if (!BufferCacheDestroyed) {
+        lock_guard<mutex> CacheLock(BufferCache.Lock);
+        if (!BufferCache.Free[Class].empty()) {
+            Buffer = BufferCache.Free[Class].back();
+            BufferCache.Free[Class].pop_back();
+        }
+    }
+    if (Buffer == nullptr) {
+        lock_guard<mutex> Lock(this->Lock);
+        if (!FreeLists[Class].empty()) {
+            Buffer = FreeLists[Class].back();
+            FreeLists[Class].pop_back();
+        } else {
+            Buffer = Reserve(Class);
+        }
+    }
+    if (Buffer == nullptr) {
+        AllocationsFailed++;
+        return {};
+    }
+    AddInFlight((int64_t)QcBufferClassSize(Class));
+    return QcBuffer(Buffer, QcBufferDeleter{Length});
+}
+
+void
+QcBufferPool::Free(
+    _In_ uint8_t* Buffer,
+    _In_ size_t Length
+    )
+{
+    if (Length > QcBufferClassSize(QcBufferClassCount - 1)) {
+        delete[] Buffer;
+        BytesAllocated -= Length;
+        AddInFlight(-(int64_t)Length);
+        return;
+    }
+    size_t Class = QcBufferClass(Length);
+    size_t Size = QcBufferClassSize(Class);
+    AddInFlight(-(int64_t)Size);
+    if (!BufferCacheDestroyed) {
+        lock_guard<mutex> CacheLock(BufferCache.Lock);
+        if (BufferCache.Free[Class].size() < max<size_t>(1, ThreadCacheBytes / Size)) {
+            BufferCache.Free[Class].push_back(Buffer);
+            return;
+        }
+    }
+    lock_guard<mutex> Lock(this->Lock);
+    FreeLists[Class].push_back(Buffer);
+}
+
+uint8_t*
+QcBufferPool::Reserve(
+    _In_ size_t Class
+    )
+{
+    size_t Size = QcBufferClassSize(Class);
+    if (!HugePages) {
+        if (!ReserveBytes(Size)) {
+            Trim();
+            if (!ReserveBytes(Size)) {
+                return nullptr;
+            }
+        }
+        auto Buffer = new(nothrow) uint8_t[Size];
+        if (Buffer == nullptr) {
+            BytesAllocated -= Size;
+        }
+        return Buffer;
+    }
+#ifdef __linux__
+    // Small classes are carved out of a hugepage, the rest of which fills
+    // the class' free list.
+    size_t SlabLength = max(Size, QcHugePageSize);
+    if (!ReserveBytes(SlabLength)) {
+        return nullptr;
+    }
+    QcHugePageSlab Slab{nullptr, SlabLength, true};
+    Slab.Base = mmap(nullptr, SlabLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (Slab.Base == MAP_FAILED) {
+        // None reserved; aligned memory may still get transparent ones.
+        Slab.Mapped = false;
+        Slab.Base = aligned_alloc(QcHugePageSize, SlabLength);
+        if (Slab.Base == nullptr) {
+            BytesAllocated -= SlabLength;
+            return nullptr;
+        }
+        madvise(Slab.Base, SlabLength, MADV_HUGEPAGE);
+    }
+    Slabs.push_back(Slab);
+    auto Base = (uint8_t*)Slab.Base;
+    for (size_t Offset = Size; Offset < SlabLength; Offset += Size) {
+        FreeLists[Class].push_back(Base + Offset);
+    }
+    return Base;
+#else
+    return nullptr;
+#endif
+}
+
+bool
+QcBufferPool::ReserveBytes(
+    _In_ uint64_t Length
+    )
+{
+    uint64_t Allocated = BytesAllocated.fetch_add(Length) + Length;
+    if (Limit != 0 && Allocated > Limit) {
+        BytesAllocated -= Length;
+        return false;
+    }
+    QcRaiseHighWater(BytesAllocatedHighWater, Allocated);
+    return true;
+}
+
+void
+QcBufferPool::Trim()
+{
+    // Hugepages can't be released a buffer at a time.
+    if (HugePages) {
+        return;
+    }
+    for (auto Cache : Caches) {
+        lock_guard<mutex> CacheLock(Cache->Lock);
+        for (size_t Class = 0; Class < QcBufferClassCount; ++Class) {
+            FreeLists[Class].insert(FreeLists[Class].end(), Cache->Free[Class].begin(), Cache->Free[Class].end());
+            Cache->Free[Class].clear();
+        }
+    }
+    for (size_t Class = 0; Class < QcBufferClassCount; ++Class) {
+        for (auto Buffer : FreeLists[Class]) {
+            delete[] Buffer;
+        }
+        BytesAllocated -= FreeLists[Class].size() * QcBufferClassSize(Class);
+        FreeLists[Class].clear();
+    }
+}
+
+void
+QcBufferPool::AddInFlight(
+    _In_ int64_t Length
+    )
+{
+    uint64_t InFlight = BytesInFlight.fetch_add((uint64_t)Length, memory_order_relaxed) + (uint64_t)Length;
+    if (Length > 0) {
+        QcRaiseHighWater(BytesInFlightHighWater, InFlight);
+    }
+}
+
+QcBufferPoolStatistics
+QcBufferPool::GetStatistics() const
+{
+    QcBufferPoolStatistics Stats;
+    Stats.BytesAllocated = BytesAllocated.load(memory_order_relaxed);
+    Stats.BytesAllocatedHighWater = BytesAllocatedHighWater.load(memory_order_relaxed);
+    Stats.BytesInFlight = BytesInFlight.load(memory_order_relaxed);
+    Stats.BytesInFlightHighWater = BytesInFlightHighWater.load(memory_order_relaxed);
+    Stats.AllocationsFailed = AllocationsFailed.load(memory_order_relaxed);
+    return Stats;
+}
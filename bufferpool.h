@@ -0,0 +1,108 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+//
+// The process' data path buffers: send buffers, shared fanout chunks, stripe
+// chunks, served file reads and tunnel socket reads. Lengths are rounded up to a power of two size
+// class, and freed buffers are kept for reuse, first in a small cache on the
+// freeing thread, then in the pool's free lists, so transfers in their
+// steady state don't touch the heap. Lengths past the largest class are
+// allocated and freed directly.
+//
+// Memory the pool takes is counted, and may be capped; past the cap,
+// buffers which aren't in use are released, the threads' caches included,
+// and allocations fail once there are none left.
+//
+
+const uint32_t QcMinBufferClassShift = 12;
+const uint32_t QcMaxBufferClassShift = 22;
+const size_t QcBufferClassCount = QcMaxBufferClassShift - QcMinBufferClassShift + 1;
+const size_t QcHugePageSize = 2 * 1024 * 1024;
+
+struct QcBufferDeleter {
+    size_t Length{0};
+    void operator()(_In_ uint8_t* Buffer) const;
+};
+
+//
+// A buffer from the pool, returned to it on destruction.
+//
+using QcBuffer = std::unique_ptr<uint8_t[], QcBufferDeleter>;
+
+struct QcBufferCache;
+
+struct QcBufferPoolStatistics {
+    // Memory taken for buffers, and the most it's been.
+    uint64_t BytesAllocated{0};
+    uint64_t BytesAllocatedHighWater{0};
+    // Memory in buffers being used, and the most it's been.
+    uint64_t BytesInFlight{0};
+    uint64_t BytesInFlightHighWater{0};
+    // Allocations refused by the cap.
+    uint64_t AllocationsFailed{0};
+};
+
+class QcBufferPool {
+public:
+    QcBufferPool(const QcBufferPool&) = delete;
+    QcBufferPool& operator=(const QcBufferPool&) = delete;
+    ~QcBufferPool();
+
+    static QcBufferPool& Get();
+
+    // Set up before the first buffer is allocated. Zero removes the cap.
+    void SetLimit(_In_ uint64_t Bytes) { Limit = Bytes; }
+    // Backs the size classes with 2 MiB hugepages, from the reserved pool
+    // if there is one, or else transparent ones. Linux only; elsewhere it
+    // returns false. Buffers in hugepages are kept until the process exits.
+    bool EnableHugePages();
+
+    // Returns an empty buffer if the cap doesn't leave room for it.
+    QcBuffer Allocate(_In_ size_t Length);
+
+    QcBufferPoolStatistics GetStatistics() const;
+
+private:
+    friend struct QcBufferDeleter;
+    friend struct QcBufferCache;
+
+    QcBufferPool() = default;
+
+    void Free(_In_ uint8_t* Buffer, _In_ size_t Length);
+    // Takes new memory for a buffer of class Class, which may fill the
+    // class' free list with more.
+    uint8_t* Reserve(_In_ size_t Class);
+    bool ReserveBytes(_In_ uint64_t Length);
+    // Releases the free lists, and the buffers cached by every thread, where
+    // their memory can be released. Called with Lock held.
+    void Trim();
+    void AddInFlight(_In_ int64_t Length);
+
+    struct QcHugePageSlab {
+        void* Base;
+        size_t Length;
+        bool Mapped;
+    };
+
+    std::mutex Lock;
+    std::array<std::vector<uint8_t*>, QcBufferClassCount> FreeLists;
+    std::vector<QcHugePageSlab> Slabs;
+    // Every thread's cache, so Trim can take back what they hold.
+    std::vector<QcBufferCache*> Caches;
+    uint64_t Limit{0};
+    bool HugePages{false};
+    std::atomic<uint64_t> BytesAllocated{0};
+    std::atomic<uint64_t> BytesAllocatedHighWater{0};
+    std::atomic<uint64_t> BytesInFlight{0};
+    std::atomic<uint64_t> BytesInFlightHighWater{0};
+    std::atomic<uint64_t> AllocationsFailed{0};
+};
@@ -0,0 +1,38 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+//
+// A counter which is updated from many MsQuic worker threads at once. Each
+// thread adds to its own cache line, and readers sum all of the shards, so
+// updates never contend.
+//
+template<typename T = uint64_t, size_t ShardCount = 16>
+class QcShardedCounter {
+public:
+    void Add(_In_ T Value) {
+        Shards[ShardIndex()].Value.fetch_add(Value, std::memory_order_relaxed);
+    }
+    T Get() const {
+        T Sum = 0;
+        for (auto& Shard : Shards) {
+            Sum += Shard.Value.load(std::memory_order_relaxed);
+        }
+        return Sum;
+    }
+private:
+    static size_t ShardIndex() {
+        static thread_local const size_t Index =
+            std::hash<std::thread::id>{}(std::this_thread::get_id()) % ShardCount;
+        return Index;
+    }
+    struct alignas(64) QcCounterShard {
+        std::atomic<T> Value{0};
+    };
+    QcCounterShard Shards[ShardCount];
+};
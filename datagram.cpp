@@ -0,0 +1,218 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+using namespace std;
+
+void
+QcFecEncoder::Encode(
+    _In_reads_bytes_(Length) const uint8_t* Record,
+    _In_ uint32_t Length,
+    _Inout_ vector<vector<uint8_t>>& Datagrams
+    )
+{
+    vector<uint8_t> Datagram(1 + 8 + Length);
+    Datagram[0] = QcDatagramData;
+    uint8_t* Cursor = QuicVarIntEncode(Sequence, Datagram.data() + 1);
+    memcpy(Cursor, Record, Length);
+    Datagram.resize((size_t)(Cursor - Datagram.data()) + Length);
+    Datagrams.push_back(std::move(Datagram));
+    if (GroupSize == 0) {
+        Sequence++;
+        return;
+    }
+    if (GroupCount == 0) {
+        GroupFirst = Sequence;
+    }
+    if (Parity.size() < Length) {
+        Parity.resize(Length, 0);
+    }
+    for (uint32_t i = 0; i < Length; ++i) {
+        Parity[i] ^= Record[i];
+    }
+    LengthXor ^= Length;
+    GroupCount++;
+    Sequence++;
+    if (GroupCount == GroupSize) {
+        Finish(Datagrams);
+    }
+}
+
+void
+QcFecEncoder::Finish(
+    _Inout_ vector<vector<uint8_t>>& Datagrams
+    )
+{
+    if (GroupCount == 0) {
+        return;
+    }
+    vector<uint8_t> Datagram(QcMaxDatagramOverhead + Parity.size());
+    Datagram[0] = QcDatagramParity;
+    uint8_t* Cursor = QuicVarIntEncode(GroupFirst, Datagram.data() + 1);
+    Cursor = QuicVarIntEncode(GroupCount, Cursor);
+    Cursor = QuicVarIntEncode(LengthXor, Cursor);
+    memcpy(Cursor, Parity.data(), Parity.size());
+    Datagram.resize((size_t)(Cursor - Datagram.data()) + Parity.size());
+    Datagrams.push_back(std::move(Datagram));
+    Parity.clear();
+    LengthXor = 0;
+    GroupCount = 0;
+}
+
+QcFecDecoder::QcFecDecoder() :
+    Window(WindowSize)
+{
+}
+
+bool
+QcFecDecoder::Has(
+    _In_ uint64_t Sequence
+    ) const
+{
+    auto& Entry = Window[Sequence % WindowSize];
+    return Entry.Present && Entry.Sequence == Sequence;
+}
+
+void
+QcFecDecoder::Receive(
+    _In_reads_bytes_(Length) const uint8_t* Datagram,
+    _In_ uint32_t Length,
+    _In_ const DeliverFn& Deliver
+    )
+{
+    uint16_t Offset = 1;
+    uint16_t HeaderLength = (uint16_t)min<uint32_t>(Length, QcMaxDatagramOverhead);
+    QUIC_VAR_INT Sequence = 0;
+    if (Length < 2 || !QuicVarIntDecode(HeaderLength, Datagram, &Offset, &Sequence)) {
+        Counters.Malformed++;
+        return;
+    }
+    if (Datagram[0] == QcDatagramData) {
+        Accept(Sequence, Datagram + Offset, Length - Offset, false, Deliver);
+        return;
+    }
+    QUIC_VAR_INT Count = 0, LengthXor = 0;
+    if (Datagram[0] != QcDatagramParity ||
+        !QuicVarIntDecode(HeaderLength, Datagram, &Offset, &Count) ||
+        !QuicVarIntDecode(HeaderLength, Datagram, &Offset, &LengthXor) ||
+        Count == 0 || Count > QcMaxFecGroupSize) {
+        Counters.Malformed++;
+        return;
+    }
+    if (!Started || Sequence < Base) {
+        // The group's records have left the window, or none have arrived.
+        return;
+    }
+    uint64_t MissingSequence = 0;
+    uint32_t MissingCount = 0;
+    for (uint64_t i = Sequence; i < Sequence + Count; ++i) {
+        if (!Has(i)) {
+            MissingSequence = i;
+            MissingCount++;
+        }
+    }
+    if (MissingCount != 1) {
+        return;
+    }
+    vector<uint8_t> Rebuilt(Datagram + Offset, Datagram + Length);
+    uint64_t RebuiltLength = LengthXor;
+    for (uint64_t i = Sequence; i < Sequence + Count; ++i) {
+        if (i == MissingSequence) {
+            continue;
+        }
+        auto& Record = Window[i % WindowSize].Record;
+        if (Record.size() > Rebuilt.size()) {
+            Counters.Malformed++;
+            return;
+        }
+        for (size_t j = 0; j < Record.size(); ++j) {
+            Rebuilt[j] ^= Record[j];
+        }
+        RebuiltLength ^= Record.size();
+    }
+    if (RebuiltLength > Rebuilt.size()) {
+        Counters.Malformed++;
+        return;
+    }
+    Accept(MissingSequence, Rebuilt.data(), (uint32_t)RebuiltLength, true, Deliver);
+}
+
+void
+QcFecDecoder::Accept(
+    _In_ uint64_t Sequence,
+    _In_reads_bytes_(Length) const uint8_t* Record,
+    _In_ uint32_t Length,
+    _In_ bool Rebuilt,
+    _In_ const DeliverFn& Deliver
+    )
+{
+    if (Started && Sequence < Base) {
+        Counters.Late++;
+        return;
+    }
+    if (!Started) {
+        Base = Sequence >= WindowSize ? Sequence - WindowSize + 1 : 0;
+        Highest = Sequence;
+        Started = true;
+    }
+    if (Sequence >= Base + WindowSize) {
+        // Slide the window up, counting what's left behind unreceived.
+        uint64_t NewBase = Sequence - WindowSize + 1;
+        uint64_t End = min(NewBase, Base + WindowSize);
+        for (uint64_t i = Base; i < End; ++i) {
+            if (!Has(i)) {
+                Counters.Missing++;
+            }
+            Window[i % WindowSize].Present = false;
+        }
+        Counters.Missing += NewBase - End;
+        Base = NewBase;
+    }
+    auto& Entry = Window[Sequence % WindowSize];
+    if (Entry.Present && Entry.Sequence == Sequence) {
+        Counters.Duplicates++;
+        return;
+    }
+    Entry.Sequence = Sequence;
+    Entry.Present = true;
+    Entry.Record.assign(Record, Record + Length);
+    if (Rebuilt) {
+        Counters.Recovered++;
+    } else {
+        Counters.Received++;
+        if (Sequence < Highest) {
+            Counters.Reordered++;
+        }
+    }
+    Highest = max(Highest, Sequence);
+    Deliver(Record, Length);
+}
+
+void
+QcFecDecoder::Finish()
+{
+    if (!Started) {
+        return;
+    }
+    for (uint64_t i = Base; i <= Highest; ++i) {
+        if (!Has(i)) {
+            Counters.Missing++;
+        }
+    }
+    Started = false;
+}
+
+void
+QcFecDecoder::GetStatistics(
+    _Inout_ QcDatagramStatistics& Statistics
+    ) const
+{
+    Statistics.Received += Counters.Received;
+    Statistics.Recovered += Counters.Recovered;
+    Statistics.Reordered += Counters.Reordered;
+    Statistics.Duplicates += Counters.Duplicates;
+    Statistics.Late += Counters.Late;
+    Statistics.Missing += Counters.Missing;
+    Statistics.Malformed += Counters.Malformed;
+}
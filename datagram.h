@@ -0,0 +1,118 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+//
+// Records sent as unreliable QUIC DATAGRAMs. A data datagram is a type byte
+// and a varint sequence number, then the record.
+//
+// With forward error correction, each group of up to GroupSize records is
+// followed by a parity datagram: the type, a varint first sequence number,
+// a varint record count, the varint XOR of the record lengths, then the XOR
+// of the records, each zero padded to the longest. Any one record lost from
+// a group is rebuilt from the rest and the parity, without a retransmission.
+//
+const uint8_t QcDatagramData = 0;
+const uint8_t QcDatagramParity = 1;
+const uint32_t QcMaxFecGroupSize = 64;
+// Largest header of either kind.
+const uint32_t QcMaxDatagramOverhead = 1 + 8 + 8 + 8;
+
+struct QcDatagramStatistics {
+    // Sender. Datagrams are either acknowledged, declared lost by MsQuic, or
+    // dropped: too long for the path, or canceled.
+    uint64_t Sent;
+    uint64_t Acknowledged;
+    uint64_t Lost;
+    uint64_t Dropped;
+    // Receiver, in records. Reordered records arrived after a later one;
+    // late ones arrived too long after to be told apart from duplicates, and
+    // are discarded. Missing records were neither received nor recovered.
+    uint64_t Received;
+    uint64_t Recovered;
+    uint64_t Reordered;
+    uint64_t Duplicates;
+    uint64_t Late;
+    uint64_t Missing;
+    uint64_t Malformed;
+};
+
+class QcFecEncoder {
+public:
+    // GroupSize zero disables error correction.
+    QcFecEncoder(_In_ uint32_t FecGroupSize) : GroupSize(FecGroupSize) {}
+
+    // Appends the datagram for Record to Datagrams, and the group's parity
+    // if Record completes it.
+    void
+    Encode(
+        _In_reads_bytes_(Length) const uint8_t* Record,
+        _In_ uint32_t Length,
+        _Inout_ std::vector<std::vector<uint8_t>>& Datagrams);
+
+    // Appends the parity of a partial group, at the end of the records.
+    void Finish(_Inout_ std::vector<std::vector<uint8_t>>& Datagrams);
+
+private:
+    uint32_t GroupSize;
+    uint64_t Sequence{0};
+    uint64_t GroupFirst{0};
+    uint32_t GroupCount{0};
+    uint32_t LengthXor{0};
+    std::vector<uint8_t> Parity;
+};
+
+//
+// Tracks the last WindowSize sequence numbers, to spot duplicates and
+// reordering, and keeps their records for rebuilding lost ones.
+//
+class QcFecDecoder {
+public:
+    typedef std::function<void(const uint8_t* Record, uint32_t Length)> DeliverFn;
+
+    QcFecDecoder();
+
+    // Passes the datagram's record, and any record it lets be recovered, to
+    // Deliver. Records are delivered as they arrive, so may be out of order.
+    void
+    Receive(
+        _In_reads_bytes_(Length) const uint8_t* Datagram,
+        _In_ uint32_t Length,
+        _In_ const DeliverFn& Deliver);
+
+    // Counts the records before the last one seen which never arrived.
+    void Finish();
+
+    // Adds this decoder's counts to Statistics.
+    void GetStatistics(_Inout_ QcDatagramStatistics& Statistics) const;
+
+private:
+    struct Slot {
+        uint64_t Sequence;
+        bool Present{false};
+        std::vector<uint8_t> Record;
+    };
+
+    void
+    Accept(
+        _In_ uint64_t Sequence,
+        _In_reads_bytes_(Length) const uint8_t* Record,
+        _In_ uint32_t Length,
+        _In_ bool Rebuilt,
+        _In_ const DeliverFn& Deliver);
+
+    bool Has(_In_ uint64_t Sequence) const;
+
+    static const uint32_t WindowSize = 1024;
+    std::vector<Slot> Window;
+    // Lowest sequence number the window covers.
+    uint64_t Base{0};
+    uint64_t Highest{0};
+    bool Started{false};
+    QcDatagramStatistics Counters{};
+};
@@ -0,0 +1,210 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+using namespace std;
+
+//
+// FastCDC's gear table, a random value per byte. Boundaries depend on it, so
+// it's fixed: every sender has to cut the same data in the same places for
+// its chunks to be found in a receiver's store.
+//
+constexpr array<uint64_t, 256>
+QcMakeGearTable()
+{
+    array<uint64_t, 256> Table{};
+    // splitmix64, from an arbitrary seed.
+    uint64_t State = 0x71756963636174ull;
+    for (auto& Entry : Table) {
+        uint64_t Value = (State += 0x9E3779B97F4A7C15ull);
+        Value = (Value ^ (Value >> 30)) * 0xBF58476D1CE4E5B9ull;
+        Value = (Value ^ (Value >> 27)) * 0x94D049BB133111EBull;
+        Entry = Value ^ (Value >> 31);
+    }
+    return Table;
+}
+
+const array<uint64_t, 256> GearTable = QcMakeGearTable();
+
+// Normalized chunking: boundaries are harder to hit before the average
+// length, and easier after, so lengths cluster around it. The gear hash
+// shifts left a bit per byte, so its high bits cover the last 64 bytes.
+const uint64_t DedupMaskSmall = ~0ull << (64 - 18);
+const uint64_t DedupMaskLarge = ~0ull << (64 - 14);
+
+uint32_t
+QcFindChunkBoundary(
+    _In_reads_bytes_(Length) const uint8_t* Data,
+    _In_ size_t Length
+    )
+{
+    if (Length <= QcMinDedupChunkLength) {
+        return (uint32_t)Length;
+    }
+    // Nothing shorter than the minimum is a chunk, so skip hashing it.
+    size_t Normal = min<size_t>(Length, QcAvgDedupChunkLength);
+    size_t End = min<size_t>(Length, QcMaxDedupChunkLength);
+    uint64_t Hash = 0;
+    size_t i = QcMinDedupChunkLength;
+    for (; i < Normal; ++i) {
+        Hash = (Hash << 1) + GearTable[Data[i]];
+        if ((Hash & DedupMaskSmall) == 0) {
+            return (uint32_t)(i + 1);
+        }
+    }
+    for (; i < End; ++i) {
+        Hash = (Hash << 1) + GearTable[Data[i]];
+        if ((Hash & DedupMaskLarge) == 0) {
+            return (uint32_t)(i + 1);
+        }
+    }
+    return (uint32_t)End;
+}
+
+uint64_t
+QcMaxDedupManifestLength(
+    _In_ uint64_t FileSize
+    )
+{
+    // Every chunk but the last is at least the minimum length.
+    return min((FileSize / QcMinDedupChunkLength + 1) * QcMaxDedupManifestEntryLength, QcDedupManifestLimit);
+}
+
+void
+QcEncodeDedupManifest(
+    _In_ const vector<QcDedupChunk>& Chunks,
+    _Out_ vector<uint8_t>& Buffer
+    )
+{
+    Buffer.resize(Chunks.size() * QcMaxDedupManifestEntryLength);
+    uint8_t* Cursor = Buffer.data();
+    for (auto& Chunk : Chunks) {
+        Cursor = QuicVarIntEncode(Chunk.Length, Cursor);
+        memcpy(Cursor, Chunk.Hash.data(), QcStrongHashLength);
+        Cursor += QcStrongHashLength;
+    }
+    Buffer.resize((size_t)(Cursor - Buffer.data()));
+}
+
+bool
+QcDecodeDedupManifest(
+    _In_ const vector<uint8_t>& Buffer,
+    _In_ uint64_t FileSize,
+    _Out_ vector<QcDedupChunk>& Chunks
+    )
+{
+    Chunks.clear();
+    uint64_t Total = 0;
+    size_t Offset = 0;
+    while (Offset < Buffer.size()) {
+        // Decoded against a window of an entry, as varint offsets are 16-bit.
+        uint16_t EntryLength = (uint16_t)min<size_t>(Buffer.size() - Offset, QcMaxDedupManifestEntryLength);
+        uint16_t EntryOffset = 0;
+        QUIC_VAR_INT Length;
+        if (!QuicVarIntDecode(EntryLength, Buffer.data() + Offset, &EntryOffset, &Length) ||
+            Length == 0 || Length > QcMaxDedupChunkLength ||
+            EntryLength - EntryOffset < (uint16_t)QcStrongHashLength) {
+            return false;
+        }
+        QcDedupChunk Chunk;
+        Chunk.Length = (uint32_t)Length;
+        memcpy(Chunk.Hash.data(), Buffer.data() + Offset + EntryOffset, QcStrongHashLength);
+        Chunks.push_back(Chunk);
+        Offset += EntryOffset + QcStrongHashLength;
+        Total += Length;
+        if (Total > FileSize) {
+            return false;
+        }
+    }
+    return Total == FileSize;
+}
+
+QcChunkStore::QcChunkStore(
+    _In_ const filesystem::path& Root
+    ) :
+    Path(Root)
+{
+    error_code Error;
+    filesystem::create_directories(Path, Error);
+    Valid = filesystem::is_directory(Path, Error);
+    // Temporary names only need to differ between processes sharing Root.
+    uint64_t Prefix;
+    CxPlatRandom(sizeof(Prefix), &Prefix);
+    NextTemporary = Prefix;
+}
+
+filesystem::path
+QcChunkStore::GetPath(
+    _In_ const QcDedupChunk& Chunk
+    ) const
+{
+    static const char Digits[] = "0123456789abcdef";
+    string Name;
+    for (auto Byte : Chunk.Hash) {
+        Name += Digits[Byte >> 4];
+        Name += Digits[Byte & 0xF];
+    }
+    return Path / Name.substr(0, 2) / Name;
+}
+
+bool
+QcChunkStore::Contains(
+    _In_ const QcDedupChunk& Chunk
+    ) const
+{
+    error_code Error;
+    uint64_t Size = filesystem::file_size(GetPath(Chunk), Error);
+    return !Error && Size == Chunk.Length;
+}
+
+bool
+QcChunkStore::Read(
+    _In_ const QcDedupChunk& Chunk,
+    _Out_writes_bytes_(Chunk.Length) uint8_t* Buffer
+    )
+{
+    auto ChunkPath = GetPath(Chunk);
+    ifstream File(ChunkPath, ios::binary | ios::in);
+    File.read((char*)Buffer, Chunk.Length);
+    if ((uint32_t)File.gcount() == Chunk.Length) {
+        array<uint8_t, QcStrongHashLength> Hash;
+        QcStrongHash(Buffer, Chunk.Length, Hash);
+        if (Hash == Chunk.Hash) {
+            return true;
+        }
+    }
+    Log() << "Chunk " << ChunkPath.filename() << " is corrupt; removing it" << endl;
+    File.close();
+    error_code Error;
+    filesystem::remove(ChunkPath, Error);
+    return false;
+}
+
+bool
+QcChunkStore::Write(
+    _In_ const QcDedupChunk& Chunk,
+    _In_reads_bytes_(Chunk.Length) const uint8_t* Data
+    )
+{
+    auto ChunkPath = GetPath(Chunk);
+    auto TemporaryPath = ChunkPath;
+    TemporaryPath += ".tmp" + to_string(NextTemporary++);
+    error_code Error;
+    filesystem::create_directories(ChunkPath.parent_path(), Error);
+    {
+        ofstream File(TemporaryPath, ios::binary | ios::out | ios::trunc);
+        File.write((const char*)Data, Chunk.Length);
+        File.close();
+        if (!File.good()) {
+            filesystem::remove(TemporaryPath, Error);
+            return false;
+        }
+    }
+    filesystem::rename(TemporaryPath, ChunkPath, Error);
+    if (Error) {
+        filesystem::remove(TemporaryPath, Error);
+        return false;
+    }
+    return true;
+}
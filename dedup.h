@@ -0,0 +1,103 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+//
+// Deduplication across transfers. The sender cuts the file into chunks at
+// content-defined boundaries (FastCDC), so an insertion only changes the
+// chunks around it, and names each by its strong hash. The receiver keeps
+// every chunk it has received in a chunk store; the sender announces the
+// chunks of the file, and sends only those the store doesn't hold.
+//
+// After the transfer header, the body is:
+//
+//   varint Length     then Length bytes of manifest: for each chunk in
+//                     order, a varint length and its strong hash
+//   data              the chunks the receiver asked for, in order
+//
+// Once it has the manifest, the receiver answers on a unidirectional stream
+// with a bitmap of the chunks it needs, a bit per chunk, least significant
+// bit first; the sender waits for it before sending any chunk data.
+//
+
+const uint32_t QcMinDedupChunkLength = 16 * 1024;
+const uint32_t QcAvgDedupChunkLength = 64 * 1024;
+const uint32_t QcMaxDedupChunkLength = 256 * 1024;
+// A varint length and a hash.
+const uint32_t QcMaxDedupManifestEntryLength = 8 + QcStrongHashLength;
+// Receivers buffer the manifest whole, so whatever the file's size, they
+// take no more than this; larger files are sent whole instead.
+const uint64_t QcDedupManifestLimit = 64 * 1024 * 1024;
+
+struct QcDedupChunk {
+    uint32_t Length;
+    std::array<uint8_t, QcStrongHashLength> Hash;
+};
+
+//
+// Returns the length of the chunk starting at Data. Data must hold at least
+// QcMaxDedupChunkLength bytes, unless it's the rest of the file.
+//
+uint32_t
+QcFindChunkBoundary(
+    _In_reads_bytes_(Length) const uint8_t* Data,
+    _In_ size_t Length);
+
+// The largest manifest a receiver takes for a file of FileSize bytes.
+uint64_t
+QcMaxDedupManifestLength(
+    _In_ uint64_t FileSize);
+
+void
+QcEncodeDedupManifest(
+    _In_ const std::vector<QcDedupChunk>& Chunks,
+    _Out_ std::vector<uint8_t>& Buffer);
+
+// Fails unless the chunks are valid lengths, adding up to FileSize.
+bool
+QcDecodeDedupManifest(
+    _In_ const std::vector<uint8_t>& Buffer,
+    _In_ uint64_t FileSize,
+    _Out_ std::vector<QcDedupChunk>& Chunks);
+
+//
+// Chunks received by a server, as files named by their hash under Root,
+// fanned out into directories by the hash's first byte. Chunks are written
+// under a temporary name and renamed into place, so concurrent transfers may
+// store the same chunk, and a crash never leaves a torn one.
+//
+class QcChunkStore {
+public:
+    QcChunkStore(_In_ const std::filesystem::path& Root);
+    bool IsValid() const { return Valid; }
+
+    bool
+    Contains(
+        _In_ const QcDedupChunk& Chunk) const;
+
+    // Reads a chunk into Buffer, which must hold Chunk.Length bytes, and
+    // verifies its hash. Corrupt chunks are removed.
+    bool
+    Read(
+        _In_ const QcDedupChunk& Chunk,
+        _Out_writes_bytes_(Chunk.Length) uint8_t* Buffer);
+
+    bool
+    Write(
+        _In_ const QcDedupChunk& Chunk,
+        _In_reads_bytes_(Chunk.Length) const uint8_t* Data);
+
+private:
+    std::filesystem::path GetPath(_In_ const QcDedupChunk& Chunk) const;
+
+    std::filesystem::path Path;
+    std::atomic<uint64_t> NextTemporary{0};
+    bool Valid{false};
+};
@@ -0,0 +1,161 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+#include "openssl/evp.h"
+
+using namespace std;
+
+const uint32_t MinDeltaBlockSize = 4 * 1024;
+const uint32_t MaxDeltaBlockSize = 1024 * 1024;
+const uint32_t SignatureReadSize = 4 * 1024 * 1024;
+
+void
+QcRollingChecksum::Compute(
+    _In_reads_bytes_(DataLength) const uint8_t* Data,
+    _In_ uint32_t DataLength
+    )
+{
+    // Written as two independent sums, rather than B += A per byte, so the
+    // compiler can vectorize it. Only the low 16 bits matter, so wrapping
+    // is harmless.
+    uint32_t SumA = 0;
+    uint32_t SumB = 0;
+    for (uint32_t i = 0; i < DataLength; ++i) {
+        SumA += Data[i];
+        SumB += (DataLength - i) * (uint32_t)Data[i];
+    }
+    A = SumA & 0xFFFF;
+    B = SumB & 0xFFFF;
+    Length = DataLength;
+}
+
+void
+QcStrongHash(
+    _In_reads_bytes_(Length) const uint8_t* Data,
+    _In_ uint32_t Length,
+    _Out_ array<uint8_t, QcStrongHashLength>& Hash
+    )
+{
+    // SHA-256, which OpenSSL accelerates with the SHA extensions where the
+    // processor has them, truncated.
+    uint8_t Digest[EVP_MAX_MD_SIZE];
+    unsigned int DigestLength = 0;
+    EVP_Digest(Data, Length, Digest, &DigestLength, EVP_sha256(), nullptr);
+    memcpy(Hash.data(), Digest, QcStrongHashLength);
+}
+
+uint32_t
+QcDeltaBlockSize(
+    _In_ uint64_t FileSize
+    )
+{
+    uint32_t BlockSize = MinDeltaBlockSize;
+    while (BlockSize < MaxDeltaBlockSize && (uint64_t)BlockSize * BlockSize < FileSize) {
+        BlockSize *= 2;
+    }
+    while ((FileSize / BlockSize) > QcMaxSignatureBlocks) {
+        BlockSize *= 2;
+    }
+    return BlockSize;
+}
+
+bool
+QcComputeSignatures(
+    _In_ const filesystem::path& Path,
+    _In_ uint32_t BlockSize,
+    _In_ uint64_t BlockCount,
+    _In_ uint32_t ThreadCount,
+    _Out_ vector<QcBlockSignature>& Signatures
+    )
+{
+    Signatures.resize((size_t)BlockCount);
+    if (BlockCount == 0) {
+        return true;
+    }
+    ThreadCount = (uint32_t)max<uint64_t>(1, min<uint64_t>(ThreadCount, BlockCount));
+    uint32_t BatchBlocks = max(1u, SignatureReadSize / BlockSize);
+    atomic<bool> Failed{false};
+    auto Worker = [&](uint64_t First, uint64_t Last) {
+        ifstream File(Path, ios::binary | ios::in);
+        File.seekg((streamoff)(First * BlockSize));
+        vector<uint8_t> Buffer((size_t)BatchBlocks * BlockSize);
+        QcRollingChecksum Checksum;
+        for (uint64_t Block = First; Block < Last && !Failed; Block += BatchBlocks) {
+            uint32_t Count = (uint32_t)min<uint64_t>(BatchBlocks, Last - Block);
+            File.read((char*)Buffer.data(), (streamsize)Count * BlockSize);
+            if ((uint64_t)File.gcount() != (uint64_t)Count * BlockSize) {
+                Failed = true;
+                return;
+            }
+            for (uint32_t i = 0; i < Count; ++i) {
+                const uint8_t* Data = Buffer.data() + (size_t)i * BlockSize;
+                Checksum.Compute(Data, BlockSize);
+                Signatures[(size_t)(Block + i)].Weak = Checksum.Get();
+                QcStrongHash(Data, BlockSize, Signatures[(size_t)(Block + i)].Strong);
+            }
+        }
+    };
+    vector<thread> Threads;
+    uint64_t PerThread = (BlockCount + ThreadCount - 1) / ThreadCount;
+    for (uint64_t First = 0; First < BlockCount; First += PerThread) {
+        Threads.emplace_back(Worker, First, min(BlockCount, First + PerThread));
+    }
+    for (auto& Thread : Threads) {
+        Thread.join();
+    }
+    return !Failed;
+}
+
+void
+QcEncodeSignatures(
+    _In_ uint32_t BlockSize,
+    _In_ const vector<QcBlockSignature>& Signatures,
+    _Out_ vector<uint8_t>& Buffer
+    )
+{
+    Buffer.resize(16 + Signatures.size() * QcSignatureLength);
+    uint8_t* Cursor = Buffer.data();
+    Cursor = QuicVarIntEncode(BlockSize, Cursor);
+    Cursor = QuicVarIntEncode(Signatures.size(), Cursor);
+    for (auto& Signature : Signatures) {
+        for (uint32_t i = 0; i < 4; ++i) {
+            *Cursor++ = (uint8_t)(Signature.Weak >> (8 * i));
+        }
+        memcpy(Cursor, Signature.Strong.data(), QcStrongHashLength);
+        Cursor += QcStrongHashLength;
+    }
+    Buffer.resize((size_t)(Cursor - Buffer.data()));
+}
+
+bool
+QcDecodeSignatures(
+    _In_ const vector<uint8_t>& Buffer,
+    _Out_ uint32_t& BlockSize,
+    _Out_ vector<QcBlockSignature>& Signatures
+    )
+{
+    uint16_t Offset = 0;
+    QUIC_VAR_INT Size = 0, Count = 0;
+    uint16_t HeaderLength = (uint16_t)min<size_t>(Buffer.size(), 16);
+    if (!QuicVarIntDecode(HeaderLength, Buffer.data(), &Offset, &Size) ||
+        !QuicVarIntDecode(HeaderLength, Buffer.data(), &Offset, &Count) ||
+        Size == 0 || Size > (1u << 30) ||
+        Count > QcMaxSignatureBlocks ||
+        Buffer.size() - Offset != Count * QcSignatureLength) {
+        return false;
+    }
+    BlockSize = (uint32_t)Size;
+    Signatures.resize((size_t)Count);
+    const uint8_t* Cursor = Buffer.data() + Offset;
+    for (auto& Signature : Signatures) {
+        Signature.Weak = 0;
+        for (uint32_t i = 0; i < 4; ++i) {
+            Signature.Weak |= (uint32_t)*Cursor++ << (8 * i);
+        }
+        memcpy(Signature.Strong.data(), Cursor, QcStrongHashLength);
+        Cursor += QcStrongHashLength;
+    }
+    return true;
+}
@@ -0,0 +1,89 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+//
+// rsync-style delta transfer. The receiver sends a signature for each full
+// block of its existing copy; the sender replies with a body of records,
+// each either literal data or a run of the receiver's blocks.
+//
+
+const uint32_t QcStrongHashLength = 16;
+const uint32_t QcSignatureLength = 4 + QcStrongHashLength;
+const uint32_t QcMaxSignatureBlocks = 1 << 24;
+
+// Delta body records.
+// Literal: tag, varint length, then the data.
+const uint8_t QcDeltaRecordLiteral = 0;
+// Copy: tag, varint first block, varint block count.
+const uint8_t QcDeltaRecordCopy = 1;
+
+struct QcBlockSignature {
+    uint32_t Weak;
+    std::array<uint8_t, QcStrongHashLength> Strong;
+};
+
+//
+// rsync's rolling checksum: two 16-bit sums which can be slid along the data
+// a byte at a time.
+//
+struct QcRollingChecksum {
+    uint32_t A{0};
+    uint32_t B{0};
+    uint32_t Length{0};
+
+    void
+    Compute(
+        _In_reads_bytes_(DataLength) const uint8_t* Data,
+        _In_ uint32_t DataLength);
+
+    void Roll(_In_ uint8_t Out, _In_ uint8_t In) {
+        A = (A - Out + In) & 0xFFFF;
+        B = (B - Length * Out + A) & 0xFFFF;
+    }
+
+    uint32_t Get() const { return A | (B << 16); }
+};
+
+void
+QcStrongHash(
+    _In_reads_bytes_(Length) const uint8_t* Data,
+    _In_ uint32_t Length,
+    _Out_ std::array<uint8_t, QcStrongHashLength>& Hash);
+
+// Block size for a basis file of FileSize bytes; roughly its square root.
+uint32_t
+QcDeltaBlockSize(
+    _In_ uint64_t FileSize);
+
+//
+// Computes signatures for the full blocks of Path, in parallel across
+// ThreadCount threads.
+//
+bool
+QcComputeSignatures(
+    _In_ const std::filesystem::path& Path,
+    _In_ uint32_t BlockSize,
+    _In_ uint64_t BlockCount,
+    _In_ uint32_t ThreadCount,
+    _Out_ std::vector<QcBlockSignature>& Signatures);
+
+// Varint block size, varint block count, then each weak checksum (4 bytes,
+// little endian) and strong hash.
+void
+QcEncodeSignatures(
+    _In_ uint32_t BlockSize,
+    _In_ const std::vector<QcBlockSignature>& Signatures,
+    _Out_ std::vector<uint8_t>& Buffer);
+
+bool
+QcDecodeSignatures(
+    _In_ const std::vector<uint8_t>& Buffer,
+    _Out_ uint32_t& BlockSize,
+    _Out_ std::vector<QcBlockSignature>& Signatures);
@@ -0,0 +1,220 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Files held open at once while a batch is flushed.
+const size_t CommitOpenLimit = 256;
+
+bool
+QcSyncFile(
+    _In_ const filesystem::path& Path
+    )
+{
+#ifdef _WIN32
+    HANDLE File = CreateFileW(
+        Path.c_str(),
+        GENERIC_WRITE,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (File == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    bool Result = FlushFileBuffers(File) != FALSE;
+    CloseHandle(File);
+    return Result;
+#else
+    int File = open(Path.c_str(), O_RDONLY);
+    if (File < 0) {
+        return false;
+    }
+#ifdef __linux__
+    bool Result = fdatasync(File) == 0;
+#else
+    bool Result = fsync(File) == 0;
+#endif
+    close(File);
+    return Result;
+#endif
+}
+
+bool
+QcSyncDirectory(
+    _In_ const filesystem::path& Path
+    )
+{
+#ifdef _WIN32
+    UNREFERENCED_PARAMETER(Path);
+    return true;
+#else
+    int Directory = open(Path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (Directory < 0) {
+        return false;
+    }
+    bool Result = fsync(Directory) == 0;
+    close(Directory);
+    return Result;
+#endif
+}
+
+QcGroupCommitter::QcGroupCommitter(
+    _In_ milliseconds CommitWindow,
+    _In_ uint64_t CommitByteWindow
+    ) :
+    Window(CommitWindow),
+    ByteWindow(max<uint64_t>(CommitByteWindow, 1))
+{
+    Worker = thread(&QcGroupCommitter::Run, this);
+}
+
+QcGroupCommitter::~QcGroupCommitter()
+{
+    {
+        unique_lock<mutex> Guard(Lock);
+        ShuttingDown = true;
+    }
+    Changed.notify_all();
+    Worker.join();
+}
+
+void
+QcGroupCommitter::Add(
+    _In_ const filesystem::path& PartialPath,
+    _In_ const filesystem::path& FinalPath,
+    _In_ uint64_t Size
+    )
+{
+    {
+        unique_lock<mutex> Guard(Lock);
+        if (Batch.empty()) {
+            BatchStart = steady_clock::now();
+        }
+        Batch.push_back({PartialPath, FinalPath});
+        BatchBytes += Size;
+    }
+    Changed.notify_all();
+}
+
+void
+QcGroupCommitter::Drain()
+{
+    unique_lock<mutex> Guard(Lock);
+    DrainWaiters++;
+    Changed.notify_all();
+    Changed.wait(Guard, [this]{ return Batch.empty() && !Committing; });
+    DrainWaiters--;
+}
+
+uint64_t
+QcGroupCommitter::GetFilesCommitted()
+{
+    unique_lock<mutex> Guard(Lock);
+    return FilesCommitted;
+}
+
+uint64_t
+QcGroupCommitter::GetBatchesCommitted()
+{
+    unique_lock<mutex> Guard(Lock);
+    return BatchesCommitted;
+}
+
+uint64_t
+QcGroupCommitter::GetFailures()
+{
+    unique_lock<mutex> Guard(Lock);
+    return Failures;
+}
+
+void
+QcGroupCommitter::Run()
+{
+    unique_lock<mutex> Guard(Lock);
+    while (true) {
+        if (Batch.empty()) {
+            if (ShuttingDown) {
+                break;
+            }
+            Changed.wait(Guard);
+            continue;
+        }
+        auto Due = BatchStart + Window;
+        if (!ShuttingDown && DrainWaiters == 0 && BatchBytes < ByteWindow && steady_clock::now() < Due) {
+            Changed.wait_until(Guard, Due);
+            continue;
+        }
+        vector<Pending> Current;
+        Current.swap(Batch);
+        BatchBytes = 0;
+        Committing = true;
+        Guard.unlock();
+        Commit(Current);
+        Guard.lock();
+        Committing = false;
+        Changed.notify_all();
+    }
+}
+
+void
+QcGroupCommitter::Commit(
+    _In_ vector<Pending>& Current
+    )
+{
+    vector<bool> Synced(Current.size(), false);
+#ifdef __linux__
+    for (size_t Start = 0; Start < Current.size(); Start += CommitOpenLimit) {
+        size_t End = min(Current.size(), Start + CommitOpenLimit);
+        vector<int> Files;
+        for (size_t i = Start; i < End; ++i) {
+            int File = open(Current[i].PartialPath.c_str(), O_RDONLY);
+            if (File >= 0) {
+                // Start writeback of everything before waiting on any of it.
+                sync_file_range(File, 0, 0, SYNC_FILE_RANGE_WRITE);
+            }
+            Files.push_back(File);
+        }
+        for (size_t i = Start; i < End; ++i) {
+            int File = Files[i - Start];
+            if (File >= 0) {
+                Synced[i] = fdatasync(File) == 0;
+                close(File);
+            }
+        }
+    }
+#else
+    for (size_t i = 0; i < Current.size(); ++i) {
+        Synced[i] = QcSyncFile(Current[i].PartialPath);
+    }
+#endif
+    uint64_t Committed = 0;
+    vector<filesystem::path> Directories;
+    for (size_t i = 0; i < Current.size(); ++i) {
+        error_code Error;
+        if (Synced[i]) {
+            filesystem::rename(Current[i].PartialPath, Current[i].FinalPath, Error);
+        }
+        if (!Synced[i] || Error) {
+            Log() << "Failed to commit " << Current[i].FinalPath << endl;
+            filesystem::remove(Current[i].PartialPath, Error);
+            continue;
+        }
+        Committed++;
+        auto Directory = Current[i].FinalPath.parent_path();
+        if (find(Directories.begin(), Directories.end(), Directory) == Directories.end()) {
+            Directories.push_back(Directory);
+        }
+    }
+    for (auto& Directory : Directories) {
+        QcSyncDirectory(Directory);
+    }
+    unique_lock<mutex> Guard(Lock);
+    FilesCommitted += Committed;
+    Failures += Current.size() - Committed;
+    BatchesCommitted++;
+}
@@ -0,0 +1,99 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// How received files reach the disk. In every mode a file is written under a
+// partial name beside its destination, and renamed into place once complete,
+// so a reader (or a crash) never sees a torn file under the real name.
+//
+enum QcDurability : uint8_t {
+    // Renamed as soon as it's complete; the data reaches the disk whenever
+    // the kernel writes it back.
+    QcDurabilityNone,
+    // Flushed (fdatasync) before the rename, and the directory after, before
+    // the transfer completes.
+    QcDurabilityFile,
+    // Completed files are flushed in batches on a background thread (see
+    // QcGroupCommitter), and renamed into place once flushed. Transfers
+    // complete without waiting, so the last window of files may be lost in
+    // a crash, but never torn.
+    QcDurabilityGroup
+};
+
+// Ends the name a file is received as, after a tag unique to the transfer.
+const char* const QcPartialSuffix = ".quiccat-partial";
+// What the partial name adds to a file's: '.', the tag as 16 hex digits, and
+// the suffix.
+const size_t QcPartialNameOverhead = 1 + 16 + 16;
+
+// Flushes a file's data to disk.
+bool QcSyncFile(_In_ const std::filesystem::path& Path);
+
+// Flushes a directory, so renames within it are durable. Nothing to do on
+// Windows.
+bool QcSyncDirectory(_In_ const std::filesystem::path& Path);
+
+//
+// Batches the flushes of completed files. Writeback of every file in a batch
+// is started at once and then waited for, so the device sees one large burst
+// instead of a queue of small synchronous ones; then they're renamed into
+// place, and each directory touched is flushed once.
+//
+// A batch is committed once Window has passed since its first file, or it
+// holds ByteWindow bytes, whichever is first.
+//
+class QcGroupCommitter {
+public:
+    QcGroupCommitter(
+        _In_ std::chrono::milliseconds Window,
+        _In_ uint64_t ByteWindow);
+    // Commits everything added, then stops.
+    ~QcGroupCommitter();
+
+    // Commits PartialPath, of Size bytes, as FinalPath in a later batch.
+    void
+    Add(
+        _In_ const std::filesystem::path& PartialPath,
+        _In_ const std::filesystem::path& FinalPath,
+        _In_ uint64_t Size);
+
+    // Blocks until everything added so far is committed.
+    void Drain();
+
+    uint64_t GetFilesCommitted();
+    uint64_t GetBatchesCommitted();
+    uint64_t GetFailures();
+
+private:
+    struct Pending {
+        std::filesystem::path PartialPath;
+        std::filesystem::path FinalPath;
+    };
+
+    void Run();
+    void Commit(_In_ std::vector<Pending>& Batch);
+
+    std::chrono::milliseconds Window;
+    uint64_t ByteWindow;
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::vector<Pending> Batch;
+    uint64_t BatchBytes{0};
+    std::chrono::steady_clock::time_point BatchStart;
+    bool Committing{false};
+    uint32_t DrainWaiters{0};
+    bool ShuttingDown{false};
+    uint64_t FilesCommitted{0};
+    uint64_t BatchesCommitted{0};
+    uint64_t Failures{0};
+    std::thread Worker;
+};
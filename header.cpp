@@ -0,0 +1,280 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+using namespace std;
+
+void
+QcAppendVarInt(
+    _In_ uint64_t Value,
+    _Inout_ vector<uint8_t>& Buffer
+    )
+{
+    uint8_t Encoded[8];
+    uint8_t* End = QuicVarIntEncode(Value, Encoded);
+    Buffer.insert(Buffer.end(), Encoded, End);
+}
+
+void
+QcAppendCapability(
+    _In_ uint8_t Id,
+    _In_ uint64_t Value,
+    _Inout_ vector<uint8_t>& Buffer
+    )
+{
+    QcAppendVarInt(Id, Buffer);
+    QcAppendVarInt(QuicVarIntSize(Value), Buffer);
+    QcAppendVarInt(Value, Buffer);
+}
+
+void
+QcEncodeCapabilities(
+    _In_ const QcCapabilities& Capabilities,
+    _Out_ vector<uint8_t>& Buffer
+    )
+{
+    Buffer.clear();
+    QcAppendCapability(QcCapabilityChunkSize, Capabilities.ChunkSize, Buffer);
+    QcAppendCapability(QcCapabilityEncodings, Capabilities.Encodings, Buffer);
+    QcAppendCapability(QcCapabilityCompression, Capabilities.Compression, Buffer);
+    QcAppendCapability(QcCapabilityHash, Capabilities.Hash, Buffer);
+    QcAppendCapability(QcCapabilityMaxStreams, Capabilities.MaxStreams, Buffer);
+    QcAppendCapability(QcCapabilityResume, Capabilities.Resume ? 1 : 0, Buffer);
+}
+
+bool
+QcDecodeCapabilities(
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ QcCapabilities& Capabilities
+    )
+{
+    Capabilities = {};
+    if (Length > UINT16_MAX) {
+        return false;
+    }
+    uint16_t Offset = 0;
+    while (Offset < Length) {
+        QUIC_VAR_INT Id, ValueLength;
+        if (!QuicVarIntDecode((uint16_t)Length, Buffer, &Offset, &Id) ||
+            !QuicVarIntDecode((uint16_t)Length, Buffer, &Offset, &ValueLength) ||
+            ValueLength > (uint64_t)(Length - Offset)) {
+            return false;
+        }
+        uint16_t End = (uint16_t)(Offset + ValueLength);
+        QUIC_VAR_INT Value = 0;
+        switch (Id) {
+        case QcCapabilityChunkSize:
+        case QcCapabilityEncodings:
+        case QcCapabilityCompression:
+        case QcCapabilityHash:
+        case QcCapabilityMaxStreams:
+        case QcCapabilityResume:
+            if (!QuicVarIntDecode(End, Buffer, &Offset, &Value) || Offset != End) {
+                return false;
+            }
+            break;
+        default:
+            // From a later version; skip it.
+            Offset = End;
+            continue;
+        }
+        switch (Id) {
+        case QcCapabilityChunkSize: Capabilities.ChunkSize = Value; break;
+        case QcCapabilityEncodings: Capabilities.Encodings = Value; break;
+        case QcCapabilityCompression: Capabilities.Compression = Value; break;
+        case QcCapabilityHash: Capabilities.Hash = Value; break;
+        case QcCapabilityMaxStreams: Capabilities.MaxStreams = Value; break;
+        default: Capabilities.Resume = Value != 0; break;
+        }
+    }
+    return true;
+}
+
+//
+// The smaller of two limits, where zero is no limit.
+//
+uint64_t
+QcMinLimit(
+    _In_ uint64_t A,
+    _In_ uint64_t B
+    )
+{
+    return A == 0 ? B : B == 0 ? A : min(A, B);
+}
+
+QcCapabilities
+QcIntersectCapabilities(
+    _In_ const QcCapabilities& Local,
+    _In_ const QcCapabilities& Peer
+    )
+{
+    QcCapabilities Result;
+    Result.ChunkSize = QcMinLimit(Local.ChunkSize, Peer.ChunkSize);
+    if (Result.ChunkSize != 0) {
+        Result.ChunkSize = max(Result.ChunkSize, QcMinChunkSize);
+    }
+    Result.Encodings = Local.Encodings & Peer.Encodings;
+    Result.Compression = Local.Compression & Peer.Compression;
+    Result.Hash = Local.Hash & Peer.Hash;
+    Result.MaxStreams = QcMinLimit(Local.MaxStreams, Peer.MaxStreams);
+    Result.Resume = Local.Resume && Peer.Resume;
+    return Result;
+}
+
+uint32_t
+QcEncodeTransferHeader(
+    _In_ const QcTransferHeader& Header,
+    _Out_writes_bytes_(MaxHeaderLength) uint8_t* Buffer
+    )
+{
+    uint8_t* Cursor = Buffer;
+    if (Header.Version == QcHeaderVersion1) {
+        if (Header.Flags != 0) {
+            *Cursor++ = 0;
+            *Cursor++ = (uint8_t)Header.Flags;
+        }
+        *Cursor++ = (uint8_t)Header.Name.size();
+    } else {
+        vector<uint8_t> Options;
+        QcEncodeCapabilities(Header.Options, Options);
+        Cursor = QuicVarIntEncode(Header.Version, Cursor);
+        Cursor = QuicVarIntEncode(Header.Flags, Cursor);
+        Cursor = QuicVarIntEncode(Options.size(), Cursor);
+        memcpy(Cursor, Options.data(), Options.size());
+        Cursor += Options.size();
+        Cursor = QuicVarIntEncode(Header.Name.size(), Cursor);
+    }
+    memcpy(Cursor, Header.Name.data(), Header.Name.size());
+    Cursor += Header.Name.size();
+    Cursor = QuicVarIntEncode(Header.Size, Cursor);
+    return (uint32_t)(Cursor - Buffer);
+}
+
+void
+QcHeaderParser::Reset(
+    _In_ uint32_t Version
+    )
+{
+    Header = {};
+    Header.Version = Version;
+    Current = Version == QcHeaderVersion1 ? StateLegacyStart : StateVersion;
+    VarIntLength = 0;
+    Remaining = 0;
+    OptionsData.clear();
+}
+
+QcHeaderParser::Result
+QcHeaderParser::Fail(
+    _In_ const char* Reason
+    )
+{
+    Log() << Reason << endl;
+    Current = StateFailed;
+    return Invalid;
+}
+
+QcHeaderParser::Result
+QcHeaderParser::Feed(
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ uint32_t& Consumed
+    )
+{
+    Consumed = 0;
+    while (Current != StateDone && Current != StateFailed && Consumed < Length) {
+        switch (Current) {
+        case StateLegacyStart: {
+            uint8_t Byte = Buffer[Consumed++];
+            if (Byte == 0) {
+                Current = StateLegacyFlags;
+            } else {
+                Remaining = Byte;
+                Current = StateName;
+            }
+            break;
+        }
+        case StateLegacyFlags:
+            Header.Flags = Buffer[Consumed++];
+            Current = StateLegacyNameLength;
+            break;
+        case StateLegacyNameLength:
+            Remaining = Buffer[Consumed++];
+            if (Remaining == 0) {
+                return Fail("File name length is invalid!");
+            }
+            Current = StateName;
+            break;
+        case StateOptions:
+        case StateName: {
+            uint32_t Take = (uint32_t)min<uint64_t>(Remaining, Length - Consumed);
+            if (Current == StateOptions) {
+                OptionsData.insert(OptionsData.end(), Buffer + Consumed, Buffer + Consumed + Take);
+            } else {
+                Header.Name.append((const char*)Buffer + Consumed, Take);
+            }
+            Consumed += Take;
+            Remaining -= Take;
+            if (Remaining != 0) {
+                break;
+            }
+            if (Current == StateName) {
+                Current = StateSize;
+            } else if (!QcDecodeCapabilities(OptionsData.data(), (uint32_t)OptionsData.size(), Header.Options)) {
+                return Fail("Transfer header options are malformed!");
+            } else {
+                Current = StateNameLength;
+            }
+            break;
+        }
+        default: {
+            // The rest are varints, gathered a byte at a time.
+            VarInt[VarIntLength++] = Buffer[Consumed++];
+            uint8_t VarIntSize = (uint8_t)(1u << (VarInt[0] >> 6));
+            if (VarIntLength < VarIntSize) {
+                break;
+            }
+            uint16_t Offset = 0;
+            QUIC_VAR_INT Value = 0;
+            QuicVarIntDecode(VarIntSize, VarInt, &Offset, &Value);
+            VarIntLength = 0;
+            switch (Current) {
+            case StateVersion:
+                if (Value != Header.Version) {
+                    return Fail("Transfer header version doesn't match the connection's!");
+                }
+                Current = StateFlags;
+                break;
+            case StateFlags:
+                Header.Flags = Value;
+                Current = StateOptionsLength;
+                break;
+            case StateOptionsLength:
+                if (Value > QcMaxHeaderOptionsLength) {
+                    return Fail("Transfer header options are too long!");
+                }
+                Remaining = Value;
+                Current = StateOptions;
+                if (Remaining == 0) {
+                    Current = StateNameLength;
+                }
+                break;
+            case StateNameLength:
+                if (Value == 0 || Value > MaxFileNameLength) {
+                    return Fail("File name length is invalid!");
+                }
+                Remaining = Value;
+                Current = StateName;
+                break;
+            default:
+                Header.Size = Value;
+                Current = StateDone;
+                break;
+            }
+            break;
+        }
+        }
+    }
+    return Current == StateDone ? Complete : Current == StateFailed ? Invalid : NeedMore;
+}
@@ -0,0 +1,168 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//
+// Transfer headers, and the capabilities which decide what goes in them.
+//
+// The header version is negotiated with ALPN: "quiccat/2" file mode servers
+// and clients offer it before "quiccat", so either side may be upgraded first
+// and mixed fleets keep working. Version 1, on "quiccat", is the original
+// header: a name length byte, the name, and a varint file size, with a zero
+// name length escaping to a flags byte followed by the same.
+//
+// Version 2 is all varints, so no field is tied to a width:
+//
+//   varint Version    2
+//   varint Flags      the body encoding, one of QcHeaderFlag*
+//   varint Length     then Length bytes of options, the sender's choices as
+//                     capability records (see below)
+//   varint Length     then Length bytes of file name
+//   varint Size       the file size
+//
+// On version 2 connections the server first opens a unidirectional stream,
+// writes its capabilities to it, and closes it; the client waits for them
+// before sending the header, and only chooses what the server can accept.
+// Capabilities are records of a varint ID, a varint length and a value;
+// unknown IDs are skipped, so later versions may add more without breaking
+// these.
+//
+
+const uint32_t MaxFileNameLength = 255;
+const uint32_t QcHeaderVersion1 = 1;
+const uint32_t QcHeaderVersion2 = 2;
+// Bounds the options in a header, so it fits in MaxHeaderLength.
+const uint32_t QcMaxHeaderOptionsLength = 64;
+// Bounds a server's advertised capabilities.
+const uint32_t QcMaxCapabilitiesLength = 1024;
+// Either header version fits in this.
+const uint32_t MaxHeaderLength = 8 + 8 + 8 + QcMaxHeaderOptionsLength + 8 + MaxFileNameLength + 8;
+
+const uint8_t QcCapabilityChunkSize = 1;
+const uint8_t QcCapabilityEncodings = 2;
+const uint8_t QcCapabilityCompression = 3;
+const uint8_t QcCapabilityHash = 4;
+const uint8_t QcCapabilityMaxStreams = 5;
+const uint8_t QcCapabilityResume = 6;
+
+// Compression and hash algorithms, as bitmasks. Only the identity of each
+// exists so far; the IDs reserve room for more.
+const uint64_t QcCompressionNone = 0x01;
+const uint64_t QcHashNone = 0x01;
+
+// Chunk sizes below this aren't worth a send.
+const uint64_t QcMinChunkSize = 4096;
+
+//
+// What a receiver accepts, or in a header, what the sender chose. The
+// defaults are what every version 1 server accepts, so they stand in for
+// the capabilities of old peers.
+//
+struct QcCapabilities {
+    // The largest send the receiver wants at once; zero for no preference.
+    uint64_t ChunkSize{0};
+    // QcHeaderFlag* body encodings accepted (sparse, delta, packed and
+    // striped, and dedup where a server has a chunk store); plain bodies
+    // always are.
+    uint64_t Encodings{0x0F};
+    uint64_t Compression{QcCompressionNone};
+    uint64_t Hash{QcHashNone};
+    // Connections a striped transfer may use; zero for no limit.
+    uint64_t MaxStreams{0};
+    // Whether partial transfers may be resumed.
+    bool Resume{false};
+};
+
+void
+QcEncodeCapabilities(
+    _In_ const QcCapabilities& Capabilities,
+    _Out_ std::vector<uint8_t>& Buffer);
+
+bool
+QcDecodeCapabilities(
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ QcCapabilities& Capabilities);
+
+//
+// What both Local and Peer support.
+//
+QcCapabilities
+QcIntersectCapabilities(
+    _In_ const QcCapabilities& Local,
+    _In_ const QcCapabilities& Peer);
+
+struct QcTransferHeader {
+    uint32_t Version{QcHeaderVersion1};
+    uint64_t Flags{0};
+    // Version 2 only.
+    QcCapabilities Options;
+    std::string Name;
+    uint64_t Size{0};
+};
+
+//
+// Writes Header to Buffer, which must hold MaxHeaderLength bytes, in its
+// version's format, and returns its length.
+//
+uint32_t
+QcEncodeTransferHeader(
+    _In_ const QcTransferHeader& Header,
+    _Out_writes_bytes_(MaxHeaderLength) uint8_t* Buffer);
+
+//
+// Parses a transfer header incrementally, from however many buffers it's
+// split across. Nothing needs to be contiguous, and nothing past the header
+// is consumed.
+//
+class QcHeaderParser {
+public:
+    enum Result : uint8_t {
+        NeedMore,
+        Complete,
+        Invalid
+    };
+
+    // Starts a new header of the connection's negotiated Version.
+    void Reset(_In_ uint32_t Version);
+
+    // Parses up to Length bytes, and sets Consumed to how many were part of
+    // the header. Once Complete or Invalid, keeps returning the same.
+    Result
+    Feed(
+        _In_reads_bytes_(Length) const uint8_t* Buffer,
+        _In_ uint32_t Length,
+        _Out_ uint32_t& Consumed);
+
+    const QcTransferHeader& GetHeader() const { return Header; }
+
+private:
+    enum State : uint8_t {
+        StateLegacyStart,
+        StateLegacyFlags,
+        StateLegacyNameLength,
+        StateVersion,
+        StateFlags,
+        StateOptionsLength,
+        StateOptions,
+        StateNameLength,
+        StateName,
+        StateSize,
+        StateDone,
+        StateFailed
+    };
+
+    Result Fail(_In_ const char* Reason);
+
+    State Current{StateLegacyStart};
+    QcTransferHeader Header;
+    uint8_t VarInt[8];
+    uint8_t VarIntLength{0};
+    uint64_t Remaining{0};
+    std::vector<uint8_t> OptionsData;
+};
@@ -0,0 +1,8309 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "libquiccat.h"
+
+using namespace std;
+using namespace std::chrono;
+
+const uint32_t RandomPasswordLength = 64;
+const auto UpdateRate = milliseconds(500);
+const size_t MaxProgressLines = 32;
+const size_t MaxPooledConnections = 1024;
+// Load generator connections open at once when no concurrency is given; each
+// is carried by a thread of its own.
+const uint32_t DefaultLoadConcurrency = 64;
+// MsQuic's default connection flow control window.
+const uint32_t DefaultReceiveWindow = 16 * 1024 * 1024;
+const uint16_t DefaultRetryMemoryPercent = 65;
+// Direct I/O needs buffers, offsets and lengths aligned to the logical block
+// size; 4096 covers all common devices.
+const uint32_t DirectIoAlignment = 4096;
+const uint32_t DirectIoBlockSize = 4 * 1024 * 1024;
+const uint32_t MaxDeltaLiteral = 256 * 1024;
+const uint32_t DeltaReadSize = 4 * 1024 * 1024;
+const uint32_t DeltaOutputBatch = 64 * 1024;
+const uint32_t DeltaCopyBufferSize = 64 * 1024;
+// Delta senders take at most this much of signatures, which covers basis
+// files of a few terabytes; past it they send the whole file.
+const uint64_t MaxSignatureDataLength = 64 * 1024 * 1024;
+// The listener's workers, each of which computes a transfer's signatures on
+// its share of the processors.
+const uint32_t ListenerWorkerThreads = 2;
+const uint32_t DedupReadSize = 4 * 1024 * 1024;
+// Packed entries up to this size are gathered in memory and created by the
+// listener's writer threads; larger ones are written as they arrive.
+const uint32_t PackedBufferLimit = 1024 * 1024;
+// Receive pauses while this much of a connection's packed data is waiting
+// to be written.
+const uint64_t PackedQueueLimit = 16 * 1024 * 1024;
+// Empty entries take no payload, so their number is bounded on its own.
+const uint32_t MaxPackedEntries = 1024 * 1024;
+const uint32_t DefaultWriterThreads = 8;
+const milliseconds DefaultGroupCommitWindow(50);
+const uint64_t DefaultGroupCommitBytes = 64 * 1024 * 1024;
+// Fan-out sends read the source in chunks of this size, shared by every
+// connection, with at most FanoutWindow of them in flight.
+const uint32_t FanoutChunkSize = 1024 * 1024;
+const uint32_t FanoutWindow = 16;
+// A client's file sends keep up to two buffers in flight each, and all of
+// its transfers together at most ScheduleWindow bytes, so a lone transfer
+// runs unhindered but any others queue for their turn.
+const uint64_t ScheduleWindow = 2 * DefaultSendBufferSize;
+// Serve mode. Each request is a bidirectional stream; a listener takes up
+// to MaxServeStreams at once per connection.
+const uint16_t MaxServeStreams = 64;
+const uint32_t MaxServeRequestLength = 8 + MaxPackedNameLength + 8 + 8;
+const uint32_t ServeChunkSize = 256 * 1024;
+// Fetches split the file into ranges of this size, and keep a couple of
+// requests outstanding on each source.
+const uint64_t FetchRangeSize = 4 * 1024 * 1024;
+const uint32_t FetchRequestsPerSource = 2;
+// Striped sends cut the file into chunks of this size, and keep at most
+// StripeWindow of them waiting to send on each path.
+const uint32_t StripeChunkSize = 1024 * 1024;
+const uint32_t StripeWindow = 4;
+// A receiver keeps an unfinished striped file this long after its last path
+// leaves, for a path to reconnect, before removing it.
+const seconds StripedExpiry(60);
+// Latency mode acknowledges within this, rather than MsQuic's default 25ms.
+const uint32_t LowLatencyAckDelayMs = 1;
+// Datagram mode. Senders keep at most this many datagrams awaiting
+// acknowledgement or loss, and receivers queue at most this many to be
+// written out; beyond that, new ones are dropped.
+const uint32_t MaxOutstandingDatagrams = 1024;
+const uint32_t MaxQueuedDatagrams = 4096;
+// stdin/stdout mode queues up to this many receive buffers without growing.
+const size_t PipeReceiveBuffers = 64;
+// Striped pipes cut stdin into chunks of this size. Senders keep at most
+// PipeWindow of them past the oldest unacknowledged one, and receivers hold
+// as many past the one they're waiting to write; the two match, so a chunk
+// the receiver is waiting on always fits.
+const uint32_t PipeChunkSize = 256 * 1024;
+const uint32_t PipeWindow = 64;
+// Tunnel mode carries a TCP connection per bidi stream.
+const uint16_t MaxTunnelStreams = 1024;
+
+const MsQuicApi* MsQuic;
+
+const MsQuicAlpn Alpn("quiccat");
+// File mode offers version 2 headers first (see header.h). Relays and pipes
+// stay on version 1, as they pass the sender's bytes on untouched.
+const char FileAlpnV2[] = "quiccat/2";
+const MsQuicAlpn FileAlpn(FileAlpnV2, "quiccat");
+// Serving listeners use their own ALPN, so push clients and fetch clients
+// can't connect to the wrong kind of listener.
+const MsQuicAlpn ServeAlpn("quiccat-serve");
+const MsQuicAlpn TunnelAlpn("quiccat-tunnel");
+const MsQuicAlpn DatagramAlpn("quiccat-datagram");
+const MsQuicAlpn StripedPipeAlpn("quiccat-pipes");
+
+//
+// Datagram send state, shared with the connection callback.
+//
+struct QcDatagramSender {
+    mutex Lock;
+    condition_variable Changed;
+    bool SendEnabled{false};
+    bool Closed{false};
+    uint16_t MaxSendLength{0};
+    uint32_t Outstanding{0};
+    QcDatagramStatistics Statistics{};
+};
+
+// Owns one datagram's data until it reaches a final send state.
+struct QcDatagramSend {
+    QcDatagramSender* Sender;
+    vector<uint8_t> Data;
+    QUIC_BUFFER Buffer;
+};
+
+//
+// A striped file, received over several connections (see
+// QcHeaderFlagStriped). Every path's extents are written into the one
+// partial file, and it's committed once they cover it. Entries stay after
+// they're committed until the last path leaves, so a chunk resent by a path
+// which didn't learn of its delivery is ignored, rather than starting the
+// file over.
+//
+struct QcStripedFile {
+    uint64_t TransferId;
+    string Name;
+    string PartialName;
+    uint64_t Size;
+    // Paths attached, and when the last one left; protected by the
+    // listener's StripedMutex.
+    uint32_t Paths{0};
+    steady_clock::time_point Detached;
+    mutex Lock;
+    // Every path writes its extents at once, outside Lock. Writing counts
+    // the writes under way, and the file is only closed once none are.
+#ifdef _WIN32
+    HANDLE File{INVALID_HANDLE_VALUE};
+#else
+    int File{-1};
+#endif
+    uint32_t Writing{0};
+    condition_variable Idle;
+    // Ranges received, [Start, End) keyed by Start; touching ranges merge.
+    map<uint64_t, uint64_t> Received;
+    uint64_t ReceivedBytes{0};
+    bool Committed{false};
+    bool Failed{false};
+};
+
+bool QcCloseStripedFile(_Inout_ QcStripedFile& Striped);
+
+//
+// A striped pipe's chunk, received ahead of being written out.
+//
+struct QcPipeChunk {
+    QcBuffer Data;
+    uint32_t Length{0};
+    bool Ready{false};
+};
+
+struct QcConnection;
+struct QcPipeReassembly;
+
+//
+// One stream of a striped pipe. Records are a varint sequence number and a
+// varint length, gathered into Header, then Remaining bytes of data into
+// Chunk. A receive whose next record has no room in the window is left
+// pending, in Held, and parsed by the writer once there is.
+//
+struct QcPipeLane {
+    QcPipeReassembly* Pipe;
+    unique_ptr<MsQuicStream> Stream;
+    uint8_t Header[16];
+    uint8_t HeaderLength{0};
+    uint64_t Remaining{0};
+    QcPipeChunk* Chunk{nullptr};
+    vector<QUIC_BUFFER> Held;
+    uint32_t HeldIndex{0};
+    uint32_t HeldOffset{0};
+    uint64_t HeldLength{0};
+    bool Pending{false};
+};
+
+//
+// A striped pipe's receive side: a window of PipeWindow chunks from Next,
+// the next to be written, in Slots by sequence number. End is the number of
+// chunks, once a lane has carried the end record.
+//
+struct QcPipeReassembly {
+    QcConnection* Connection;
+    mutex Lock;
+    condition_variable Changed;
+    vector<QcPipeChunk> Slots = vector<QcPipeChunk>(PipeWindow);
+    uint64_t Next{0};
+    uint64_t End{UINT64_MAX};
+    vector<unique_ptr<QcPipeLane>> Lanes;
+    bool Failed{false};
+    bool Closed{false};
+};
+
+typedef struct QcListener QcListener;
+
+struct QcConnection {
+    MsQuicConnection* Connection;
+    MsQuicStream* Stream;
+    QcListener* Listener;
+    // Server connections are pooled, so the MsQuic wrappers live inline
+    // rather than being allocated per connection.
+    optional<MsQuicConnection> ConnectionStorage;
+    optional<MsQuicStream> StreamStorage;
+    // Position in QcListener::Connections, for constant time removal.
+    size_t ConnectionIndex;
+    list<QcConnection*>::iterator QueuePosition;
+    bool Admitted;
+    // Work running on the listener's threads (verification, signatures)
+    // keeps the context alive past SHUTDOWN_COMPLETE.
+    mutex WorkMutex;
+    uint32_t PendingWork;
+    bool ShutdownComplete;
+    CXPLAT_EVENT ConnectionShutdownEvent;
+    CXPLAT_EVENT StreamsReadyEvent;
+    string Password;
+    unique_ptr<QcSink> Sink;
+    string FileName;
+    // What FileName is received as, when it's renamed into place after.
+    string PartialName;
+    uint64_t BytesReceived;
+    uint64_t BytesReceivedSnapshot;
+    steady_clock::time_point StartTime;
+    steady_clock::time_point LastUpdate;
+    steady_clock::time_point EndTime;
+    QcBuffer SendBuffer;
+    CXPLAT_EVENT SendCompleteEvent;
+    QUIC_BUFFER SendQuicBuffer;
+    uint64_t FileSize{0};
+    uint32_t CurrentSendSize = DefaultSendBufferSize;
+    uint16_t UnidiStreams;
+    uint16_t BiDiStreams;
+    bool SendCanceled = false;
+    // File sends, on clients. Sends with a length as their context were
+    // granted by Scheduler, and are released to it as they complete.
+    atomic<uint32_t> SendsCompleted{0};
+    QcTransferScheduler* Scheduler;
+    QcTransferScheduler::Transfer* ScheduledTransfer;
+    QUIC_STATUS TransferStatus = QUIC_STATUS_ABORTED;
+    // Client handshakes: when it completed, and why the transport closed the
+    // connection, e.g. the server refused it.
+    steady_clock::time_point ConnectedTime;
+    QUIC_STATUS ShutdownStatus;
+    // The transfer header version negotiated by ALPN, and on servers, the
+    // header being received.
+    uint32_t HeaderVersion{QcHeaderVersion1};
+    QcHeaderParser HeaderParser;
+    // File sends wait on CapabilitiesReadyEvent for the server's
+    // capabilities, which version 1 servers have none of.
+    bool FileSend;
+    CXPLAT_EVENT CapabilitiesReadyEvent;
+    bool CapabilitiesStreamStarted;
+    vector<uint8_t> CapabilitiesData;
+    bool CapabilitiesReceived;
+    QcCapabilities PeerCapabilities;
+    // Sparse and delta transfer body parsing. Records are a short header,
+    // gathered into RecordHeader, optionally followed by RecordRemaining
+    // bytes of data. PayloadOffset is the file position written up to.
+    bool Sparse;
+    bool Delta;
+    uint8_t RecordHeader[24];
+    uint8_t RecordHeaderLength;
+    uint64_t RecordRemaining;
+    uint64_t PayloadOffset;
+    // Delta receive: the existing file, and the signatures sent for it.
+    ifstream Basis;
+    uint32_t DeltaBlockSize;
+    uint64_t BasisBlocks;
+    // Delta signatures, or the dedup chunk bitmap, sent back to the client.
+    vector<uint8_t> SignatureBuffer;
+    QUIC_BUFFER SignatureQuicBuffer;
+    // Striped receive: the file shared with the transfer's other paths.
+    // Extents are parsed as sparse ones, into PayloadOffset.
+    bool Striped;
+    shared_ptr<QcStripedFile> StripedFile;
+    // Dedup receive: the manifest, then the chunks in its order, written out
+    // from the chunk store or, for those in DedupNeeded, as they arrive in
+    // DedupChunkData. DedupNeeded is filled in on a worker thread, which sets
+    // DedupNeededReady before asking the client for the chunks.
+    bool Dedup;
+    uint8_t DedupState;
+    vector<uint8_t> DedupManifest;
+    uint64_t DedupManifestRemaining;
+    vector<QcDedupChunk> DedupChunks;
+    vector<bool> DedupNeeded;
+    atomic<bool> DedupNeededReady{false};
+    size_t DedupNext;
+    vector<uint8_t> DedupChunkData;
+    // Set while a receive is with the writer threads, which parse the body
+    // (see QcQueueDedupReceive); protected by WorkMutex.
+    bool DedupWriting;
+    // Packed receive. Entries are a varint name length, the name, a varint
+    // size, then the data; PackedState is the part being parsed.
+    bool Packed;
+    uint8_t PackedState;
+    string PackedName;
+    uint64_t PackedEntrySize;
+    string PackedPartialName;
+    uint64_t PackedNameRemaining;
+    vector<uint8_t> PackedData;
+    unique_ptr<QcSink> PackedSink;
+    set<string> PackedNames;
+    uint64_t PackedQueuedBytes;
+    uint32_t PackedQueuedEntries;
+    bool PackedPaused;
+    bool PackedFailed;
+    // Set when the stream's FIN arrived with entries still queued; the last
+    // writer then finishes the transfer and completes PackedFinishLength.
+    bool PackedFinishing;
+    uint64_t PackedFinishLength;
+    // Relay: the onward connection to the next server. Received data is sent
+    // on straight out of MsQuic's receive buffers, and only completed once
+    // that send completes, so the onward connection's flow control reaches
+    // back to the sender. Echo mode sends RelayBuffers back on the same
+    // stream instead.
+    optional<MsQuicConnection> RelayConnectionStorage;
+    optional<MsQuicStream> RelayStreamStorage;
+    vector<QUIC_BUFFER> RelayBuffers;
+    uint64_t RelayPendingLength;
+    bool RelayFinSent;
+    // Set from either connection's callbacks.
+    atomic<bool> RelayAborted{false};
+    // Until the onward connection shuts down; protected by WorkMutex.
+    bool RelayActive;
+    // Delta send. SignatureData holds at most MaxSignatureData bytes; past
+    // that, it's dropped and SignaturesTooLong set.
+    CXPLAT_EVENT SignaturesReadyEvent;
+    vector<uint8_t> SignatureData;
+    uint64_t MaxSignatureData;
+    bool SignaturesComplete;
+    bool SignaturesTooLong;
+    // Direct receive. The header lands in DirectHeader, and the rest of the
+    // stream in the sink's direct buffer; DirectProvided is how much of the
+    // file has been handed to MsQuic so far.
+    uint8_t DirectHeader[MaxHeaderLength];
+    uint8_t* DirectBuffer;
+    uint32_t DirectHeaderLength;
+    uint64_t DirectProvided;
+    // Datagram send, on clients.
+    QcDatagramSender* DatagramSender;
+    // Datagram receive: copies of the datagrams, waiting to be decoded and
+    // written out by QcServer::ReceiveDatagrams. Protected by RecvDataMutex.
+    deque<vector<uint8_t>> Datagrams;
+    uint64_t DatagramsDropped;
+    // Striped pipe receive, written out by QcServer::RunStripedPipe.
+    unique_ptr<QcPipeReassembly> Pipe;
+    // stdin/stdout variables
+    QcSource* PipeSource;
+    vector<QUIC_BUFFER> RecvData;
+    condition_variable RecvDataCV;
+    mutex RecvDataMutex;
+};
+
+struct QcListener {
+    MsQuicConfiguration* Config;
+    MsQuicListener* Listener;
+    CXPLAT_EVENT ConnectionReceivedEvent;
+    CXPLAT_EVENT ConnectionShutdownEvent;
+    string Password;
+    filesystem::path DestinationPath;
+    QcSinkFactory SinkFactory;
+    QcCompletionCallback CompletionCallback;
+    // Protected by ConnectionListMutex.
+    vector<QcConnection*> Connections;
+    list<QcConnection*> AdmissionQueue;
+    uint32_t ActiveConnections{0};
+    uint64_t ReservedReceiveMemory{0};
+    mutex ConnectionListMutex;
+    mutex ProgressMutex;
+    mutex PoolMutex;
+    vector<QcConnection*> FreeConnections;
+    QcShardedCounter<uint64_t> TotalBytesReceived;
+    QcShardedCounter<int64_t> TotalDuration;
+    QcShardedCounter<uint64_t> ConnectionsAccepted;
+    QcShardedCounter<uint64_t> ConnectionsQueued;
+    QcShardedCounter<uint64_t> ConnectionsRefused;
+    unique_ptr<QcAddressRateLimiter> HandshakeLimiter;
+    unique_ptr<QcWorkQueue> Verifier;
+    // Slower per-transfer work, e.g. delta signatures.
+    unique_ptr<QcWorkQueue> Workers;
+    // Creates the small files of packed transfers, so file system metadata
+    // operations overlap.
+    unique_ptr<QcWorkQueue> Writers;
+    uint32_t WriterThreads;
+    atomic<uint32_t> PendingVerifications{0};
+    uint32_t MaxPendingVerifications;
+    // Whether this listener is one of those forcing Retry; protected by
+    // QcRetryState's lock.
+    bool RetryForced{false};
+    QcShardedCounter<uint64_t> HandshakesRateLimited;
+    QcShardedCounter<uint64_t> VerificationsRejected;
+    QcShardedCounter<uint64_t> VerificationsFailed;
+    QcShardedCounter<uint64_t> VerificationsSucceeded;
+    QcShardedCounter<uint64_t> RetryEnforcements;
+    steady_clock::time_point LastUpdate;
+    uint32_t MaxConnections;
+    uint32_t MaxQueuedConnections;
+    uint64_t ReceiveMemoryBudget;
+    uint32_t ReceiveWindow;
+    bool DirectReceive;
+    bool Wait;
+    bool ShowProgress;
+    // Files are received under a partial name and committed into place (see
+    // QcCommitFile). Only the default sinks write files where this expects.
+    bool AtomicFinalize{false};
+    QcDurability Durability{QcDurabilityNone};
+    unique_ptr<QcGroupCommitter> Committer;
+    // What file mode accepts, sent to version 2 clients as they connect.
+    QcCapabilities Capabilities;
+    vector<uint8_t> CapabilitiesData;
+    QUIC_BUFFER CapabilitiesBuffer;
+    // Chunks of received files, for deduplicated transfers.
+    unique_ptr<QcChunkStore> ChunkStore;
+    QcShardedCounter<uint64_t> BytesDeduplicated;
+    // Striped transfers, by transfer ID.
+    mutex StripedMutex;
+    unordered_map<uint64_t, shared_ptr<QcStripedFile>> StripedFiles;
+    // Relay mode forwards transfers to RelayTarget instead of receiving them.
+    bool Relay{false};
+    // Serve mode answers requests for files under ServePath.
+    bool Serve{false};
+    filesystem::path ServePath;
+    QcShardedCounter<uint64_t> TotalBytesServed;
+    // Echo mode sends each connection's stream back to it.
+    bool Echo{false};
+    // Datagram mode. Connected connections wait here, holding a
+    // PendingWork reference, for ReceiveDatagrams; protected by
+    // ConnectionListMutex.
+    bool Datagram{false};
+    deque<QcConnection*> DatagramConnections;
+    // Striped pipe mode. Its connections wait here for RunStripedPipe as
+    // datagram mode's do, and pipe mode's, once their stream has started,
+    // for RunPipe.
+    bool StripedPipe{false};
+    deque<QcConnection*> PipeConnections;
+    // Tunnel mode connects each stream to the TCP address given.
+    unique_ptr<QcTunnel> Tunnel;
+    const MsQuicRegistration* Registration;
+    MsQuicConfiguration* RelayConfig;
+    string RelayTarget;
+    uint16_t RelayPort;
+    string RelayPassword;
+
+    ~QcListener() {
+        // Outstanding work may free connections.
+        Verifier.reset();
+        Workers.reset();
+        Writers.reset();
+        for (auto Connection : FreeConnections) {
+            CxPlatEventUninitialize(Connection->SendCompleteEvent);
+            delete Connection;
+        }
+        // Striped files whose paths never finished them.
+        for (auto& Entry : StripedFiles) {
+            if (!Entry.second->Committed) {
+                QcCloseStripedFile(*Entry.second);
+                auto PartialPath = DestinationPath / Entry.second->PartialName;
+                error_code Error;
+                filesystem::remove(PartialPath, Error);
+            }
+        }
+    }
+};
+
+QcFileSource::QcFileSource(
+    _In_ const filesystem::path& FilePath
+    ) :
+    Path(FilePath),
+    File(FilePath, ios::binary | ios::in)
+{
+    error_code Error;
+    Size = filesystem::file_size(Path, Error);
+    if (Error) {
+        File.setstate(ios::failbit);
+    }
+#ifdef _WIN32
+    ExtentHandle =
+        CreateFileW(
+            Path.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr);
+#else
+    ExtentHandle = open(Path.c_str(), O_RDONLY);
+#endif
+}
+
+QcFileSource::~QcFileSource()
+{
+#ifdef _WIN32
+    if (ExtentHandle != INVALID_HANDLE_VALUE) {
+        CloseHandle(ExtentHandle);
+    }
+#else
+    if (ExtentHandle >= 0) {
+        close(ExtentHandle);
+    }
+#endif
+}
+
+bool
+QcFileSource::NextDataExtent(
+    _In_ uint64_t Offset,
+    _Out_ uint64_t& Start,
+    _Out_ uint64_t& End
+    )
+{
+    Start = End = Size;
+    if (Offset >= Size) {
+        return true;
+    }
+#ifdef _WIN32
+    if (ExtentHandle == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    FILE_ALLOCATED_RANGE_BUFFER Query, Range;
+    Query.FileOffset.QuadPart = (LONGLONG)Offset;
+    Query.Length.QuadPart = (LONGLONG)(Size - Offset);
+    DWORD Returned = 0;
+    if (!DeviceIoControl(
+            ExtentHandle,
+            FSCTL_QUERY_ALLOCATED_RANGES,
+            &Query,
+            sizeof(Query),
+            &Range,
+            sizeof(Range),
+            &Returned,
+            nullptr) &&
+        GetLastError() != ERROR_MORE_DATA) {
+        return false;
+    }
+    if (Returned < sizeof(Range)) {
+        return true;
+    }
+    Start = max(Offset, (uint64_t)Range.FileOffset.QuadPart);
+    End = min(Size, (uint64_t)(Range.FileOffset.QuadPart + Range.Length.QuadPart));
+    return true;
+#elif defined(SEEK_DATA)
+    if (ExtentHandle < 0) {
+        return false;
+    }
+    auto Data = lseek(ExtentHandle, (off_t)Offset, SEEK_DATA);
+    if (Data < 0) {
+        // ENXIO: no data past Offset.
+        return errno == ENXIO;
+    }
+    auto Hole = lseek(ExtentHandle, Data, SEEK_HOLE);
+    if (Hole < 0) {
+        return false;
+    }
+    Start = min(Size, (uint64_t)Data);
+    End = min(Size, (uint64_t)Hole);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool
+QcFileSource::Seek(
+    _In_ uint64_t Offset
+    )
+{
+    File.clear();
+    File.seekg((streamoff)Offset);
+    Position = Offset;
+    ReadAhead.Advance(Position);
+    return !File.fail();
+}
+
+void
+QcFileSource::SetReadAhead(
+    _In_ uint64_t Window
+    )
+{
+    ReadAhead.Open(Path, Size, Window);
+    ReadAhead.Advance(Position);
+}
+
+bool
+QcSparseSource::Read(
+    _Out_writes_bytes_to_(Length, BytesRead) uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ uint32_t& BytesRead
+    )
+{
+    QC_TRACE(QcTraceRead, Length);
+    // Callers treat a short read as the end, so fill the whole buffer.
+    BytesRead = 0;
+    while (BytesRead < Length) {
+        if (PendingOffset < PendingLength) {
+            uint32_t CopyLength = min<uint32_t>(PendingLength - PendingOffset, Length - BytesRead);
+            memcpy(Buffer + BytesRead, Pending + PendingOffset, CopyLength);
+            PendingOffset += (uint8_t)CopyLength;
+            BytesRead += CopyLength;
+        } else if (ExtentRemaining != 0) {
+            uint32_t ReadLength = (uint32_t)min<uint64_t>(ExtentRemaining, Length - BytesRead);
+            uint32_t Read = 0;
+            if (!Source.Read(Buffer + BytesRead, ReadLength, Read) || Read == 0) {
+                Log() << "Source ended inside a data extent!" << endl;
+                return false;
+            }
+            BytesRead += Read;
+            ExtentRemaining -= Read;
+            Position += Read;
+        } else if (!Finished) {
+            uint64_t Start, End;
+            if (!Source.NextDataExtent(Position, Start, End)) {
+                return false;
+            }
+            if (Start >= End) {
+                Finished = true;
+                continue;
+            }
+            if (!Source.Seek(Start)) {
+                return false;
+            }
+            uint8_t* Cursor = QuicVarIntEncode(Start, Pending);
+            Cursor = QuicVarIntEncode(End - Start, Cursor);
+            PendingLength = (uint8_t)(Cursor - Pending);
+            PendingOffset = 0;
+            Position = Start;
+            ExtentRemaining = End - Start;
+        } else {
+            break;
+        }
+    }
+    return true;
+}
+
+bool
+QcFileSource::Read(
+    _Out_writes_bytes_to_(Length, BytesRead) uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ uint32_t& BytesRead
+    )
+{
+    QC_TRACE(QcTraceRead, Length);
+    File.read((char*)Buffer, Length);
+    BytesRead = (uint32_t)File.gcount();
+    Position += BytesRead;
+    ReadAhead.Advance(Position);
+    return !File.bad();
+}
+
+QcPackedSource::QcPackedSource(
+    _In_ const filesystem::path& Directory
+    ) :
+    Path(filesystem::absolute(Directory).lexically_normal())
+{
+    if (!Path.has_filename()) {
+        Path = Path.parent_path();
+    }
+    error_code Error;
+    for (filesystem::recursive_directory_iterator It(Path, Error), End; !Error && It != End; It.increment(Error)) {
+        if (It->is_symlink(Error) || !It->is_regular_file(Error)) {
+            continue;
+        }
+        auto Name = It->path().lexically_relative(Path).generic_string();
+        uint64_t FileSize = It->file_size(Error);
+        if (Error) {
+            break;
+        }
+        if (Name.size() > MaxPackedNameLength) {
+            Log() << "Skipping " << It->path() << ", its path is too long" << endl;
+            continue;
+        }
+        Entries.push_back({Name, FileSize});
+        Size += FileSize;
+    }
+    if (Error) {
+        Log() << "Failed to list " << Path << ": " << Error.message() << endl;
+    }
+    Valid = !Error && Path.filename().generic_string().size() <= MaxFileNameLength;
+}
+
+bool
+QcPackedSource::Read(
+    _Out_writes_bytes_to_(Length, BytesRead) uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ uint32_t& BytesRead
+    )
+{
+    // Callers treat a short read as the end, so fill the whole buffer.
+    BytesRead = 0;
+    while (BytesRead < Length) {
+        if (PendingOffset < Pending.size()) {
+            uint32_t CopyLength = (uint32_t)min<size_t>(Pending.size() - PendingOffset, Length - BytesRead);
+            memcpy(Buffer + BytesRead, Pending.data() + PendingOffset, CopyLength);
+            PendingOffset += CopyLength;
+            BytesRead += CopyLength;
+        } else if (FileRemaining != 0) {
+            uint32_t ReadLength = (uint32_t)min<uint64_t>(FileRemaining, Length - BytesRead);
+            ReadAhead.Advance(Entries[Current - 1].Size - FileRemaining);
+            File.read((char*)Buffer + BytesRead, ReadLength);
+            if ((uint32_t)File.gcount() != ReadLength) {
+                Log() << "Failed to read " << Path / Entries[Current - 1].Name << endl;
+                return false;
+            }
+            BytesRead += ReadLength;
+            FileRemaining -= ReadLength;
+        } else if (Current < Entries.size()) {
+            auto& Next = Entries[Current++];
+            File.close();
+            File.clear();
+            if (Next.Size != 0) {
+                File.open(Path / Next.Name, ios::binary | ios::in);
+                if (!File.is_open()) {
+                    Log() << "Failed to open " << Path / Next.Name << endl;
+                    return false;
+                }
+            }
+            if (ReadAheadWindow != 0) {
+                ReadAhead.Open(Path / Next.Name, Next.Size, ReadAheadWindow);
+                // Small files are read whole before the one ahead is done.
+                if (Current < Entries.size()) {
+                    QcReadAhead::Prefetch(Path / Entries[Current].Name, ReadAheadWindow);
+                }
+            }
+            Pending.resize(8 + Next.Name.size() + 8);
+            uint8_t* Cursor = QuicVarIntEncode(Next.Name.size(), Pending.data());
+            memcpy(Cursor, Next.Name.data(), Next.Name.size());
+            Cursor = QuicVarIntEncode(Next.Size, Cursor + Next.Name.size());
+            Pending.resize((size_t)(Cursor - Pending.data()));
+            PendingOffset = 0;
+            FileRemaining = Next.Size;
+        } else {
+            break;
+        }
+    }
+    return true;
+}
+
+bool
+QcBufferSource::Read(
+    _Out_writes_bytes_to_(Length, BytesRead) uint8_t* Buffer,
+    _In_ uint32_t ReadLength,
+    _Out_ uint32_t& BytesRead
+    )
+{
+    BytesRead = (uint32_t)min<uint64_t>(ReadLength, Length - Offset);
+    memcpy(Buffer, Data + Offset, BytesRead);
+    Offset += BytesRead;
+    return true;
+}
+
+bool
+QcSyntheticSource::Read(
+    _Out_writes_bytes_to_(Length, BytesRead) uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ uint32_t& BytesRead
+    )
+{
+    BytesRead = (uint32_t)min<uint64_t>(Length, Size - Offset);
+    memset(Buffer, 'q', BytesRead);
+    Offset += BytesRead;
+    return true;
+}
+
+QcStdioSource::QcStdioSource(
+    _In_ FILE* Stream,
+    _In_ bool ReadImmediate
+    ) :
+    File(Stream),
+    Immediate(ReadImmediate)
+{
+#ifdef _WIN32
+    // Windows interprets 0x1A as EOF unless you tell it to read stdin as binary
+    _setmode(_fileno(File), _O_BINARY);
+#else
+    if (pipe(CancelPipe) == 0) {
+        fcntl(CancelPipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(CancelPipe[1], F_SETFL, O_NONBLOCK);
+    } else {
+        CancelPipe[0] = CancelPipe[1] = -1;
+    }
+#endif
+}
+
+QcStdioSource::~QcStdioSource()
+{
+#ifndef _WIN32
+    if (CancelPipe[0] >= 0) {
+        close(CancelPipe[0]);
+        close(CancelPipe[1]);
+    }
+#endif
+}
+
+#ifndef _WIN32
+//
+// Waits for File to have input, or an error or end for read to report.
+// Returns false if the source was canceled first.
+//
+bool
+QcStdioSource::WaitForInput()
+{
+    pollfd Fds[2] = {{fileno(File), POLLIN, 0}, {CancelPipe[0], POLLIN, 0}};
+    while (!Canceled) {
+        int Ready = poll(Fds, 2, -1);
+        if ((Ready < 0 && errno != EINTR) || (Ready > 0 && Fds[0].revents != 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+bool
+QcStdioSource::Read(
+    _Out_writes_bytes_to_(Length, BytesRead) uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ uint32_t& BytesRead
+    )
+{
+    QC_TRACE(QcTraceRead, Length);
+    BytesRead = 0;
+#ifdef _WIN32
+    Reader = GetCurrentThreadId();
+    if (Canceled) {
+        Reader = 0;
+        return true;
+    }
+    if (Immediate) {
+        // Whatever one read returns, so each write on the other end of the
+        // pipe is sent as soon as it's made.
+        auto Result = read(fileno(File), Buffer, Length);
+        if (Result > 0) {
+            BytesRead = (uint32_t)Result;
+        }
+    } else if (isatty(fileno(File))) {
+        if (fgets((char*)Buffer, Length, File) != nullptr) {
+            BytesRead = (uint32_t)strlen((char*)Buffer);
+        }
+    } else {
+        BytesRead = (uint32_t)fread(Buffer, 1, Length, File);
+    }
+    Reader = 0;
+    if (Canceled) {
+        // The read may have been canceled, rather than failed.
+        clearerr(File);
+        return true;
+    }
+    return !ferror(File);
+#else
+    // Reads go to the descriptor, not through stdio's buffer, so that
+    // waiting for input can be canceled. Terminals return a line per read.
+    int Fd = fileno(File);
+    // Immediate sources return whatever one read does, so each write on the
+    // other end of the pipe is sent as soon as it's made; others fill the
+    // buffer, as fread would.
+    bool Fill = !Immediate && !isatty(Fd);
+    while (BytesRead < Length && WaitForInput()) {
+        auto Result = read(Fd, Buffer + BytesRead, Length - BytesRead);
+        if (Result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        BytesRead += (uint32_t)Result;
+        if (Result == 0 || !Fill) {
+            break;
+        }
+    }
+    return true;
+#endif
+}
+
+void
+QcStdioSource::Cancel()
+{
+    Canceled = true;
+#ifdef _WIN32
+    DWORD Id = Reader;
+    if (Id != 0) {
+        HANDLE Thread = OpenThread(THREAD_TERMINATE, FALSE, Id);
+        if (Thread != nullptr) {
+            CancelSynchronousIo(Thread);
+            CloseHandle(Thread);
+        }
+    }
+#else
+    uint8_t Wake = 0;
+    (void)!write(CancelPipe[1], &Wake, sizeof(Wake));
+#endif
+}
+
+void
+QcStdioSource::Resume()
+{
+#ifdef _WIN32
+    clearerr(File);
+#else
+    uint8_t Drain[16];
+    while (read(CancelPipe[0], Drain, sizeof(Drain)) > 0) {
+    }
+#endif
+    Canceled = false;
+}
+
+QcDeltaSource::QcDeltaSource(
+    _In_ QcSource& Inner,
+    _In_ uint32_t BasisBlockSize,
+    _In_ vector<QcBlockSignature>&& BasisSignatures
+    ) :
+    Source(Inner),
+    BlockSize(BasisBlockSize),
+    Signatures(std::move(BasisSignatures)),
+    Filter(1 << 16)
+{
+    Index.reserve(Signatures.size());
+    for (uint32_t i = 0; i < Signatures.size(); ++i) {
+        Index.emplace(Signatures[i].Weak, i);
+        Filter[(Signatures[i].Weak ^ (Signatures[i].Weak >> 16)) & 0xFFFF] = true;
+    }
+    Window.resize(MaxDeltaLiteral + BlockSize + DeltaReadSize);
+}
+
+bool
+QcDeltaSource::Read(
+    _Out_writes_bytes_to_(Length, BytesRead) uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ uint32_t& BytesRead
+    )
+{
+    // Callers treat a short read as the end, so fill the whole buffer.
+    BytesRead = 0;
+    while (BytesRead < Length) {
+        if (OutputOffset < Output.size()) {
+            uint32_t CopyLength = (uint32_t)min<size_t>(Output.size() - OutputOffset, Length - BytesRead);
+            memcpy(Buffer + BytesRead, Output.data() + OutputOffset, CopyLength);
+            OutputOffset += CopyLength;
+            BytesRead += CopyLength;
+        } else if (Finished) {
+            break;
+        } else if (!Produce()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+QcDeltaSource::Fill()
+{
+    // Keep the pending literal; everything before it has been encoded.
+    memmove(Window.data(), Window.data() + LiteralStart, WindowEnd - LiteralStart);
+    Position -= LiteralStart;
+    WindowEnd -= LiteralStart;
+    LiteralStart = 0;
+    while (WindowEnd < Window.size()) {
+        uint32_t ReadLength = (uint32_t)min<size_t>(Window.size() - WindowEnd, UINT32_MAX);
+        uint32_t Read = 0;
+        if (!Source.Read(Window.data() + WindowEnd, ReadLength, Read)) {
+            return false;
+        }
+        WindowEnd += Read;
+        if (Read < ReadLength) {
+            SourceEnded = true;
+            break;
+        }
+    }
+    return true;
+}
+
+bool
+QcDeltaSource::FindMatch(
+    _In_ const uint8_t* Block,
+    _Out_ uint32_t& Match
+    )
+{
+    uint32_t Weak = Checksum.Get();
+    if (!Filter[(Weak ^ (Weak >> 16)) & 0xFFFF]) {
+        return false;
+    }
+    auto Candidates = Index.equal_range(Weak);
+    if (Candidates.first == Candidates.second) {
+        return false;
+    }
+    array<uint8_t, QcStrongHashLength> Strong;
+    QcStrongHash(Block, BlockSize, Strong);
+    // Prefer the block following the current run, so runs stay long.
+    bool Found = false;
+    for (auto Candidate = Candidates.first; Candidate != Candidates.second; ++Candidate) {
+        if (Signatures[Candidate->second].Strong == Strong) {
+            if (!Found || Candidate->second == CopyStart + CopyCount) {
+                Match = Candidate->second;
+                Found = true;
+            }
+        }
+    }
+    return Found;
+}
+
+void
+QcDeltaSource::FlushLiteral()
+{
+    if (Position == LiteralStart) {
+        return;
+    }
+    uint64_t Length = Position - LiteralStart;
+    size_t Start = Output.size();
+    Output.resize(Start + 1 + 8 + (size_t)Length);
+    uint8_t* Cursor = Output.data() + Start;
+    *Cursor++ = QcDeltaRecordLiteral;
+    Cursor = QuicVarIntEncode(Length, Cursor);
+    memcpy(Cursor, Window.data() + LiteralStart, (size_t)Length);
+    Cursor += Length;
+    Output.resize((size_t)(Cursor - Output.data()));
+    LiteralBytes += Length;
+    LiteralStart = Position;
+}
+
+void
+QcDeltaSource::FlushCopy()
+{
+    if (CopyCount == 0) {
+        return;
+    }
+    size_t Start = Output.size();
+    Output.resize(Start + 1 + 8 + 8);
+    uint8_t* Cursor = Output.data() + Start;
+    *Cursor++ = QcDeltaRecordCopy;
+    Cursor = QuicVarIntEncode(CopyStart, Cursor);
+    Cursor = QuicVarIntEncode(CopyCount, Cursor);
+    Output.resize((size_t)(Cursor - Output.data()));
+    MatchedBytes += CopyCount * BlockSize;
+    CopyCount = 0;
+}
+
+bool
+QcDeltaSource::Produce()
+{
+    Output.clear();
+    OutputOffset = 0;
+    while (Output.size() < DeltaOutputBatch && !Finished) {
+        if (WindowEnd - Position < BlockSize && !SourceEnded) {
+            if (!Fill()) {
+                return false;
+            }
+            continue;
+        }
+        if (WindowEnd - Position < BlockSize) {
+            // The tail is shorter than a block, so can't match.
+            Position = WindowEnd;
+            FlushCopy();
+            FlushLiteral();
+            Finished = true;
+            break;
+        }
+        if (!ChecksumValid) {
+            Checksum.Compute(Window.data() + Position, BlockSize);
+            ChecksumValid = true;
+        }
+        uint32_t Match;
+        if (FindMatch(Window.data() + Position, Match)) {
+            if (Position != LiteralStart) {
+                FlushCopy();
+                FlushLiteral();
+            }
+            if (CopyCount == 0 || Match != CopyStart + CopyCount) {
+                FlushCopy();
+                CopyStart = Match;
+            }
+            CopyCount++;
+            Position += BlockSize;
+            LiteralStart = Position;
+            ChecksumValid = false;
+        } else {
+            if (Position + BlockSize < WindowEnd) {
+                Checksum.Roll(Window[Position], Window[Position + BlockSize]);
+            } else {
+                ChecksumValid = false;
+            }
+            Position++;
+            if (Position - LiteralStart >= MaxDeltaLiteral) {
+                FlushCopy();
+                FlushLiteral();
+            }
+        }
+    }
+    return true;
+}
+
+//
+// Cuts Source into content-defined chunks, and hashes each, for a
+// deduplicated transfer. Reads it to the end.
+//
+bool
+QcChunkSource(
+    _In_ QcSource& Source,
+    _Out_ vector<QcDedupChunk>& Chunks
+    )
+{
+    Chunks.clear();
+    // Boundaries are only final with a maximum chunk in hand, or at the end.
+    vector<uint8_t> Window(QcMaxDedupChunkLength + DedupReadSize);
+    size_t Start = 0;
+    size_t End = 0;
+    bool SourceEnded = false;
+    uint64_t Total = 0;
+    while (true) {
+        if (End - Start < QcMaxDedupChunkLength && !SourceEnded) {
+            memmove(Window.data(), Window.data() + Start, End - Start);
+            End -= Start;
+            Start = 0;
+            while (End < Window.size()) {
+                uint32_t ReadLength = (uint32_t)(Window.size() - End);
+                uint32_t Read = 0;
+                if (!Source.Read(Window.data() + End, ReadLength, Read)) {
+                    return false;
+                }
+                End += Read;
+                if (Read < ReadLength) {
+                    SourceEnded = true;
+                    break;
+                }
+            }
+        }
+        if (Start == End) {
+            break;
+        }
+        QcDedupChunk Chunk;
+        Chunk.Length = QcFindChunkBoundary(Window.data() + Start, End - Start);
+        QcStrongHash(Window.data() + Start, Chunk.Length, Chunk.Hash);
+        Chunks.push_back(Chunk);
+        Start += Chunk.Length;
+        Total += Chunk.Length;
+    }
+    // The manifest has to match the size in the header.
+    return Total == Source.GetSize();
+}
+
+QcDedupSource::QcDedupSource(
+    _In_ QcSource& Inner,
+    _In_ const vector<QcDedupChunk>& FileChunks,
+    _In_ vector<bool>&& NeededChunks
+    ) :
+    Source(Inner),
+    Chunks(FileChunks),
+    Needed(std::move(NeededChunks))
+{
+}
+
+bool
+QcDedupSource::Read(
+    _Out_writes_bytes_to_(Length, BytesRead) uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ uint32_t& BytesRead
+    )
+{
+    // Callers treat a short read as the end, so fill the whole buffer.
+    BytesRead = 0;
+    while (BytesRead < Length) {
+        if (ChunkRemaining == 0) {
+            while (Current < Chunks.size() && !Needed[Current]) {
+                DeduplicatedBytes += Chunks[Current].Length;
+                ChunkOffset += Chunks[Current].Length;
+                Current++;
+            }
+            if (Current == Chunks.size()) {
+                break;
+            }
+            if (Position != ChunkOffset) {
+                if (!Source.Seek(ChunkOffset)) {
+                    return false;
+                }
+                Position = ChunkOffset;
+            }
+            ChunkRemaining = Chunks[Current].Length;
+            ChunkOffset += Chunks[Current].Length;
+            Current++;
+        }
+        uint32_t ReadLength = (uint32_t)min<uint64_t>(ChunkRemaining, Length - BytesRead);
+        uint32_t Read = 0;
+        if (!Source.Read(Buffer + BytesRead, ReadLength, Read) || Read != ReadLength) {
+            // The file shrank since it was chunked.
+            return false;
+        }
+        BytesRead += Read;
+        ChunkRemaining -= Read;
+        Position += Read;
+        SentBytes += Read;
+    }
+    return true;
+}
+
+bool
+QcSink::Skip(
+    _In_ uint64_t Length
+    )
+{
+    static const uint8_t Zeros[64 * 1024] = {};
+    while (Length != 0) {
+        uint32_t WriteLength = (uint32_t)min<uint64_t>(Length, sizeof(Zeros));
+        if (!Write(Zeros, WriteLength)) {
+            return false;
+        }
+        Length -= WriteLength;
+    }
+    return true;
+}
+
+bool
+QcFileSink::Open(
+    _In_ const string& Name,
+    _In_ uint64_t /*Size*/
+    )
+{
+    // Log() << "Creating file: " << DestinationPath / Name << endl;
+    FilePath = DestinationPath / Name;
+    Position = 0;
+    Sparse = false;
+    DestinationFile.open(FilePath, ios::binary | ios::out);
+    if (DestinationFile.fail()) {
+        Log() << "Failed to open " << DestinationPath / Name << " for writing!" << endl;
+        return false;
+    }
+    DropBehind.Open(FilePath, DropBehindWindow);
+    return true;
+}
+
+bool
+QcFileSink::Write(
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    QC_TRACE(QcTraceWrite, Length);
+    DestinationFile.write((const char*)Buffer, Length);
+    Position += Length;
+    if (Position >= DropBehind.GetNextPosition()) {
+        DestinationFile.flush();
+        DropBehind.Advance(Position);
+    }
+    return !DestinationFile.fail();
+}
+
+bool
+QcFileSink::Skip(
+    _In_ uint64_t Length
+    )
+{
+    // Seeking past the end and writing leaves a hole.
+    DestinationFile.seekp((streamoff)Length, ios::cur);
+    Position += Length;
+    Sparse = true;
+    return !DestinationFile.fail();
+}
+
+bool
+QcFileSink::Close()
+{
+    DestinationFile.flush();
+    DropBehind.Close();
+    DestinationFile.close();
+    if (DestinationFile.fail()) {
+        return false;
+    }
+    if (Sparse) {
+        // A trailing hole isn't written at all, so extend the file over it.
+        error_code Error;
+        if (filesystem::file_size(FilePath, Error) < Position && !Error) {
+            filesystem::resize_file(FilePath, Position, Error);
+        }
+        return !Error;
+    }
+    return true;
+}
+
+QcMappedFileSink::~QcMappedFileSink()
+{
+    Close();
+}
+
+bool
+QcMappedFileSink::Open(
+    _In_ const string& Name,
+    _In_ uint64_t FileSize
+    )
+{
+    auto FilePath = DestinationPath / Name;
+    if (FileSize == QcUnknownSize || (uint64_t)(size_t)FileSize != FileSize) {
+        Log() << "Can't map " << FilePath << " of size " << FileSize << endl;
+        return false;
+    }
+    Size = FileSize;
+    Offset = 0;
+#ifdef _WIN32
+    File = CreateFileW(
+        FilePath.c_str(),
+        GENERIC_READ | GENERIC_WRITE,
+        0,
+        nullptr,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (File == INVALID_HANDLE_VALUE) {
+        Log() << "Failed to open " << FilePath << " for writing!" << endl;
+        return false;
+    }
+    if (Size == 0) {
+        return true;
+    }
+    Mapping = CreateFileMappingW(File, nullptr, PAGE_READWRITE, (DWORD)(Size >> 32), (DWORD)Size, nullptr);
+    if (Mapping != nullptr) {
+        View = (uint8_t*)MapViewOfFile(Mapping, FILE_MAP_WRITE, 0, 0, 0);
+    }
+#else
+    File = open(FilePath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (File < 0) {
+        Log() << "Failed to open " << FilePath << " for writing!" << endl;
+        return false;
+    }
+    if (Size == 0) {
+        return true;
+    }
+    // Allocate the blocks now, so running out of space fails here rather
+    // than as a SIGBUS when the mapping is written.
+    int Error = posix_fallocate(File, 0, (off_t)Size);
+    if (Error != 0 && Error != EOPNOTSUPP && Error != EINVAL) {
+        Log() << "Failed to allocate " << Size << " bytes for " << FilePath << ": " << Error << endl;
+        return false;
+    }
+    if (Error != 0 && ftruncate(File, (off_t)Size) != 0) {
+        Log() << "Failed to size " << FilePath << ": " << errno << endl;
+        return false;
+    }
+    auto Address = mmap(nullptr, (size_t)Size, PROT_READ | PROT_WRITE, MAP_SHARED, File, 0);
+    if (Address != MAP_FAILED) {
+        View = (uint8_t*)Address;
+        madvise(View, (size_t)Size, MADV_SEQUENTIAL);
+    }
+#endif
+    if (View == nullptr) {
+        Log() << "Failed to map " << FilePath << endl;
+        return false;
+    }
+    return true;
+}
+
+bool
+QcMappedFileSink::Write(
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    QC_TRACE(QcTraceWrite, Length);
+    if (Length > Size - Offset) {
+        Log() << "Received more than the file size!" << endl;
+        return false;
+    }
+    if (Length != 0) {
+        memcpy(View + Offset, Buffer, Length);
+        Offset += Length;
+    }
+    return true;
+}
+
+bool
+QcMappedFileSink::Skip(
+    _In_ uint64_t Length
+    )
+{
+    if (Length > Size - Offset) {
+        Log() << "Received more than the file size!" << endl;
+        return false;
+    }
+    Offset += Length;
+    return true;
+}
+
+bool
+QcMappedFileSink::Close()
+{
+    bool Result = true;
+#ifdef _WIN32
+    if (View != nullptr) {
+        Result &= UnmapViewOfFile(View) != FALSE;
+    }
+    if (Mapping != nullptr) {
+        CloseHandle(Mapping);
+    }
+    if (File != INVALID_HANDLE_VALUE) {
+        Result &= CloseHandle(File) != FALSE;
+    }
+    File = INVALID_HANDLE_VALUE;
+    Mapping = nullptr;
+#else
+    if (View != nullptr) {
+        Result &= munmap(View, (size_t)Size) == 0;
+    }
+    if (File >= 0) {
+        Result &= close(File) == 0;
+    }
+    File = -1;
+#endif
+    View = nullptr;
+    return Result;
+}
+
+QcDirectIoFileSink::~QcDirectIoFileSink()
+{
+    Close();
+    if (Block != nullptr) {
+        operator delete[](Block, align_val_t(DirectIoAlignment));
+    }
+}
+
+bool
+QcDirectIoFileSink::Open(
+    _In_ const string& Name,
+    _In_ uint64_t Size
+    )
+{
+    auto FilePath = DestinationPath / Name;
+    if (Block == nullptr) {
+        Block = new(align_val_t(DirectIoAlignment), nothrow) uint8_t[DirectIoBlockSize];
+        if (Block == nullptr) {
+            return false;
+        }
+    }
+    BlockLength = 0;
+    FileOffset = 0;
+#ifdef _WIN32
+    Direct = true;
+    File = CreateFileW(
+        FilePath.c_str(),
+        GENERIC_WRITE,
+        0,
+        nullptr,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH,
+        nullptr);
+    if (File == INVALID_HANDLE_VALUE) {
+        Log() << "Failed to open " << FilePath << " for writing!" << endl;
+        return false;
+    }
+    UNREFERENCED_PARAMETER(Size);
+#else
+    Direct = true;
+    File = open(FilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    if (File < 0 && errno == EINVAL) {
+        // e.g. tmpfs
+        Log() << "Direct I/O not supported for " << FilePath << ", using buffered writes" << endl;
+        Direct = false;
+        File = open(FilePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (File < 0) {
+        Log() << "Failed to open " << FilePath << " for writing!" << endl;
+        return false;
+    }
+    if (Size != QcUnknownSize && Size != 0) {
+        // Keep the file contiguous; it's only a hint.
+        posix_fallocate(File, 0, (off_t)Size);
+    }
+#endif
+    return true;
+}
+
+bool
+QcDirectIoFileSink::WriteBlock(
+    _In_ uint32_t Length
+    )
+{
+    uint32_t Written = 0;
+    while (Written < Length) {
+#ifdef _WIN32
+        DWORD Result = 0;
+        OVERLAPPED Overlapped{};
+        Overlapped.Offset = (DWORD)(FileOffset + Written);
+        Overlapped.OffsetHigh = (DWORD)((FileOffset + Written) >> 32);
+        if (!WriteFile(File, Block + Written, Length - Written, &Result, &Overlapped)) {
+            Log() << "Failed to write to file: " << GetLastError() << endl;
+            return false;
+        }
+#else
+        auto Result = pwrite(File, Block + Written, Length - Written, (off_t)(FileOffset + Written));
+        if (Result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && Direct) {
+                // Some file systems take O_DIRECT at open, but then refuse
+                // the writes; carry on through the page cache.
+                Log() << "Direct I/O writes refused, using buffered writes" << endl;
+                Direct = false;
+                if (fcntl(File, F_SETFL, fcntl(File, F_GETFL) & ~O_DIRECT) == 0) {
+                    continue;
+                }
+            }
+            Log() << "Failed to write to file: " << errno << endl;
+            return false;
+        }
+#endif
+        if (Result == 0) {
+            Log() << "Failed to write to file: no progress" << endl;
+            return false;
+        }
+        uint32_t Done = (uint32_t)Result;
+        if (Direct && Done < Length - Written) {
+            // A short write would leave the rest misaligned for direct I/O.
+            // Carry on from the last aligned offset instead; the bytes after
+            // it are simply written again.
+            Done &= ~(DirectIoAlignment - 1);
+        }
+        Written += Done;
+    }
+    FileOffset += Length;
+    return true;
+}
+
+bool
+QcDirectIoFileSink::Write(
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    QC_TRACE(QcTraceWrite, Length);
+    while (Length != 0) {
+        uint32_t CopyLength = min(Length, DirectIoBlockSize - BlockLength);
+        memcpy(Block + BlockLength, Buffer, CopyLength);
+        BlockLength += CopyLength;
+        Buffer += CopyLength;
+        Length -= CopyLength;
+        if (BlockLength == DirectIoBlockSize) {
+            if (!WriteBlock(BlockLength)) {
+                return false;
+            }
+            BlockLength = 0;
+        }
+    }
+    return true;
+}
+
+bool
+QcDirectIoFileSink::Close()
+{
+    bool Result = true;
+#ifdef _WIN32
+    if (File == INVALID_HANDLE_VALUE) {
+        return true;
+    }
+    if (BlockLength != 0) {
+        // Write the tail padded out to the alignment, then trim the padding.
+        uint64_t FileSize = FileOffset + BlockLength;
+        uint32_t Padded = (BlockLength + DirectIoAlignment - 1) & ~(DirectIoAlignment - 1);
+        memset(Block + BlockLength, 0, Padded - BlockLength);
+        Result = WriteBlock(Padded);
+        LARGE_INTEGER End;
+        End.QuadPart = (LONGLONG)FileSize;
+        Result &= SetFilePointerEx(File, End, nullptr, FILE_BEGIN) && SetEndOfFile(File);
+        BlockLength = 0;
+    }
+    Result &= CloseHandle(File) != FALSE;
+    File = INVALID_HANDLE_VALUE;
+#else
+    if (File < 0) {
+        return true;
+    }
+    if (BlockLength != 0) {
+        // The tail can't be written with O_DIRECT unless it's aligned.
+        if (Direct && (BlockLength % DirectIoAlignment) != 0) {
+            Result = fcntl(File, F_SETFL, fcntl(File, F_GETFL) & ~O_DIRECT) == 0;
+            Direct = false;
+        }
+        Result = Result && WriteBlock(BlockLength);
+        BlockLength = 0;
+    }
+    // Drop any preallocation past the data.
+    Result &= ftruncate(File, (off_t)FileOffset) == 0;
+    Result &= close(File) == 0;
+    File = -1;
+#endif
+    return Result;
+}
+
+bool
+QcBufferSink::Open(
+    _In_ const string& SinkName,
+    _In_ uint64_t Size
+    )
+{
+    Name = SinkName;
+    Data.clear();
+    if (Size != QcUnknownSize) {
+        Data.reserve(Size);
+    }
+    return true;
+}
+
+bool
+QcBufferSink::Write(
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    Data.insert(Data.end(), Buffer, Buffer + Length);
+    return true;
+}
+
+QcStdioSink::QcStdioSink(
+    _In_ FILE* Stream,
+    _In_ bool Unbuffered
+    ) :
+    File(Stream)
+{
+#ifdef _WIN32
+    // Windows converts \n to \r\n unless you set this
+    _setmode(_fileno(File), _O_BINARY);
+#endif
+    if (Unbuffered) {
+        setvbuf(File, nullptr, _IONBF, 0);
+    }
+}
+
+bool
+QcStdioSink::Write(
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    QC_TRACE(QcTraceWrite, Length);
+    return fwrite(Buffer, 1, Length, File) == Length;
+}
+
+void
+PrintProgress(
+    _In_ const string& FileName,
+    _In_ const uint64_t BytesComplete,
+    _In_ const uint64_t BytesTotal,
+    _In_ const steady_clock::duration ElapsedTime,
+    _In_ const uint64_t RateBytes,
+    _In_ const steady_clock::duration RateTime
+    )
+{
+    static const int ProgressBarWidth = 20;
+    static const int FileNameWidth = 32;
+    static const int Precision = 3;
+    const float ProgressFraction = (float)BytesComplete / BytesTotal;
+    const auto BytesRemaining = BytesComplete < BytesTotal ? BytesTotal - BytesComplete : 0;
+    const auto EstimatedRemaining = BytesComplete > 0 ? (ElapsedTime / BytesComplete) * BytesRemaining : minutes(999);
+
+    Log() << "\r";
+    if (FileName.length() <= FileNameWidth) {
+        Log() << setw(FileNameWidth - 1) << left << FileName;
+    } else {
+        const auto HalfWord = (FileNameWidth - 3) / 2;
+        Log() << FileName.substr(0,HalfWord) << "..." << FileName.substr(FileName.length() - HalfWord);
+    }
+    Log() << " [";
+    int pos = (int)(ProgressBarWidth * ProgressFraction);
+    for (int i = 0; i < ProgressBarWidth; ++i) {
+        if (i <= pos) {
+            Log() << "|";
+        } else {
+            Log() << " ";
+        }
+    }
+    Log() << "] " << setw(3) << right << (int)(ProgressFraction * 100.0) << "%";
+    Log() << " " << setw(3) << duration_cast<minutes>(EstimatedRemaining).count() << "min "
+        << setw(2) << (duration_cast<seconds>(EstimatedRemaining) - duration_cast<minutes>(EstimatedRemaining)).count() << "s";
+    if (RateTime > steady_clock::duration(0)) {
+        const auto BitsPerSecond =
+            (RateBytes * 8 * steady_clock::duration::period::den) /
+            (RateTime.count() * steady_clock::duration::period::num);
+        if (BitsPerSecond >= 1000000000) {
+            Log() << " " << setw(Precision + 1) << setprecision(Precision) << BitsPerSecond / 1000000000.0 << "Gbps";
+        } else if (BitsPerSecond >= 1000000) {
+            Log() << " " << setw(Precision + 1) << setprecision(Precision) << BitsPerSecond / 1000000.0 << "Mbps";
+        } else if (BitsPerSecond >= 1000) {
+            Log() << " " << setw(Precision + 1) << setprecision(Precision) << BitsPerSecond / 1000.0 << "Kbps";
+        } else {
+            Log() << " " << setw(Precision + 1) << BitsPerSecond << "bps";
+        }
+    }
+    Log() << flush;
+}
+
+void
+PrintProgressAll(
+    _In_ QcListener& Listener,
+    _In_ steady_clock::time_point& Now,
+    _In_ bool FinRecieved
+    )
+{
+    static const int ESC = 27;
+    if (!Listener.ShowProgress) {
+        return;
+    }
+    if (FinRecieved) {
+        Listener.ProgressMutex.lock();
+    } else if (!Listener.ProgressMutex.try_lock()) {
+        return;
+    }
+    if (Now - Listener.LastUpdate >= UpdateRate || FinRecieved) {
+        Listener.LastUpdate = Now;
+        unique_lock<mutex> Lock(Listener.ConnectionListMutex);
+        // Only the furthest along connections are shown, so don't sort the
+        // whole list, or reorder it underneath the connection indexes.
+        vector<QcConnection*> Shown(Listener.Connections);
+        auto ConnectionCount = min(Shown.size(), MaxProgressLines);
+        std::partial_sort(
+            Shown.begin(),
+            Shown.begin() + ConnectionCount,
+            Shown.end(),
+            [](const QcConnection* a, const QcConnection* b) {
+                return a->BytesReceived/(double)a->FileSize > b->BytesReceived/(double)b->FileSize;
+            });
+        Shown.resize(ConnectionCount);
+        // move cursor back the number of lines as there are connections
+        Log() << static_cast<char>(ESC) << '[' << ConnectionCount << 'A';
+        for (auto Connection : Shown) {
+            Log() << static_cast<char>(ESC) << "[2K";
+            PrintProgress(
+                Connection->FileName,
+                Connection->BytesReceived,
+                Connection->FileSize,
+                Now - Connection->StartTime,
+                Connection->BytesReceived - Connection->BytesReceivedSnapshot,
+                Now - Connection->LastUpdate);
+            /*if (ConnectionCount-- > 0)*/ {
+                Log() << endl;
+            }
+            Connection->LastUpdate = Now;
+            Connection->BytesReceivedSnapshot = Connection->BytesReceived;
+        }
+    }
+    // Hold the lock the entire time in case a 2nd FinReceived comes in while
+    // already processing one.
+    Listener.ProgressMutex.unlock();
+}
+
+void
+PrintTransferSummary(
+    _In_ steady_clock::duration ElapsedTime,
+    _In_ const uint64_t BytesTransferred,
+    _In_ const char* DirectionStr
+    )
+{
+    double RateBps = 0;
+    if (ElapsedTime > steady_clock::duration(0)) {
+        RateBps =
+            (BytesTransferred * 8.0 * steady_clock::duration::period::den) /
+            (ElapsedTime.count() * steady_clock::duration::period::num);
+        // ((BytesTransferred * 8.0) /
+        // (ElapsedTime.count() * steady_clock::duration::period::num)) * steady_clock::duration::period::den;
+    }
+    Log() << dec << BytesTransferred << " bytes " << DirectionStr << " in ";
+    if (ElapsedTime >= hours(1)) {
+        Log() << duration_cast<hours>(ElapsedTime).count() << "hr ";
+        ElapsedTime -= duration_cast<hours>(ElapsedTime);
+    }
+    if (ElapsedTime >= minutes(1)) {
+        Log() << duration_cast<minutes>(ElapsedTime).count() << "min ";
+        ElapsedTime -= duration_cast<minutes>(ElapsedTime);
+    }
+    if (ElapsedTime >= seconds(1)) {
+        Log() << duration_cast<seconds>(ElapsedTime).count() << "s ";
+        ElapsedTime -= duration_cast<seconds>(ElapsedTime);
+    }
+    if (ElapsedTime >= milliseconds(1)) {
+        Log() << duration_cast<milliseconds>(ElapsedTime).count() << "ms";
+    }
+    if (RateBps >= 1000000000) {
+        Log() << " (" << setprecision(4) << RateBps / 1000000000.0 << "Gbps)" << endl;
+    } else if (RateBps >= 1000000) {
+        Log() << " (" << setprecision(4) << RateBps / 1000000.0 << "Mbps)" << endl;
+    } else if (RateBps >= 1000) {
+        Log() << " (" << setprecision(4) << RateBps / 1000.0 << "Kbps)" << endl;
+    } else {
+        Log() << " (" << RateBps << "bps)" << endl;
+    }
+}
+
+void
+QcReadStdInThread(
+    _In_ QcConnection& ConnectionContext)
+{
+    bool EndOfFile = false;
+    QUIC_STATUS Status;
+    do {
+        uint32_t ReadBytes = 0;
+        bool Success =
+            ConnectionContext.PipeSource->Read(
+                ConnectionContext.SendBuffer.get(),
+                DefaultSendBufferSize,
+                ReadBytes);
+        EndOfFile = ReadBytes == 0 || !Success;
+        if (ReadBytes > 0) {
+            ConnectionContext.SendQuicBuffer.Length = ReadBytes;
+            QUIC_SEND_FLAGS SendFlags = EndOfFile ? QUIC_SEND_FLAG_FIN : QUIC_SEND_FLAG_NONE;
+            if (QUIC_FAILED(Status = ConnectionContext.Stream->Send(&ConnectionContext.SendQuicBuffer, 1, SendFlags))) {
+                Log() << "StreamSend failed with 0x" << hex << Status << endl;
+                ConnectionContext.Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+                return;
+            }
+            CxPlatEventWaitForever(ConnectionContext.SendCompleteEvent);
+        }
+    } while (!EndOfFile);
+    if (EndOfFile) {
+        ConnectionContext.Stream->Shutdown(QUIC_STATUS_SUCCESS, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL);
+    }
+}
+
+//
+// Writes data queued by QcStdInStdOutStreamCallback to Sink until the
+// connection closes.
+//
+void
+QcDrainPipe(
+    _In_ QcConnection& Conn,
+    _In_ QcSink& Sink
+    )
+{
+    bool ConnectionClosed = false;
+    {
+        unique_lock<mutex> Lock(Conn.RecvDataMutex);
+        Conn.RecvData.reserve(PipeReceiveBuffers);
+    }
+    do {
+        unique_lock<mutex> Lock(Conn.RecvDataMutex);
+        Conn.RecvDataCV.wait(Lock, [&Conn]{return Conn.RecvData.size() > 0;});
+        uint64_t ConsumedLength = 0;
+        for(auto& Data : Conn.RecvData) {
+            if (Data.Buffer == nullptr && Data.Length == 0) {
+                // Connection closed
+                ConnectionClosed = true;
+                break;
+            } else {
+                Sink.Write(Data.Buffer, Data.Length);
+                ConsumedLength += Data.Length;
+            }
+        }
+        Sink.Flush();
+        Conn.RecvData.clear();
+        if (!ConnectionClosed) {
+            Conn.Stream->ReceiveComplete(ConsumedLength);
+        }
+    } while (!ConnectionClosed);
+}
+
+QUIC_STATUS
+QcStdInStdOutStreamCallback(
+    _In_ MsQuicStream* Stream,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Connection = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_START_COMPLETE:
+        if (QUIC_FAILED(Event->START_COMPLETE.Status)) {
+            Log() << "Stream start result: " << hex << Event->START_COMPLETE.Status << dec << endl;
+            return Event->START_COMPLETE.Status;
+        }
+        Connection->StartTime = steady_clock::now();
+        break;
+    case QUIC_STREAM_EVENT_RECEIVE: {
+        QUIC_STATUS Status = QUIC_STATUS_PENDING;
+        unique_lock<mutex> Lock(Connection->RecvDataMutex);
+        for (unsigned i = 0; i < Event->RECEIVE.BufferCount; ++i) {
+            Connection->RecvData.push_back(Event->RECEIVE.Buffers[i]);
+        }
+        Connection->BytesReceived += Event->RECEIVE.TotalBufferLength;
+        if (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) {
+            Stream->Shutdown(QUIC_STATUS_SUCCESS | QUIC_STREAM_SHUTDOWN_FLAG_INLINE);
+            Connection->TransferStatus = QUIC_STATUS_SUCCESS;
+            Status = QUIC_STATUS_SUCCESS;
+        } else {
+            Lock.unlock();
+            Connection->RecvDataCV.notify_one();
+        }
+        return Status;
+    }
+    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+        if (Event->SEND_COMPLETE.Canceled) {
+            Connection->SendCanceled = true;
+        }
+        if (Event->SEND_COMPLETE.ClientContext != nullptr) {
+            Connection->Scheduler->Release(
+                Connection->ScheduledTransfer,
+                (uint32_t)(uintptr_t)Event->SEND_COMPLETE.ClientContext);
+        }
+        Connection->SendsCompleted++;
+        CxPlatEventSet(Connection->SendCompleteEvent);
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE: {
+        Connection->EndTime = steady_clock::now();
+        unique_lock<mutex> Lock(Connection->RecvDataMutex);
+        Connection->RecvData.push_back({0, nullptr});
+        Connection->RecvDataCV.notify_one();
+        if (!Event->SHUTDOWN_COMPLETE.ConnectionShutdown) {
+            Connection->TransferStatus = QUIC_STATUS_SUCCESS;
+            Connection->Connection->Shutdown(QUIC_STATUS_SUCCESS);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+QUIC_STATUS
+QcFileSendStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Connection = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_START_COMPLETE:
+        if (QUIC_FAILED(Event->START_COMPLETE.Status)) {
+            Log() << "Stream start result: " << hex << Event->START_COMPLETE.Status << dec << endl;
+            return Event->START_COMPLETE.Status;
+        }
+        break;
+    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+        if (Event->SEND_COMPLETE.Canceled) {
+            Connection->SendCanceled = true;
+        }
+        CxPlatEventSet(Connection->SendCompleteEvent);
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        Connection->Connection->Shutdown(QUIC_STATUS_SUCCESS);
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// A chunk of a fan-out send's source, shared by every connection. It returns
+// to the pool once each of them has finished sending it.
+//
+struct QcSharedChunk {
+    QcBuffer Data;
+    QUIC_BUFFER Buffer;
+    atomic<uint32_t> References;
+};
+
+struct QcFanout {
+    mutex Lock;
+    condition_variable ChunkReleased;
+    vector<unique_ptr<QcSharedChunk>> Chunks;
+    vector<QcSharedChunk*> FreeChunks;
+};
+
+struct QcFanoutTarget {
+    QcFanout* Fanout;
+    QcConnection Context{};
+    unique_ptr<MsQuicConnection> Connection;
+    unique_ptr<MsQuicStream> Stream;
+    string Address;
+    bool Started{false};
+    // Once a target fails, the reader stops sending to it.
+    bool Failed{false};
+    // Targets may negotiate different header versions, so each has its own.
+    uint8_t Header[MaxHeaderLength];
+    QUIC_BUFFER HeaderBuffer;
+};
+
+void
+QcReleaseChunk(
+    _In_ QcFanout& Fanout,
+    _In_ QcSharedChunk* Chunk
+    )
+{
+    if (--Chunk->References == 0) {
+        unique_lock<mutex> Lock(Fanout.Lock);
+        Fanout.FreeChunks.push_back(Chunk);
+        Fanout.ChunkReleased.notify_one();
+    }
+}
+
+QUIC_STATUS
+QcFanoutSendStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Target = (QcFanoutTarget*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_START_COMPLETE:
+        if (QUIC_FAILED(Event->START_COMPLETE.Status)) {
+            Log() << "Stream start result: " << hex << Event->START_COMPLETE.Status << dec << endl;
+            return Event->START_COMPLETE.Status;
+        }
+        break;
+    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+        if (Event->SEND_COMPLETE.Canceled) {
+            unique_lock<mutex> Lock(Target->Fanout->Lock);
+            Target->Context.SendCanceled = true;
+            Target->Failed = true;
+        }
+        if (Event->SEND_COMPLETE.ClientContext != nullptr) {
+            QcReleaseChunk(*Target->Fanout, (QcSharedChunk*)Event->SEND_COMPLETE.ClientContext);
+        }
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        Target->Connection->Shutdown(QUIC_STATUS_SUCCESS);
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// A fetch pulls one file from any number of serving listeners. The file is
+// split into ranges, which sources take as they finish earlier ones, so
+// faster sources serve more of it. Once no ranges are left, idle sources
+// also request ranges still in flight elsewhere; the first reply wins.
+//
+struct QcFetch;
+
+struct QcFetchSource {
+    QcFetch* Fetch;
+    QcConnection Context{};
+    unique_ptr<MsQuicConnection> Connection;
+    string Address;
+    bool Started{false};
+    bool Failed{false};
+    uint32_t Outstanding{0};
+};
+
+struct QcFetchRange {
+    uint64_t Offset;
+    uint64_t Length;
+    uint32_t Requests{0};
+    QcFetchSource* Owner{nullptr};
+    bool Done{false};
+};
+
+struct QcFetchRequest {
+    QcFetch* Fetch;
+    QcFetchSource* Source;
+    MsQuicStream* Stream;
+    size_t Range;
+    uint8_t Request[MaxServeRequestLength];
+    QUIC_BUFFER RequestBuffer;
+    // The reply starts with the file size.
+    uint8_t SizeHeader[8];
+    uint8_t SizeHeaderLength{0};
+    uint64_t Received{0};
+    // The stream's own, until it shuts down, and one for each caller about
+    // to shut it down; the last frees the request and its stream. Protected
+    // by the fetch lock.
+    uint32_t References{1};
+};
+
+struct QcFetch {
+    string Name;
+    mutex Lock;
+    condition_variable Changed;
+    bool SizeKnown{false};
+    uint64_t Size{0};
+    vector<QcFetchRange> Ranges;
+    size_t NextRange{0};
+    // Ranges whose requests failed, to be taken before new ones.
+    vector<size_t> Retry;
+    size_t RangesDone{0};
+    uint64_t BytesReceived{0};
+    list<QcFetchRequest*> Requests;
+    vector<unique_ptr<QcFetchSource>> Sources;
+    // Positional writes to the destination.
+    mutex FileLock;
+    fstream File;
+    bool WriteFailed{false};
+};
+
+void QcFetchSchedule(_In_ QcFetch& Fetch, _Inout_ vector<QcFetchRequest*>& Aborts);
+
+//
+// Drops a reference to Request, freeing it and its stream with the last.
+// Called with the fetch lock held.
+//
+void
+QcReleaseFetchRequest(
+    _In_ QcFetchRequest* Request
+    )
+{
+    if (--Request->References == 0) {
+        delete Request->Stream;
+        delete Request;
+    }
+}
+
+//
+// Shuts down the streams of Aborts, each collected under the fetch lock with
+// a reference. Called once the lock is released, as MsQuic may complete the
+// shutdown inline, and that takes the lock.
+//
+void
+QcAbortFetchRequests(
+    _In_ QcFetch& Fetch,
+    _Inout_ vector<QcFetchRequest*>& Aborts
+    )
+{
+    if (Aborts.empty()) {
+        return;
+    }
+    for (auto Request : Aborts) {
+        Request->Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+    }
+    unique_lock<mutex> Lock(Fetch.Lock);
+    for (auto Request : Aborts) {
+        QcReleaseFetchRequest(Request);
+    }
+    Aborts.clear();
+}
+
+QUIC_STATUS
+QcFetchStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Request = (QcFetchRequest*)Context;
+    auto& Fetch = *Request->Fetch;
+    vector<QcFetchRequest*> Aborts;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE:
+        for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; ++i) {
+            const uint8_t* Data = Event->RECEIVE.Buffers[i].Buffer;
+            uint32_t Length = Event->RECEIVE.Buffers[i].Length;
+            while (Length != 0 &&
+                (Request->SizeHeaderLength == 0 ||
+                 Request->SizeHeaderLength < (1u << (Request->SizeHeader[0] >> 6)))) {
+                Request->SizeHeader[Request->SizeHeaderLength++] = *Data++;
+                Length--;
+                if (Request->SizeHeaderLength != (1u << (Request->SizeHeader[0] >> 6))) {
+                    continue;
+                }
+                uint16_t Offset = 0;
+                QUIC_VAR_INT Size = 0;
+                QuicVarIntDecode(Request->SizeHeaderLength, Request->SizeHeader, &Offset, &Size);
+                bool Mismatch = false;
+                {
+                    unique_lock<mutex> Lock(Fetch.Lock);
+                    if (!Fetch.SizeKnown) {
+                        Fetch.Size = Size;
+                        Fetch.SizeKnown = true;
+                        for (uint64_t RangeOffset = 0; RangeOffset < Size || Fetch.Ranges.empty(); RangeOffset += FetchRangeSize) {
+                            Fetch.Ranges.push_back({RangeOffset, min(FetchRangeSize, Size - RangeOffset)});
+                        }
+                        // The first request was sent before the size was known.
+                        Fetch.Ranges[0].Requests = 1;
+                        Fetch.Ranges[0].Owner = Request->Source;
+                        Fetch.NextRange = 1;
+                        QcFetchSchedule(Fetch, Aborts);
+                    } else if (Size != Fetch.Size) {
+                        Log() << Request->Source->Address << " has a different " << Fetch.Name << "!" << endl;
+                        Request->Source->Failed = true;
+                        Mismatch = true;
+                    }
+                }
+                QcAbortFetchRequests(Fetch, Aborts);
+                if (Mismatch) {
+                    Request->Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+                    return QUIC_STATUS_SUCCESS;
+                }
+            }
+            if (Length == 0) {
+                continue;
+            }
+            uint64_t Offset, Expected;
+            {
+                unique_lock<mutex> Lock(Fetch.Lock);
+                Offset = Fetch.Ranges[Request->Range].Offset + Request->Received;
+                Expected = Fetch.Ranges[Request->Range].Length - Request->Received;
+            }
+            if (Length > Expected) {
+                Log() << Request->Source->Address << " sent too much!" << endl;
+                Request->Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INVALID_PARAMETER);
+                return QUIC_STATUS_SUCCESS;
+            }
+            {
+                unique_lock<mutex> FileLock(Fetch.FileLock);
+                Fetch.File.seekp((streamoff)Offset);
+                Fetch.File.write((const char*)Data, Length);
+                Fetch.WriteFailed |= !Fetch.File.good();
+            }
+            Request->Received += Length;
+        }
+        if (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) {
+            {
+                unique_lock<mutex> Lock(Fetch.Lock);
+                auto& Range = Fetch.Ranges[Request->Range];
+                if (Request->Received == Range.Length && !Range.Done) {
+                    Range.Done = true;
+                    Fetch.RangesDone++;
+                    Fetch.BytesReceived += Range.Length;
+                    // Duplicates sent at the end are no longer needed.
+                    for (auto Other : Fetch.Requests) {
+                        if (Other != Request && Other->Range == Request->Range) {
+                            Other->References++;
+                            Aborts.push_back(Other);
+                        }
+                    }
+                    Fetch.Changed.notify_all();
+                }
+            }
+            QcAbortFetchRequests(Fetch, Aborts);
+        }
+        break;
+    case QUIC_STREAM_EVENT_PEER_SEND_ABORTED: {
+        // Missing files and bad requests won't succeed with this source;
+        // anything else (e.g. a busy server) might with another.
+        auto Error = (QUIC_STATUS)Event->PEER_SEND_ABORTED.ErrorCode;
+        if (Error == QUIC_STATUS_NOT_FOUND || Error == QUIC_STATUS_INVALID_PARAMETER) {
+            Log() << Request->Source->Address << " can't serve " << Fetch.Name << "!" << endl;
+            unique_lock<mutex> Lock(Fetch.Lock);
+            Request->Source->Failed = true;
+        }
+        break;
+    }
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE: {
+        {
+            unique_lock<mutex> Lock(Fetch.Lock);
+            if (Event->SHUTDOWN_COMPLETE.ConnectionShutdown || !Fetch.SizeKnown) {
+                Request->Source->Failed = true;
+            }
+            Fetch.Requests.remove(Request);
+            Request->Source->Outstanding--;
+            if (Fetch.SizeKnown) {
+                auto& Range = Fetch.Ranges[Request->Range];
+                Range.Requests--;
+                if (!Range.Done && Range.Requests == 0) {
+                    Fetch.Retry.push_back(Request->Range);
+                }
+            }
+            QcReleaseFetchRequest(Request);
+            QcFetchSchedule(Fetch, Aborts);
+            Fetch.Changed.notify_all();
+        }
+        QcAbortFetchRequests(Fetch, Aborts);
+        break;
+    }
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Sends a request for Range (the whole file, until the size is known) to
+// Source. Called with the fetch lock held; a request whose send fails is
+// added to Aborts, for QcAbortFetchRequests once it's released.
+//
+bool
+QcFetchRequestRange(
+    _In_ QcFetch& Fetch,
+    _In_ QcFetchSource& Source,
+    _In_ size_t Range,
+    _Inout_ vector<QcFetchRequest*>& Aborts
+    )
+{
+    auto Request = new(nothrow) QcFetchRequest();
+    if (Request == nullptr) {
+        return false;
+    }
+    Request->Fetch = &Fetch;
+    Request->Source = &Source;
+    Request->Range = Range;
+    uint64_t Offset = Fetch.SizeKnown ? Fetch.Ranges[Range].Offset : 0;
+    uint64_t Length = Fetch.SizeKnown ? Fetch.Ranges[Range].Length : FetchRangeSize;
+    uint8_t* Cursor = QuicVarIntEncode(Fetch.Name.size(), Request->Request);
+    memcpy(Cursor, Fetch.Name.data(), Fetch.Name.size());
+    Cursor = QuicVarIntEncode(Offset, Cursor + Fetch.Name.size());
+    Cursor = QuicVarIntEncode(Length, Cursor);
+    Request->RequestBuffer = {(uint32_t)(Cursor - Request->Request), Request->Request};
+    Request->Stream =
+        new(nothrow) MsQuicStream(
+            *Source.Connection,
+            QUIC_STREAM_OPEN_FLAG_NONE,
+            CleanUpManual,
+            QcFetchStreamCallback,
+            Request);
+    if (Request->Stream == nullptr || !Request->Stream->IsValid() ||
+        QUIC_FAILED(Request->Stream->Start(QUIC_STREAM_START_FLAG_IMMEDIATE | QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL))) {
+        delete Request->Stream;
+        delete Request;
+        return false;
+    }
+    // From here on, the stream's SHUTDOWN_COMPLETE releases it.
+    Fetch.Requests.push_back(Request);
+    Source.Outstanding++;
+    if (Fetch.SizeKnown) {
+        Fetch.Ranges[Range].Requests++;
+        if (Fetch.Ranges[Range].Owner == nullptr) {
+            Fetch.Ranges[Range].Owner = &Source;
+        }
+    }
+    if (QUIC_FAILED(Request->Stream->Send(&Request->RequestBuffer, 1, QUIC_SEND_FLAG_FIN))) {
+        Request->References++;
+        Aborts.push_back(Request);
+    }
+    return true;
+}
+
+//
+// Gives each source with room another range. Called with the fetch lock
+// held, collecting Aborts as QcFetchRequestRange does.
+//
+void
+QcFetchSchedule(
+    _In_ QcFetch& Fetch,
+    _Inout_ vector<QcFetchRequest*>& Aborts
+    )
+{
+    if (!Fetch.SizeKnown) {
+        return;
+    }
+    for (auto& Source : Fetch.Sources) {
+        while (!Source->Failed && Source->Outstanding < FetchRequestsPerSource) {
+            size_t Range = SIZE_MAX;
+            if (!Fetch.Retry.empty()) {
+                Range = Fetch.Retry.back();
+                Fetch.Retry.pop_back();
+            } else if (Fetch.NextRange < Fetch.Ranges.size()) {
+                Range = Fetch.NextRange++;
+            } else {
+                // Endgame: duplicate a range a (possibly slow) source is
+                // still working on.
+                for (size_t i = 0; i < Fetch.Ranges.size(); ++i) {
+                    auto& Candidate = Fetch.Ranges[i];
+                    if (!Candidate.Done && Candidate.Requests == 1 && Candidate.Owner != Source.get()) {
+                        Range = i;
+                        break;
+                    }
+                }
+            }
+            if (Range == SIZE_MAX) {
+                break;
+            }
+            if (!QcFetchRequestRange(Fetch, *Source, Range, Aborts)) {
+                Source->Failed = true;
+                if (!Fetch.Ranges[Range].Done && Fetch.Ranges[Range].Requests == 0) {
+                    Fetch.Retry.push_back(Range);
+                }
+            }
+        }
+    }
+}
+
+//
+// A striped send cuts the file into chunks, which paths take as they have
+// room, so faster paths carry more of it. A path's chunks are confirmed
+// once the server acknowledges its FIN; if it fails before then, they're
+// all sent again on the others. Resends the server already has are
+// harmless, as each chunk says where it goes.
+//
+struct QcStripe;
+
+struct QcStripePath {
+    QcStripe* Stripe;
+    QcConnection Context{};
+    unique_ptr<MsQuicConnection> Connection;
+    unique_ptr<MsQuicStream> Stream;
+    QcNetworkPath Route;
+    string Label;
+    // Until its connection's shutdown has been waited for.
+    bool Started{false};
+    // Open once connected, until its stream shuts down; Finishing once it
+    // takes no more chunks, as its FIN is sent or it's aborted. Paths which finish cleanly may be reconnected, to carry
+    // chunks resent from a failed one.
+    bool Open{false};
+    bool Finishing{false};
+    bool Failed{false};
+    bool FinAcknowledged{false};
+    uint32_t Outstanding{0};
+    // Chunks sent since it connected, awaiting confirmation.
+    vector<size_t> Chunks;
+    uint64_t BytesSent{0};
+    // The transfer header and ID, sent first on every connection.
+    uint8_t Header[MaxHeaderLength + 8];
+    QUIC_BUFFER HeaderBuffer;
+};
+
+// A chunk being sent: its extent header, then its data.
+struct QcStripeSend {
+    QcStripePath* Path;
+    // The chunk's offset and length, then its data.
+    uint8_t Header[16];
+    QcBuffer Data;
+    QUIC_BUFFER Buffers[2];
+};
+
+struct QcStripe {
+    mutex Lock;
+    condition_variable Changed;
+    size_t ChunkCount{0};
+    size_t NextChunk{0};
+    // Chunks of failed paths, to be taken before new ones.
+    vector<size_t> Retry;
+    size_t ChunksConfirmed{0};
+    // Sends are reused, with their buffers, once they complete.
+    vector<unique_ptr<QcStripeSend>> Sends;
+    vector<QcStripeSend*> FreeSends;
+};
+
+QUIC_STATUS
+QcStripeSendStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Path = (QcStripePath*)Context;
+    auto& Stripe = *Path->Stripe;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_START_COMPLETE:
+        if (QUIC_FAILED(Event->START_COMPLETE.Status)) {
+            Log() << "Stream start result: " << hex << Event->START_COMPLETE.Status << dec << endl;
+            return Event->START_COMPLETE.Status;
+        }
+        break;
+    case QUIC_STREAM_EVENT_SEND_COMPLETE: {
+        // The header is sent without a context.
+        auto Send = (QcStripeSend*)Event->SEND_COMPLETE.ClientContext;
+        unique_lock<mutex> Lock(Stripe.Lock);
+        if (Event->SEND_COMPLETE.Canceled) {
+            Path->Context.SendCanceled = true;
+        }
+        if (Send != nullptr) {
+            Stripe.FreeSends.push_back(Send);
+            Path->Outstanding--;
+            Stripe.Changed.notify_all();
+        }
+        break;
+    }
+    case QUIC_STREAM_EVENT_SEND_SHUTDOWN_COMPLETE: {
+        unique_lock<mutex> Lock(Stripe.Lock);
+        Path->FinAcknowledged = Event->SEND_SHUTDOWN_COMPLETE.Graceful;
+        break;
+    }
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE: {
+        {
+            unique_lock<mutex> Lock(Stripe.Lock);
+            Path->Open = false;
+            if (Path->FinAcknowledged && !Path->Context.SendCanceled) {
+                Stripe.ChunksConfirmed += Path->Chunks.size();
+            } else {
+                if (!Path->Chunks.empty()) {
+                    Log() << Path->Label << " failed; resending its "
+                        << Path->Chunks.size() << " chunks on the other paths." << endl;
+                }
+                Path->Failed = true;
+                Stripe.Retry.insert(Stripe.Retry.end(), Path->Chunks.begin(), Path->Chunks.end());
+            }
+            Path->Chunks.clear();
+            Stripe.Changed.notify_all();
+        }
+        Path->Connection->Shutdown(QUIC_STATUS_SUCCESS);
+        break;
+    }
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Stands in as the sink of a packed transfer; it only creates the directory
+// the entries are written under.
+//
+struct QcPackedRootSink : public QcSink {
+    QcPackedRootSink(_In_ const filesystem::path& Directory) : DestinationPath(Directory) {}
+    bool Open(const string& Name, uint64_t /*Size*/) override {
+        if (Name.empty() || Name == ".") {
+            return false;
+        }
+        error_code Error;
+        filesystem::create_directories(DestinationPath / Name, Error);
+        if (Error) {
+            Log() << "Failed to create " << DestinationPath / Name << endl;
+            return false;
+        }
+        return true;
+    }
+    bool Write(const uint8_t* /*Buffer*/, uint32_t /*Length*/) override { return false; }
+    bool Close() override { return true; }
+
+    filesystem::path DestinationPath;
+};
+
+//
+// Stands in as the sink of one path of a striped transfer, whose extents go
+// to the file shared by every path (see QcStripedFile).
+//
+struct QcStripedPathSink : public QcSink {
+    bool Open(const string& /*Name*/, uint64_t /*Size*/) override { return true; }
+    bool Write(const uint8_t* /*Buffer*/, uint32_t /*Length*/) override { return false; }
+    bool Close() override { return true; }
+};
+
+//
+// The name a file is received as, beside Name. Each transfer gets its own,
+// so a second transfer of the same name can't write into the first's file
+// while it waits to be committed.
+//
+string
+QcPartialName(
+    _In_ const string& Name
+    )
+{
+    uint64_t Tag;
+    CxPlatRandom(sizeof(Tag), &Tag);
+    stringstream Partial;
+    Partial << Name << '.' << hex << setw(16) << setfill('0') << Tag << QcPartialSuffix;
+    return Partial.str();
+}
+
+//
+// Whether the last component of Name still fits in a file name once
+// QcPartialName adds to it.
+//
+bool
+QcFitsPartialName(
+    _In_ const string& Name
+    )
+{
+    return filesystem::path(Name).filename().string().size() + QcPartialNameOverhead <= MaxFileNameLength;
+}
+
+//
+// Checks a parsed transfer header against what the listener accepts, and
+// opens a sink for it.
+//
+QUIC_STATUS
+QcOpenTransfer(
+    _In_ QcConnection& Connection,
+    _In_ const QcTransferHeader& Header,
+    _In_ steady_clock::time_point Now
+    )
+{
+    uint64_t Flags = Header.Flags;
+    // One body encoding per transfer.
+    if ((Flags & ~(uint64_t)(QcHeaderFlagSparse | QcHeaderFlagDelta | QcHeaderFlagPacked | QcHeaderFlagStriped | QcHeaderFlagDedup)) != 0 ||
+        (Flags & (Flags - 1)) != 0) {
+        Log() << "Unsupported transfer flags: " << hex << Flags << dec << endl;
+        return QUIC_STATUS_NOT_SUPPORTED;
+    }
+    if (Header.Version >= QcHeaderVersion2) {
+        // Version 2 senders choose from what was advertised, so anything
+        // else is a broken sender.
+        auto& Accepted = Connection.Listener->Capabilities;
+        auto& Chosen = Header.Options;
+        if ((Flags & ~Accepted.Encodings) != 0 ||
+            !has_single_bit(Chosen.Compression) || (Chosen.Compression & ~Accepted.Compression) != 0 ||
+            !has_single_bit(Chosen.Hash) || (Chosen.Hash & ~Accepted.Hash) != 0 ||
+            (Chosen.Resume && !Accepted.Resume)) {
+            Log() << "Transfer header options weren't offered!" << endl;
+            return QUIC_STATUS_NOT_SUPPORTED;
+        }
+    }
+    Connection.Sparse = (Flags & QcHeaderFlagSparse) != 0;
+    Connection.Delta = (Flags & QcHeaderFlagDelta) != 0;
+    Connection.Packed = (Flags & QcHeaderFlagPacked) != 0;
+    Connection.Striped = (Flags & QcHeaderFlagStriped) != 0;
+    Connection.Dedup = (Flags & QcHeaderFlagDedup) != 0;
+    if ((Connection.Packed || Connection.Striped || Connection.Dedup) && Connection.Listener->Writers == nullptr) {
+        Log() << "Packed, striped and deduplicated transfers need a destination directory!" << endl;
+        return QUIC_STATUS_NOT_SUPPORTED;
+    }
+    if (Connection.Dedup && Connection.Listener->ChunkStore == nullptr) {
+        Log() << "Deduplicated transfers need a chunk store!" << endl;
+        return QUIC_STATUS_NOT_SUPPORTED;
+    }
+    Connection.FileName = Header.Name;
+
+    if (Connection.FileName.find("..") != string::npos) {
+        Log() << "File name contains .. " << endl;
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+
+    if (Connection.FileName.find(Connection.Listener->DestinationPath.preferred_separator) != string::npos) {
+        Log() << "File name contains path separator" << endl;
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+
+    // Most transfers are received under a longer partial name, which has to
+    // fit as well; better to say so now than fail to open it.
+    bool Partial = Connection.Delta || Connection.Striped || (Connection.Listener->AtomicFinalize && !Connection.Packed);
+    if (Partial && !QcFitsPartialName(Connection.FileName)) {
+        Log() << "File name is too long to receive; at most " << MaxFileNameLength - QcPartialNameOverhead << " bytes!" << endl;
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+
+    Connection.FileSize = Header.Size;
+
+    string SinkName = Connection.FileName;
+    if (Connection.Delta) {
+        // Without an existing file, there are no signatures and the whole
+        // file comes as literals.
+        auto BasisPath = Connection.Listener->DestinationPath / Connection.FileName;
+        error_code Error;
+        uint64_t BasisSize = filesystem::is_regular_file(BasisPath, Error) ? filesystem::file_size(BasisPath, Error) : 0;
+        if (!Error && BasisSize != 0) {
+            Connection.Basis.open(BasisPath, ios::binary | ios::in);
+        }
+        if (Connection.Basis.is_open()) {
+            Connection.DeltaBlockSize = QcDeltaBlockSize(BasisSize);
+            Connection.BasisBlocks = BasisSize / Connection.DeltaBlockSize;
+        } else {
+            Connection.DeltaBlockSize = QcDeltaBlockSize(0);
+            Connection.BasisBlocks = 0;
+        }
+    }
+    // Delta transfers are received beside the existing file, which they read
+    // from, whatever the sink.
+    if (Connection.Delta || (Connection.Listener->AtomicFinalize && !Connection.Packed)) {
+        Connection.PartialName = QcPartialName(Connection.FileName);
+        SinkName = Connection.PartialName;
+    }
+
+    if (Connection.Packed) {
+        // Entries get sinks of their own, under a directory named for the transfer.
+        Connection.Sink = make_unique<QcPackedRootSink>(Connection.Listener->DestinationPath);
+    } else if (Connection.Striped) {
+        // The file is shared with the other paths, and opened once the
+        // transfer ID arrives.
+        Connection.Sink = make_unique<QcStripedPathSink>();
+    } else {
+        Connection.Sink = Connection.Listener->SinkFactory();
+    }
+    if (Connection.Sink == nullptr ||
+        !Connection.Sink->Open(SinkName, Connection.FileSize)) {
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+
+    Connection.StartTime = Now;
+    Connection.LastUpdate = Now;
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Gathers a record header of VarIntCount varints, starting at Start, a byte at
+// a time; records may be split across receives, and their headers are only a
+// few bytes. Returns true once it's complete.
+//
+bool
+QcGatherRecordHeader(
+    _In_ QcConnection& Connection,
+    _In_ uint8_t Byte,
+    _In_ uint32_t Start,
+    _In_ uint32_t VarIntCount,
+    _Out_writes_(VarIntCount) QUIC_VAR_INT* Values
+    )
+{
+    Connection.RecordHeader[Connection.RecordHeaderLength++] = Byte;
+    uint32_t HeaderLength = Start;
+    for (uint32_t i = 0; i < VarIntCount; ++i) {
+        if (Connection.RecordHeaderLength <= HeaderLength) {
+            return false;
+        }
+        HeaderLength += 1u << (Connection.RecordHeader[HeaderLength] >> 6);
+    }
+    if (Connection.RecordHeaderLength < HeaderLength) {
+        return false;
+    }
+    uint16_t Offset = (uint16_t)Start;
+    for (uint32_t i = 0; i < VarIntCount; ++i) {
+        QuicVarIntDecode((uint16_t)HeaderLength, Connection.RecordHeader, &Offset, &Values[i]);
+    }
+    Connection.RecordHeaderLength = 0;
+    return true;
+}
+
+//
+// Writes Length bytes of the basis file, starting at Offset, to the sink.
+//
+bool
+QcCopyFromBasis(
+    _In_ QcConnection& Connection,
+    _In_ uint64_t Offset,
+    _In_ uint64_t Length
+    )
+{
+    uint8_t Buffer[DeltaCopyBufferSize];
+    Connection.Basis.seekg((streamoff)Offset);
+    while (Length != 0) {
+        uint32_t ReadLength = (uint32_t)min<uint64_t>(Length, sizeof(Buffer));
+        Connection.Basis.read((char*)Buffer, ReadLength);
+        if ((uint32_t)Connection.Basis.gcount() != ReadLength ||
+            !Connection.Sink->Write(Buffer, ReadLength)) {
+            Log() << "Failed to copy from the existing file!" << endl;
+            return false;
+        }
+        Length -= ReadLength;
+    }
+    return true;
+}
+
+QUIC_STATUS
+QcReplySendStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* /*Context*/,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    if (Event->Type == QUIC_STREAM_EVENT_START_COMPLETE &&
+        QUIC_FAILED(Event->START_COMPLETE.Status)) {
+        Log() << "Reply stream start result: " << hex << Event->START_COMPLETE.Status << dec << endl;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+void QcFreeConnection(_In_ QcConnection* Connection);
+void QcFinishConnection(_In_ QcConnection& Connection);
+
+//
+// Sends SignatureBuffer back to the client on a unidirectional stream, and
+// drops the work reference taken by QcBeginReply. What names the reply in
+// errors.
+//
+void
+QcSendReply(
+    _In_ QcConnection& Connection,
+    _In_z_ const char* What
+    )
+{
+    Connection.SignatureQuicBuffer.Buffer = Connection.SignatureBuffer.data();
+    Connection.SignatureQuicBuffer.Length = (uint32_t)Connection.SignatureBuffer.size();
+
+    bool Free;
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        if (!Connection.ShutdownComplete) {
+            // Deletes itself once shut down, if it starts.
+            auto Stream =
+                new MsQuicStream(
+                    *Connection.Connection,
+                    QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL,
+                    CleanUpAutoDelete,
+                    QcReplySendStreamCallback);
+            if (!Stream->IsValid() || QUIC_FAILED(Stream->Start(QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+                delete Stream;
+                Stream = nullptr;
+            }
+            if (Stream == nullptr ||
+                QUIC_FAILED(Stream->Send(&Connection.SignatureQuicBuffer, 1, QUIC_SEND_FLAG_FIN))) {
+                Log() << "Failed to send " << What << "!" << endl;
+                Connection.Connection->Shutdown(QUIC_STATUS_INTERNAL_ERROR);
+            }
+        }
+        Free = --Connection.PendingWork == 0 && Connection.ShutdownComplete;
+    }
+    if (Free) {
+        QcFreeConnection(&Connection);
+    }
+}
+
+//
+// Computes signatures of the existing file and sends them back to the client.
+// Runs on the listener's worker threads.
+//
+void
+QcSendSignatures(
+    _In_ QcConnection& Connection
+    )
+{
+    vector<QcBlockSignature> Signatures;
+    if (!QcComputeSignatures(
+            Connection.Listener->DestinationPath / Connection.FileName,
+            Connection.DeltaBlockSize,
+            Connection.BasisBlocks,
+            max(thread::hardware_concurrency() / ListenerWorkerThreads, 1u),
+            Signatures)) {
+        // Nothing can match; the sender falls back to literals.
+        Log() << "Failed to compute signatures for " << Connection.FileName << endl;
+        Signatures.clear();
+    }
+    QcEncodeSignatures(Connection.DeltaBlockSize, Signatures, Connection.SignatureBuffer);
+    QcSendReply(Connection, "signatures");
+}
+
+//
+// Checks which chunks of a deduplicated transfer the store is missing, and
+// asks the client for them. Runs on the listener's worker threads.
+//
+void
+QcSendChunkBitmap(
+    _In_ QcConnection& Connection
+    )
+{
+    auto& Chunks = Connection.DedupChunks;
+    Connection.DedupNeeded.assign(Chunks.size(), false);
+    Connection.SignatureBuffer.assign((Chunks.size() + 7) / 8, 0);
+    // Chunks repeated within the file are stored as the first copy arrives.
+    set<array<uint8_t, QcStrongHashLength>> Requested;
+    for (size_t i = 0; i < Chunks.size(); ++i) {
+        if (Requested.count(Chunks[i].Hash) != 0 ||
+            Connection.Listener->ChunkStore->Contains(Chunks[i])) {
+            continue;
+        }
+        Requested.insert(Chunks[i].Hash);
+        Connection.DedupNeeded[i] = true;
+        Connection.SignatureBuffer[i / 8] |= (uint8_t)(1u << (i % 8));
+    }
+    Connection.DedupNeededReady.store(true, memory_order_release);
+    QcSendReply(Connection, "the chunk bitmap");
+}
+
+//
+// Runs Reply for Connection on the listener's worker threads.
+//
+void
+QcBeginReply(
+    _In_ QcConnection& Connection,
+    _In_ void (*Reply)(QcConnection&)
+    )
+{
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        Connection.PendingWork++;
+    }
+    Connection.Listener->Workers->Post([&Connection, Reply]() { Reply(Connection); });
+}
+
+enum QcPackedState : uint8_t {
+    PackedStateNameLength,
+    PackedStateName,
+    PackedStateSize,
+    PackedStateData,
+};
+
+//
+// Packed entry names are relative paths with '/' separators, which mustn't
+// leave the transfer's directory.
+//
+bool
+QcValidPackedName(
+    _In_ const string& Name
+    )
+{
+    if (Name.empty() || Name.front() == '/' ||
+        Name.find_first_of("\\:") != string::npos) {
+        return false;
+    }
+    size_t Start = 0;
+    while (Start <= Name.size()) {
+        size_t End = Name.find('/', Start);
+        if (End == string::npos) {
+            End = Name.size();
+        }
+        auto Component = Name.substr(Start, End - Start);
+        if (Component.empty() || Component == "." || Component == "..") {
+            return false;
+        }
+        Start = End + 1;
+    }
+    return true;
+}
+
+//
+// Moves a completed file, Size bytes, from PartialName into place as Name
+// under the destination, as durably as the listener's mode asks. Group
+// commits happen later, so only the caller's part can fail here.
+//
+bool
+QcCommitFile(
+    _In_ QcListener& Listener,
+    _In_ const string& PartialName,
+    _In_ const string& Name,
+    _In_ uint64_t Size
+    )
+{
+    auto FinalPath = Listener.DestinationPath / Name;
+    auto PartialPath = Listener.DestinationPath / PartialName;
+    error_code Error;
+    switch (Listener.Durability) {
+    case QcDurabilityGroup:
+        Listener.Committer->Add(PartialPath, FinalPath, Size);
+        return true;
+    case QcDurabilityFile:
+        if (!QcSyncFile(PartialPath)) {
+            Log() << "Failed to flush " << FinalPath << endl;
+            filesystem::remove(PartialPath, Error);
+            return false;
+        }
+        filesystem::rename(PartialPath, FinalPath, Error);
+        return !Error && QcSyncDirectory(FinalPath.parent_path());
+    default:
+        filesystem::rename(PartialPath, FinalPath, Error);
+        return !Error;
+    }
+}
+
+//
+// Removes what was received of a failed file.
+//
+void
+QcDiscardFile(
+    _In_ QcListener& Listener,
+    _In_ const string& PartialName
+    )
+{
+    auto PartialPath = Listener.DestinationPath / PartialName;
+    error_code Error;
+    filesystem::remove(PartialPath, Error);
+}
+
+//
+// Closes a sink, and commits or discards its file, received as PartialName.
+//
+bool
+QcFinishFile(
+    _In_ QcListener& Listener,
+    _In_ QcSink& Sink,
+    _In_ const string& PartialName,
+    _In_ const string& Name,
+    _In_ uint64_t Size,
+    _In_ bool Success
+    )
+{
+    Success = Sink.Close() && Success;
+    if (!Listener.AtomicFinalize) {
+        return Success;
+    }
+    if (Success) {
+        return QcCommitFile(Listener, PartialName, Name, Size);
+    }
+    QcDiscardFile(Listener, PartialName);
+    return false;
+}
+
+//
+// Called at the stream's FIN. If the writer threads still have entries of
+// this transfer, leaves the last of them to finish it and complete Length,
+// rather than waiting here on the MsQuic worker.
+//
+bool
+QcDeferPackedFinish(
+    _In_ QcConnection& Connection,
+    _In_ uint64_t Length
+    )
+{
+    unique_lock<mutex> Lock(Connection.WorkMutex);
+    if (Connection.PackedQueuedEntries == 0) {
+        return false;
+    }
+    Connection.PackedFinishing = true;
+    Connection.PackedFinishLength = Length;
+    return true;
+}
+
+//
+// Checks a packed transfer ended between entries, once the writer threads
+// are done with it, and closes the root. Its entries were committed as they
+// completed.
+//
+bool
+QcFinishPackedPayload(
+    _In_ QcConnection& Connection
+    )
+{
+    bool Result = true;
+    if (Connection.PackedState != PackedStateNameLength || Connection.RecordHeaderLength != 0) {
+        Log() << "Transfer ended inside a packed entry!" << endl;
+        Result = false;
+    } else if (Connection.PayloadOffset != Connection.FileSize) {
+        Log() << "Packed transfer ended early!" << endl;
+        Result = false;
+    }
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        Result = Result && !Connection.PackedFailed;
+    }
+    return Connection.Sink->Close() && Result;
+}
+
+//
+// Opens a sink for one packed entry, creating its directory first.
+//
+unique_ptr<QcSink>
+QcOpenPackedEntry(
+    _In_ QcListener& Listener,
+    _In_ const string& Name,
+    _In_ uint64_t Size,
+    _Out_ string& PartialName
+    )
+{
+    if (Listener.AtomicFinalize && !QcFitsPartialName(Name)) {
+        Log() << Name << " is too long to receive; at most " << MaxFileNameLength - QcPartialNameOverhead << " bytes!" << endl;
+        return nullptr;
+    }
+    error_code Error;
+    filesystem::create_directories((Listener.DestinationPath / Name).parent_path(), Error);
+    auto Sink = Listener.SinkFactory();
+    string SinkName = Name;
+    PartialName.clear();
+    if (Listener.AtomicFinalize) {
+        PartialName = QcPartialName(Name);
+        SinkName = PartialName;
+    }
+    if (Sink == nullptr || !Sink->Open(SinkName, Size)) {
+        return nullptr;
+    }
+    return Sink;
+}
+
+void
+QcWritePackedEntry(
+    _In_ QcConnection& Connection,
+    _In_ const string& Name,
+    _In_ const vector<uint8_t>& Data
+    )
+{
+    string PartialName;
+    auto Sink = QcOpenPackedEntry(*Connection.Listener, Name, Data.size(), PartialName);
+    bool Result =
+        Sink != nullptr &&
+        QcFinishFile(
+            *Connection.Listener,
+            *Sink,
+            PartialName,
+            Name,
+            Data.size(),
+            Sink->Write(Data.data(), (uint32_t)Data.size()));
+    if (!Result) {
+        Log() << "Failed to write " << Name << endl;
+    }
+    bool Finish;
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        Connection.PackedFailed |= !Result;
+        Connection.PackedQueuedBytes -= Data.size();
+        Connection.PackedQueuedEntries--;
+        if (Connection.PackedPaused &&
+            Connection.PackedQueuedBytes <= PackedQueueLimit / 2 &&
+            !Connection.ShutdownComplete) {
+            Connection.PackedPaused = false;
+            Connection.Stream->ReceiveSetEnabled(true);
+        }
+        Finish = Connection.PackedFinishing && Connection.PackedQueuedEntries == 0;
+    }
+    if (Finish) {
+        // The receive callback left the FIN pending for this.
+        Connection.TransferStatus =
+            QcFinishPackedPayload(Connection) ? QUIC_STATUS_SUCCESS : QUIC_STATUS_INTERNAL_ERROR;
+    }
+    bool Free;
+    bool Finished = false;
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        if (Finish) {
+            // A connection that shut down meanwhile was left for us to report.
+            Connection.PackedFinishing = false;
+            if (Connection.ShutdownComplete) {
+                Finished = true;
+            } else {
+                Connection.Stream->ReceiveComplete(Connection.PackedFinishLength);
+            }
+        }
+        Free = --Connection.PendingWork == 0 && Connection.ShutdownComplete && !Finished;
+    }
+    if (Finish) {
+        CxPlatEventSet(Connection.SendCompleteEvent);
+    }
+    if (Finished) {
+        QcFinishConnection(Connection);
+    } else if (Free) {
+        QcFreeConnection(&Connection);
+    }
+}
+
+//
+// Hands a complete small entry to the writer threads.
+//
+void
+QcQueuePackedEntry(
+    _In_ QcConnection& Connection
+    )
+{
+    auto Name = Connection.FileName + "/" + Connection.PackedName;
+    auto Data = make_shared<vector<uint8_t>>(std::move(Connection.PackedData));
+    Connection.PackedData = {};
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        Connection.PendingWork++;
+        Connection.PackedQueuedEntries++;
+        Connection.PackedQueuedBytes += Data->size();
+        if (!Connection.PackedPaused && Connection.PackedQueuedBytes > PackedQueueLimit) {
+            Connection.PackedPaused = true;
+            Connection.Stream->ReceiveSetEnabled(false);
+        }
+    }
+    Connection.Listener->Writers->Post([&Connection, Name, Data]() {
+        QcWritePackedEntry(Connection, Name, *Data);
+    });
+}
+
+//
+// Parses packed entries. Small entries are gathered and queued to the writer
+// threads; large ones are streamed to their own sink on this thread.
+//
+bool
+QcWritePackedPayload(
+    _In_ QcConnection& Connection,
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    while (Length != 0) {
+        QUIC_VAR_INT Value;
+        switch (Connection.PackedState) {
+        case PackedStateNameLength:
+            if (!QcGatherRecordHeader(Connection, *Buffer++, 0, 1, &Value)) {
+                Length--;
+                continue;
+            }
+            Length--;
+            if (Value == 0 || Value > MaxPackedNameLength) {
+                Log() << "Invalid packed entry name length!" << endl;
+                return false;
+            }
+            if (Connection.PackedNames.size() >= MaxPackedEntries) {
+                Log() << "Too many packed entries!" << endl;
+                return false;
+            }
+            Connection.PackedName.clear();
+            Connection.PackedNameRemaining = Value;
+            Connection.PackedState = PackedStateName;
+            break;
+        case PackedStateName: {
+            uint32_t CopyLength = (uint32_t)min<uint64_t>(Connection.PackedNameRemaining, Length);
+            Connection.PackedName.append((const char*)Buffer, CopyLength);
+            Buffer += CopyLength;
+            Length -= CopyLength;
+            Connection.PackedNameRemaining -= CopyLength;
+            if (Connection.PackedNameRemaining == 0) {
+                if (!QcValidPackedName(Connection.PackedName)) {
+                    Log() << "Invalid packed entry name: " << Connection.PackedName << endl;
+                    return false;
+                }
+                if (!Connection.PackedNames.insert(Connection.PackedName).second) {
+                    Log() << "Duplicate packed entry: " << Connection.PackedName << endl;
+                    return false;
+                }
+                Connection.PackedState = PackedStateSize;
+            }
+            break;
+        }
+        case PackedStateSize:
+            if (!QcGatherRecordHeader(Connection, *Buffer++, 0, 1, &Value)) {
+                Length--;
+                continue;
+            }
+            Length--;
+            if (Value > Connection.FileSize - Connection.PayloadOffset) {
+                Log() << "Packed entry exceeds the transfer size!" << endl;
+                return false;
+            }
+            Connection.RecordRemaining = Value;
+            Connection.PackedEntrySize = Value;
+            if (Value > PackedBufferLimit) {
+                Connection.PackedSink =
+                    QcOpenPackedEntry(
+                        *Connection.Listener,
+                        Connection.FileName + "/" + Connection.PackedName,
+                        Value,
+                        Connection.PackedPartialName);
+                if (Connection.PackedSink == nullptr) {
+                    Log() << "Failed to create " << Connection.PackedName << endl;
+                    return false;
+                }
+            } else {
+                Connection.PackedData.reserve((size_t)Value);
+            }
+            Connection.PackedState = PackedStateData;
+            break;
+        case PackedStateData: {
+            uint32_t WriteLength = (uint32_t)min<uint64_t>(Connection.RecordRemaining, Length);
+            if (Connection.PackedSink != nullptr) {
+                if (!Connection.PackedSink->Write(Buffer, WriteLength)) {
+                    Log() << "Failed to write " << Connection.PackedName << endl;
+                    return false;
+                }
+            } else {
+                Connection.PackedData.insert(Connection.PackedData.end(), Buffer, Buffer + WriteLength);
+            }
+            Buffer += WriteLength;
+            Length -= WriteLength;
+            Connection.RecordRemaining -= WriteLength;
+            Connection.PayloadOffset += WriteLength;
+            break;
+        }
+        }
+        if (Connection.PackedState == PackedStateData && Connection.RecordRemaining == 0) {
+            if (Connection.PackedSink != nullptr) {
+                bool Closed =
+                    QcFinishFile(
+                        *Connection.Listener,
+                        *Connection.PackedSink,
+                        Connection.PackedPartialName,
+                        Connection.FileName + "/" + Connection.PackedName,
+                        Connection.PackedEntrySize,
+                        true);
+                Connection.PackedSink.reset();
+                if (!Closed) {
+                    Log() << "Failed to write " << Connection.PackedName << endl;
+                    return false;
+                }
+            } else {
+                QcQueuePackedEntry(Connection);
+            }
+            Connection.PackedState = PackedStateNameLength;
+        }
+    }
+    return true;
+}
+
+//
+// Opens a striped file's partial file, created up front so extents can be
+// written wherever they land.
+//
+bool
+QcOpenStripedFile(
+    _Inout_ QcStripedFile& Striped,
+    _In_ const filesystem::path& Path
+    )
+{
+#ifdef _WIN32
+    Striped.File = CreateFileW(
+        Path.c_str(),
+        GENERIC_WRITE,
+        0,
+        nullptr,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    return Striped.File != INVALID_HANDLE_VALUE;
+#else
+    Striped.File = open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    return Striped.File >= 0;
+#endif
+}
+
+//
+// Closes a striped file, once no path is writing to it.
+//
+bool
+QcCloseStripedFile(
+    _Inout_ QcStripedFile& Striped
+    )
+{
+    bool Result = true;
+#ifdef _WIN32
+    if (Striped.File != INVALID_HANDLE_VALUE) {
+        Result = CloseHandle(Striped.File) != FALSE;
+        Striped.File = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (Striped.File >= 0) {
+        Result = close(Striped.File) == 0;
+        Striped.File = -1;
+    }
+#endif
+    return Result;
+}
+
+//
+// Writes all of Buffer at Offset of a striped file. Positioned writes don't
+// share a file position, so paths needn't take turns.
+//
+bool
+QcWriteStripedFile(
+    _In_ QcStripedFile& Striped,
+    _In_ uint64_t Offset,
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    while (Length != 0) {
+#ifdef _WIN32
+        DWORD Result = 0;
+        OVERLAPPED Overlapped{};
+        Overlapped.Offset = (DWORD)Offset;
+        Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+        if (!WriteFile(Striped.File, Buffer, Length, &Result, &Overlapped)) {
+            Log() << "Failed to write to file: " << GetLastError() << endl;
+            return false;
+        }
+#else
+        auto Result = pwrite(Striped.File, Buffer, Length, (off_t)Offset);
+        if (Result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Log() << "Failed to write to file: " << errno << endl;
+            return false;
+        }
+#endif
+        if (Result == 0) {
+            Log() << "Failed to write to file: no progress" << endl;
+            return false;
+        }
+        Buffer += Result;
+        Length -= (uint32_t)Result;
+        Offset += (uint64_t)Result;
+    }
+    return true;
+}
+
+//
+// Removes striped transfers whose paths all left over StripedExpiry ago,
+// with their partial files. Called with StripedMutex held.
+//
+void
+QcExpireStripedFiles(
+    _In_ QcListener& Listener,
+    _In_ steady_clock::time_point Now
+    )
+{
+    for (auto Entry = Listener.StripedFiles.begin(); Entry != Listener.StripedFiles.end();) {
+        auto& Striped = *Entry->second;
+        if (Striped.Paths != 0 || Now - Striped.Detached < StripedExpiry) {
+            ++Entry;
+            continue;
+        }
+        {
+            unique_lock<mutex> FileLock(Striped.Lock);
+            if (!Striped.Committed) {
+                Log() << "Abandoned striped transfer of " << Striped.Name << endl;
+                QcCloseStripedFile(Striped);
+                QcDiscardFile(Listener, Striped.PartialName);
+            }
+        }
+        Entry = Listener.StripedFiles.erase(Entry);
+    }
+}
+
+//
+// Joins a path to its striped transfer, opening the shared file for the
+// first one.
+//
+bool
+QcAttachStripedFile(
+    _In_ QcConnection& Connection,
+    _In_ uint64_t TransferId
+    )
+{
+    auto& Listener = *Connection.Listener;
+    unique_lock<mutex> Lock(Listener.StripedMutex);
+    QcExpireStripedFiles(Listener, steady_clock::now());
+    auto& Striped = Listener.StripedFiles[TransferId];
+    if (Striped == nullptr) {
+        Striped = make_shared<QcStripedFile>();
+        Striped->TransferId = TransferId;
+        Striped->Name = Connection.FileName;
+        Striped->PartialName = QcPartialName(Connection.FileName);
+        Striped->Size = Connection.FileSize;
+        auto PartialPath = Listener.DestinationPath / Striped->PartialName;
+        if (!QcOpenStripedFile(*Striped, PartialPath)) {
+            Log() << "Failed to open " << PartialPath << " for writing!" << endl;
+            Listener.StripedFiles.erase(TransferId);
+            return false;
+        }
+    } else if (Striped->Name != Connection.FileName || Striped->Size != Connection.FileSize) {
+        Log() << "Striped transfer doesn't match its other paths!" << endl;
+        return false;
+    }
+    Striped->Paths++;
+    Connection.StripedFile = Striped;
+    return true;
+}
+
+//
+// Leaves a path's striped transfer. The last path out drops a committed
+// file's entry; an unfinished one waits for QcExpireStripedFiles.
+//
+void
+QcDetachStripedFile(
+    _In_ QcConnection& Connection
+    )
+{
+    auto& Listener = *Connection.Listener;
+    auto& Striped = *Connection.StripedFile;
+    auto Now = steady_clock::now();
+    {
+        unique_lock<mutex> Lock(Listener.StripedMutex);
+        if (--Striped.Paths == 0) {
+            Striped.Detached = Now;
+            bool Committed;
+            {
+                unique_lock<mutex> FileLock(Striped.Lock);
+                Committed = Striped.Committed;
+            }
+            if (Committed) {
+                Listener.StripedFiles.erase(Striped.TransferId);
+            }
+        }
+        QcExpireStripedFiles(Listener, Now);
+    }
+    Connection.StripedFile.reset();
+}
+
+//
+// Writes Length bytes of an extent at Offset of a striped file, and records
+// them as received.
+//
+bool
+QcWriteStripe(
+    _In_ QcStripedFile& Striped,
+    _In_ uint64_t Offset,
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    unique_lock<mutex> Lock(Striped.Lock);
+    if (Striped.Committed) {
+        // A resent chunk; the file is already complete.
+        return true;
+    }
+    if (Striped.Failed) {
+        return false;
+    }
+    Striped.Writing++;
+    Lock.unlock();
+    bool Written = QcWriteStripedFile(Striped, Offset, Buffer, Length);
+    Lock.lock();
+    if (--Striped.Writing == 0) {
+        Striped.Idle.notify_all();
+    }
+    if (!Written) {
+        Striped.Failed = true;
+        return false;
+    }
+    uint64_t Start = Offset;
+    uint64_t End = Offset + Length;
+    auto Next = Striped.Received.upper_bound(Start);
+    if (Next != Striped.Received.begin()) {
+        auto Previous = prev(Next);
+        if (Previous->second >= Start) {
+            Start = Previous->first;
+            End = max(End, Previous->second);
+            Striped.ReceivedBytes -= Previous->second - Previous->first;
+            Striped.Received.erase(Previous);
+        }
+    }
+    while (Next != Striped.Received.end() && Next->first <= End) {
+        End = max(End, Next->second);
+        Striped.ReceivedBytes -= Next->second - Next->first;
+        Next = Striped.Received.erase(Next);
+    }
+    Striped.Received[Start] = End;
+    Striped.ReceivedBytes += End - Start;
+    return true;
+}
+
+bool
+QcWriteStripedPayload(
+    _In_ QcConnection& Connection,
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    while (Length != 0) {
+        if (Connection.RecordRemaining != 0) {
+            uint32_t WriteLength = (uint32_t)min<uint64_t>(Connection.RecordRemaining, Length);
+            if (!QcWriteStripe(*Connection.StripedFile, Connection.PayloadOffset, Buffer, WriteLength)) {
+                return false;
+            }
+            Buffer += WriteLength;
+            Length -= WriteLength;
+            Connection.RecordRemaining -= WriteLength;
+            Connection.PayloadOffset += WriteLength;
+            continue;
+        }
+        uint8_t Byte = *Buffer++;
+        Length--;
+        QUIC_VAR_INT Values[2];
+        if (Connection.StripedFile == nullptr) {
+            // The transfer ID comes first.
+            if (QcGatherRecordHeader(Connection, Byte, 0, 1, Values) &&
+                !QcAttachStripedFile(Connection, Values[0])) {
+                return false;
+            }
+            continue;
+        }
+        // Extent: offset, length.
+        if (!QcGatherRecordHeader(Connection, Byte, 0, 2, Values)) {
+            continue;
+        }
+        if (Values[1] > Connection.FileSize || Values[0] > Connection.FileSize - Values[1]) {
+            Log() << "Invalid data extent!" << endl;
+            return false;
+        }
+        Connection.PayloadOffset = Values[0];
+        Connection.RecordRemaining = Values[1];
+    }
+    return true;
+}
+
+//
+// Ends one path of a striped transfer. The path which completes the file
+// commits it; the others succeed once their extents are written.
+//
+bool
+QcFinishStripedPayload(
+    _In_ QcConnection& Connection
+    )
+{
+    if (Connection.StripedFile == nullptr ||
+        Connection.RecordRemaining != 0 ||
+        Connection.RecordHeaderLength != 0) {
+        Log() << "Transfer ended inside a record!" << endl;
+        return false;
+    }
+    auto& Striped = *Connection.StripedFile;
+    unique_lock<mutex> Lock(Striped.Lock);
+    // Another path may still be writing, if only a resent chunk, and the
+    // file can't be closed under it.
+    Striped.Idle.wait(Lock, [&Striped]{ return Striped.Writing == 0; });
+    if (Striped.Committed) {
+        return true;
+    }
+    if (Striped.Failed) {
+        return false;
+    }
+    if (Striped.ReceivedBytes != Striped.Size) {
+        // The rest is on other paths.
+        return true;
+    }
+    if (!QcCloseStripedFile(Striped)) {
+        Striped.Failed = true;
+        QcDiscardFile(*Connection.Listener, Striped.PartialName);
+        return false;
+    }
+    Striped.Committed = true;
+    return QcCommitFile(*Connection.Listener, Striped.PartialName, Striped.Name, Striped.Size);
+}
+
+enum QcDedupState : uint8_t {
+    DedupStateManifestLength,
+    DedupStateManifest,
+    DedupStateChunks,
+};
+
+//
+// Writes the chunks the store holds to the sink, up to the next one the
+// client is sending.
+//
+bool
+QcCopyStoredChunks(
+    _In_ QcConnection& Connection
+    )
+{
+    auto& Chunks = Connection.DedupChunks;
+    while (Connection.DedupNext < Chunks.size() && !Connection.DedupNeeded[Connection.DedupNext]) {
+        auto& Chunk = Chunks[Connection.DedupNext];
+        Connection.DedupChunkData.resize(Chunk.Length);
+        if (!Connection.Listener->ChunkStore->Read(Chunk, Connection.DedupChunkData.data()) ||
+            !Connection.Sink->Write(Connection.DedupChunkData.data(), Chunk.Length)) {
+            Log() << "Failed to copy a chunk from the store!" << endl;
+            return false;
+        }
+        Connection.DedupChunkData.clear();
+        Connection.PayloadOffset += Chunk.Length;
+        Connection.Listener->BytesDeduplicated.Add(Chunk.Length);
+        Connection.DedupNext++;
+    }
+    return true;
+}
+
+//
+// Checks a chunk received in full against its hash, and writes it to the
+// sink and the store.
+//
+bool
+QcEndReceivedChunk(
+    _In_ QcConnection& Connection
+    )
+{
+    auto& Chunk = Connection.DedupChunks[Connection.DedupNext];
+    array<uint8_t, QcStrongHashLength> Hash;
+    QcStrongHash(Connection.DedupChunkData.data(), Chunk.Length, Hash);
+    if (Hash != Chunk.Hash) {
+        Log() << "Chunk doesn't match its hash!" << endl;
+        return false;
+    }
+    if (!Connection.Sink->Write(Connection.DedupChunkData.data(), Chunk.Length)) {
+        return false;
+    }
+    // Later references to the chunk, in this file or others, are copied
+    // from the store.
+    if (!Connection.Listener->ChunkStore->Write(Chunk, Connection.DedupChunkData.data())) {
+        Log() << "Failed to store a chunk!" << endl;
+        return false;
+    }
+    Connection.DedupChunkData.clear();
+    Connection.PayloadOffset += Chunk.Length;
+    Connection.DedupNext++;
+    return true;
+}
+
+bool
+QcWriteDedupPayload(
+    _In_ QcConnection& Connection,
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    while (Length != 0) {
+        if (Connection.DedupState == DedupStateManifestLength) {
+            uint8_t Byte = *Buffer++;
+            Length--;
+            QUIC_VAR_INT Values[1];
+            if (!QcGatherRecordHeader(Connection, Byte, 0, 1, Values)) {
+                continue;
+            }
+            if (Values[0] > QcMaxDedupManifestLength(Connection.FileSize)) {
+                Log() << "Dedup manifest is too long!" << endl;
+                return false;
+            }
+            Connection.DedupManifestRemaining = Values[0];
+            Connection.DedupState = DedupStateManifest;
+        } else if (Connection.DedupState == DedupStateManifest) {
+            uint32_t Take = (uint32_t)min<uint64_t>(Connection.DedupManifestRemaining, Length);
+            Connection.DedupManifest.insert(Connection.DedupManifest.end(), Buffer, Buffer + Take);
+            Buffer += Take;
+            Length -= Take;
+            Connection.DedupManifestRemaining -= Take;
+        } else {
+            if (!Connection.DedupNeededReady.load(memory_order_acquire)) {
+                Log() << "Chunk data arrived before it was asked for!" << endl;
+                return false;
+            }
+            if (Connection.DedupChunkData.empty() && !QcCopyStoredChunks(Connection)) {
+                return false;
+            }
+            if (Connection.DedupNext == Connection.DedupChunks.size()) {
+                Log() << "More chunk data than the manifest lists!" << endl;
+                return false;
+            }
+            auto& Chunk = Connection.DedupChunks[Connection.DedupNext];
+            uint32_t Take = (uint32_t)min<size_t>(Chunk.Length - Connection.DedupChunkData.size(), Length);
+            Connection.DedupChunkData.insert(Connection.DedupChunkData.end(), Buffer, Buffer + Take);
+            Buffer += Take;
+            Length -= Take;
+            if (Connection.DedupChunkData.size() == Chunk.Length && !QcEndReceivedChunk(Connection)) {
+                return false;
+            }
+        }
+        if (Connection.DedupState == DedupStateManifest && Connection.DedupManifestRemaining == 0) {
+            if (!QcDecodeDedupManifest(Connection.DedupManifest, Connection.FileSize, Connection.DedupChunks)) {
+                Log() << "Dedup manifest is malformed!" << endl;
+                return false;
+            }
+            Connection.DedupManifest.clear();
+            Connection.DedupState = DedupStateChunks;
+            QcBeginReply(Connection, QcSendChunkBitmap);
+        }
+    }
+    return true;
+}
+
+bool
+QcFinishDedupPayload(
+    _In_ QcConnection& Connection
+    )
+{
+    if (Connection.DedupState != DedupStateChunks ||
+        !Connection.DedupNeededReady.load(memory_order_acquire) ||
+        !Connection.DedupChunkData.empty()) {
+        Log() << "Transfer ended inside a record!" << endl;
+        return false;
+    }
+    if (!QcCopyStoredChunks(Connection)) {
+        return false;
+    }
+    if (Connection.DedupNext != Connection.DedupChunks.size()) {
+        Log() << "Deduplicated transfer ended early!" << endl;
+        return false;
+    }
+    return true;
+}
+
+//
+// Passes received body data to the sink, recreating holes in sparse transfers
+// and blocks of the existing file in delta transfers.
+//
+bool
+QcWritePayload(
+    _In_ QcConnection& Connection,
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length
+    )
+{
+    if (Connection.Packed) {
+        return QcWritePackedPayload(Connection, Buffer, Length);
+    }
+    if (Connection.Striped) {
+        return QcWriteStripedPayload(Connection, Buffer, Length);
+    }
+    if (Connection.Dedup) {
+        return QcWriteDedupPayload(Connection, Buffer, Length);
+    }
+    if (!Connection.Sparse && !Connection.Delta) {
+        return Connection.Sink->Write(Buffer, Length);
+    }
+    while (Length != 0) {
+        if (Connection.RecordRemaining != 0) {
+            uint32_t WriteLength = (uint32_t)min<uint64_t>(Connection.RecordRemaining, Length);
+            if (!Connection.Sink->Write(Buffer, WriteLength)) {
+                return false;
+            }
+            Buffer += WriteLength;
+            Length -= WriteLength;
+            Connection.RecordRemaining -= WriteLength;
+            Connection.PayloadOffset += WriteLength;
+            continue;
+        }
+        uint8_t Byte = *Buffer++;
+        Length--;
+        QUIC_VAR_INT Values[2];
+        if (Connection.Sparse) {
+            // Extent: offset, length.
+            if (!QcGatherRecordHeader(Connection, Byte, 0, 2, Values)) {
+                continue;
+            }
+            if (Values[0] < Connection.PayloadOffset ||
+                Values[1] > Connection.FileSize ||
+                Values[0] > Connection.FileSize - Values[1]) {
+                Log() << "Invalid data extent!" << endl;
+                return false;
+            }
+            if (!Connection.Sink->Skip(Values[0] - Connection.PayloadOffset)) {
+                return false;
+            }
+            Connection.PayloadOffset = Values[0];
+            Connection.RecordRemaining = Values[1];
+            continue;
+        }
+        uint8_t Tag = Connection.RecordHeaderLength == 0 ? Byte : Connection.RecordHeader[0];
+        if (Tag == QcDeltaRecordLiteral) {
+            if (!QcGatherRecordHeader(Connection, Byte, 1, 1, Values)) {
+                continue;
+            }
+            if (Values[0] > Connection.FileSize - Connection.PayloadOffset) {
+                Log() << "Invalid literal!" << endl;
+                return false;
+            }
+            Connection.RecordRemaining = Values[0];
+        } else if (Tag == QcDeltaRecordCopy) {
+            if (!QcGatherRecordHeader(Connection, Byte, 1, 2, Values)) {
+                continue;
+            }
+            if (Values[0] > Connection.BasisBlocks ||
+                Values[1] > Connection.BasisBlocks - Values[0] ||
+                Values[1] * Connection.DeltaBlockSize > Connection.FileSize - Connection.PayloadOffset) {
+                Log() << "Invalid block reference!" << endl;
+                return false;
+            }
+            uint64_t CopyLength = Values[1] * Connection.DeltaBlockSize;
+            if (!QcCopyFromBasis(Connection, Values[0] * Connection.DeltaBlockSize, CopyLength)) {
+                return false;
+            }
+            Connection.PayloadOffset += CopyLength;
+        } else {
+            Log() << "Invalid delta record!" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// Closes the sink at the end of the stream, after any trailing hole.
+//
+bool
+QcFinishPayload(
+    _In_ QcConnection& Connection
+    )
+{
+    bool Result = true;
+    if (Connection.Striped) {
+        return QcFinishStripedPayload(Connection);
+    }
+    if (Connection.Packed) {
+        return QcFinishPackedPayload(Connection);
+    }
+    if (Connection.Dedup) {
+        Result = QcFinishDedupPayload(Connection);
+    } else if (Connection.Sparse || Connection.Delta) {
+        if (Connection.RecordRemaining != 0 || Connection.RecordHeaderLength != 0) {
+            Log() << "Transfer ended inside a record!" << endl;
+            Result = false;
+        } else if (Connection.Sparse) {
+            Result = Connection.Sink->Skip(Connection.FileSize - Connection.PayloadOffset);
+        } else if (Connection.PayloadOffset != Connection.FileSize) {
+            Log() << "Delta transfer ended early!" << endl;
+            Result = false;
+        }
+    }
+    if (Connection.Delta) {
+        // Close the existing file before it's replaced.
+        Result = Connection.Sink->Close() && Result;
+        Connection.Basis.close();
+        if (!Result) {
+            QcDiscardFile(*Connection.Listener, Connection.PartialName);
+            return false;
+        }
+        return QcCommitFile(*Connection.Listener, Connection.PartialName, Connection.FileName, Connection.FileSize);
+    }
+    return QcFinishFile(
+        *Connection.Listener,
+        *Connection.Sink,
+        Connection.PartialName,
+        Connection.FileName,
+        Connection.FileSize,
+        Result);
+}
+
+//
+// Parses a receive of a deduplicated transfer's body on a writer thread, then
+// completes it, or if the connection shut down meanwhile, finishes that.
+//
+void
+QcWriteDedupReceive(
+    _In_ QcConnection& Connection,
+    _In_ const vector<QUIC_BUFFER>& Buffers,
+    _In_ uint64_t Length,
+    _In_ bool Fin
+    )
+{
+    bool Result = true;
+    for (auto& Buffer : Buffers) {
+        if (!QcWriteDedupPayload(Connection, Buffer.Buffer, Buffer.Length)) {
+            Log() << "Failed to write to file!" << endl;
+            Result = false;
+            break;
+        }
+    }
+    if (Result && Fin) {
+        Connection.TransferStatus =
+            QcFinishPayload(Connection) ? QUIC_STATUS_SUCCESS : QUIC_STATUS_INTERNAL_ERROR;
+    }
+    bool Free;
+    bool Finished = false;
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        Connection.DedupWriting = false;
+        if (Connection.ShutdownComplete) {
+            // It was left for us to report.
+            Finished = true;
+        } else if (!Result) {
+            Connection.Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+        } else {
+            Connection.Stream->ReceiveComplete(Length);
+        }
+        Free = --Connection.PendingWork == 0 && Connection.ShutdownComplete && !Finished;
+    }
+    if (Fin) {
+        CxPlatEventSet(Connection.SendCompleteEvent);
+    }
+    if (Finished) {
+        QcFinishConnection(Connection);
+    } else if (Free) {
+        QcFreeConnection(&Connection);
+    }
+}
+
+//
+// Hands a receive of a deduplicated transfer's body to the writer threads:
+// checking chunks against their hashes and reading and writing the chunk
+// store are too slow for the MsQuic worker. The receive is left pending, so
+// nothing more is indicated on the stream until it's completed, and the body
+// is still parsed in order.
+//
+QUIC_STATUS
+QcQueueDedupReceive(
+    _In_ QcConnection& Connection,
+    _In_ const QUIC_STREAM_EVENT* Event,
+    _In_ uint32_t First,
+    _In_ uint32_t Offset
+    )
+{
+    vector<QUIC_BUFFER> Buffers(Event->RECEIVE.Buffers + First, Event->RECEIVE.Buffers + Event->RECEIVE.BufferCount);
+    if (!Buffers.empty()) {
+        Buffers.front().Buffer += Offset;
+        Buffers.front().Length -= Offset;
+    }
+    uint64_t Length = Event->RECEIVE.TotalBufferLength;
+    bool Fin = (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) != 0;
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        Connection.PendingWork++;
+        Connection.DedupWriting = true;
+    }
+    Connection.Listener->Writers->Post([&Connection, Buffers, Length, Fin]() {
+        QcWriteDedupReceive(Connection, Buffers, Length, Fin);
+    });
+    return QUIC_STATUS_PENDING;
+}
+
+QUIC_STATUS
+QcFileRecvStreamCallback(
+    _In_ MsQuicStream* Stream,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Connection = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_START_COMPLETE:
+        if (QUIC_FAILED(Event->START_COMPLETE.Status)) {
+            Log() << "Stream start result: " << hex << Event->START_COMPLETE.Status << dec << endl;
+            return Event->START_COMPLETE.Status;
+        }
+        break;
+    case QUIC_STREAM_EVENT_RECEIVE: {
+        // Where the body starts: a buffer, and an offset into it.
+        uint32_t First = 0;
+        uint32_t Offset = 0;
+        auto Now = steady_clock::now();
+        if (Connection->Sink == nullptr) {
+            auto Result = QcHeaderParser::NeedMore;
+            for (; First < Event->RECEIVE.BufferCount && Result == QcHeaderParser::NeedMore; ++First) {
+                Result =
+                    Connection->HeaderParser.Feed(
+                        Event->RECEIVE.Buffers[First].Buffer,
+                        Event->RECEIVE.Buffers[First].Length,
+                        Offset);
+            }
+            if (Result == QcHeaderParser::NeedMore && (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN)) {
+                Log() << "Transfer header is truncated" << endl;
+                Result = QcHeaderParser::Invalid;
+            }
+            if (Result == QcHeaderParser::Invalid) {
+                Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INVALID_PARAMETER);
+                return QUIC_STATUS_INTERNAL_ERROR;
+            }
+            if (Result == QcHeaderParser::NeedMore) {
+                Connection->BytesReceived += Event->RECEIVE.TotalBufferLength;
+                break;
+            }
+            // The body starts in the buffer the header ended in.
+            First--;
+            QUIC_STATUS Status = QcOpenTransfer(*Connection, Connection->HeaderParser.GetHeader(), Now);
+            if (QUIC_FAILED(Status)) {
+                Stream->Shutdown((QUIC_UINT62)Status);
+                return QUIC_STATUS_INTERNAL_ERROR;
+            }
+            if (Connection->Delta) {
+                QcBeginReply(*Connection, QcSendSignatures);
+            }
+        }
+        if (Connection->Dedup) {
+            Connection->BytesReceived += Event->RECEIVE.TotalBufferLength;
+            if (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) {
+                Connection->EndTime = Now;
+            }
+            PrintProgressAll(
+                *Connection->Listener,
+                Now,
+                Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN);
+            return QcQueueDedupReceive(*Connection, Event, First, Offset);
+        }
+        for (unsigned i = First; i < Event->RECEIVE.BufferCount; ++i) {
+            auto WriteLength = Event->RECEIVE.Buffers[i].Length - Offset;
+            if (!QcWritePayload(*Connection, Event->RECEIVE.Buffers[i].Buffer + Offset, WriteLength)) {
+                Log() << "Failed to write to file!" << endl;
+                Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+                return QUIC_STATUS_INTERNAL_ERROR;
+            }
+            Offset = 0;
+        }
+        Connection->BytesReceived += Event->RECEIVE.TotalBufferLength;
+        PrintProgressAll(
+            *Connection->Listener,
+            Now,
+            Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN);
+        if (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) {
+            Connection->EndTime = Now;
+            if (Connection->Packed &&
+                QcDeferPackedFinish(*Connection, Event->RECEIVE.TotalBufferLength)) {
+                return QUIC_STATUS_PENDING;
+            }
+            Connection->TransferStatus =
+                QcFinishPayload(*Connection) ? QUIC_STATUS_SUCCESS : QUIC_STATUS_INTERNAL_ERROR;
+            CxPlatEventSet(Connection->SendCompleteEvent);
+        }
+        break;
+    }
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        CxPlatEventSet(Connection->SendCompleteEvent);
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// A request to a serving listener, on a bidirectional stream of its own: a
+// varint name length, the name (a path relative to the served directory),
+// then varint offset and length, with zero length meaning the rest of the
+// file. The reply is the file's size as a varint, then the requested bytes.
+//
+struct QcServeRequest {
+    QcListener* Listener;
+    vector<uint8_t> Request;
+    ifstream File;
+    uint64_t FileSize{0};
+    uint64_t Remaining{0};
+    bool SizeSent{false};
+    bool Finished{false};
+    // Two buffers, so the next read overlaps the send in flight.
+    QcBuffer Buffers[2];
+    QUIC_BUFFER QuicBuffers[2];
+    uint32_t InFlight{0};
+    uint32_t NextBuffer{0};
+};
+
+QUIC_STATUS
+QcOpenServeRequest(
+    _In_ QcServeRequest& Request
+    )
+{
+    uint16_t Length = (uint16_t)Request.Request.size();
+    const uint8_t* Data = Request.Request.data();
+    uint16_t Offset = 0;
+    QUIC_VAR_INT NameLength = 0, FileOffset = 0, RangeLength = 0;
+    if (!QuicVarIntDecode(Length, Data, &Offset, &NameLength) ||
+        NameLength > (uint64_t)(Length - Offset)) {
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+    string Name((const char*)Data + Offset, (size_t)NameLength);
+    Offset += (uint16_t)NameLength;
+    if (!QuicVarIntDecode(Length, Data, &Offset, &FileOffset) ||
+        !QuicVarIntDecode(Length, Data, &Offset, &RangeLength) ||
+        Offset != Length) {
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+    if (!QcValidPackedName(Name)) {
+        Log() << "Invalid request for " << Name << endl;
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+    // The name can't climb out of ServePath, but a symlink under it could.
+    error_code Error;
+    auto Path = filesystem::weakly_canonical(Request.Listener->ServePath / Name, Error);
+    auto Relative = Path.lexically_relative(Request.Listener->ServePath);
+    if (Error || Relative.empty() || *Relative.begin() == "..") {
+        Log() << "Refused request for " << Name << " outside the served directory" << endl;
+        return QUIC_STATUS_NOT_FOUND;
+    }
+    if (!filesystem::is_regular_file(Path, Error)) {
+        return QUIC_STATUS_NOT_FOUND;
+    }
+    Request.FileSize = filesystem::file_size(Path, Error);
+    Request.File.open(Path, ios::binary | ios::in);
+    if (Error || !Request.File.is_open()) {
+        return QUIC_STATUS_NOT_FOUND;
+    }
+    if (FileOffset > Request.FileSize) {
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+    Request.Remaining = Request.FileSize - FileOffset;
+    if (RangeLength != 0) {
+        Request.Remaining = min<uint64_t>(Request.Remaining, RangeLength);
+    }
+    Request.File.seekg((streamoff)FileOffset);
+    Request.Buffers[0] = QcBufferPool::Get().Allocate(ServeChunkSize);
+    Request.Buffers[1] = QcBufferPool::Get().Allocate(ServeChunkSize);
+    if (Request.Buffers[0] == nullptr || Request.Buffers[1] == nullptr) {
+        return QUIC_STATUS_OUT_OF_MEMORY;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Reads and sends the reply until both buffers are in flight.
+//
+void
+QcServeNext(
+    _In_ QcServeRequest& Request,
+    _In_ MsQuicStream& Stream
+    )
+{
+    while (Request.InFlight < 2 && !Request.Finished) {
+        uint8_t* Buffer = Request.Buffers[Request.NextBuffer].get();
+        uint32_t Length = 0;
+        if (!Request.SizeSent) {
+            Length = (uint32_t)(QuicVarIntEncode(Request.FileSize, Buffer) - Buffer);
+            Request.SizeSent = true;
+        }
+        uint32_t ReadLength = (uint32_t)min<uint64_t>(ServeChunkSize - Length, Request.Remaining);
+        Request.File.read((char*)Buffer + Length, ReadLength);
+        if ((uint32_t)Request.File.gcount() != ReadLength) {
+            Log() << "Failed to read a served file!" << endl;
+            Stream.Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+            return;
+        }
+        Length += ReadLength;
+        Request.Remaining -= ReadLength;
+        Request.Finished = Request.Remaining == 0;
+        Request.QuicBuffers[Request.NextBuffer] = {Length, Buffer};
+        Request.InFlight++;
+        QUIC_STATUS Status =
+            Stream.Send(
+                &Request.QuicBuffers[Request.NextBuffer],
+                1,
+                Request.Finished ? QUIC_SEND_FLAG_FIN : QUIC_SEND_FLAG_NONE);
+        if (QUIC_FAILED(Status)) {
+            Request.InFlight--;
+            Stream.Shutdown((QUIC_UINT62)Status);
+            return;
+        }
+        Request.Listener->TotalBytesServed.Add(ReadLength);
+        Request.NextBuffer ^= 1;
+    }
+}
+
+QUIC_STATUS
+QcServeStreamCallback(
+    _In_ MsQuicStream* Stream,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Request = (QcServeRequest*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE:
+        if (Request->Request.size() + Event->RECEIVE.TotalBufferLength > MaxServeRequestLength) {
+            Log() << "Request is too long!" << endl;
+            Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INVALID_PARAMETER);
+            return QUIC_STATUS_INTERNAL_ERROR;
+        }
+        for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; ++i) {
+            Request->Request.insert(
+                Request->Request.end(),
+                Event->RECEIVE.Buffers[i].Buffer,
+                Event->RECEIVE.Buffers[i].Buffer + Event->RECEIVE.Buffers[i].Length);
+        }
+        if (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) {
+            QUIC_STATUS Status = QcOpenServeRequest(*Request);
+            if (QUIC_FAILED(Status)) {
+                Stream->Shutdown((QUIC_UINT62)Status);
+                return QUIC_STATUS_INTERNAL_ERROR;
+            }
+            QcServeNext(*Request, *Stream);
+        }
+        break;
+    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+        Request->InFlight--;
+        if (!Event->SEND_COMPLETE.Canceled) {
+            QcServeNext(*Request, *Stream);
+        }
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        delete Request;
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+QUIC_STATUS
+QcAcceptServeRequest(
+    _In_ QcConnection& Connection,
+    _In_ HQUIC Stream
+    )
+{
+    if (!Connection.Admitted) {
+        // Fetch clients take the range to another source.
+        return QUIC_STATUS_SERVER_BUSY;
+    }
+    auto Request = new(nothrow) QcServeRequest();
+    if (Request == nullptr) {
+        return QUIC_STATUS_OUT_OF_MEMORY;
+    }
+    Request->Listener = Connection.Listener;
+    if (Connection.StartTime == steady_clock::time_point()) {
+        Connection.StartTime = steady_clock::now();
+    }
+    new MsQuicStream(Stream, CleanUpAutoDelete, QcServeStreamCallback, Request);
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Forwards a relayed transfer's data onward. Receives are left pending until
+// the onward send completes, so at most a receive window is held here and a
+// slow next hop slows the sender.
+//
+QUIC_STATUS
+QcRelayRecvStreamCallback(
+    _In_ MsQuicStream* Stream,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Connection = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_START_COMPLETE:
+        if (QUIC_FAILED(Event->START_COMPLETE.Status)) {
+            Log() << "Stream start result: " << hex << Event->START_COMPLETE.Status << dec << endl;
+            return Event->START_COMPLETE.Status;
+        }
+        break;
+    case QUIC_STREAM_EVENT_RECEIVE: {
+        auto Now = steady_clock::now();
+        if (!Connection->RelayStreamStorage.has_value()) {
+            // The onward connection failed to start.
+            Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_CONNECTION_REFUSED);
+            return QUIC_STATUS_INTERNAL_ERROR;
+        }
+        if (Connection->FileName.empty()) {
+            // Only the name and size are needed, for progress. The body is
+            // passed on as is, except delta, whose signatures would need
+            // relaying back.
+            auto Result = QcHeaderParser::NeedMore;
+            for (uint32_t i = 0; i < Event->RECEIVE.BufferCount && Result == QcHeaderParser::NeedMore; ++i) {
+                uint32_t Consumed;
+                Result =
+                    Connection->HeaderParser.Feed(
+                        Event->RECEIVE.Buffers[i].Buffer,
+                        Event->RECEIVE.Buffers[i].Length,
+                        Consumed);
+            }
+            if (Result == QcHeaderParser::NeedMore && (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN)) {
+                Log() << "Transfer header is truncated" << endl;
+                Result = QcHeaderParser::Invalid;
+            }
+            if (Result == QcHeaderParser::Invalid) {
+                Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INVALID_PARAMETER);
+                return QUIC_STATUS_INTERNAL_ERROR;
+            }
+            if (Result == QcHeaderParser::Complete) {
+                auto& Header = Connection->HeaderParser.GetHeader();
+                if ((Header.Flags & (QcHeaderFlagDelta | QcHeaderFlagDedup)) != 0) {
+                    Log() << "Delta and deduplicated transfers can't be relayed!" << endl;
+                    Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_NOT_SUPPORTED);
+                    return QUIC_STATUS_INTERNAL_ERROR;
+                }
+                Connection->FileName = Header.Name;
+                Connection->FileSize = Header.Size;
+                Connection->StartTime = Now;
+                Connection->LastUpdate = Now;
+            }
+        }
+        Connection->RelayBuffers.assign(
+            Event->RECEIVE.Buffers,
+            Event->RECEIVE.Buffers + Event->RECEIVE.BufferCount);
+        Connection->RelayPendingLength = Event->RECEIVE.TotalBufferLength;
+        Connection->BytesReceived += Event->RECEIVE.TotalBufferLength;
+        bool Fin = (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) != 0;
+        if (Fin) {
+            Connection->EndTime = Now;
+            Connection->RelayFinSent = true;
+        }
+        QUIC_STATUS Status =
+            Connection->RelayStreamStorage->Send(
+                Connection->RelayBuffers.data(),
+                (uint32_t)Connection->RelayBuffers.size(),
+                Fin ? QUIC_SEND_FLAG_FIN : QUIC_SEND_FLAG_NONE);
+        if (QUIC_FAILED(Status)) {
+            Log() << "Relay send failed with 0x" << hex << Status << dec << endl;
+            Stream->Shutdown((QUIC_UINT62)Status);
+            return QUIC_STATUS_INTERNAL_ERROR;
+        }
+        PrintProgressAll(*Connection->Listener, Now, Fin);
+        return QUIC_STATUS_PENDING;
+    }
+    case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
+        if (Connection->RelayStreamStorage.has_value()) {
+            Connection->RelayStreamStorage->Shutdown(Event->PEER_SEND_ABORTED.ErrorCode);
+        }
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+QUIC_STATUS
+QcRelaySendStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Connection = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+        if (Event->SEND_COMPLETE.Canceled) {
+            Connection->RelayAborted = true;
+            Connection->StreamStorage->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+        } else {
+            // Frees the received data, and lets more arrive.
+            Connection->StreamStorage->ReceiveComplete(Connection->RelayPendingLength);
+        }
+        break;
+    case QUIC_STREAM_EVENT_PEER_RECEIVE_ABORTED:
+        Connection->RelayAborted = true;
+        Connection->StreamStorage->Shutdown(Event->PEER_RECEIVE_ABORTED.ErrorCode);
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        if (Connection->RelayFinSent && !Connection->RelayAborted &&
+            !Event->SHUTDOWN_COMPLETE.ConnectionShutdown) {
+            Connection->TransferStatus = QUIC_STATUS_SUCCESS;
+        }
+        Connection->RelayConnectionStorage->Shutdown(QUIC_STATUS_SUCCESS);
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Echo mode sends everything received straight back on the same stream, out
+// of MsQuic's receive buffers, for latency benchmarks (QcClient::PingPong).
+//
+QUIC_STATUS
+QcEchoStreamCallback(
+    _In_ MsQuicStream* Stream,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Connection = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE: {
+        bool Fin = (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) != 0;
+        if (Connection->BytesReceived == 0) {
+            Connection->StartTime = steady_clock::now();
+        }
+        Connection->BytesReceived += Event->RECEIVE.TotalBufferLength;
+        if (Event->RECEIVE.TotalBufferLength == 0) {
+            if (Fin) {
+                Stream->Shutdown(QUIC_STATUS_SUCCESS, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL);
+            }
+            break;
+        }
+        Connection->RelayBuffers.assign(
+            Event->RECEIVE.Buffers,
+            Event->RECEIVE.Buffers + Event->RECEIVE.BufferCount);
+        Connection->RelayPendingLength = Event->RECEIVE.TotalBufferLength;
+        QUIC_STATUS Status =
+            Stream->Send(
+                Connection->RelayBuffers.data(),
+                (uint32_t)Connection->RelayBuffers.size(),
+                Fin ? QUIC_SEND_FLAG_FIN : QUIC_SEND_FLAG_NONE);
+        if (QUIC_FAILED(Status)) {
+            Log() << "Echo send failed with 0x" << hex << Status << dec << endl;
+            Stream->Shutdown((QUIC_UINT62)Status);
+            return QUIC_STATUS_INTERNAL_ERROR;
+        }
+        return QUIC_STATUS_PENDING;
+    }
+    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+        if (!Event->SEND_COMPLETE.Canceled) {
+            Stream->ReceiveComplete(Connection->RelayPendingLength);
+        }
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        Connection->EndTime = steady_clock::now();
+        if (!Event->SHUTDOWN_COMPLETE.ConnectionShutdown) {
+            Connection->TransferStatus = QUIC_STATUS_SUCCESS;
+            Connection->Connection->Shutdown(QUIC_STATUS_SUCCESS);
+        }
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+QUIC_STATUS
+QcRelayConnectionCallback(
+    _In_ MsQuicConnection* /*Connection*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_CONNECTION_EVENT* Event
+    )
+{
+    auto Connection = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE: {
+        if (QUIC_FAILED(Connection->TransferStatus)) {
+            // Lets the sender know the transfer didn't make it.
+            Connection->Connection->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+        }
+        bool Finished;
+        {
+            unique_lock<mutex> Lock(Connection->WorkMutex);
+            Connection->RelayActive = false;
+            Connection->PendingWork--;
+            Finished = Connection->ShutdownComplete;
+        }
+        if (Finished) {
+            QcFinishConnection(*Connection);
+        }
+        break;
+    }
+    case QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED:
+        return QUIC_STATUS_NOT_SUPPORTED;
+    case QUIC_CONNECTION_EVENT_PEER_CERTIFICATE_RECEIVED:
+        if (!QcVerifyCertificate(
+            Connection->Listener->RelayPassword,
+            Event->PEER_CERTIFICATE_RECEIVED.Certificate)) {
+            Log() << "Relay target's password doesn't match!" << endl;
+            return QUIC_STATUS_CONNECTION_REFUSED;
+        }
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Opens the onward connection for a relayed transfer. Its stream is started
+// right away, so the handshake overlaps the first data arriving; MsQuic holds
+// sends until it's connected.
+//
+bool
+QcStartRelay(
+    _In_ QcConnection& Connection
+    )
+{
+    auto Listener = Connection.Listener;
+    Connection.RelayConnectionStorage.emplace(
+        *Listener->Registration,
+        CleanUpManual,
+        QcRelayConnectionCallback,
+        &Connection);
+    if (!Connection.RelayConnectionStorage->IsValid()) {
+        Log() << "Failed to open relay connection!" << endl;
+        Connection.RelayConnectionStorage.reset();
+        return false;
+    }
+    Connection.RelayStreamStorage.emplace(
+        *Connection.RelayConnectionStorage,
+        QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL,
+        CleanUpManual,
+        QcRelaySendStreamCallback,
+        &Connection);
+    if (!Connection.RelayStreamStorage->IsValid() ||
+        QUIC_FAILED(Connection.RelayStreamStorage->Start(QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL | QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+        Log() << "Failed to start relay stream!" << endl;
+        Connection.RelayStreamStorage.reset();
+        Connection.RelayConnectionStorage.reset();
+        return false;
+    }
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        Connection.PendingWork++;
+        Connection.RelayActive = true;
+    }
+    if (QUIC_FAILED(
+        Connection.RelayConnectionStorage->Start(
+            *Listener->RelayConfig,
+            Listener->RelayTarget.c_str(),
+            Listener->RelayPort))) {
+        Log() << "Failed to start relay connection to " << Listener->RelayTarget << "!" << endl;
+        {
+            unique_lock<mutex> Lock(Connection.WorkMutex);
+            Connection.PendingWork--;
+            Connection.RelayActive = false;
+        }
+        Connection.RelayStreamStorage.reset();
+        Connection.RelayConnectionStorage.reset();
+        return false;
+    }
+    return true;
+}
+
+//
+// Keeps about a receive window of the destination handed to MsQuic ahead of
+// what has arrived. In app-owned mode the stream's flow control limit is the
+// end of the provided buffers, so this also paces the sender.
+//
+bool
+QcProvideDirectBuffers(
+    _In_ QcConnection& Connection
+    )
+{
+    const uint64_t Window = Connection.Listener->ReceiveWindow;
+    uint64_t Arrived = Connection.BytesReceived - Connection.DirectHeaderLength;
+    uint64_t Target = min(Connection.FileSize, Arrived + Window);
+    // Top up in large steps rather than on every receive.
+    if (Target <= Connection.DirectProvided ||
+        (Target < Connection.FileSize && Target - Connection.DirectProvided < Window / 2)) {
+        return true;
+    }
+    const uint32_t MaxBuffers = 8;
+    QUIC_BUFFER Buffers[MaxBuffers];
+    uint32_t BufferCount = 0;
+    while (Connection.DirectProvided < Target && BufferCount < MaxBuffers) {
+        uint32_t Length = (uint32_t)min<uint64_t>(Target - Connection.DirectProvided, UINT32_MAX);
+        Buffers[BufferCount].Buffer = Connection.DirectBuffer + Connection.DirectProvided;
+        Buffers[BufferCount].Length = Length;
+        BufferCount++;
+        Connection.DirectProvided += Length;
+    }
+    if (BufferCount == 0) {
+        return true;
+    }
+    QUIC_STATUS Status =
+        MsQuic->StreamProvideReceiveBuffers(*Connection.Stream, BufferCount, Buffers);
+    if (QUIC_FAILED(Status)) {
+        Log() << "Failed to provide receive buffers: " << hex << Status << dec << endl;
+        return false;
+    }
+    return true;
+}
+
+//
+// File receive with app-owned buffers. MsQuic first gets only DirectHeader,
+// which bounds what the sender can send until the header is parsed and the
+// sink's direct buffer is known; after that the payload is decrypted straight
+// into the destination and never passes through a Write.
+//
+QUIC_STATUS
+QcDirectRecvStreamCallback(
+    _In_ MsQuicStream* Stream,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Connection = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE: {
+        auto Now = steady_clock::now();
+        uint64_t Previous = Connection->BytesReceived;
+        Connection->BytesReceived += Event->RECEIVE.TotalBufferLength;
+        if (Connection->Sink == nullptr) {
+            // The header arrives in DirectHeader, possibly over several events.
+            // Only the bytes new to this event are fed to the parser.
+            uint64_t Received = min<uint64_t>(Connection->BytesReceived, MaxHeaderLength);
+            uint32_t Consumed = 0;
+            auto Result = QcHeaderParser::NeedMore;
+            if (Previous < Received) {
+                Result =
+                    Connection->HeaderParser.Feed(
+                        Connection->DirectHeader + Previous,
+                        (uint32_t)(Received - Previous),
+                        Consumed);
+            }
+            if (Result == QcHeaderParser::NeedMore) {
+                if (!(Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN)) {
+                    break;
+                }
+                Log() << "Transfer header is truncated" << endl;
+                Result = QcHeaderParser::Invalid;
+            }
+            if (Result == QcHeaderParser::Invalid) {
+                Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INVALID_PARAMETER);
+                return QUIC_STATUS_INTERNAL_ERROR;
+            }
+            auto& Header = Connection->HeaderParser.GetHeader();
+            if (Header.Flags != 0) {
+                // Records can't be placed before they're parsed. Refused
+                // before the sink is opened, which would truncate the file.
+                Log() << "Sparse, delta, packed, striped and deduplicated transfers can't be received directly!" << endl;
+                Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_NOT_SUPPORTED);
+                return QUIC_STATUS_INTERNAL_ERROR;
+            }
+            QUIC_STATUS Status = QcOpenTransfer(*Connection, Header, Now);
+            if (QUIC_FAILED(Status)) {
+                Stream->Shutdown((QUIC_UINT62)Status);
+                return QUIC_STATUS_INTERNAL_ERROR;
+            }
+            Connection->DirectHeaderLength = (uint32_t)(Previous + Consumed);
+            if (Connection->FileSize != 0) {
+                Connection->DirectBuffer = Connection->Sink->GetDirectBuffer();
+                if (Connection->DirectBuffer == nullptr) {
+                    Log() << "Sink doesn't support direct receive!" << endl;
+                    Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_NOT_SUPPORTED);
+                    return QUIC_STATUS_INTERNAL_ERROR;
+                }
+            }
+            // The start of the file shares DirectHeader with the header.
+            Connection->DirectProvided =
+                min<uint64_t>(MaxHeaderLength - Connection->DirectHeaderLength, Connection->FileSize);
+        }
+        if (Connection->BytesReceived - Connection->DirectHeaderLength > Connection->FileSize) {
+            Log() << "Received more than the file size!" << endl;
+            Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INVALID_PARAMETER);
+            return QUIC_STATUS_INTERNAL_ERROR;
+        }
+        // Move any file data that landed in DirectHeader into place.
+        uint64_t HeaderStart = max<uint64_t>(Previous, Connection->DirectHeaderLength);
+        uint64_t HeaderEnd = min<uint64_t>(Connection->BytesReceived, MaxHeaderLength);
+        if (HeaderStart < HeaderEnd) {
+            memcpy(
+                Connection->DirectBuffer + (HeaderStart - Connection->DirectHeaderLength),
+                Connection->DirectHeader + HeaderStart,
+                (size_t)(HeaderEnd - HeaderStart));
+        }
+        if (!QcProvideDirectBuffers(*Connection)) {
+            Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+            return QUIC_STATUS_INTERNAL_ERROR;
+        }
+        PrintProgressAll(
+            *Connection->Listener,
+            Now,
+            Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN);
+        if (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) {
+            Connection->EndTime = Now;
+            bool Complete =
+                Connection->BytesReceived - Connection->DirectHeaderLength == Connection->FileSize;
+            Connection->TransferStatus =
+                QcFinishFile(
+                    *Connection->Listener,
+                    *Connection->Sink,
+                    Connection->PartialName,
+                    Connection->FileName,
+                    Connection->FileSize,
+                    Complete) ? QUIC_STATUS_SUCCESS : QUIC_STATUS_INTERNAL_ERROR;
+            CxPlatEventSet(Connection->SendCompleteEvent);
+        }
+        break;
+    }
+    case QUIC_STREAM_EVENT_RECEIVE_BUFFER_NEEDED:
+        // Only a sender ignoring flow control gets here.
+        Log() << "Peer sent past the receive window!" << endl;
+        Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INVALID_PARAMETER);
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        CxPlatEventSet(Connection->SendCompleteEvent);
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+QcConnection*
+QcAllocateConnection(
+    _In_ QcListener& Listener
+    )
+{
+    QcConnection* Connection = nullptr;
+    {
+        unique_lock<mutex> Lock(Listener.PoolMutex);
+        if (!Listener.FreeConnections.empty()) {
+            Connection = Listener.FreeConnections.back();
+            Listener.FreeConnections.pop_back();
+        }
+    }
+    if (Connection == nullptr) {
+        Connection = new(nothrow) QcConnection();
+        if (Connection == nullptr) {
+            return nullptr;
+        }
+        CxPlatEventInitialize(&Connection->SendCompleteEvent, false, false);
+    }
+    Connection->Listener = &Listener;
+    Connection->Password = Listener.Password;
+    return Connection;
+}
+
+void
+QcFreeConnection(
+    _In_ QcConnection* Connection
+    )
+{
+    QcListener& Listener = *Connection->Listener;
+    Connection->RelayStreamStorage.reset();
+    Connection->RelayConnectionStorage.reset();
+    Connection->RelayBuffers.clear();
+    Connection->RelayPendingLength = 0;
+    Connection->RelayFinSent = false;
+    Connection->RelayAborted = false;
+    Connection->RelayActive = false;
+    Connection->Pipe.reset();
+    Connection->StreamStorage.reset();
+    Connection->ConnectionStorage.reset();
+    Connection->Connection = nullptr;
+    Connection->Stream = nullptr;
+    Connection->Admitted = false;
+    Connection->PendingWork = 0;
+    Connection->ShutdownComplete = false;
+    Connection->Sink.reset();
+    Connection->FileName.clear();
+    Connection->PartialName.clear();
+    Connection->PackedPartialName.clear();
+    Connection->BytesReceived = 0;
+    Connection->BytesReceivedSnapshot = 0;
+    Connection->StartTime = Connection->LastUpdate = Connection->EndTime = {};
+    Connection->SendBuffer.reset();
+    Connection->SendQuicBuffer = {};
+    Connection->FileSize = 0;
+    Connection->SendCanceled = false;
+    Connection->TransferStatus = QUIC_STATUS_ABORTED;
+    Connection->Sparse = false;
+    Connection->Delta = false;
+    Connection->Striped = false;
+    if (Connection->StripedFile != nullptr) {
+        QcDetachStripedFile(*Connection);
+    }
+    Connection->Dedup = false;
+    Connection->DedupState = DedupStateManifestLength;
+    Connection->DedupManifest.clear();
+    Connection->DedupManifestRemaining = 0;
+    Connection->DedupChunks.clear();
+    Connection->DedupNeeded.clear();
+    Connection->DedupNeededReady = false;
+    Connection->DedupNext = 0;
+    Connection->DedupChunkData.clear();
+    Connection->DedupWriting = false;
+    Connection->Packed = false;
+    Connection->PackedState = 0;
+    Connection->PackedName.clear();
+    Connection->PackedNameRemaining = 0;
+    Connection->PackedData.clear();
+    Connection->PackedSink.reset();
+    Connection->PackedNames.clear();
+    Connection->PackedQueuedBytes = 0;
+    Connection->PackedQueuedEntries = 0;
+    Connection->PackedPaused = false;
+    Connection->PackedFailed = false;
+    Connection->PackedFinishing = false;
+    Connection->PackedFinishLength = 0;
+    Connection->RecordHeaderLength = 0;
+    Connection->RecordRemaining = 0;
+    Connection->PayloadOffset = 0;
+    Connection->Basis.close();
+    Connection->Basis.clear();
+    Connection->DeltaBlockSize = 0;
+    Connection->BasisBlocks = 0;
+    Connection->SignatureBuffer.clear();
+    Connection->SignatureQuicBuffer = {};
+    Connection->DirectBuffer = nullptr;
+    Connection->DirectHeaderLength = 0;
+    Connection->DirectProvided = 0;
+    Connection->HeaderVersion = QcHeaderVersion1;
+    Connection->PipeSource = nullptr;
+    {
+        unique_lock<mutex> Lock(Connection->RecvDataMutex);
+        Connection->RecvData.clear();
+        Connection->Datagrams.clear();
+        Connection->DatagramsDropped = 0;
+    }
+    CxPlatEventReset(Connection->SendCompleteEvent);
+    {
+        unique_lock<mutex> Lock(Listener.PoolMutex);
+        if (Listener.FreeConnections.size() < MaxPooledConnections) {
+            Listener.FreeConnections.push_back(Connection);
+            return;
+        }
+    }
+    CxPlatEventUninitialize(Connection->SendCompleteEvent);
+    delete Connection;
+}
+
+//
+// Removes a completed connection from the listener, returns its admission slot
+// and receive memory, and admits queued connections into the freed slots.
+//
+void
+QcReleaseConnection(
+    _In_ QcConnection& Connection
+    )
+{
+    QcListener& Listener = *Connection.Listener;
+    unique_lock<mutex> Lock(Listener.ConnectionListMutex);
+    auto Last = Listener.Connections.back();
+    Listener.Connections[Connection.ConnectionIndex] = Last;
+    Last->ConnectionIndex = Connection.ConnectionIndex;
+    Listener.Connections.pop_back();
+    if (Connection.Admitted) {
+        Listener.ActiveConnections--;
+    } else {
+        Listener.AdmissionQueue.erase(Connection.QueuePosition);
+    }
+    Listener.ReservedReceiveMemory -= Listener.ReceiveWindow;
+    while (!Listener.AdmissionQueue.empty() &&
+        (Listener.MaxConnections == 0 || Listener.ActiveConnections < Listener.MaxConnections)) {
+        auto Next = Listener.AdmissionQueue.front();
+        Listener.AdmissionQueue.pop_front();
+        Next->Admitted = true;
+        Listener.ActiveConnections++;
+        // Still under the lock, so Next can't be freed. This is queued to
+        // Next's worker and doesn't call back into us inline.
+        if (Next->Stream != nullptr) {
+            Next->Stream->ReceiveSetEnabled(true);
+        }
+    }
+}
+
+//
+// MsQuic's Retry threshold is process-wide, shared by every listener in the
+// process. Listeners forcing Retry are counted, and the configured threshold
+// is only put back once none are.
+//
+struct QcRetryState {
+    mutex Lock;
+    uint32_t Forcing{0};
+    uint16_t MemoryPercent{DefaultRetryMemoryPercent};
+};
+
+QcRetryState&
+QcGetRetryState()
+{
+    static QcRetryState State;
+    return State;
+}
+
+void
+QcSetRetryMemoryPercent(
+    _In_ uint16_t Percent
+    )
+{
+    MsQuic->SetParam(nullptr, QUIC_PARAM_GLOBAL_RETRY_MEMORY_PERCENT, sizeof(Percent), &Percent);
+}
+
+//
+// Stops Listener forcing Retry, if it was. Called with QcRetryState's lock
+// held.
+//
+void
+QcReleaseRetry(
+    _In_ QcRetryState& State,
+    _In_ QcListener& Listener
+    )
+{
+    if (!Listener.RetryForced) {
+        return;
+    }
+    Listener.RetryForced = false;
+    if (--State.Forcing == 0) {
+        QcSetRetryMemoryPercent(State.MemoryPercent);
+    }
+}
+
+//
+// Requires stateless retry (address validation) of every new handshake while
+// verifications are backed up, so spoofed sources can't add to the backlog and
+// the per-address limits apply to real addresses.
+//
+void
+QcUpdateRetryEnforcement(
+    _In_ QcListener& Listener,
+    _In_ uint32_t Pending
+    )
+{
+    const uint32_t ForceThreshold = max(Listener.MaxPendingVerifications / 2, 1u);
+    const uint32_t ReleaseThreshold = Listener.MaxPendingVerifications / 4;
+    auto& State = QcGetRetryState();
+    unique_lock<mutex> Lock(State.Lock);
+    if (!Listener.RetryForced && Pending >= ForceThreshold) {
+        if (State.Forcing++ == 0) {
+            QcSetRetryMemoryPercent(0);
+        }
+        Listener.RetryForced = true;
+        Listener.RetryEnforcements.Add(1);
+    } else if (Pending <= ReleaseThreshold) {
+        QcReleaseRetry(State, Listener);
+    }
+}
+
+void
+QcCompletePeerVerification(
+    _In_ QcConnection& Connection,
+    _In_ QUIC_CERTIFICATE* Certificate
+    )
+{
+    QcListener& Listener = *Connection.Listener;
+    bool Verified = QcVerifyCertificate(Connection.Password, Certificate);
+    QcReleaseCertificate(Certificate);
+    if (Verified) {
+        Listener.VerificationsSucceeded.Add(1);
+    } else {
+        Log() << "Peer password doesn't match!" << endl;
+        Listener.VerificationsFailed.Add(1);
+    }
+    bool Free;
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        if (!Connection.ShutdownComplete) {
+            MsQuic->ConnectionCertificateValidationComplete(
+                *Connection.Connection,
+                Verified,
+                Verified ? QUIC_TLS_ALERT_CODE_SUCCESS : QUIC_TLS_ALERT_CODE_BAD_CERTIFICATE);
+        }
+        Free = --Connection.PendingWork == 0 && Connection.ShutdownComplete;
+    }
+    QcUpdateRetryEnforcement(Listener, --Listener.PendingVerifications);
+    if (Free) {
+        QcFreeConnection(&Connection);
+    }
+}
+
+//
+// PBKDF2 is deliberately expensive, so verification is handed to the
+// listener's verifier threads and the handshake completes asynchronously.
+//
+QUIC_STATUS
+QcBeginPeerVerification(
+    _In_ QcConnection& Connection,
+    _In_ QUIC_CERTIFICATE* Certificate
+    )
+{
+    QcListener& Listener = *Connection.Listener;
+    auto Pending = ++Listener.PendingVerifications;
+    if (Pending > Listener.MaxPendingVerifications) {
+        --Listener.PendingVerifications;
+        Listener.VerificationsRejected.Add(1);
+        return QUIC_STATUS_CONNECTION_REFUSED;
+    }
+    QcUpdateRetryEnforcement(Listener, Pending);
+    auto Reference = QcReferenceCertificate(Certificate);
+    if (Reference == nullptr) {
+        QcUpdateRetryEnforcement(Listener, --Listener.PendingVerifications);
+        return QUIC_STATUS_CONNECTION_REFUSED;
+    }
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        Connection.PendingWork++;
+    }
+    Listener.Verifier->Post([&Connection, Reference]() {
+        QcCompletePeerVerification(Connection, Reference);
+    });
+    return QUIC_STATUS_PENDING;
+}
+
+//
+// Reports a server connection's transfer and frees it, once it has shut down
+// and any relay has finished.
+//
+void
+QcFinishConnection(
+    _In_ QcConnection& Connection
+    )
+{
+    auto Listener = Connection.Listener;
+    QcReleaseConnection(Connection);
+    Listener->TotalDuration.Add((Connection.EndTime - Connection.StartTime).count());
+    Listener->TotalBytesReceived.Add(Connection.BytesReceived);
+    if (Listener->CompletionCallback) {
+        Listener->CompletionCallback({
+            Connection.TransferStatus,
+            Connection.FileName,
+            Connection.BytesReceived,
+            Connection.EndTime - Connection.StartTime});
+    }
+    bool Free;
+    {
+        unique_lock<mutex> Lock(Connection.WorkMutex);
+        Free = Connection.PendingWork == 0;
+    }
+    if (Free) {
+        QcFreeConnection(&Connection);
+    }
+    if (!Listener->Wait) {
+        CxPlatEventSet(Listener->ConnectionShutdownEvent);
+    }
+}
+
+//
+// The transfer header version a negotiated ALPN stands for.
+//
+uint32_t
+QcAlpnHeaderVersion(
+    _In_reads_bytes_(Length) const uint8_t* NegotiatedAlpn,
+    _In_ uint8_t Length
+    )
+{
+    if (Length == sizeof(FileAlpnV2) - 1 && memcmp(NegotiatedAlpn, FileAlpnV2, Length) == 0) {
+        return QcHeaderVersion2;
+    }
+    return QcHeaderVersion1;
+}
+
+QUIC_STATUS
+QcCapabilitiesSendStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* /*Context*/,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    if (Event->Type == QUIC_STREAM_EVENT_START_COMPLETE &&
+        QUIC_FAILED(Event->START_COMPLETE.Status)) {
+        Log() << "Capabilities stream start result: " << hex << Event->START_COMPLETE.Status << dec << endl;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Sends the listener's capabilities to a version 2 client, on a
+// unidirectional stream opened before any other.
+//
+void
+QcSendCapabilities(
+    _In_ QcConnection& Connection
+    )
+{
+    // Deletes itself once shut down, if it starts.
+    auto Stream =
+        new MsQuicStream(
+            *Connection.Connection,
+            QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL,
+            CleanUpAutoDelete,
+            QcCapabilitiesSendStreamCallback);
+    if (!Stream->IsValid() || QUIC_FAILED(Stream->Start(QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+        delete Stream;
+        Stream = nullptr;
+    }
+    if (Stream == nullptr ||
+        QUIC_FAILED(Stream->Send(&Connection.Listener->CapabilitiesBuffer, 1, QUIC_SEND_FLAG_FIN))) {
+        Log() << "Failed to send capabilities!" << endl;
+        Connection.Connection->Shutdown(QUIC_STATUS_INTERNAL_ERROR);
+    }
+}
+
+//
+// The length of the record header gathered by Lane, once it's complete, or
+// else zero.
+//
+uint32_t
+QcPipeLaneHeaderLength(
+    _In_ const QcPipeLane& Lane
+    )
+{
+    uint32_t HeaderLength = 0;
+    for (uint32_t i = 0; i < 2; ++i) {
+        if (Lane.HeaderLength <= HeaderLength) {
+            return 0;
+        }
+        HeaderLength += 1u << (Lane.Header[HeaderLength] >> 6);
+    }
+    return Lane.HeaderLength >= HeaderLength ? HeaderLength : 0;
+}
+
+//
+// Parses up to Length bytes of a striped pipe lane into the window, and sets
+// Consumed to how many were. Returns false, before consuming the rest, once
+// the next record has no room in the window yet; anything invalid fails the
+// pipe. Called with the pipe's lock held.
+//
+bool
+QcParsePipeLane(
+    _In_ QcPipeLane& Lane,
+    _In_reads_bytes_(Length) const uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ uint32_t& Consumed
+    )
+{
+    auto& Pipe = *Lane.Pipe;
+    auto Fail = [&](const char* Reason) {
+        Log() << "Striped pipe failed: " << Reason << endl;
+        Pipe.Failed = true;
+        Pipe.Changed.notify_all();
+        return true;
+    };
+    Consumed = 0;
+    while (!Pipe.Failed) {
+        if (Lane.Chunk != nullptr) {
+            if (Consumed == Length) {
+                break;
+            }
+            uint32_t Copy = (uint32_t)min<uint64_t>(Lane.Remaining, Length - Consumed);
+            memcpy(Lane.Chunk->Data.get() + Lane.Chunk->Length, Buffer + Consumed, Copy);
+            Lane.Chunk->Length += Copy;
+            Lane.Remaining -= Copy;
+            Consumed += Copy;
+            if (Lane.Remaining == 0) {
+                Lane.Chunk->Ready = true;
+                Lane.Chunk = nullptr;
+                Pipe.Changed.notify_all();
+            }
+            continue;
+        }
+        uint32_t HeaderLength = QcPipeLaneHeaderLength(Lane);
+        if (HeaderLength == 0) {
+            // Headers are only a few bytes; gather them a byte at a time.
+            if (Consumed == Length) {
+                break;
+            }
+            Lane.Header[Lane.HeaderLength++] = Buffer[Consumed++];
+            continue;
+        }
+        QUIC_VAR_INT Sequence, ChunkLength;
+        uint16_t Offset = 0;
+        QuicVarIntDecode((uint16_t)HeaderLength, Lane.Header, &Offset, &Sequence);
+        QuicVarIntDecode((uint16_t)HeaderLength, Lane.Header, &Offset, &ChunkLength);
+        if (Sequence < Pipe.Next || Sequence >= Pipe.End) {
+            return Fail("chunk out of range");
+        }
+        if (ChunkLength == 0) {
+            // The end; every chunk before it is somewhere on the way.
+            if (Pipe.End != UINT64_MAX) {
+                return Fail("more than one end");
+            }
+            Pipe.End = Sequence;
+            Lane.HeaderLength = 0;
+            Pipe.Changed.notify_all();
+            continue;
+        }
+        if (ChunkLength > PipeChunkSize) {
+            return Fail("chunk too long");
+        }
+        if (Sequence >= Pipe.Next + PipeWindow) {
+            return false;
+        }
+        auto& Slot = Pipe.Slots[Sequence % PipeWindow];
+        if (Slot.Data != nullptr) {
+            return Fail("duplicate chunk");
+        }
+        Slot.Data = QcBufferPool::Get().Allocate((size_t)ChunkLength);
+        if (Slot.Data == nullptr) {
+            return Fail("buffer pool is out of memory");
+        }
+        Lane.Chunk = &Slot;
+        Lane.Remaining = ChunkLength;
+        Lane.HeaderLength = 0;
+    }
+    return true;
+}
+
+//
+// Parses as much of a lane's held receive as there's room for. Returns true
+// once it's all been parsed, and the receive can be completed. Called with
+// the pipe's lock held.
+//
+bool
+QcParsePipeLaneHeld(
+    _In_ QcPipeLane& Lane
+    )
+{
+    while (Lane.HeldIndex < Lane.Held.size() && !Lane.Pipe->Failed) {
+        auto& Buffer = Lane.Held[Lane.HeldIndex];
+        uint32_t Consumed;
+        bool More =
+            QcParsePipeLane(Lane, Buffer.Buffer + Lane.HeldOffset, Buffer.Length - Lane.HeldOffset, Consumed);
+        Lane.HeldOffset += Consumed;
+        if (!More) {
+            return false;
+        }
+        Lane.HeldIndex++;
+        Lane.HeldOffset = 0;
+    }
+    return true;
+}
+
+QUIC_STATUS
+QcPipeRecvStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Lane = (QcPipeLane*)Context;
+    auto& Pipe = *Lane->Pipe;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE: {
+        unique_lock<mutex> Lock(Pipe.Lock);
+        Pipe.Connection->BytesReceived += Event->RECEIVE.TotalBufferLength;
+        Pipe.Connection->EndTime = steady_clock::now();
+        Lane->Held.assign(Event->RECEIVE.Buffers, Event->RECEIVE.Buffers + Event->RECEIVE.BufferCount);
+        Lane->HeldIndex = Lane->HeldOffset = 0;
+        if (QcParsePipeLaneHeld(*Lane)) {
+            return QUIC_STATUS_SUCCESS;
+        }
+        // Until the writer makes room; the stream's flow control holds the
+        // sender back meanwhile.
+        Lane->HeldLength = Event->RECEIVE.TotalBufferLength;
+        Lane->Pending = true;
+        return QUIC_STATUS_PENDING;
+    }
+    case QUIC_STREAM_EVENT_PEER_SEND_ABORTED: {
+        Log() << "Striped pipe stream aborted by the sender!" << endl;
+        unique_lock<mutex> Lock(Pipe.Lock);
+        Pipe.Failed = true;
+        Pipe.Changed.notify_all();
+        break;
+    }
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Takes a stream of a striped pipe connection as one of its lanes. Lanes
+// are closed with the connection, in QcFreeConnection.
+//
+QUIC_STATUS
+QcAcceptPipeLane(
+    _In_ QcConnection& Connection,
+    _In_ HQUIC Stream
+    )
+{
+    auto& Pipe = *Connection.Pipe;
+    auto Lane = make_unique<QcPipeLane>();
+    Lane->Pipe = &Pipe;
+    Lane->Held.reserve(PipeReceiveBuffers);
+    Lane->Stream = make_unique<MsQuicStream>(Stream, CleanUpManual, QcPipeRecvStreamCallback, Lane.get());
+    unique_lock<mutex> Lock(Pipe.Lock);
+    Pipe.Lanes.push_back(std::move(Lane));
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Writes a striped pipe's chunks to Out in order, until its end, resuming
+// lanes held for room in the window as it moves. Returns false if the pipe
+// failed or closed before its end, or Out failed.
+//
+bool
+QcWritePipe(
+    _In_ QcPipeReassembly& Pipe,
+    _In_ QcSink& Out
+    )
+{
+    vector<pair<MsQuicStream*, uint64_t>> Completions;
+    unique_lock<mutex> Lock(Pipe.Lock);
+    while (true) {
+        auto Writable = [&]{
+            return Pipe.Slots[Pipe.Next % PipeWindow].Ready || Pipe.Next == Pipe.End || Pipe.Failed || Pipe.Closed;
+        };
+        if (!Writable()) {
+            // Don't leave what's been written sitting in Out while waiting.
+            Lock.unlock();
+            Out.Flush();
+            Lock.lock();
+            Pipe.Changed.wait(Lock, Writable);
+        }
+        auto& Slot = Pipe.Slots[Pipe.Next % PipeWindow];
+        if (Pipe.Failed || !Slot.Ready) {
+            return Pipe.Next == Pipe.End && !Pipe.Failed;
+        }
+        QcBuffer Data = std::move(Slot.Data);
+        uint32_t Length = Slot.Length;
+        Slot.Length = 0;
+        Slot.Ready = false;
+        Pipe.Next++;
+        // The window moved; lanes held for it may go on.
+        for (auto& Lane : Pipe.Lanes) {
+            if (Lane->Pending && QcParsePipeLaneHeld(*Lane)) {
+                Lane->Pending = false;
+                Completions.emplace_back(Lane->Stream.get(), Lane->HeldLength);
+            }
+        }
+        Lock.unlock();
+        for (auto& [Stream, Completed] : Completions) {
+            Stream->ReceiveComplete(Completed);
+        }
+        Completions.clear();
+        bool Written = Out.Write(Data.get(), Length);
+        Data.reset();
+        Lock.lock();
+        if (!Written) {
+            Log() << "Failed to write the striped pipe out!" << endl;
+            return false;
+        }
+    }
+}
+
+QUIC_STATUS
+QcServerConnectionCallback(
+    _In_ MsQuicConnection* /*Connection*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_CONNECTION_EVENT* Event
+    )
+{
+    auto ConnContext = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_CONNECTION_EVENT_CONNECTED:
+        Log() << "Connected!" << endl;
+        if (!ConnContext->Listener->Wait) {
+            MsQuic->ListenerStop(*ConnContext->Listener->Listener);
+        }
+        ConnContext->HeaderVersion =
+            QcAlpnHeaderVersion(Event->CONNECTED.NegotiatedAlpn, Event->CONNECTED.NegotiatedAlpnLength);
+        if (ConnContext->HeaderVersion >= QcHeaderVersion2) {
+            QcSendCapabilities(*ConnContext);
+        }
+        if (ConnContext->Listener->Datagram) {
+            {
+                unique_lock<mutex> Lock(ConnContext->WorkMutex);
+                ConnContext->PendingWork++;
+            }
+            ConnContext->StartTime = steady_clock::now();
+            unique_lock<mutex> Lock(ConnContext->Listener->ConnectionListMutex);
+            ConnContext->Listener->DatagramConnections.push_back(ConnContext);
+        } else if (ConnContext->Listener->StripedPipe) {
+            ConnContext->Pipe = make_unique<QcPipeReassembly>();
+            ConnContext->Pipe->Connection = ConnContext;
+            {
+                unique_lock<mutex> Lock(ConnContext->WorkMutex);
+                ConnContext->PendingWork++;
+            }
+            ConnContext->StartTime = steady_clock::now();
+            unique_lock<mutex> Lock(ConnContext->Listener->ConnectionListMutex);
+            ConnContext->Listener->PipeConnections.push_back(ConnContext);
+        }
+        CxPlatEventSet(ConnContext->Listener->ConnectionReceivedEvent);
+        break;
+    case QUIC_CONNECTION_EVENT_DATAGRAM_RECEIVED: {
+        auto Buffer = Event->DATAGRAM_RECEIVED.Buffer;
+        unique_lock<mutex> Lock(ConnContext->RecvDataMutex);
+        if (ConnContext->Datagrams.size() >= MaxQueuedDatagrams) {
+            // Output is falling behind; late data is worth less than new.
+            ConnContext->DatagramsDropped++;
+            break;
+        }
+        ConnContext->Datagrams.emplace_back(Buffer->Buffer, Buffer->Buffer + Buffer->Length);
+        ConnContext->BytesReceived += Buffer->Length;
+        ConnContext->EndTime = steady_clock::now();
+        ConnContext->RecvDataCV.notify_one();
+        break;
+    }
+    case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE: {
+        if (ConnContext->RelayConnectionStorage.has_value() && !ConnContext->RelayFinSent) {
+            // The sender went away before the end; the rest may still be
+            // going onward otherwise.
+            ConnContext->RelayConnectionStorage->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+        }
+        if (ConnContext->Stream == nullptr) {
+            unique_lock<mutex> Lock(ConnContext->RecvDataMutex);
+            ConnContext->RecvData.push_back({0, nullptr});
+            ConnContext->RecvDataCV.notify_one();
+        }
+        if (ConnContext->Pipe != nullptr) {
+            unique_lock<mutex> Lock(ConnContext->Pipe->Lock);
+            ConnContext->Pipe->Closed = true;
+            ConnContext->Pipe->Changed.notify_all();
+        }
+        bool Finished;
+        {
+            unique_lock<mutex> Lock(ConnContext->WorkMutex);
+            ConnContext->ShutdownComplete = true;
+            Finished = !ConnContext->RelayActive && !ConnContext->PackedFinishing && !ConnContext->DedupWriting;
+        }
+        if (Finished) {
+            QcFinishConnection(*ConnContext);
+        }
+        break;
+    }
+    case QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED: {
+        auto Listener = ConnContext->Listener;
+        if (Listener->Serve) {
+            return QcAcceptServeRequest(*ConnContext, Event->PEER_STREAM_STARTED.Stream);
+        }
+        if (Listener->Tunnel != nullptr) {
+            return Listener->Tunnel->AcceptStream(Event->PEER_STREAM_STARTED.Stream);
+        }
+        if (Listener->StripedPipe) {
+            return QcAcceptPipeLane(*ConnContext, Event->PEER_STREAM_STARTED.Stream);
+        }
+        bool Direct = Listener->DirectReceive && !Listener->DestinationPath.empty();
+        ConnContext->HeaderParser.Reset(ConnContext->HeaderVersion);
+        ConnContext->StreamStorage.emplace(
+            Event->PEER_STREAM_STARTED.Stream,
+            CleanUpManual,
+            Listener->Relay ? QcRelayRecvStreamCallback :
+                Listener->Echo ? QcEchoStreamCallback :
+                Listener->DestinationPath.empty() ? QcStdInStdOutStreamCallback :
+                Direct ? QcDirectRecvStreamCallback : QcFileRecvStreamCallback,
+            Context);
+        if (Listener->Relay && !QcStartRelay(*ConnContext)) {
+            ConnContext->StreamStorage->Shutdown((QUIC_UINT62)QUIC_STATUS_CONNECTION_REFUSED);
+        }
+        if (Direct) {
+            // Providing buffers before returning puts the stream in app-owned mode.
+            QUIC_BUFFER Header = {MaxHeaderLength, ConnContext->DirectHeader};
+            QUIC_STATUS Status =
+                MsQuic->StreamProvideReceiveBuffers(*ConnContext->StreamStorage, 1, &Header);
+            if (QUIC_FAILED(Status)) {
+                Log() << "Failed to provide receive buffers: " << hex << Status << dec << endl;
+                ConnContext->StreamStorage->Shutdown((QUIC_UINT62)Status);
+            }
+        }
+        bool Pipe = !Listener->Relay && !Listener->Echo && Listener->DestinationPath.empty();
+        if (Pipe) {
+            unique_lock<mutex> Lock(ConnContext->WorkMutex);
+            ConnContext->PendingWork++;
+        }
+        ConnContext->StartTime = steady_clock::now();
+        unique_lock<mutex> Lock(ConnContext->Listener->ConnectionListMutex);
+        ConnContext->Stream = &*ConnContext->StreamStorage;
+        if (!ConnContext->Admitted) {
+            // Hold the data in flow control until a slot frees up.
+            ConnContext->Stream->ReceiveSetEnabled(false);
+        }
+        if (Pipe) {
+            Listener->PipeConnections.push_back(ConnContext);
+            CxPlatEventSet(Listener->ConnectionReceivedEvent);
+        }
+        break;
+    }
+    case QUIC_CONNECTION_EVENT_PEER_CERTIFICATE_RECEIVED:
+        return QcBeginPeerVerification(*ConnContext, Event->PEER_CERTIFICATE_RECEIVED.Certificate);
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Collects the signatures a server sends in response to a delta transfer, or
+// the bitmap of chunks it needs for a deduplicated one.
+//
+QUIC_STATUS
+QcSignatureRecvStreamCallback(
+    _In_ MsQuicStream* Stream,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Connection = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE:
+        if (Connection->SignaturesTooLong) {
+            break;
+        }
+        if (Connection->SignatureData.size() + Event->RECEIVE.TotalBufferLength > Connection->MaxSignatureData) {
+            Connection->SignaturesTooLong = true;
+            Connection->SignatureData.clear();
+            Connection->SignatureData.shrink_to_fit();
+            Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_BUFFER_TOO_SMALL, QUIC_STREAM_SHUTDOWN_FLAG_ABORT_RECEIVE);
+            CxPlatEventSet(Connection->SignaturesReadyEvent);
+            break;
+        }
+        for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; ++i) {
+            Connection->SignatureData.insert(
+                Connection->SignatureData.end(),
+                Event->RECEIVE.Buffers[i].Buffer,
+                Event->RECEIVE.Buffers[i].Buffer + Event->RECEIVE.Buffers[i].Length);
+        }
+        if (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) {
+            Connection->SignaturesComplete = true;
+            CxPlatEventSet(Connection->SignaturesReadyEvent);
+        }
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        CxPlatEventSet(Connection->SignaturesReadyEvent);
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Collects the capabilities a version 2 server sends as a client connects.
+//
+QUIC_STATUS
+QcCapabilitiesRecvStreamCallback(
+    _In_ MsQuicStream* Stream,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Connection = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE:
+        for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; ++i) {
+            Connection->CapabilitiesData.insert(
+                Connection->CapabilitiesData.end(),
+                Event->RECEIVE.Buffers[i].Buffer,
+                Event->RECEIVE.Buffers[i].Buffer + Event->RECEIVE.Buffers[i].Length);
+        }
+        if (Connection->CapabilitiesData.size() > QcMaxCapabilitiesLength) {
+            Log() << "Server capabilities are too long!" << endl;
+            Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INVALID_PARAMETER);
+            break;
+        }
+        if (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) {
+            Connection->CapabilitiesReceived =
+                QcDecodeCapabilities(
+                    Connection->CapabilitiesData.data(),
+                    (uint32_t)Connection->CapabilitiesData.size(),
+                    Connection->PeerCapabilities);
+            if (!Connection->CapabilitiesReceived) {
+                Log() << "Server capabilities are malformed!" << endl;
+            }
+            CxPlatEventSet(Connection->CapabilitiesReadyEvent);
+        }
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        CxPlatEventSet(Connection->CapabilitiesReadyEvent);
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+QUIC_STATUS
+QcClientConnectionCallback(
+    _In_ MsQuicConnection* /*Connection*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_CONNECTION_EVENT* Event
+    )
+{
+    auto ConnContext = (QcConnection*)Context;
+    switch (Event->Type) {
+    case QUIC_CONNECTION_EVENT_CONNECTED:
+        ConnContext->ConnectedTime = steady_clock::now();
+        Log() << "Connected!" << endl;
+        ConnContext->HeaderVersion =
+            QcAlpnHeaderVersion(Event->CONNECTED.NegotiatedAlpn, Event->CONNECTED.NegotiatedAlpnLength);
+        if (ConnContext->FileSend && ConnContext->HeaderVersion == QcHeaderVersion1) {
+            CxPlatEventSet(ConnContext->CapabilitiesReadyEvent);
+        }
+        break;
+    case QUIC_CONNECTION_EVENT_SHUTDOWN_INITIATED_BY_TRANSPORT:
+        ConnContext->ShutdownStatus = Event->SHUTDOWN_INITIATED_BY_TRANSPORT.Status;
+        break;
+    case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
+        if (ConnContext->Delta || ConnContext->Dedup) {
+            CxPlatEventSet(ConnContext->SignaturesReadyEvent);
+        }
+        if (ConnContext->FileSend) {
+            CxPlatEventSet(ConnContext->CapabilitiesReadyEvent);
+        }
+        if (ConnContext->DatagramSender != nullptr) {
+            unique_lock<mutex> Lock(ConnContext->DatagramSender->Lock);
+            ConnContext->DatagramSender->Closed = true;
+            ConnContext->DatagramSender->Changed.notify_all();
+        }
+        // Connections which never connect report no streams.
+        CxPlatEventSet(ConnContext->StreamsReadyEvent);
+        CxPlatEventSet(ConnContext->ConnectionShutdownEvent);
+        break;
+    case QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED:
+        if (ConnContext->FileSend && ConnContext->HeaderVersion >= QcHeaderVersion2 &&
+            !ConnContext->CapabilitiesStreamStarted) {
+            // Version 2 servers open this before any other.
+            ConnContext->CapabilitiesStreamStarted = true;
+            new MsQuicStream(
+                Event->PEER_STREAM_STARTED.Stream,
+                CleanUpAutoDelete,
+                QcCapabilitiesRecvStreamCallback,
+                Context);
+            break;
+        }
+        if (!ConnContext->Delta && !ConnContext->Dedup) {
+            return QUIC_STATUS_NOT_SUPPORTED;
+        }
+        new MsQuicStream(
+            Event->PEER_STREAM_STARTED.Stream,
+            CleanUpAutoDelete,
+            QcSignatureRecvStreamCallback,
+            Context);
+        break;
+    case QUIC_CONNECTION_EVENT_DATAGRAM_STATE_CHANGED:
+        if (ConnContext->DatagramSender != nullptr) {
+            auto Sender = ConnContext->DatagramSender;
+            {
+                unique_lock<mutex> Lock(Sender->Lock);
+                Sender->SendEnabled = Event->DATAGRAM_STATE_CHANGED.SendEnabled;
+                Sender->MaxSendLength = Event->DATAGRAM_STATE_CHANGED.MaxSendLength;
+                Sender->Changed.notify_all();
+            }
+            CxPlatEventSet(ConnContext->StreamsReadyEvent);
+        }
+        break;
+    case QUIC_CONNECTION_EVENT_DATAGRAM_SEND_STATE_CHANGED: {
+        auto State = Event->DATAGRAM_SEND_STATE_CHANGED.State;
+        if (!QUIC_DATAGRAM_SEND_STATE_IS_FINAL(State)) {
+            break;
+        }
+        auto Send = (QcDatagramSend*)Event->DATAGRAM_SEND_STATE_CHANGED.ClientContext;
+        {
+            unique_lock<mutex> Lock(Send->Sender->Lock);
+            if (State == QUIC_DATAGRAM_SEND_LOST_DISCARDED) {
+                Send->Sender->Statistics.Lost++;
+            } else if (State == QUIC_DATAGRAM_SEND_CANCELED) {
+                Send->Sender->Statistics.Dropped++;
+            } else {
+                Send->Sender->Statistics.Acknowledged++;
+            }
+            Send->Sender->Outstanding--;
+            Send->Sender->Changed.notify_all();
+        }
+        delete Send;
+        break;
+    }
+    case QUIC_CONNECTION_EVENT_STREAMS_AVAILABLE:
+        ConnContext->UnidiStreams = Event->STREAMS_AVAILABLE.UnidirectionalCount;
+        ConnContext->BiDiStreams = Event->STREAMS_AVAILABLE.BidirectionalCount;
+        CxPlatEventSet(ConnContext->StreamsReadyEvent);
+        break;
+    case QUIC_CONNECTION_EVENT_PEER_CERTIFICATE_RECEIVED:
+        if (!QcVerifyCertificate(
+            ConnContext->Password,
+            Event->PEER_CERTIFICATE_RECEIVED.Certificate)) {
+            Log() << "Peer password doesn't match!" << endl;
+            return QUIC_STATUS_CONNECTION_REFUSED;
+        }
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+_IRQL_requires_max_(PASSIVE_LEVEL)
+_Function_class_(QUIC_LISTENER_CALLBACK)
+QUIC_STATUS
+QcListenerCallback(
+    _In_ HQUIC /*Listener*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_LISTENER_EVENT* Event
+    )
+{
+    QcListener* ListenerContext = (QcListener*)Context;
+    if (Event->Type == QUIC_LISTENER_EVENT_NEW_CONNECTION) {
+        if (ListenerContext->HandshakeLimiter != nullptr &&
+            !ListenerContext->HandshakeLimiter->Allow(Event->NEW_CONNECTION.Info->RemoteAddress)) {
+            ListenerContext->HandshakesRateLimited.Add(1);
+            return QUIC_STATUS_CONNECTION_REFUSED;
+        }
+        QcConnection* NewConn = QcAllocateConnection(*ListenerContext);
+        if (NewConn == nullptr) {
+            Log() << "Failed to allocate connection context!" << endl;
+            ListenerContext->ConnectionsRefused.Add(1);
+            return QUIC_STATUS_CONNECTION_REFUSED;
+        }
+        {
+            unique_lock<mutex> Lock(ListenerContext->ConnectionListMutex);
+            if (ListenerContext->DestinationPath.empty() && !ListenerContext->Relay &&
+                !ListenerContext->Serve && !ListenerContext->Echo &&
+                ListenerContext->Tunnel == nullptr &&
+                ListenerContext->Connections.size() == 1) {
+                // In stdin/stdout mode, and a connection is already active.
+                // Refuse connections until the current one completes.
+                Lock.unlock();
+                ListenerContext->ConnectionsRefused.Add(1);
+                QcFreeConnection(NewConn);
+                return QUIC_STATUS_CONNECTION_REFUSED;
+            }
+            if (ListenerContext->ReceiveMemoryBudget != 0 &&
+                ListenerContext->ReservedReceiveMemory + ListenerContext->ReceiveWindow > ListenerContext->ReceiveMemoryBudget) {
+                Lock.unlock();
+                ListenerContext->ConnectionsRefused.Add(1);
+                QcFreeConnection(NewConn);
+                return QUIC_STATUS_CONNECTION_REFUSED;
+            }
+            if (ListenerContext->MaxConnections == 0 ||
+                ListenerContext->ActiveConnections < ListenerContext->MaxConnections) {
+                NewConn->Admitted = true;
+                ListenerContext->ActiveConnections++;
+            } else if (ListenerContext->AdmissionQueue.size() < ListenerContext->MaxQueuedConnections) {
+                NewConn->Admitted = false;
+                NewConn->QueuePosition =
+                    ListenerContext->AdmissionQueue.insert(ListenerContext->AdmissionQueue.end(), NewConn);
+                ListenerContext->ConnectionsQueued.Add(1);
+            } else {
+                Lock.unlock();
+                ListenerContext->ConnectionsRefused.Add(1);
+                QcFreeConnection(NewConn);
+                return QUIC_STATUS_CONNECTION_REFUSED;
+            }
+            ListenerContext->ReservedReceiveMemory += ListenerContext->ReceiveWindow;
+            NewConn->ConnectionIndex = ListenerContext->Connections.size();
+            ListenerContext->Connections.push_back(NewConn);
+        }
+        NewConn->ConnectionStorage.emplace(
+            Event->NEW_CONNECTION.Connection,
+            CleanUpManual,
+            QcServerConnectionCallback,
+            NewConn);
+        NewConn->Connection = &*NewConn->ConnectionStorage;
+        QUIC_STATUS Status = NewConn->Connection->SetConfiguration(*ListenerContext->Config);
+        if (QUIC_FAILED(Status)) {
+            Log() << "Failed to set configuration on connection: " << hex << Status << endl;
+            // MsQuic closes rejected connections itself.
+            NewConn->Connection->Handle = nullptr;
+            QcReleaseConnection(*NewConn);
+            QcFreeConnection(NewConn);
+            return QUIC_STATUS_CONNECTION_REFUSED;
+        }
+        ListenerContext->ConnectionsAccepted.Add(1);
+        return QUIC_STATUS_SUCCESS;
+    } else if (Event->Type == QUIC_LISTENER_EVENT_STOP_COMPLETE) {
+        return QUIC_STATUS_SUCCESS;
+    } else {
+        Log() << "Unhandled Listener Event: " << hex << Event->Type << endl;
+        return QUIC_STATUS_SUCCESS;
+    }
+}
+
+QUIC_STATUS
+QcInitialize()
+{
+    static MsQuicApi Api;
+    QUIC_STATUS Status;
+    if (QUIC_FAILED(Status = Api.GetInitStatus())) {
+        Log() << "Failed to initialize MsQuic: 0x" << hex << Status << endl;
+        return Status;
+    }
+    MsQuic = &Api;
+    return QUIC_STATUS_SUCCESS;
+}
+
+QcSession::QcSession(
+    _In_z_ const char* AppName
+    )
+{
+    if (QUIC_FAILED(InitStatus = QcInitialize())) {
+        return;
+    }
+    Registration = make_unique<MsQuicRegistration>(AppName, QUIC_EXECUTION_PROFILE_TYPE_MAX_THROUGHPUT);
+    if (!Registration->IsValid()) {
+        Log() << "Registration failed to open with " << hex << Registration->GetInitStatus() << endl;
+        InitStatus = Registration->GetInitStatus();
+    }
+}
+
+//
+// Trades throughput for round trip time. Acknowledging within
+// LowLatencyAckDelayMs lets the peer detect loss and grow its window within
+// a round trip, and without pacing a small write isn't held behind the last.
+//
+void
+QcSetLowLatency(
+    _Inout_ MsQuicSettings& Settings
+    )
+{
+    Settings.MaxAckDelayMs = LowLatencyAckDelayMs;
+    Settings.IsSet.MaxAckDelayMs = TRUE;
+    Settings.SetPacingEnabled(false);
+}
+
+QcClient::QcClient(
+    _In_ QcSession& ClientSession,
+    _In_ const QcClientOptions& ClientOptions
+    ) :
+    Session(ClientSession),
+    Options(ClientOptions),
+    InitStatus(QUIC_STATUS_SUCCESS)
+{
+    uint32_t Pkcs12Length = 0;
+    MsQuicCredentialConfig Creds;
+    QUIC_CERTIFICATE_PKCS12 Pkcs12Info{};
+    MsQuicSettings Settings;
+    Settings.SetDisconnectTimeoutMs(6000);
+    Scheduler = make_unique<QcTransferScheduler>(Options.ShortestFirst, Options.RateLimit, ScheduleWindow);
+
+    if (!Session.IsValid()) {
+        InitStatus = Session.GetInitStatus();
+        return;
+    }
+
+    Creds.Flags = QUIC_CREDENTIAL_FLAG_CLIENT;
+    if (!Options.Password.empty()) {
+        Creds.Flags |=
+            QUIC_CREDENTIAL_FLAG_INDICATE_CERTIFICATE_RECEIVED
+            | QUIC_CREDENTIAL_FLAG_DEFER_CERTIFICATE_VALIDATION;
+        if (!QcGenerateAuthCertificate(Options.Password, Pkcs12, Pkcs12Length)) {
+            Log() << "Failed to generate auth certificate" << endl;
+            InitStatus = QUIC_STATUS_INTERNAL_ERROR;
+            return;
+        }
+        Pkcs12Info.Asn1Blob = Pkcs12.get();
+        Pkcs12Info.Asn1BlobLength = Pkcs12Length;
+        Creds.CertificatePkcs12 = &Pkcs12Info;
+        Creds.Type = QUIC_CREDENTIAL_TYPE_CERTIFICATE_PKCS12;
+    } else {
+        Creds.Type = QUIC_CREDENTIAL_TYPE_NONE;
+        Creds.Flags |= QUIC_CREDENTIAL_FLAG_NO_CERTIFICATE_VALIDATION;
+    }
+    MsQuicSettings FileSettings = Settings;
+    // Version 2 servers send their capabilities on a stream of their own,
+    // and delta signatures come back on another.
+    FileSettings.SetPeerUnidiStreamCount(Options.Delta || Options.Dedup ? 2 : 1);
+    FileConfig =
+        make_unique<MsQuicConfiguration>(
+            Session.GetRegistration(),
+            Options.HeaderVersion == QcHeaderVersion1 ? Alpn : FileAlpn,
+            FileSettings,
+            Creds);
+    if (!FileConfig->IsValid()) {
+        Log() << "Configuration failed to init with: " << hex << FileConfig->GetInitStatus() << endl;
+        InitStatus = FileConfig->GetInitStatus();
+        return;
+    }
+    ServeConfig = make_unique<MsQuicConfiguration>(Session.GetRegistration(), ServeAlpn, Settings, Creds);
+    if (!ServeConfig->IsValid()) {
+        Log() << "Configuration failed to init with: " << hex << ServeConfig->GetInitStatus() << endl;
+        InitStatus = ServeConfig->GetInitStatus();
+        return;
+    }
+    // For stdin/stdout and tunnels, set a keepalive.
+    Settings.SetKeepAlive(20000);
+    if (Options.LowLatency) {
+        QcSetLowLatency(Settings);
+    }
+    MsQuicSettings DatagramSettings = Settings;
+    DatagramSettings.SetDatagramReceiveEnabled(true);
+    DatagramConfig = make_unique<MsQuicConfiguration>(Session.GetRegistration(), DatagramAlpn, DatagramSettings, Creds);
+    if (!DatagramConfig->IsValid()) {
+        Log() << "Configuration failed to init with: " << hex << DatagramConfig->GetInitStatus() << endl;
+        InitStatus = DatagramConfig->GetInitStatus();
+        return;
+    }
+    TunnelConfig = make_unique<MsQuicConfiguration>(Session.GetRegistration(), TunnelAlpn, Settings, Creds);
+    if (!TunnelConfig->IsValid()) {
+        Log() << "Configuration failed to init with: " << hex << TunnelConfig->GetInitStatus() << endl;
+        InitStatus = TunnelConfig->GetInitStatus();
+        return;
+    }
+    PipeConfig = make_unique<MsQuicConfiguration>(Session.GetRegistration(), Alpn, Settings, Creds);
+    if (!PipeConfig->IsValid()) {
+        Log() << "Configuration failed to init with: " << hex << PipeConfig->GetInitStatus() << endl;
+        InitStatus = PipeConfig->GetInitStatus();
+        return;
+    }
+    // The striped pipe's send window moves on as chunks complete, which must
+    // mean the receiver has them: buffered sends complete at once, and would
+    // let the sender run past the receiver's window, into its flow control.
+    MsQuicSettings StripedPipeSettings = Settings;
+    StripedPipeSettings.SetSendBufferingEnabled(false);
+    StripedPipeConfig = make_unique<MsQuicConfiguration>(Session.GetRegistration(), StripedPipeAlpn, StripedPipeSettings, Creds);
+    if (!StripedPipeConfig->IsValid()) {
+        Log() << "Configuration failed to init with: " << hex << StripedPipeConfig->GetInitStatus() << endl;
+        InitStatus = StripedPipeConfig->GetInitStatus();
+        return;
+    }
+}
+
+QcClient::~QcClient()
+{
+    WaitForAll();
+}
+
+//
+// Shuts down a client connection which has failed, and waits for it to
+// finish, so nothing MsQuic still holds (the context, buffers of sends it
+// has yet to complete) goes away under it. Returns Status.
+//
+QUIC_STATUS
+QcAbortConnection(
+    _In_ QcConnection& Connection,
+    _In_ QUIC_STATUS Status
+    )
+{
+    Connection.Connection->Shutdown((QUIC_UINT62)Status);
+    CxPlatEventWaitForever(Connection.ConnectionShutdownEvent);
+    return Status;
+}
+
+//
+// Checks the streams a server allows match file mode, once connected.
+//
+QUIC_STATUS
+QcCheckFileModeStreams(
+    _In_ const QcConnection& Connection,
+    _In_ const string& Target
+    )
+{
+    if (Connection.UnidiStreams && Connection.BiDiStreams) {
+        Log() << "Server misconfigured!" << endl;
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+    if (Connection.BiDiStreams) {
+        Log() << "Error: server in stdin/stdout mode; you are in file mode." << endl;
+        return QUIC_STATUS_INVALID_STATE;
+    }
+    if (!Connection.UnidiStreams) {
+        Log() << "Failed to connect to " << Target << "!" << endl;
+        return QUIC_FAILED(Connection.ShutdownStatus) ? Connection.ShutdownStatus : QUIC_STATUS_CONNECTION_REFUSED;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// A transfer's place with the client's scheduler, for as long as it sends.
+//
+struct QcScheduledTransfer {
+    QcTransferScheduler& Scheduler;
+    QcTransferScheduler::Transfer* Entry;
+
+    QcScheduledTransfer(
+        _In_ QcTransferScheduler& TransferScheduler,
+        _In_ const QcTransferSchedule& Schedule,
+        _In_ uint64_t Size
+        ) :
+        Scheduler(TransferScheduler),
+        Entry(TransferScheduler.Register(Schedule, Size))
+    {
+    }
+    ~QcScheduledTransfer() { Scheduler.Unregister(Entry); }
+};
+
+//
+// Sets a stream's priority to its transfer's class, for when transfers share
+// a connection.
+//
+void
+QcSetStreamPriority(
+    _In_ MsQuicStream& Stream,
+    _In_ const QcTransferSchedule& Schedule
+    )
+{
+    uint16_t Priority = QcStreamPriority(Schedule.Priority);
+    MsQuic->SetParam(Stream, QUIC_PARAM_STREAM_PRIORITY, sizeof(Priority), &Priority);
+}
+
+//
+// Waits for the capabilities of a file send connection's server, once it's
+// connected. Version 1 servers have none to send, and keep the defaults,
+// which are what they accept.
+//
+QUIC_STATUS
+QcWaitForCapabilities(
+    _In_ QcConnection& Connection,
+    _In_ const string& Target
+    )
+{
+    CxPlatEventWaitForever(Connection.CapabilitiesReadyEvent);
+    if (Connection.HeaderVersion >= QcHeaderVersion2 && !Connection.CapabilitiesReceived) {
+        Log() << "Failed to receive capabilities from " << Target << "!" << endl;
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// The header of a file send on Connection, in the version it negotiated.
+// Version 2 headers also carry the sender's choices, which so far are never
+// to compress or hash.
+//
+QcTransferHeader
+QcMakeTransferHeader(
+    _In_ const QcConnection& Connection,
+    _In_ const string& FileName,
+    _In_ uint8_t Flags,
+    _In_ uint64_t FileSize
+    )
+{
+    QcTransferHeader Header;
+    Header.Version = Connection.HeaderVersion;
+    Header.Flags = Flags;
+    Header.Options.Encodings = Flags;
+    Header.Options.Compression = QcCompressionNone;
+    Header.Options.Hash = QcHashNone;
+    Header.Name = FileName;
+    Header.Size = FileSize;
+    return Header;
+}
+
+QUIC_STATUS
+QcClient::Send(
+    _In_ QcSource& Source,
+    _In_opt_ const QcCompletionCallback& Callback,
+    _In_opt_ const QcTransferSchedule* Schedule
+    )
+{
+    QUIC_STATUS Status;
+    QcConnection ConnectionContext{};
+    const QcTransferSchedule& TransferSchedule = Schedule != nullptr ? *Schedule : Options.Schedule;
+    uint64_t TotalBytesSent = 0;
+    auto StartTime = steady_clock::now();
+    auto ConnectTime = StartTime;
+    auto FileName = Source.GetName();
+    auto Complete = [&](QUIC_STATUS Result) {
+        if (Callback) {
+            QcTransferResult Transfer{Result, FileName, TotalBytesSent, steady_clock::now() - StartTime};
+            if (ConnectionContext.ConnectedTime != steady_clock::time_point()) {
+                Transfer.HandshakeTime = ConnectionContext.ConnectedTime - ConnectTime;
+            }
+            Callback(Transfer);
+        }
+        return Result;
+    };
+
+    if (!IsValid()) {
+        return Complete(InitStatus);
+    }
+    if (FileName.size() > MaxFileNameLength) {
+        Log() << "File name is too long! Actual: " << FileName.size() << " Maximum: " << MaxFileNameLength << endl;
+        return Complete(QUIC_STATUS_INVALID_PARAMETER);
+    }
+    ConnectionContext.FileSize = Source.GetSize();
+    if (ConnectionContext.FileSize == QcUnknownSize) {
+        Log() << "Source size must be known to send in file mode!" << endl;
+        return Complete(QUIC_STATUS_INVALID_PARAMETER);
+    }
+    if (Options.ReadAhead != 0) {
+        Source.SetReadAhead(Options.ReadAhead);
+    }
+
+    CxPlatEventInitialize(&ConnectionContext.SendCompleteEvent, false, false);
+    CxPlatEventInitialize(&ConnectionContext.ConnectionShutdownEvent, false, false);
+    CxPlatEventInitialize(&ConnectionContext.StreamsReadyEvent, false, false);
+    CxPlatEventInitialize(&ConnectionContext.CapabilitiesReadyEvent, false, false);
+    ConnectionContext.FileSend = true;
+    ConnectionContext.Password = Options.Password;
+    // Sources with framing of their own (packed directories) are sent as is.
+    uint8_t HeaderFlags = Source.GetTransferFlags();
+    ConnectionContext.Delta = Options.Delta && HeaderFlags == 0;
+    if (ConnectionContext.Delta) {
+        CxPlatEventInitialize(&ConnectionContext.SignaturesReadyEvent, false, false);
+        ConnectionContext.MaxSignatureData = MaxSignatureDataLength;
+    }
+    // Deduplicated sends chunk the file before connecting, and read back the
+    // chunks the server asks for.
+    ConnectionContext.Dedup = Options.Dedup && HeaderFlags == 0 && !ConnectionContext.Delta;
+    vector<QcDedupChunk> DedupChunks;
+    vector<uint8_t> Manifest;
+    if (ConnectionContext.Dedup && !Source.Seek(0)) {
+        Log() << "Only files can be deduplicated; sending the whole file." << endl;
+        ConnectionContext.Dedup = false;
+    }
+    if (ConnectionContext.Dedup) {
+        if (!QcChunkSource(Source, DedupChunks) || !Source.Seek(0)) {
+            Log() << "Failed to read from '" << FileName << "'" << endl;
+            return Complete(QUIC_STATUS_INTERNAL_ERROR);
+        }
+        QcEncodeDedupManifest(DedupChunks, Manifest);
+        if (Manifest.size() > QcMaxDedupManifestLength(ConnectionContext.FileSize)) {
+            Log() << "Too many chunks to deduplicate; sending the whole file." << endl;
+            ConnectionContext.Dedup = false;
+            DedupChunks.clear();
+            Manifest.clear();
+        }
+    }
+    if (ConnectionContext.Dedup) {
+        CxPlatEventInitialize(&ConnectionContext.SignaturesReadyEvent, false, false);
+        ConnectionContext.MaxSignatureData = (DedupChunks.size() + 7) / 8;
+    }
+    // Outlives the stream, which releases its grants as sends complete.
+    QcScheduledTransfer Scheduled(*Scheduler, TransferSchedule, ConnectionContext.FileSize);
+    ConnectionContext.Scheduler = &*Scheduler;
+    ConnectionContext.ScheduledTransfer = Scheduled.Entry;
+    MsQuicConnection Client(Session.GetRegistration(), CleanUpManual, QcClientConnectionCallback, &ConnectionContext);
+    ConnectionContext.Connection = &Client;
+    MsQuicStream ClientStream(
+        Client,
+        QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL,
+        CleanUpManual,
+        QcFileSendStreamCallback,
+        &ConnectionContext);
+    if (QUIC_FAILED(ClientStream.Start(QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL | QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+        Log() << "Failed to start stream!" << endl;
+        return Complete(QUIC_STATUS_INTERNAL_ERROR);
+    }
+    QcSetStreamPriority(ClientStream, TransferSchedule);
+    ConnectTime = steady_clock::now();
+    if (QUIC_FAILED(Client.Start(*FileConfig, Options.Target.c_str(), Options.Port))) {
+        Log() << "Failed to start client connection!" << endl;
+        return Complete(QUIC_STATUS_INTERNAL_ERROR);
+    }
+
+    // The server's capabilities come after the handshake, so they're only
+    // waited for when the transfer has something to negotiate: an encoding
+    // of its own (packed directories) or one asked for. Plain sends start as
+    // soon as the connection is up, in the defaults' chunk size.
+    bool Negotiate = HeaderFlags != 0 || ConnectionContext.Delta || ConnectionContext.Dedup || Options.Sparse;
+    CxPlatEventWaitForever(ConnectionContext.StreamsReadyEvent);
+    if (QUIC_FAILED(Status = QcCheckFileModeStreams(ConnectionContext, Options.Target)) ||
+        (Negotiate && QUIC_FAILED(Status = QcWaitForCapabilities(ConnectionContext, Options.Target)))) {
+        return Complete(QcAbortConnection(ConnectionContext, Status));
+    }
+    QcCapabilities Accepted;
+    if (Negotiate) {
+        Accepted = ConnectionContext.PeerCapabilities;
+    }
+    if ((HeaderFlags & ~Accepted.Encodings) != 0) {
+        Log() << "The server doesn't accept directory transfers!" << endl;
+        return Complete(QcAbortConnection(ConnectionContext, QUIC_STATUS_NOT_SUPPORTED));
+    }
+    if (ConnectionContext.Delta && (Accepted.Encodings & QcHeaderFlagDelta) == 0) {
+        Log() << "The server doesn't accept delta transfers; sending the whole file." << endl;
+        ConnectionContext.Delta = false;
+    }
+    if (ConnectionContext.Dedup && (Accepted.Encodings & QcHeaderFlagDedup) == 0) {
+        Log() << "The server has no chunk store; sending the whole file." << endl;
+        ConnectionContext.Dedup = false;
+    }
+
+    // Only send extents when the source can find them.
+    optional<QcSparseSource> SparseSource;
+    uint64_t ExtentStart, ExtentEnd;
+    if (Options.Sparse && HeaderFlags == 0 && !ConnectionContext.Delta && !ConnectionContext.Dedup &&
+        (Accepted.Encodings & QcHeaderFlagSparse) != 0 &&
+        Source.NextDataExtent(0, ExtentStart, ExtentEnd)) {
+        SparseSource.emplace(Source);
+        HeaderFlags = QcHeaderFlagSparse;
+    }
+    if (ConnectionContext.Delta) {
+        HeaderFlags = QcHeaderFlagDelta;
+    } else if (ConnectionContext.Dedup) {
+        HeaderFlags = QcHeaderFlagDedup;
+    }
+    optional<QcDeltaSource> DeltaSource;
+    optional<QcDedupSource> DedupSource;
+    QcSource* Body = SparseSource.has_value() ? &*SparseSource : &Source;
+
+    // Two buffers alternate, so the next is read, and waits its turn with the
+    // scheduler, while the last is still being sent.
+    ConnectionContext.CurrentSendSize = DefaultSendBufferSize;
+    if (Accepted.ChunkSize != 0) {
+        ConnectionContext.CurrentSendSize =
+            (uint32_t)clamp<uint64_t>(Accepted.ChunkSize, QcMinChunkSize, DefaultSendBufferSize);
+    }
+    ConnectionContext.SendBuffer = QcBufferPool::Get().Allocate(2 * ConnectionContext.CurrentSendSize);
+    if (ConnectionContext.SendBuffer == nullptr) {
+        Log() << "Buffer pool is out of memory!" << endl;
+        return Complete(QcAbortConnection(ConnectionContext, QUIC_STATUS_OUT_OF_MEMORY));
+    }
+    ConnectionContext.SendQuicBuffer.Buffer = ConnectionContext.SendBuffer.get();
+    uint8_t* BufferCursor = ConnectionContext.SendQuicBuffer.Buffer;
+
+    ConnectionContext.SendQuicBuffer.Length =
+        QcEncodeTransferHeader(
+            QcMakeTransferHeader(ConnectionContext, FileName, HeaderFlags, ConnectionContext.FileSize),
+            BufferCursor);
+    BufferCursor += ConnectionContext.SendQuicBuffer.Length;
+    uint32_t BufferRemaining = ConnectionContext.CurrentSendSize - ConnectionContext.SendQuicBuffer.Length;
+
+    vector<uint8_t> Preamble;
+    if (ConnectionContext.Dedup) {
+        // The manifest follows the header, and needn't fit in a send buffer.
+        uint8_t ManifestLength[8];
+        Preamble.assign(
+            ConnectionContext.SendQuicBuffer.Buffer,
+            ConnectionContext.SendQuicBuffer.Buffer + ConnectionContext.SendQuicBuffer.Length);
+        Preamble.insert(Preamble.end(), ManifestLength, QuicVarIntEncode(Manifest.size(), ManifestLength));
+        Preamble.insert(Preamble.end(), Manifest.begin(), Manifest.end());
+        ConnectionContext.SendQuicBuffer.Buffer = Preamble.data();
+        ConnectionContext.SendQuicBuffer.Length = (uint32_t)Preamble.size();
+    }
+
+    if (ConnectionContext.Delta || ConnectionContext.Dedup) {
+        // The header goes alone, and the body waits for the server's reply:
+        // signatures, or which chunks it needs.
+        if (QUIC_FAILED(Status = ClientStream.Send(&ConnectionContext.SendQuicBuffer, 1, QUIC_SEND_FLAG_NONE))) {
+            Log() << "StreamSend failed with 0x" << hex << Status << endl;
+            return Complete(QcAbortConnection(ConnectionContext, Status));
+        }
+        CxPlatEventWaitForever(ConnectionContext.SendCompleteEvent);
+        TotalBytesSent += ConnectionContext.SendQuicBuffer.Length;
+        CxPlatEventWaitForever(ConnectionContext.SignaturesReadyEvent);
+        if (ConnectionContext.Delta) {
+            uint32_t BlockSize = 0;
+            vector<QcBlockSignature> Signatures;
+            if (ConnectionContext.SignaturesTooLong) {
+                // Without signatures, everything is sent as literals.
+                Log() << "Too many signatures from the server; sending the whole file." << endl;
+                BlockSize = QcDeltaBlockSize(0);
+            } else if (!ConnectionContext.SignaturesComplete ||
+                !QcDecodeSignatures(ConnectionContext.SignatureData, BlockSize, Signatures)) {
+                Log() << "Failed to receive signatures from the server!" << endl;
+                return Complete(QcAbortConnection(ConnectionContext, QUIC_STATUS_INTERNAL_ERROR));
+            }
+            DeltaSource.emplace(Source, BlockSize, std::move(Signatures));
+            Body = &*DeltaSource;
+        } else {
+            auto& Bitmap = ConnectionContext.SignatureData;
+            if (!ConnectionContext.SignaturesComplete || Bitmap.size() != (DedupChunks.size() + 7) / 8) {
+                Log() << "Failed to receive the chunk bitmap from the server!" << endl;
+                return Complete(QcAbortConnection(ConnectionContext, QUIC_STATUS_INTERNAL_ERROR));
+            }
+            vector<bool> Needed(DedupChunks.size());
+            for (size_t i = 0; i < DedupChunks.size(); ++i) {
+                Needed[i] = (Bitmap[i / 8] & (1u << (i % 8))) != 0;
+            }
+            DedupSource.emplace(Source, DedupChunks, std::move(Needed));
+            Body = &*DedupSource;
+        }
+        ConnectionContext.SignatureData.clear();
+        Preamble.clear();
+        BufferCursor = ConnectionContext.SendBuffer.get();
+        ConnectionContext.SendQuicBuffer.Buffer = BufferCursor;
+        ConnectionContext.SendQuicBuffer.Length = 0;
+        BufferRemaining = ConnectionContext.CurrentSendSize;
+    }
+
+    uint8_t* Buffers[2] = {
+        ConnectionContext.SendBuffer.get(),
+        ConnectionContext.SendBuffer.get() + ConnectionContext.CurrentSendSize};
+    QUIC_BUFFER QuicBuffers[2] = {ConnectionContext.SendQuicBuffer, {0, Buffers[1]}};
+    uint32_t Current = 0;
+    uint32_t SendsStarted = ConnectionContext.SendsCompleted;
+    bool EndOfFile = false;
+    uint64_t BytesSentSnapshot = 0;
+    auto LastUpdate = StartTime;
+    do {
+        auto& SendBuffer = QuicBuffers[Current];
+        uint32_t ReadLength = Scheduler->GetMaxGrant(Scheduled.Entry, BufferRemaining);
+        uint32_t BytesRead = 0;
+        if (!Body->Read(BufferCursor, ReadLength, BytesRead)) {
+            Log() << "Failed to read from '" << FileName << "'" << endl;
+            return Complete(QcAbortConnection(ConnectionContext, QUIC_STATUS_INTERNAL_ERROR));
+        }
+        if (BytesRead < ReadLength) {
+            EndOfFile = true;
+        }
+        SendBuffer.Length += BytesRead;
+        Scheduler->Acquire(Scheduled.Entry, SendBuffer.Length);
+        QUIC_SEND_FLAGS Flags = EndOfFile ? QUIC_SEND_FLAG_FIN : QUIC_SEND_FLAG_NONE;
+        if (QUIC_FAILED(Status = ClientStream.Send(&SendBuffer, 1, Flags, (void*)(uintptr_t)SendBuffer.Length))) {
+            Log() << "StreamSend failed with 0x" << hex << Status << endl;
+            Scheduler->Release(Scheduled.Entry, SendBuffer.Length);
+            Client.Shutdown((QUIC_UINT62)Status);
+            // The other buffer is MsQuic's until its send completes, canceled
+            // if need be.
+            while (ConnectionContext.SendsCompleted < SendsStarted) {
+                CxPlatEventWaitForever(ConnectionContext.SendCompleteEvent);
+            }
+            return Complete(QcAbortConnection(ConnectionContext, Status));
+        }
+        SendsStarted++;
+        TotalBytesSent += SendBuffer.Length;
+        // The other buffer is next; wait for its send to complete.
+        {
+            QC_TRACE(QcTraceSendComplete, QuicBuffers[Current ^ 1].Length);
+            while (ConnectionContext.SendsCompleted + 1 < SendsStarted) {
+                CxPlatEventWaitForever(ConnectionContext.SendCompleteEvent);
+            }
+        }
+        auto Now = steady_clock::now();
+        if (Options.ShowProgress && (EndOfFile || Now - LastUpdate >= UpdateRate)) {
+            PrintProgress(
+                FileName,
+                TotalBytesSent,
+                ConnectionContext.FileSize,
+                Now - StartTime,
+                TotalBytesSent - BytesSentSnapshot,
+                Now - LastUpdate);
+            LastUpdate = Now;
+            BytesSentSnapshot = TotalBytesSent;
+            if (EndOfFile) {
+                Log() << endl;
+            }
+        }
+        Current ^= 1;
+        BufferCursor = Buffers[Current];
+        QuicBuffers[Current].Length = 0;
+        BufferRemaining = ConnectionContext.CurrentSendSize;
+    } while (!ConnectionContext.SendCanceled && !EndOfFile);
+    CxPlatEventWaitForever(ConnectionContext.ConnectionShutdownEvent);
+    if (DeltaSource.has_value() && Options.ShowProgress) {
+        Log() << DeltaSource->MatchedBytes << " bytes matched, "
+            << DeltaSource->LiteralBytes << " bytes sent as literals" << endl;
+    }
+    if (DedupSource.has_value() && Options.ShowProgress) {
+        Log() << DedupSource->DeduplicatedBytes << " bytes deduplicated, "
+            << DedupSource->SentBytes << " bytes sent as new chunks" << endl;
+    }
+    return Complete(ConnectionContext.SendCanceled ? QUIC_STATUS_ABORTED : QUIC_STATUS_SUCCESS);
+}
+
+QUIC_STATUS
+QcClient::Fanout(
+    _In_ QcSource& Source,
+    _In_ const vector<string>& Targets,
+    _In_opt_ const QcCompletionCallback& Callback
+    )
+{
+    QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+    uint64_t TotalBytesRead = 0;
+    auto StartTime = steady_clock::now();
+    auto FileName = Source.GetName();
+    uint64_t FileSize = Source.GetSize();
+    auto Fail = [&](QUIC_STATUS Result) {
+        for (auto& Target : Targets) {
+            if (Callback) {
+                Callback({Result, FileName, 0, steady_clock::now() - StartTime, Target});
+            }
+        }
+        return Result;
+    };
+
+    if (!IsValid()) {
+        return Fail(InitStatus);
+    }
+    if (Targets.empty()) {
+        return Fail(QUIC_STATUS_INVALID_PARAMETER);
+    }
+    if (FileName.size() > MaxFileNameLength) {
+        Log() << "File name is too long! Actual: " << FileName.size() << " Maximum: " << MaxFileNameLength << endl;
+        return Fail(QUIC_STATUS_INVALID_PARAMETER);
+    }
+    if (FileSize == QcUnknownSize) {
+        Log() << "Source size must be known to send in file mode!" << endl;
+        return Fail(QUIC_STATUS_INVALID_PARAMETER);
+    }
+    if (Options.Delta || Options.Dedup) {
+        // Each receiver has its own basis or chunks, so there's no one body
+        // to share.
+        Log() << "Delta and deduplicated transfers can't fan out; sending the whole file." << endl;
+    }
+    if (Options.ReadAhead != 0) {
+        Source.SetReadAhead(Options.ReadAhead);
+    }
+
+    QcFanout Fanout;
+    vector<unique_ptr<QcFanoutTarget>> Connections;
+    for (auto& Address : Targets) {
+        auto Target = make_unique<QcFanoutTarget>();
+        Target->Fanout = &Fanout;
+        Target->Address = Address;
+        Target->Context.Password = Options.Password;
+        Target->Context.FileSize = FileSize;
+        Target->Context.TransferStatus = QUIC_STATUS_SUCCESS;
+        CxPlatEventInitialize(&Target->Context.ConnectionShutdownEvent, false, false);
+        CxPlatEventInitialize(&Target->Context.StreamsReadyEvent, false, false);
+        CxPlatEventInitialize(&Target->Context.CapabilitiesReadyEvent, false, false);
+        Target->Context.FileSend = true;
+        Target->Connection =
+            make_unique<MsQuicConnection>(
+                Session.GetRegistration(),
+                CleanUpManual,
+                QcClientConnectionCallback,
+                &Target->Context);
+        Target->Context.Connection = &*Target->Connection;
+        Target->Stream =
+            make_unique<MsQuicStream>(
+                *Target->Connection,
+                QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL,
+                CleanUpManual,
+                QcFanoutSendStreamCallback,
+                Target.get());
+        if (QUIC_FAILED(Target->Stream->Start(QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL | QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+            Log() << "Failed to start stream to " << Address << "!" << endl;
+            Target->Failed = true;
+            Target->Context.TransferStatus = QUIC_STATUS_INTERNAL_ERROR;
+        } else if (QUIC_FAILED(Target->Connection->Start(*FileConfig, Address.c_str(), Options.Port))) {
+            Log() << "Failed to start client connection to " << Address << "!" << endl;
+            Target->Failed = true;
+            Target->Context.TransferStatus = QUIC_STATUS_INTERNAL_ERROR;
+        } else {
+            Target->Started = true;
+        }
+        Connections.push_back(std::move(Target));
+    }
+    // Handshakes run in parallel; wait for all of them.
+    for (auto& Target : Connections) {
+        if (!Target->Started) {
+            continue;
+        }
+        CxPlatEventWaitForever(Target->Context.StreamsReadyEvent);
+        QUIC_STATUS Result = QcCheckFileModeStreams(Target->Context, Target->Address);
+        if (QUIC_SUCCEEDED(Result)) {
+            Result = QcWaitForCapabilities(Target->Context, Target->Address);
+        }
+        if (QUIC_SUCCEEDED(Result) && (Source.GetTransferFlags() & ~Target->Context.PeerCapabilities.Encodings) != 0) {
+            Log() << Target->Address << " doesn't accept directory transfers!" << endl;
+            Result = QUIC_STATUS_NOT_SUPPORTED;
+        }
+        if (QUIC_FAILED(Result)) {
+            unique_lock<mutex> Lock(Fanout.Lock);
+            Target->Failed = true;
+            Target->Context.TransferStatus = Result;
+            Target->Connection->Shutdown((QUIC_UINT62)Result);
+        }
+    }
+
+    // The body is shared, so it's only sparse if every target accepts that.
+    QcCapabilities Accepted;
+    for (auto& Target : Connections) {
+        if (Target->Started && !Target->Failed) {
+            Accepted = QcIntersectCapabilities(Accepted, Target->Context.PeerCapabilities);
+        }
+    }
+    uint8_t HeaderFlags = Source.GetTransferFlags();
+    optional<QcSparseSource> SparseSource;
+    uint64_t ExtentStart, ExtentEnd;
+    if (Options.Sparse && HeaderFlags == 0 && (Accepted.Encodings & QcHeaderFlagSparse) != 0 &&
+        Source.NextDataExtent(0, ExtentStart, ExtentEnd)) {
+        SparseSource.emplace(Source);
+        HeaderFlags = QcHeaderFlagSparse;
+    }
+    QcSource* Body = SparseSource.has_value() ? &*SparseSource : &Source;
+    for (auto& Target : Connections) {
+        if (!Target->Started || Target->Failed) {
+            continue;
+        }
+        Target->HeaderBuffer.Buffer = Target->Header;
+        Target->HeaderBuffer.Length =
+            QcEncodeTransferHeader(
+                QcMakeTransferHeader(Target->Context, FileName, HeaderFlags, FileSize),
+                Target->Header);
+        QUIC_STATUS Result = Target->Stream->Send(&Target->HeaderBuffer, 1, QUIC_SEND_FLAG_NONE, nullptr);
+        if (QUIC_FAILED(Result)) {
+            Log() << "StreamSend to " << Target->Address << " failed with 0x" << hex << Result << dec << endl;
+            unique_lock<mutex> Lock(Fanout.Lock);
+            Target->Failed = true;
+            Target->Context.TransferStatus = Result;
+            Target->Connection->Shutdown((QUIC_UINT62)Result);
+        }
+    }
+
+    // The chunks are shared and held by the slowest receiver, so they aren't
+    // counted as in flight; the scheduler only gives the reads their turn
+    // and rate.
+    QcScheduledTransfer Scheduled(*Scheduler, Options.Schedule, FileSize);
+    for (auto& Target : Connections) {
+        if (Target->Started) {
+            QcSetStreamPriority(*Target->Stream, Options.Schedule);
+        }
+    }
+
+    bool EndOfFile = false;
+    uint64_t BytesReadSnapshot = 0;
+    auto LastUpdate = StartTime;
+    while (!EndOfFile) {
+        // The slowest receiver holds chunks longest, and so paces the reader.
+        QcSharedChunk* Chunk;
+        {
+            unique_lock<mutex> Lock(Fanout.Lock);
+            if (Fanout.FreeChunks.empty() && Fanout.Chunks.size() < FanoutWindow) {
+                // Past the buffer pool's cap, make do with the chunks there are.
+                auto Data = QcBufferPool::Get().Allocate(FanoutChunkSize);
+                if (Data != nullptr) {
+                    Fanout.Chunks.push_back(make_unique<QcSharedChunk>());
+                    Fanout.Chunks.back()->Data = std::move(Data);
+                    Fanout.FreeChunks.push_back(&*Fanout.Chunks.back());
+                }
+            }
+            if (Fanout.Chunks.empty()) {
+                Log() << "Buffer pool is out of memory!" << endl;
+                Status = QUIC_STATUS_OUT_OF_MEMORY;
+                break;
+            }
+            Fanout.ChunkReleased.wait(Lock, [&]() { return !Fanout.FreeChunks.empty(); });
+            Chunk = Fanout.FreeChunks.back();
+            Fanout.FreeChunks.pop_back();
+        }
+        uint32_t ReadLength = Scheduler->GetMaxGrant(Scheduled.Entry, FanoutChunkSize);
+        uint32_t BytesRead = 0;
+        if (!Body->Read(Chunk->Data.get(), ReadLength, BytesRead)) {
+            Log() << "Failed to read from '" << FileName << "'" << endl;
+            Status = QUIC_STATUS_INTERNAL_ERROR;
+            unique_lock<mutex> Lock(Fanout.Lock);
+            Fanout.FreeChunks.push_back(Chunk);
+            break;
+        }
+        EndOfFile = BytesRead < ReadLength;
+        Scheduler->Acquire(Scheduled.Entry, BytesRead);
+        Scheduler->Release(Scheduled.Entry, BytesRead);
+        TotalBytesRead += BytesRead;
+        Chunk->Buffer.Buffer = Chunk->Data.get();
+        Chunk->Buffer.Length = BytesRead;
+
+        vector<QcFanoutTarget*> Active;
+        {
+            unique_lock<mutex> Lock(Fanout.Lock);
+            for (auto& Target : Connections) {
+                if (!Target->Failed) {
+                    Active.push_back(&*Target);
+                }
+            }
+        }
+        if (Active.empty()) {
+            Log() << "Every target failed!" << endl;
+            Status = QUIC_STATUS_ABORTED;
+            unique_lock<mutex> Lock(Fanout.Lock);
+            Fanout.FreeChunks.push_back(Chunk);
+            break;
+        }
+        // The reader holds a reference too, so the chunk can't return to
+        // the pool before it's been sent to every target.
+        Chunk->References = (uint32_t)Active.size() + 1;
+        QUIC_SEND_FLAGS Flags = EndOfFile ? QUIC_SEND_FLAG_FIN : QUIC_SEND_FLAG_NONE;
+        for (auto Target : Active) {
+            QUIC_STATUS Result = Target->Stream->Send(&Chunk->Buffer, 1, Flags, Chunk);
+            if (QUIC_FAILED(Result)) {
+                Log() << "StreamSend to " << Target->Address << " failed with 0x" << hex << Result << dec << endl;
+                {
+                    unique_lock<mutex> Lock(Fanout.Lock);
+                    Target->Failed = true;
+                    Target->Context.TransferStatus = Result;
+                }
+                Target->Connection->Shutdown((QUIC_UINT62)Result);
+                QcReleaseChunk(Fanout, Chunk);
+            }
+        }
+        QcReleaseChunk(Fanout, Chunk);
+
+        auto Now = steady_clock::now();
+        if (Options.ShowProgress && (EndOfFile || Now - LastUpdate >= UpdateRate)) {
+            PrintProgress(
+                FileName,
+                TotalBytesRead,
+                FileSize,
+                Now - StartTime,
+                TotalBytesRead - BytesReadSnapshot,
+                Now - LastUpdate);
+            LastUpdate = Now;
+            BytesReadSnapshot = TotalBytesRead;
+            if (EndOfFile) {
+                Log() << endl;
+            }
+        }
+    }
+
+    for (auto& Target : Connections) {
+        if (!Target->Started) {
+            continue;
+        }
+        if (QUIC_FAILED(Status)) {
+            Target->Connection->Shutdown((QUIC_UINT62)Status);
+        }
+        CxPlatEventWaitForever(Target->Context.ConnectionShutdownEvent);
+    }
+    QUIC_STATUS Result = Status;
+    for (auto& Target : Connections) {
+        QUIC_STATUS TargetStatus = Target->Context.TransferStatus;
+        if (QUIC_SUCCEEDED(TargetStatus) && Target->Context.SendCanceled) {
+            TargetStatus = QUIC_STATUS_ABORTED;
+        } else if (QUIC_SUCCEEDED(TargetStatus)) {
+            TargetStatus = Status;
+        }
+        if (QUIC_FAILED(TargetStatus)) {
+            Log() << "Transfer to " << Target->Address << " failed with 0x" << hex << TargetStatus << dec << endl;
+            if (QUIC_SUCCEEDED(Result)) {
+                Result = TargetStatus;
+            }
+        }
+        if (Callback) {
+            Callback({
+                TargetStatus,
+                FileName,
+                QUIC_SUCCEEDED(TargetStatus) ? TotalBytesRead : 0,
+                steady_clock::now() - StartTime,
+                Target->Address});
+        }
+    }
+    return Result;
+}
+
+QUIC_STATUS
+QcClient::Stripe(
+    _In_ QcSource& Source,
+    _In_ const vector<QcNetworkPath>& Paths,
+    _In_opt_ const QcCompletionCallback& Callback
+    )
+{
+    QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+    uint64_t TotalBytesSent = 0;
+    auto StartTime = steady_clock::now();
+    auto FileName = Source.GetName();
+    uint64_t FileSize = Source.GetSize();
+    QcStripe Stripe;
+    vector<unique_ptr<QcStripePath>> Lanes;
+    auto Complete = [&](QUIC_STATUS Result) {
+        if (Callback) {
+            for (auto& Path : Lanes) {
+                Callback({Result, FileName, Path->BytesSent, steady_clock::now() - StartTime, Path->Label});
+            }
+        }
+        return Result;
+    };
+
+    if (!IsValid()) {
+        return Complete(InitStatus);
+    }
+    if (Paths.empty()) {
+        return Complete(QUIC_STATUS_INVALID_PARAMETER);
+    }
+    if (FileName.size() > MaxFileNameLength) {
+        Log() << "File name is too long! Actual: " << FileName.size() << " Maximum: " << MaxFileNameLength << endl;
+        return Complete(QUIC_STATUS_INVALID_PARAMETER);
+    }
+    if (FileSize == QcUnknownSize || Source.GetTransferFlags() != 0 || !Source.Seek(0)) {
+        // Resent chunks are read again, from wherever they are.
+        Log() << "Only files can be striped!" << endl;
+        return Complete(QUIC_STATUS_INVALID_PARAMETER);
+    }
+    if (Options.Sparse || Options.Delta || Options.Dedup) {
+        Log() << "Striped transfers send the whole file." << endl;
+    }
+    if (Options.ReadAhead != 0) {
+        Source.SetReadAhead(Options.ReadAhead);
+    }
+
+    uint64_t TransferId;
+    CxPlatRandom(sizeof(TransferId), &TransferId);
+    // Varints hold 62 bits.
+    TransferId >>= 2;
+    Stripe.ChunkCount = (size_t)((FileSize + StripeChunkSize - 1) / StripeChunkSize);
+    for (auto& Route : Paths) {
+        auto Path = make_unique<QcStripePath>();
+        Path->Stripe = &Stripe;
+        Path->Route = Route;
+        Path->Label = Route.LocalAddress.empty() ? Route.Target : Route.LocalAddress + " to " + Route.Target;
+        Path->Context.Password = Options.Password;
+        Path->Context.FileSize = FileSize;
+        CxPlatEventInitialize(&Path->Context.ConnectionShutdownEvent, false, false);
+        CxPlatEventInitialize(&Path->Context.StreamsReadyEvent, false, false);
+        CxPlatEventInitialize(&Path->Context.CapabilitiesReadyEvent, false, false);
+        Path->Context.FileSend = true;
+        Lanes.push_back(std::move(Path));
+    }
+
+    // Starts a connection on Path.
+    auto Connect = [&](QcStripePath& Path) {
+        if (Path.Started) {
+            CxPlatEventWaitForever(Path.Context.ConnectionShutdownEvent);
+            Path.Started = false;
+        }
+        Path.Stream.reset();
+        Path.Connection.reset();
+        // Left over from the last connection's shutdown.
+        CxPlatEventReset(Path.Context.StreamsReadyEvent);
+        CxPlatEventReset(Path.Context.CapabilitiesReadyEvent);
+        Path.Context.HeaderVersion = QcHeaderVersion1;
+        Path.Context.CapabilitiesStreamStarted = false;
+        Path.Context.CapabilitiesData.clear();
+        Path.Context.CapabilitiesReceived = false;
+        Path.Context.PeerCapabilities = {};
+        Path.Context.UnidiStreams = 0;
+        Path.Context.BiDiStreams = 0;
+        Path.Context.ShutdownStatus = QUIC_STATUS_SUCCESS;
+        Path.Context.SendCanceled = false;
+        Path.FinAcknowledged = false;
+        Path.Finishing = false;
+        Path.Connection =
+            make_unique<MsQuicConnection>(
+                Session.GetRegistration(),
+                CleanUpManual,
+                QcClientConnectionCallback,
+                &Path.Context);
+        Path.Context.Connection = &*Path.Connection;
+        if (!Path.Route.LocalAddress.empty()) {
+            QUIC_ADDR LocalAddress{};
+            if (!ConvertArgToAddress(Path.Route.LocalAddress.c_str(), 0, &LocalAddress) ||
+                QUIC_FAILED(MsQuic->SetParam(
+                    *Path.Connection,
+                    QUIC_PARAM_CONN_LOCAL_ADDRESS,
+                    sizeof(LocalAddress),
+                    &LocalAddress))) {
+                Log() << "Failed to bind to " << Path.Route.LocalAddress << "!" << endl;
+                return false;
+            }
+        }
+        Path.Stream =
+            make_unique<MsQuicStream>(
+                *Path.Connection,
+                QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL,
+                CleanUpManual,
+                QcStripeSendStreamCallback,
+                &Path);
+        if (QUIC_FAILED(Path.Stream->Start(QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL | QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+            Log() << "Failed to start stream on " << Path.Label << "!" << endl;
+            return false;
+        }
+        QcSetStreamPriority(*Path.Stream, Options.Schedule);
+        if (QUIC_FAILED(Path.Connection->Start(*FileConfig, Path.Route.Target.c_str(), Options.Port))) {
+            Log() << "Failed to start client connection on " << Path.Label << "!" << endl;
+            return false;
+        }
+        Path.Started = true;
+        return true;
+    };
+    // Waits for Path's handshake, and once it's up, sends the transfer header
+    // in the version negotiated and opens it to chunks.
+    auto WaitForConnect = [&](QcStripePath& Path) {
+        CxPlatEventWaitForever(Path.Context.StreamsReadyEvent);
+        QUIC_STATUS Result = QcCheckFileModeStreams(Path.Context, Path.Label);
+        if (QUIC_SUCCEEDED(Result)) {
+            Result = QcWaitForCapabilities(Path.Context, Path.Label);
+        }
+        auto& Accepted = Path.Context.PeerCapabilities;
+        if (QUIC_SUCCEEDED(Result) &&
+            ((Accepted.Encodings & QcHeaderFlagStriped) == 0 ||
+             (Accepted.MaxStreams != 0 && Accepted.MaxStreams < Paths.size()))) {
+            Log() << Path.Label << " doesn't accept transfers striped over " << Paths.size() << " paths!" << endl;
+            Result = QUIC_STATUS_NOT_SUPPORTED;
+        }
+        if (QUIC_SUCCEEDED(Result)) {
+            auto Header = QcMakeTransferHeader(Path.Context, FileName, QcHeaderFlagStriped, FileSize);
+            Header.Options.MaxStreams = Paths.size();
+            uint32_t HeaderLength = QcEncodeTransferHeader(Header, Path.Header);
+            uint8_t* Cursor = QuicVarIntEncode(TransferId, Path.Header + HeaderLength);
+            Path.HeaderBuffer = {(uint32_t)(Cursor - Path.Header), Path.Header};
+            Result = Path.Stream->Send(&Path.HeaderBuffer, 1, QUIC_SEND_FLAG_NONE, nullptr);
+        }
+        unique_lock<mutex> Lock(Stripe.Lock);
+        if (QUIC_FAILED(Result)) {
+            Path.Failed = true;
+            Path.Connection->Shutdown((QUIC_UINT62)Result);
+        } else {
+            Path.Open = true;
+        }
+    };
+
+    // Handshakes run in parallel; wait for all of them.
+    for (auto& Path : Lanes) {
+        if (!Connect(*Path)) {
+            unique_lock<mutex> Lock(Stripe.Lock);
+            Path->Failed = true;
+        }
+    }
+    for (auto& Path : Lanes) {
+        if (!Path->Failed) {
+            WaitForConnect(*Path);
+        }
+    }
+
+    // The chunks are sent from their own buffers, so they aren't counted as
+    // in flight; the scheduler only gives the reads their turn and rate.
+    QcScheduledTransfer Scheduled(*Scheduler, Options.Schedule, FileSize);
+    uint64_t ReadPosition = 0;
+    uint64_t BytesSentSnapshot = 0;
+    auto LastUpdate = StartTime;
+    while (true) {
+        enum { SendChunk, FinishPath, ReconnectPath, Finished, Failed } Action;
+        QcStripePath* Path = nullptr;
+        size_t Chunk = 0;
+        {
+            unique_lock<mutex> Lock(Stripe.Lock);
+            while (true) {
+                bool Pending = !Stripe.Retry.empty() || Stripe.NextChunk < Stripe.ChunkCount;
+                bool AnyOpen = false;
+                QcStripePath* Idle = nullptr;
+                Path = nullptr;
+                for (auto& Candidate : Lanes) {
+                    if (!Candidate->Open) {
+                        if (!Candidate->Failed && Idle == nullptr) {
+                            Idle = &*Candidate;
+                        }
+                        continue;
+                    }
+                    AnyOpen = true;
+                    if (Candidate->Finishing) {
+                        continue;
+                    }
+                    // With nothing left to send, any open path can finish;
+                    // otherwise the least loaded path with room goes next.
+                    if (!Pending) {
+                        Path = &*Candidate;
+                        break;
+                    }
+                    if (Candidate->Outstanding < StripeWindow &&
+                        (Path == nullptr || Candidate->Outstanding < Path->Outstanding)) {
+                        Path = &*Candidate;
+                    }
+                }
+                if (Path != nullptr && !Pending) {
+                    Path->Finishing = true;
+                    Action = FinishPath;
+                    break;
+                }
+                if (Path != nullptr) {
+                    if (!Stripe.Retry.empty()) {
+                        Chunk = Stripe.Retry.back();
+                        Stripe.Retry.pop_back();
+                    } else {
+                        Chunk = Stripe.NextChunk++;
+                    }
+                    Path->Chunks.push_back(Chunk);
+                    Path->Outstanding++;
+                    Action = SendChunk;
+                    break;
+                }
+                if (!AnyOpen) {
+                    if (Stripe.ChunksConfirmed == Stripe.ChunkCount) {
+                        Action = Finished;
+                    } else if (Idle != nullptr) {
+                        // Chunks of a failed path, and only paths which
+                        // already finished to send them on.
+                        Path = Idle;
+                        Action = ReconnectPath;
+                    } else {
+                        Action = Failed;
+                    }
+                    break;
+                }
+                Stripe.Changed.wait(Lock);
+            }
+        }
+
+        if (Action == Finished) {
+            break;
+        }
+        if (Action == Failed) {
+            Log() << "Every path failed!" << endl;
+            Status = QUIC_STATUS_ABORTED;
+            break;
+        }
+        if (Action == ReconnectPath) {
+            if (Connect(*Path)) {
+                WaitForConnect(*Path);
+            } else {
+                unique_lock<mutex> Lock(Stripe.Lock);
+                Path->Failed = true;
+            }
+            continue;
+        }
+        if (Action == FinishPath) {
+            Path->Stream->Shutdown(QUIC_STATUS_SUCCESS, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL);
+            continue;
+        }
+
+        uint64_t Offset = (uint64_t)Chunk * StripeChunkSize;
+        uint32_t Length = (uint32_t)min<uint64_t>(StripeChunkSize, FileSize - Offset);
+        QcStripeSend* Send = nullptr;
+        {
+            unique_lock<mutex> Lock(Stripe.Lock);
+            if (!Stripe.FreeSends.empty()) {
+                Send = Stripe.FreeSends.back();
+                Stripe.FreeSends.pop_back();
+            }
+        }
+        if (Send == nullptr) {
+            auto Data = QcBufferPool::Get().Allocate(StripeChunkSize);
+            if (Data == nullptr) {
+                Log() << "Buffer pool is out of memory!" << endl;
+                Status = QUIC_STATUS_OUT_OF_MEMORY;
+                break;
+            }
+            unique_lock<mutex> Lock(Stripe.Lock);
+            Stripe.Sends.push_back(make_unique<QcStripeSend>());
+            Send = &*Stripe.Sends.back();
+            Send->Data = std::move(Data);
+        }
+        Send->Path = Path;
+        uint8_t* Cursor = QuicVarIntEncode(Offset, Send->Header);
+        Cursor = QuicVarIntEncode(Length, Cursor);
+        uint32_t HeaderLength = (uint32_t)(Cursor - Send->Header);
+        Cursor = Send->Data.get();
+        bool ReadFailed = Offset != ReadPosition && !Source.Seek(Offset);
+        uint32_t Filled = 0;
+        while (!ReadFailed && Filled < Length) {
+            uint32_t ReadLength = Scheduler->GetMaxGrant(Scheduled.Entry, Length - Filled);
+            uint32_t BytesRead = 0;
+            if (!Source.Read(Cursor + Filled, ReadLength, BytesRead) || BytesRead == 0) {
+                ReadFailed = true;
+                break;
+            }
+            Scheduler->Acquire(Scheduled.Entry, BytesRead);
+            Scheduler->Release(Scheduled.Entry, BytesRead);
+            Filled += BytesRead;
+        }
+        if (ReadFailed) {
+            Log() << "Failed to read from '" << FileName << "'" << endl;
+            unique_lock<mutex> Lock(Stripe.Lock);
+            Stripe.FreeSends.push_back(Send);
+            Status = QUIC_STATUS_INTERNAL_ERROR;
+            break;
+        }
+        ReadPosition = Offset + Length;
+        Send->Buffers[0] = {HeaderLength, Send->Header};
+        Send->Buffers[1] = {Length, Send->Data.get()};
+        QUIC_STATUS Result = Path->Stream->Send(Send->Buffers, 2, QUIC_SEND_FLAG_NONE, Send);
+        if (QUIC_FAILED(Result)) {
+            // Its shutdown returns the path's chunks, this one too.
+            Log() << "StreamSend on " << Path->Label << " failed with 0x" << hex << Result << dec << endl;
+            {
+                unique_lock<mutex> Lock(Stripe.Lock);
+                Stripe.FreeSends.push_back(Send);
+                Path->Outstanding--;
+                Path->Finishing = true;
+            }
+            Path->Stream->Shutdown((QUIC_UINT62)Result);
+            continue;
+        }
+        Path->BytesSent += Length;
+        TotalBytesSent += Length;
+
+        auto Now = steady_clock::now();
+        if (Options.ShowProgress && Now - LastUpdate >= UpdateRate) {
+            PrintProgress(
+                FileName,
+                TotalBytesSent,
+                FileSize,
+                Now - StartTime,
+                TotalBytesSent - BytesSentSnapshot,
+                Now - LastUpdate);
+            LastUpdate = Now;
+            BytesSentSnapshot = TotalBytesSent;
+        }
+    }
+    if (Options.ShowProgress && QUIC_SUCCEEDED(Status)) {
+        auto Now = steady_clock::now();
+        PrintProgress(FileName, TotalBytesSent, FileSize, Now - StartTime, TotalBytesSent - BytesSentSnapshot, Now - LastUpdate);
+        Log() << endl;
+    }
+
+    for (auto& Path : Lanes) {
+        if (!Path->Started) {
+            continue;
+        }
+        if (QUIC_FAILED(Status)) {
+            Path->Connection->Shutdown((QUIC_UINT62)Status);
+        }
+        CxPlatEventWaitForever(Path->Context.ConnectionShutdownEvent);
+    }
+    return Complete(Status);
+}
+
+QUIC_STATUS
+QcClient::Fetch(
+    _In_ const string& Name,
+    _In_ const vector<string>& Sources,
+    _In_ const filesystem::path& DestinationPath,
+    _In_opt_ const QcCompletionCallback& Callback
+    )
+{
+    QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+    auto StartTime = steady_clock::now();
+    QcFetch Fetch;
+    auto Complete = [&](QUIC_STATUS Result) {
+        if (Callback) {
+            Callback({Result, Name, Fetch.BytesReceived, steady_clock::now() - StartTime});
+        }
+        return Result;
+    };
+
+    if (!IsValid()) {
+        return Complete(InitStatus);
+    }
+    if (Sources.empty() || Name.empty() || Name.size() > MaxPackedNameLength) {
+        return Complete(QUIC_STATUS_INVALID_PARAMETER);
+    }
+    Fetch.Name = Name;
+    auto FilePath = DestinationPath / filesystem::path(Name).filename();
+    {
+        // Created up front, so ranges can be written wherever they land.
+        ofstream Create(FilePath, ios::binary | ios::out | ios::trunc);
+    }
+    Fetch.File.open(FilePath, ios::binary | ios::in | ios::out);
+    if (!Fetch.File.is_open()) {
+        Log() << "Failed to open " << FilePath << " for writing!" << endl;
+        return Complete(QUIC_STATUS_INVALID_PARAMETER);
+    }
+
+    for (auto& Address : Sources) {
+        auto Source = make_unique<QcFetchSource>();
+        Source->Fetch = &Fetch;
+        Source->Address = Address;
+        Source->Context.Password = Options.Password;
+        CxPlatEventInitialize(&Source->Context.ConnectionShutdownEvent, false, false);
+        CxPlatEventInitialize(&Source->Context.StreamsReadyEvent, false, false);
+        Source->Connection =
+            make_unique<MsQuicConnection>(
+                Session.GetRegistration(),
+                CleanUpManual,
+                QcClientConnectionCallback,
+                &Source->Context);
+        Source->Context.Connection = &*Source->Connection;
+        if (QUIC_FAILED(Source->Connection->Start(*ServeConfig, Address.c_str(), Options.Port))) {
+            Log() << "Failed to start client connection to " << Address << "!" << endl;
+            Source->Failed = true;
+        } else {
+            Source->Started = true;
+        }
+        Fetch.Sources.push_back(std::move(Source));
+    }
+    {
+        // The first request finds the size. Requests wait in MsQuic until
+        // the connection is up, so this doesn't wait for a handshake.
+        vector<QcFetchRequest*> Aborts;
+        {
+            unique_lock<mutex> Lock(Fetch.Lock);
+            bool Requested = false;
+            for (auto& Source : Fetch.Sources) {
+                if (!Source->Failed && QcFetchRequestRange(Fetch, *Source, 0, Aborts)) {
+                    Requested = true;
+                    break;
+                }
+            }
+            if (!Requested) {
+                Status = QUIC_STATUS_CONNECTION_REFUSED;
+            }
+        }
+        QcAbortFetchRequests(Fetch, Aborts);
+    }
+
+    uint64_t BytesSnapshot = 0;
+    auto LastUpdate = StartTime;
+    vector<QcFetchRequest*> Aborts;
+    while (QUIC_SUCCEEDED(Status)) {
+        QcAbortFetchRequests(Fetch, Aborts);
+        unique_lock<mutex> Lock(Fetch.Lock);
+        Fetch.Changed.wait_for(Lock, UpdateRate);
+        if (Fetch.SizeKnown && Fetch.RangesDone == Fetch.Ranges.size()) {
+            break;
+        }
+        if (Fetch.Requests.empty()) {
+            if (!Fetch.SizeKnown) {
+                // The size request failed; try the next source.
+                for (auto& Source : Fetch.Sources) {
+                    if (!Source->Failed && QcFetchRequestRange(Fetch, *Source, 0, Aborts)) {
+                        break;
+                    }
+                }
+            } else {
+                QcFetchSchedule(Fetch, Aborts);
+            }
+            if (Fetch.Requests.empty()) {
+                Log() << "No source can serve " << Name << "!" << endl;
+                Status = QUIC_STATUS_ABORTED;
+                break;
+            }
+        }
+        auto Now = steady_clock::now();
+        if (Options.ShowProgress && Fetch.SizeKnown && Now - LastUpdate >= UpdateRate) {
+            PrintProgress(
+                Name,
+                Fetch.BytesReceived,
+                Fetch.Size,
+                Now - StartTime,
+                Fetch.BytesReceived - BytesSnapshot,
+                Now - LastUpdate);
+            LastUpdate = Now;
+            BytesSnapshot = Fetch.BytesReceived;
+        }
+    }
+    if (Options.ShowProgress && QUIC_SUCCEEDED(Status)) {
+        auto Now = steady_clock::now();
+        PrintProgress(Name, Fetch.BytesReceived, Fetch.Size, Now - StartTime, Fetch.BytesReceived - BytesSnapshot, Now - LastUpdate);
+        Log() << endl;
+    }
+
+    QcAbortFetchRequests(Fetch, Aborts);
+    for (auto& Source : Fetch.Sources) {
+        if (Source->Started) {
+            Source->Connection->Shutdown(QUIC_SUCCEEDED(Status) ? QUIC_STATUS_SUCCESS : (QUIC_UINT62)Status);
+            CxPlatEventWaitForever(Source->Context.ConnectionShutdownEvent);
+        }
+    }
+    Fetch.File.flush();
+    if (QUIC_SUCCEEDED(Status) && (Fetch.WriteFailed || !Fetch.File.good())) {
+        Log() << "Failed to write " << FilePath << "!" << endl;
+        Status = QUIC_STATUS_INTERNAL_ERROR;
+    }
+    Fetch.File.close();
+    if (QUIC_FAILED(Status)) {
+        error_code Error;
+        filesystem::remove(FilePath, Error);
+    }
+    return Complete(Status);
+}
+
+QUIC_STATUS
+QcClient::SendAsync(
+    _In_ unique_ptr<QcSource> Source,
+    _In_opt_ QcCompletionCallback Callback,
+    _In_opt_ optional<QcTransferSchedule> Schedule
+    )
+{
+    if (!IsValid()) {
+        return InitStatus;
+    }
+    unique_lock<mutex> Lock(PendingMutex);
+    Pending.emplace_back(
+        [this, Source = std::move(Source), Callback = std::move(Callback), Schedule]() {
+            Send(*Source, Callback, Schedule.has_value() ? &*Schedule : nullptr);
+        });
+    return QUIC_STATUS_PENDING;
+}
+
+void
+QcClient::WaitForAll()
+{
+    vector<thread> Transfers;
+    {
+        unique_lock<mutex> Lock(PendingMutex);
+        Transfers.swap(Pending);
+    }
+    for (auto& Transfer : Transfers) {
+        Transfer.join();
+    }
+}
+
+QUIC_STATUS
+QcClient::Pipe(
+    _In_ QcSource& In,
+    _In_ QcSink& Out,
+    _In_opt_ const QcCompletionCallback& Callback
+    )
+{
+    QcConnection ConnectionContext{};
+    auto Complete = [&](QUIC_STATUS Result) {
+        if (Callback) {
+            Callback({
+                Result,
+                In.GetName(),
+                ConnectionContext.BytesReceived,
+                ConnectionContext.EndTime - ConnectionContext.StartTime});
+        }
+        return Result;
+    };
+
+    if (!IsValid()) {
+        return Complete(InitStatus);
+    }
+
+    CxPlatEventInitialize(&ConnectionContext.SendCompleteEvent, false, false);
+    CxPlatEventInitialize(&ConnectionContext.ConnectionShutdownEvent, false, false);
+    CxPlatEventInitialize(&ConnectionContext.StreamsReadyEvent, false, false);
+    ConnectionContext.Password = Options.Password;
+    MsQuicConnection Client(Session.GetRegistration(), CleanUpManual, QcClientConnectionCallback, &ConnectionContext);
+    ConnectionContext.Connection = &Client;
+    MsQuicStream ClientStream(
+        Client,
+        QUIC_STREAM_OPEN_FLAG_NONE,
+        CleanUpManual,
+        QcStdInStdOutStreamCallback,
+        &ConnectionContext);
+    if (QUIC_FAILED(ClientStream.Start(QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL | QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+        Log() << "Failed to start stream!" << endl;
+        return Complete(QUIC_STATUS_INTERNAL_ERROR);
+    }
+    if (QUIC_FAILED(Client.Start(*PipeConfig, Options.Target.c_str(), Options.Port))) {
+        Log() << "Failed to start client connection!" << endl;
+        return Complete(QUIC_STATUS_INTERNAL_ERROR);
+    }
+
+    CxPlatEventWaitForever(ConnectionContext.StreamsReadyEvent);
+    if (ConnectionContext.UnidiStreams && ConnectionContext.BiDiStreams) {
+        Log() << "Server misconfigured!" << endl;
+        return Complete(QcAbortConnection(ConnectionContext, QUIC_STATUS_INTERNAL_ERROR));
+    }
+    if (ConnectionContext.UnidiStreams) {
+        Log() << "Error: server in file mode; you are in stdin/stdout mode." << endl;
+        return Complete(QcAbortConnection(ConnectionContext, QUIC_STATUS_INVALID_STATE));
+    }
+
+    ConnectionContext.SendBuffer = QcBufferPool::Get().Allocate(DefaultSendBufferSize);
+    if (ConnectionContext.SendBuffer == nullptr) {
+        Log() << "Buffer pool is out of memory!" << endl;
+        return Complete(QcAbortConnection(ConnectionContext, QUIC_STATUS_OUT_OF_MEMORY));
+    }
+    ConnectionContext.SendQuicBuffer.Buffer = ConnectionContext.SendBuffer.get();
+    ConnectionContext.PipeSource = &In;
+    ConnectionContext.Stream = &ClientStream;
+    Out.Open(In.GetName(), QcUnknownSize);
+    thread ReadStdIn(QcReadStdInThread, std::ref(ConnectionContext));
+    QcDrainPipe(ConnectionContext, Out);
+    CxPlatEventWaitForever(ConnectionContext.ConnectionShutdownEvent);
+    // stdin needn't end with the connection. The reader is stopped, and
+    // joined before the context it uses goes away.
+    In.Cancel();
+    ReadStdIn.join();
+    In.Resume();
+    Out.Close();
+    return Complete(ConnectionContext.TransferStatus);
+}
+
+//
+// A striped pipe's chunk, kept from its send until it's acknowledged.
+//
+struct QcPipeSend {
+    uint32_t Lane;
+    uint8_t Header[16];
+    QcBuffer Data;
+    QUIC_BUFFER Buffers[2];
+    bool Acknowledged{true};
+};
+
+//
+// Striped pipe send state, shared with the lanes' callbacks. Sends is a ring
+// of PipeWindow chunks by sequence number, up to Next; Oldest is the first
+// which hasn't been acknowledged.
+//
+struct QcPipeSender {
+    mutex Lock;
+    condition_variable Changed;
+    vector<QcPipeSend> Sends = vector<QcPipeSend>(PipeWindow);
+    uint64_t Next{0};
+    uint64_t Oldest{0};
+    // Bytes sent on each lane and not yet acknowledged.
+    vector<uint64_t> Outstanding;
+    vector<unique_ptr<MsQuicStream>> Lanes;
+    uint32_t LanesClosed{0};
+    bool Failed{false};
+};
+
+QUIC_STATUS
+QcPipeSendStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Sender = (QcPipeSender*)Context;
+    unique_lock<mutex> Lock(Sender->Lock);
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_SEND_COMPLETE: {
+        auto Send = (QcPipeSend*)Event->SEND_COMPLETE.ClientContext;
+        if (Event->SEND_COMPLETE.Canceled) {
+            Sender->Failed = true;
+        }
+        Send->Acknowledged = true;
+        Sender->Outstanding[Send->Lane] -= Send->Buffers[0].Length + Send->Buffers[1].Length;
+        while (Sender->Oldest < Sender->Next && Sender->Sends[Sender->Oldest % PipeWindow].Acknowledged) {
+            Sender->Oldest++;
+        }
+        Sender->Changed.notify_all();
+        break;
+    }
+    case QUIC_STREAM_EVENT_PEER_RECEIVE_ABORTED:
+        Sender->Failed = true;
+        Sender->Changed.notify_all();
+        break;
+    case QUIC_STREAM_EVENT_SEND_SHUTDOWN_COMPLETE:
+        if (!Event->SEND_SHUTDOWN_COMPLETE.Graceful) {
+            Sender->Failed = true;
+            Sender->Changed.notify_all();
+        }
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        Sender->LanesClosed++;
+        Sender->Changed.notify_all();
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+QUIC_STATUS
+QcClient::StripedPipe(
+    _In_ QcSource& In,
+    _In_ uint16_t StreamCount,
+    _In_opt_ const QcCompletionCallback& Callback
+    )
+{
+    uint64_t BytesSent = 0;
+    auto StartTime = steady_clock::now();
+    auto Complete = [&](QUIC_STATUS Result) {
+        if (Callback) {
+            Callback({Result, In.GetName(), BytesSent, steady_clock::now() - StartTime});
+        }
+        return Result;
+    };
+
+    if (!IsValid()) {
+        return Complete(InitStatus);
+    }
+    if (StreamCount == 0 || StreamCount > QcMaxPipeStreams) {
+        return Complete(QUIC_STATUS_INVALID_PARAMETER);
+    }
+
+    QcConnection ConnectionContext{};
+    CxPlatEventInitialize(&ConnectionContext.ConnectionShutdownEvent, false, false);
+    CxPlatEventInitialize(&ConnectionContext.StreamsReadyEvent, false, false);
+    ConnectionContext.Password = Options.Password;
+    MsQuicConnection Client(Session.GetRegistration(), CleanUpManual, QcClientConnectionCallback, &ConnectionContext);
+    ConnectionContext.Connection = &Client;
+    if (QUIC_FAILED(Client.Start(*StripedPipeConfig, Options.Target.c_str(), Options.Port))) {
+        Log() << "Failed to start client connection!" << endl;
+        return Complete(QUIC_STATUS_INTERNAL_ERROR);
+    }
+    CxPlatEventWaitForever(ConnectionContext.StreamsReadyEvent);
+    if (ConnectionContext.UnidiStreams == 0) {
+        Log() << "Failed to connect to " << Options.Target << ", or it isn't in striped pipe mode!" << endl;
+        Client.Shutdown(QUIC_STATUS_SUCCESS);
+        CxPlatEventWaitForever(ConnectionContext.ConnectionShutdownEvent);
+        return Complete(QUIC_STATUS_CONNECTION_REFUSED);
+    }
+
+    // Destroyed before the connection, closing the lanes.
+    QcPipeSender Sender;
+    StreamCount = min(StreamCount, ConnectionContext.UnidiStreams);
+    Sender.Outstanding.resize(StreamCount);
+    QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+    for (uint16_t i = 0; i < StreamCount; ++i) {
+        auto Lane = make_unique<MsQuicStream>(
+            Client,
+            QUIC_STREAM_OPEN_FLAG_UNIDIRECTIONAL,
+            CleanUpManual,
+            QcPipeSendStreamCallback,
+            &Sender);
+        if (!Lane->IsValid() || QUIC_FAILED(Lane->Start(QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+            Log() << "Failed to start stream!" << endl;
+            Status = QUIC_STATUS_INTERNAL_ERROR;
+            break;
+        }
+        Sender.Lanes.push_back(std::move(Lane));
+    }
+
+    StartTime = steady_clock::now();
+    bool End = false;
+    while (QUIC_SUCCEEDED(Status) && !End) {
+        uint32_t Lane = 0;
+        QcPipeSend* Send;
+        {
+            unique_lock<mutex> Lock(Sender.Lock);
+            // The receiver holds no more than the window past what it's
+            // written, so nothing further may be sent until Oldest is in.
+            Sender.Changed.wait(Lock, [&]{ return Sender.Next < Sender.Oldest + PipeWindow || Sender.Failed; });
+            if (Sender.Failed) {
+                Status = QUIC_STATUS_ABORTED;
+                break;
+            }
+            Send = &Sender.Sends[Sender.Next % PipeWindow];
+        }
+        if (Send->Data == nullptr) {
+            Send->Data = QcBufferPool::Get().Allocate(PipeChunkSize);
+            if (Send->Data == nullptr) {
+                Log() << "Buffer pool is out of memory!" << endl;
+                Status = QUIC_STATUS_OUT_OF_MEMORY;
+                break;
+            }
+        }
+        uint32_t BytesRead = 0;
+        if (!In.Read(Send->Data.get(), PipeChunkSize, BytesRead)) {
+            Log() << "Failed to read " << In.GetName() << endl;
+            Status = QUIC_STATUS_INTERNAL_ERROR;
+            break;
+        }
+        // The end is an empty chunk, numbered the count of the others.
+        End = BytesRead == 0;
+        {
+            unique_lock<mutex> Lock(Sender.Lock);
+            uint8_t* Cursor = QuicVarIntEncode(Sender.Next, Send->Header);
+            Cursor = QuicVarIntEncode(BytesRead, Cursor);
+            Send->Buffers[0] = {(uint32_t)(Cursor - Send->Header), Send->Header};
+            Send->Buffers[1] = {BytesRead, Send->Data.get()};
+            // Onto the lane with the least waiting, which is likely the
+            // one moving fastest.
+            Lane = (uint32_t)(min_element(Sender.Outstanding.begin(), Sender.Outstanding.end()) - Sender.Outstanding.begin());
+            Sender.Outstanding[Lane] += Send->Buffers[0].Length + BytesRead;
+            Send->Lane = Lane;
+            Send->Acknowledged = false;
+            Sender.Next++;
+        }
+        Status = Sender.Lanes[Lane]->Send(
+            Send->Buffers,
+            End ? 1 : 2,
+            End ? QUIC_SEND_FLAG_FIN : QUIC_SEND_FLAG_NONE,
+            Send);
+        if (QUIC_FAILED(Status)) {
+            Log() << "StreamSend failed with 0x" << hex << Status << dec << endl;
+            break;
+        }
+        BytesSent += BytesRead;
+    }
+
+    if (QUIC_SUCCEEDED(Status)) {
+        // The end went on one lane; the others only need finishing.
+        for (auto& Lane : Sender.Lanes) {
+            Lane->Shutdown(QUIC_STATUS_SUCCESS, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL);
+        }
+        unique_lock<mutex> Lock(Sender.Lock);
+        Sender.Changed.wait(Lock, [&]{ return Sender.LanesClosed == Sender.Lanes.size(); });
+        if (Sender.Failed) {
+            Status = QUIC_STATUS_ABORTED;
+        }
+    }
+    Client.Shutdown(QUIC_SUCCEEDED(Status) ? QUIC_STATUS_SUCCESS : (QUIC_UINT62)Status);
+    CxPlatEventWaitForever(ConnectionContext.ConnectionShutdownEvent);
+    return Complete(Status);
+}
+
+struct QcPingPong {
+    MsQuicConnection* Connection;
+    mutex Lock;
+    condition_variable Returned;
+    // Bytes of the current message yet to come back.
+    uint64_t Outstanding{0};
+    steady_clock::time_point ReturnTime;
+    bool Closed{false};
+};
+
+QUIC_STATUS
+QcPingPongStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto PingPong = (QcPingPong*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE: {
+        auto Now = steady_clock::now();
+        unique_lock<mutex> Lock(PingPong->Lock);
+        if (Event->RECEIVE.TotalBufferLength == 0 || PingPong->Outstanding == 0) {
+            break;
+        }
+        PingPong->Outstanding -= min(PingPong->Outstanding, Event->RECEIVE.TotalBufferLength);
+        if (PingPong->Outstanding == 0) {
+            PingPong->ReturnTime = Now;
+            PingPong->Returned.notify_one();
+        }
+        break;
+    }
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE: {
+        {
+            unique_lock<mutex> Lock(PingPong->Lock);
+            PingPong->Closed = true;
+            PingPong->Returned.notify_one();
+        }
+        if (!Event->SHUTDOWN_COMPLETE.ConnectionShutdown) {
+            PingPong->Connection->Shutdown(QUIC_STATUS_SUCCESS);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Sorts Samples, and summarizes them.
+//
+QcLatencyStatistics
+QcComputeLatencyStatistics(
+    _Inout_ vector<steady_clock::duration>& Samples
+    )
+{
+    QcLatencyStatistics Statistics{};
+    if (Samples.empty()) {
+        return Statistics;
+    }
+    sort(Samples.begin(), Samples.end());
+    // Nearest rank, in parts per thousand.
+    auto Rank = [&](size_t PerMille) {
+        size_t Index = (Samples.size() * PerMille + 999) / 1000;
+        return Samples[max<size_t>(Index, 1) - 1];
+    };
+    Statistics.Samples = (uint32_t)Samples.size();
+    Statistics.Min = Samples.front();
+    Statistics.P50 = Rank(500);
+    Statistics.P99 = Rank(990);
+    Statistics.P999 = Rank(999);
+    Statistics.Max = Samples.back();
+    return Statistics;
+}
+
+QUIC_STATUS
+QcClient::PingPong(
+    _In_ uint32_t Count,
+    _In_ uint32_t MessageSize,
+    _Out_ QcLatencyStatistics& Statistics
+    )
+{
+    Statistics = {};
+    if (!IsValid()) {
+        return InitStatus;
+    }
+    if (Count == 0 || MessageSize == 0 || MessageSize > DefaultSendBufferSize) {
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+
+    QcConnection ConnectionContext{};
+    CxPlatEventInitialize(&ConnectionContext.ConnectionShutdownEvent, false, false);
+    CxPlatEventInitialize(&ConnectionContext.StreamsReadyEvent, false, false);
+    ConnectionContext.Password = Options.Password;
+    MsQuicConnection Client(Session.GetRegistration(), CleanUpManual, QcClientConnectionCallback, &ConnectionContext);
+    ConnectionContext.Connection = &Client;
+    QcPingPong Context;
+    Context.Connection = &Client;
+    MsQuicStream Stream(Client, QUIC_STREAM_OPEN_FLAG_NONE, CleanUpManual, QcPingPongStreamCallback, &Context);
+    if (QUIC_FAILED(Stream.Start(QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL | QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+        Log() << "Failed to start stream!" << endl;
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+    if (QUIC_FAILED(Client.Start(*PipeConfig, Options.Target.c_str(), Options.Port))) {
+        Log() << "Failed to start client connection!" << endl;
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+    CxPlatEventWaitForever(ConnectionContext.StreamsReadyEvent);
+    if (ConnectionContext.UnidiStreams) {
+        Log() << "Error: server in file mode; ping-pong needs a server in echo mode." << endl;
+        return QcAbortConnection(ConnectionContext, QUIC_STATUS_INVALID_STATE);
+    }
+    if (!ConnectionContext.BiDiStreams) {
+        Log() << "Failed to connect to " << Options.Target << "!" << endl;
+        return QcAbortConnection(ConnectionContext, QUIC_STATUS_CONNECTION_REFUSED);
+    }
+
+    // The message isn't changed, so every send can share it.
+    vector<uint8_t> Message(MessageSize, 'q');
+    QUIC_BUFFER Buffer{MessageSize, Message.data()};
+    vector<steady_clock::duration> Samples;
+    Samples.reserve(Count);
+    QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+    for (uint32_t i = 0; i < Count; ++i) {
+        unique_lock<mutex> Lock(Context.Lock);
+        if (Context.Closed) {
+            break;
+        }
+        Context.Outstanding = MessageSize;
+        auto SendTime = steady_clock::now();
+        if (QUIC_FAILED(Status = Stream.Send(&Buffer))) {
+            Log() << "StreamSend failed with 0x" << hex << Status << dec << endl;
+            break;
+        }
+        Context.Returned.wait(Lock, [&]{ return Context.Outstanding == 0 || Context.Closed; });
+        if (Context.Outstanding != 0) {
+            break;
+        }
+        Samples.push_back(Context.ReturnTime - SendTime);
+    }
+    Stream.Shutdown(QUIC_STATUS_SUCCESS, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL);
+    CxPlatEventWaitForever(ConnectionContext.ConnectionShutdownEvent);
+    if (Samples.empty()) {
+        return QUIC_FAILED(Status) ? Status : QUIC_STATUS_ABORTED;
+    }
+    Statistics = QcComputeLatencyStatistics(Samples);
+    if (Samples.size() != Count) {
+        return QUIC_FAILED(Status) ? Status : QUIC_STATUS_ABORTED;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+QUIC_STATUS
+QcClient::LoadGen(
+    _In_ const QcLoadOptions& Load,
+    _Out_ QcLoadStatistics& Statistics
+    )
+{
+    Statistics = {};
+    if (!IsValid()) {
+        return InitStatus;
+    }
+    if (Load.Connections == 0) {
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+
+    // Arrivals and sizes are drawn up front, so a run is repeatable with the
+    // same seed, and drawing them doesn't delay the connections.
+    mt19937_64 Rng(Load.Seed);
+    vector<steady_clock::duration> Arrivals(Load.Connections);
+    vector<uint64_t> Sizes(Load.Connections);
+    double ArrivalTime = 0;
+    for (uint32_t i = 0; i < Load.Connections; ++i) {
+        if (Load.ArrivalRate > 0) {
+            ArrivalTime += exponential_distribution<double>(Load.ArrivalRate)(Rng);
+            Arrivals[i] = duration_cast<steady_clock::duration>(duration<double>(ArrivalTime));
+        }
+        Sizes[i] = QcSampleSize(Load.Sizes, Rng);
+    }
+
+    // Each thread carries one connection at a time; MsQuic's registration,
+    // configuration and credentials are shared by all of them.
+    uint32_t ThreadCount = min(Load.Concurrency == 0 ? DefaultLoadConcurrency : Load.Concurrency, Load.Connections);
+    atomic<uint32_t> NextConnection{0};
+    mutex StatisticsLock;
+    vector<steady_clock::duration> Completions;
+    vector<steady_clock::duration> Handshakes;
+    auto StartTime = steady_clock::now();
+    auto Generate = [&]() {
+        uint32_t Index;
+        while ((Index = NextConnection++) < Load.Connections) {
+            auto Due = StartTime + Arrivals[Index];
+            bool Late = Load.ArrivalRate > 0 && steady_clock::now() > Due + milliseconds(1);
+            this_thread::sleep_until(Due);
+            QcSyntheticSource Source("loadgen-" + to_string(Index), Sizes[Index]);
+            Send(Source, [&](const QcTransferResult& Result) {
+                unique_lock<mutex> Lock(StatisticsLock);
+                Statistics.Started++;
+                Statistics.Delayed += Late ? 1 : 0;
+                if (Result.HandshakeTime != steady_clock::duration(0)) {
+                    Handshakes.push_back(Result.HandshakeTime);
+                }
+                if (QUIC_SUCCEEDED(Result.Status)) {
+                    Statistics.Completed++;
+                    Statistics.BytesSent += Result.BytesTransferred;
+                    Completions.push_back(Result.ElapsedTime);
+                } else if (Result.Status == QUIC_STATUS_CONNECTION_REFUSED) {
+                    Statistics.Refused++;
+                } else {
+                    Statistics.Failed++;
+                }
+            });
+        }
+    };
+    vector<thread> Threads;
+    Threads.reserve(ThreadCount);
+    for (uint32_t i = 0; i < ThreadCount; ++i) {
+        Threads.emplace_back(Generate);
+    }
+    for (auto& Thread : Threads) {
+        Thread.join();
+    }
+    Statistics.ElapsedTime = steady_clock::now() - StartTime;
+    Statistics.Completion = QcComputeLatencyStatistics(Completions);
+    Statistics.Handshake = QcComputeLatencyStatistics(Handshakes);
+    return Statistics.Completed == Load.Connections ? QUIC_STATUS_SUCCESS : QUIC_STATUS_ABORTED;
+}
+
+//
+// Reads exactly Length bytes from Source, unless it ends first.
+//
+bool
+QcReadFull(
+    _In_ QcSource& Source,
+    _Out_writes_bytes_(Length) uint8_t* Buffer,
+    _In_ uint32_t Length,
+    _Out_ uint32_t& BytesRead
+    )
+{
+    BytesRead = 0;
+    while (BytesRead < Length) {
+        uint32_t Read = 0;
+        if (!Source.Read(Buffer + BytesRead, Length - BytesRead, Read)) {
+            return false;
+        }
+        if (Read == 0) {
+            break;
+        }
+        BytesRead += Read;
+    }
+    return true;
+}
+
+//
+// Reads the next record: RecordSize bytes, or if zero, a 16-bit big endian
+// length followed by that many bytes. False at the end of Source.
+//
+bool
+QcReadRecord(
+    _In_ QcSource& Source,
+    _In_ uint32_t RecordSize,
+    _Inout_ vector<uint8_t>& Record
+    )
+{
+    uint32_t Length = RecordSize;
+    uint32_t BytesRead = 0;
+    if (RecordSize == 0) {
+        uint8_t Prefix[2];
+        if (!QcReadFull(Source, Prefix, sizeof(Prefix), BytesRead) || BytesRead != sizeof(Prefix)) {
+            return false;
+        }
+        Length = ((uint32_t)Prefix[0] << 8) | Prefix[1];
+    }
+    Record.resize(Length);
+    return QcReadFull(Source, Record.data(), Length, BytesRead) && BytesRead == Length && Length != 0;
+}
+
+QUIC_STATUS
+QcClient::SendDatagrams(
+    _In_ QcSource& In,
+    _In_ uint32_t RecordSize,
+    _In_ uint32_t FecGroupSize,
+    _Out_ QcDatagramStatistics& Statistics
+    )
+{
+    Statistics = {};
+    if (!IsValid()) {
+        return InitStatus;
+    }
+    if (FecGroupSize > QcMaxFecGroupSize || RecordSize > UINT16_MAX) {
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+
+    QcConnection ConnectionContext{};
+    QcDatagramSender Sender;
+    CxPlatEventInitialize(&ConnectionContext.ConnectionShutdownEvent, false, false);
+    CxPlatEventInitialize(&ConnectionContext.StreamsReadyEvent, false, false);
+    ConnectionContext.Password = Options.Password;
+    ConnectionContext.DatagramSender = &Sender;
+    MsQuicConnection Client(Session.GetRegistration(), CleanUpManual, QcClientConnectionCallback, &ConnectionContext);
+    ConnectionContext.Connection = &Client;
+    if (QUIC_FAILED(Client.Start(*DatagramConfig, Options.Target.c_str(), Options.Port))) {
+        Log() << "Failed to start client connection!" << endl;
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+    CxPlatEventWaitForever(ConnectionContext.StreamsReadyEvent);
+    {
+        unique_lock<mutex> Lock(Sender.Lock);
+        if (!Sender.SendEnabled) {
+            Log() << "Failed to connect to " << Options.Target << ", or it isn't in datagram mode!" << endl;
+            Lock.unlock();
+            Client.Shutdown(QUIC_STATUS_SUCCESS);
+            CxPlatEventWaitForever(ConnectionContext.ConnectionShutdownEvent);
+            return QUIC_STATUS_CONNECTION_REFUSED;
+        }
+    }
+
+    QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+    QcFecEncoder Encoder(FecGroupSize);
+    vector<uint8_t> Record;
+    vector<vector<uint8_t>> Datagrams;
+    bool More = true;
+    while (More && QUIC_SUCCEEDED(Status)) {
+        More = QcReadRecord(In, RecordSize, Record);
+        if (More) {
+            unique_lock<mutex> Lock(Sender.Lock);
+            if (Record.size() + QcMaxDatagramOverhead > Sender.MaxSendLength) {
+                // Too long for the path; there's no fragmenting a datagram.
+                Sender.Statistics.Dropped++;
+                continue;
+            }
+            Lock.unlock();
+            Encoder.Encode(Record.data(), (uint32_t)Record.size(), Datagrams);
+        } else {
+            Encoder.Finish(Datagrams);
+        }
+        for (auto& Datagram : Datagrams) {
+            unique_lock<mutex> Lock(Sender.Lock);
+            Sender.Changed.wait(Lock, [&]{ return Sender.Outstanding < MaxOutstandingDatagrams || Sender.Closed; });
+            if (Sender.Closed) {
+                Status = QUIC_STATUS_ABORTED;
+                break;
+            }
+            auto Send = new QcDatagramSend{&Sender, std::move(Datagram), {}};
+            Send->Buffer.Buffer = Send->Data.data();
+            Send->Buffer.Length = (uint32_t)Send->Data.size();
+            Sender.Outstanding++;
+            Sender.Statistics.Sent++;
+            Lock.unlock();
+            Status = MsQuic->DatagramSend(Client, &Send->Buffer, 1, QUIC_SEND_FLAG_NONE, Send);
+            if (QUIC_FAILED(Status)) {
+                Log() << "DatagramSend failed with 0x" << hex << Status << dec << endl;
+                Lock.lock();
+                Sender.Outstanding--;
+                Sender.Statistics.Sent--;
+                Sender.Statistics.Dropped++;
+                Lock.unlock();
+                delete Send;
+                break;
+            }
+        }
+        Datagrams.clear();
+    }
+    {
+        // Let the last datagrams go, and find out what became of them.
+        unique_lock<mutex> Lock(Sender.Lock);
+        Sender.Changed.wait(Lock, [&]{ return Sender.Outstanding == 0 || Sender.Closed; });
+    }
+    Client.Shutdown(QUIC_STATUS_SUCCESS);
+    CxPlatEventWaitForever(ConnectionContext.ConnectionShutdownEvent);
+    unique_lock<mutex> Lock(Sender.Lock);
+    Statistics = Sender.Statistics;
+    return Status;
+}
+
+QUIC_STATUS
+QcClient::Forward(
+    _In_ const string& LocalAddress
+    )
+{
+    if (!IsValid()) {
+        return InitStatus;
+    }
+
+    QcConnection ConnectionContext{};
+    CxPlatEventInitialize(&ConnectionContext.ConnectionShutdownEvent, false, false);
+    CxPlatEventInitialize(&ConnectionContext.StreamsReadyEvent, false, false);
+    ConnectionContext.Password = Options.Password;
+    MsQuicConnection Client(Session.GetRegistration(), CleanUpManual, QcClientConnectionCallback, &ConnectionContext);
+    ConnectionContext.Connection = &Client;
+    if (QUIC_FAILED(Client.Start(*TunnelConfig, Options.Target.c_str(), Options.Port))) {
+        Log() << "Failed to start client connection!" << endl;
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+    CxPlatEventWaitForever(ConnectionContext.StreamsReadyEvent);
+    if (!ConnectionContext.BiDiStreams) {
+        Log() << "Failed to connect to " << Options.Target << "!" << endl;
+        return QUIC_STATUS_CONNECTION_REFUSED;
+    }
+
+    QcTunnel Tunnel;
+    if (!Tunnel.Forward(LocalAddress, &Client)) {
+        Client.Shutdown(QUIC_STATUS_SUCCESS);
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+    Log() << "Forwarding " << LocalAddress << " to " << Options.Target << endl;
+    CxPlatEventWaitForever(ConnectionContext.ConnectionShutdownEvent);
+    Log() << Tunnel.GetChannelsOpened() << " connections forwarded, "
+        << Tunnel.GetBytesSent() << " bytes sent, "
+        << Tunnel.GetBytesReceived() << " bytes received" << endl;
+    return QUIC_STATUS_SUCCESS;
+}
+
+QcServer::QcServer(
+    _In_ QcSession& ServerSession,
+    _In_ const QcServerOptions& ServerOptions
+    ) :
+    Session(ServerSession),
+    Options(ServerOptions),
+    Context(make_unique<QcListener>())
+{
+    Context->Password = Options.Password;
+    Context->DestinationPath = Options.DestinationPath;
+    Context->Wait = Options.Wait;
+    Context->ShowProgress = Options.ShowProgress;
+    Context->MaxConnections = Options.MaxConnections;
+    Context->MaxQueuedConnections = Options.MaxQueuedConnections;
+    Context->ReceiveMemoryBudget = Options.ReceiveMemoryBudget;
+    Context->ReceiveWindow = Options.ReceiveWindow != 0 ? Options.ReceiveWindow : DefaultReceiveWindow;
+    Context->MaxPendingVerifications = Options.MaxPendingVerifications;
+    Context->DirectReceive = Options.DirectReceive;
+    Context->WriterThreads = Options.WriterThreads != 0 ? Options.WriterThreads : DefaultWriterThreads;
+    Context->Relay = !Options.RelayTarget.empty();
+    Context->RelayTarget = Options.RelayTarget;
+    Context->RelayPort = Options.RelayPort != 0 ? Options.RelayPort : Options.Port;
+    Context->RelayPassword = Options.RelayPassword;
+    Context->Serve = !Options.ServePath.empty();
+    if (Context->Serve) {
+        // Requests are checked against the resolved path.
+        error_code Error;
+        Context->ServePath = filesystem::weakly_canonical(Options.ServePath, Error);
+        if (Error) {
+            Context->ServePath = Options.ServePath;
+        }
+    }
+    Context->Echo = Options.Echo;
+    Context->Datagram = Options.Datagram;
+    Context->StripedPipe = Options.PipeStreams != 0;
+    if (Options.HandshakesPerSecond != 0) {
+        Context->HandshakeLimiter =
+            make_unique<QcAddressRateLimiter>(
+                Options.HandshakesPerSecond,
+                max(Options.HandshakeBurst, Options.HandshakesPerSecond));
+    }
+    if (!Options.DestinationPath.empty()) {
+        auto DestinationPath = Options.DestinationPath;
+        Context->AtomicFinalize = true;
+        Context->Durability = Options.Durability;
+        if (Options.Durability == QcDurabilityGroup) {
+            Context->Committer =
+                make_unique<QcGroupCommitter>(
+                    Options.GroupCommitWindow != milliseconds(0) ? Options.GroupCommitWindow : DefaultGroupCommitWindow,
+                    Options.GroupCommitBytes != 0 ? Options.GroupCommitBytes : DefaultGroupCommitBytes);
+        }
+        if (Options.DirectReceive) {
+            Context->SinkFactory = [DestinationPath]() { return make_unique<QcMappedFileSink>(DestinationPath); };
+        } else if (Options.DirectIo) {
+            Context->SinkFactory = [DestinationPath]() { return make_unique<QcDirectIoFileSink>(DestinationPath); };
+        } else {
+            auto DropBehind = Options.DropBehind;
+            Context->SinkFactory = [DestinationPath, DropBehind]() {
+                return make_unique<QcFileSink>(DestinationPath, DropBehind);
+            };
+        }
+    }
+    CxPlatEventInitialize(&(Context->ConnectionReceivedEvent), false, false);
+    CxPlatEventInitialize(&(Context->ConnectionShutdownEvent), false, false);
+}
+
+QcServer::~QcServer()
+{
+    Listener.reset();
+    // Verifications still queued could force Retry again.
+    Context->Verifier.reset();
+    {
+        auto& State = QcGetRetryState();
+        unique_lock<mutex> Lock(State.Lock);
+        QcReleaseRetry(State, *Context);
+    }
+    CxPlatEventUninitialize(Context->ConnectionReceivedEvent);
+    CxPlatEventUninitialize(Context->ConnectionShutdownEvent);
+}
+
+void
+QcServer::SetSinkFactory(
+    _In_ QcSinkFactory Factory
+    )
+{
+    Context->SinkFactory = std::move(Factory);
+    // Other sinks may not write files under their names at all.
+    Context->AtomicFinalize = false;
+}
+
+void
+QcServer::SetCompletionCallback(
+    _In_ QcCompletionCallback Callback
+    )
+{
+    Context->CompletionCallback = std::move(Callback);
+}
+
+QUIC_STATUS
+QcServer::Start()
+{
+    QUIC_STATUS Status;
+    QUIC_ADDR LocalAddr;
+    uint32_t Pkcs12Length = 0;
+    MsQuicCredentialConfig Creds;
+    QUIC_CERTIFICATE_PKCS12 Pkcs12Info{};
+    MsQuicSettings Settings;
+    string TempPassword;
+    bool FileMode = false;
+
+    if (!Session.IsValid()) {
+        return Session.GetInitStatus();
+    }
+
+    Settings.SetDisconnectTimeoutMs(6000);
+    if (Options.ReceiveWindow != 0) {
+        Settings.SetConnFlowControlWindow(Options.ReceiveWindow);
+    }
+    Creds.Flags = QUIC_CREDENTIAL_FLAG_NONE;
+    if (!Options.Password.empty()) {
+        TempPassword = Options.Password;
+        Creds.Flags |=
+            QUIC_CREDENTIAL_FLAG_INDICATE_CERTIFICATE_RECEIVED
+            | QUIC_CREDENTIAL_FLAG_REQUIRE_CLIENT_AUTHENTICATION
+            | QUIC_CREDENTIAL_FLAG_DEFER_CERTIFICATE_VALIDATION;
+    } else {
+        char RandomPassword[RandomPasswordLength];
+        CxPlatRandom(sizeof RandomPassword, RandomPassword);
+        TempPassword = string(RandomPassword, sizeof RandomPassword);
+    }
+    if (!QcGenerateAuthCertificate(TempPassword, Pkcs12, Pkcs12Length)) {
+        Log() << "Failed to generate auth certificate" << endl;
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+    if (!Options.Password.empty()) {
+        auto VerifierThreads = Options.VerifierThreads;
+        if (VerifierThreads == 0) {
+            VerifierThreads = max(thread::hardware_concurrency() / 4, 1u);
+        }
+        Context->Verifier = make_unique<QcWorkQueue>(VerifierThreads);
+    }
+    {
+        // While another listener is forcing Retry, the current value is its
+        // zero rather than the one to go back to.
+        auto& State = QcGetRetryState();
+        unique_lock<mutex> Lock(State.Lock);
+        if (Options.RetryMemoryPercent.has_value()) {
+            State.MemoryPercent = *Options.RetryMemoryPercent;
+            if (State.Forcing == 0) {
+                QcSetRetryMemoryPercent(State.MemoryPercent);
+            }
+        } else if (State.Forcing == 0) {
+            uint16_t Percent;
+            uint32_t PercentLength = sizeof(Percent);
+            if (QUIC_SUCCEEDED(
+                MsQuic->GetParam(nullptr, QUIC_PARAM_GLOBAL_RETRY_MEMORY_PERCENT, &PercentLength, &Percent))) {
+                State.MemoryPercent = Percent;
+            }
+        }
+    }
+    Creds.CertificatePkcs12 = &Pkcs12Info;
+    Creds.CertificatePkcs12->Asn1Blob = Pkcs12.get();
+    Creds.CertificatePkcs12->Asn1BlobLength = (uint32_t)Pkcs12Length;
+    Creds.CertificatePkcs12->PrivateKeyPassword = nullptr;
+    Creds.Type = QUIC_CREDENTIAL_TYPE_CERTIFICATE_PKCS12;
+    if (Context->Serve) {
+        // Each request is a bidi stream of its own.
+        Settings.SetPeerBidiStreamCount(MaxServeStreams);
+    } else if (Options.Datagram) {
+        // Records arrive as datagrams; there are no streams.
+        Settings.SetDatagramReceiveEnabled(true);
+        Settings.SetKeepAlive(20000);
+    } else if (!Options.ExposeAddress.empty()) {
+        Context->Tunnel = make_unique<QcTunnel>();
+        if (!Context->Tunnel->Expose(Options.ExposeAddress)) {
+            return QUIC_STATUS_INVALID_PARAMETER;
+        }
+        // Each TCP connection is a bidi stream of its own, and they may sit
+        // idle for a long time.
+        Settings.SetPeerBidiStreamCount(MaxTunnelStreams);
+        Settings.SetKeepAlive(20000);
+    } else if (!Options.DestinationPath.empty() || Context->Relay) {
+        // File mode active, allow 1 unidi stream for sending a file.
+        Settings.SetPeerUnidiStreamCount(1);
+        if (Options.MaxQueuedConnections != 0) {
+            // Queued senders are blocked on flow control, keep them from idling out.
+            Settings.SetKeepAlive(20000);
+        }
+        // Delta signatures are computed off MsQuic's workers; each job is
+        // itself parallel, so only a couple run at once.
+        Context->Workers = make_unique<QcWorkQueue>(ListenerWorkerThreads);
+        Context->Writers = make_unique<QcWorkQueue>(Context->WriterThreads);
+        if (!Context->Relay) {
+            FileMode = true;
+            if (!Options.ChunkStorePath.empty()) {
+                Context->ChunkStore = make_unique<QcChunkStore>(Options.ChunkStorePath);
+                if (!Context->ChunkStore->IsValid()) {
+                    Log() << "Failed to open the chunk store " << Options.ChunkStorePath << endl;
+                    return QUIC_STATUS_INVALID_PARAMETER;
+                }
+                Context->Capabilities.Encodings |= QcHeaderFlagDedup;
+            }
+            if (Context->DirectReceive) {
+                // Only plain bodies can be placed before they're parsed.
+                Context->Capabilities.Encodings = 0;
+            }
+            QcEncodeCapabilities(Context->Capabilities, Context->CapabilitiesData);
+            Context->CapabilitiesBuffer.Buffer = Context->CapabilitiesData.data();
+            Context->CapabilitiesBuffer.Length = (uint32_t)Context->CapabilitiesData.size();
+        }
+    } else if (Context->StripedPipe) {
+        // Each lane of the pipe is a unidi stream of its own.
+        Settings.SetPeerUnidiStreamCount(min(Options.PipeStreams, QcMaxPipeStreams));
+        Settings.SetKeepAlive(20000);
+    } else {
+        // stdin/stdout mode active, allow 1 bidi stream.
+        Settings.SetPeerBidiStreamCount(1);
+        // For stdin/stdout, set a keepalive.
+        Settings.SetKeepAlive(20000);
+    }
+    if (Options.LowLatency) {
+        QcSetLowLatency(Settings);
+    }
+    const MsQuicAlpn& ListenerAlpn =
+        Context->Serve ? ServeAlpn :
+        Context->Tunnel != nullptr ? TunnelAlpn :
+        Context->Datagram ? DatagramAlpn :
+        Context->StripedPipe ? StripedPipeAlpn :
+        FileMode && Options.HeaderVersion != QcHeaderVersion1 ? FileAlpn : Alpn;
+    Config = make_unique<MsQuicConfiguration>(Session.GetRegistration(), ListenerAlpn, Settings, Creds);
+    if (!Config->IsValid()) {
+        Log() << "Configuration failed to init with: " << hex << Config->GetInitStatus() << endl;
+        return Config->GetInitStatus();
+    }
+    Context->Config = Config.get();
+    if (Context->Relay && QUIC_FAILED(Status = StartRelay())) {
+        return Status;
+    }
+    Listener = make_unique<MsQuicListener>(Session.GetRegistration(), QcListenerCallback, Context.get());
+    Context->Listener = Listener.get();
+    if (!ConvertArgToAddress(Options.ListenAddress.c_str(), Options.Port, &LocalAddr)) {
+        Log() << "Failed to convert address: " << Options.ListenAddress << endl;
+        return QUIC_STATUS_INVALID_PARAMETER;
+    }
+    if (QUIC_FAILED(Status = Listener->Start(ListenerAlpn, &LocalAddr))) {
+        Log() << "Failed to start listener: " << hex << Status << endl;
+        return Status;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+//
+// Creates the client configuration relay mode uses for onward connections.
+//
+QUIC_STATUS
+QcServer::StartRelay()
+{
+    uint32_t Pkcs12Length = 0;
+    MsQuicCredentialConfig Creds;
+    QUIC_CERTIFICATE_PKCS12 Pkcs12Info{};
+    MsQuicSettings Settings;
+    Settings.SetDisconnectTimeoutMs(6000);
+
+    Creds.Flags = QUIC_CREDENTIAL_FLAG_CLIENT;
+    if (!Options.RelayPassword.empty()) {
+        Creds.Flags |=
+            QUIC_CREDENTIAL_FLAG_INDICATE_CERTIFICATE_RECEIVED
+            | QUIC_CREDENTIAL_FLAG_DEFER_CERTIFICATE_VALIDATION;
+        if (!QcGenerateAuthCertificate(Options.RelayPassword, RelayPkcs12, Pkcs12Length)) {
+            Log() << "Failed to generate relay auth certificate" << endl;
+            return QUIC_STATUS_INTERNAL_ERROR;
+        }
+        Pkcs12Info.Asn1Blob = RelayPkcs12.get();
+        Pkcs12Info.Asn1BlobLength = Pkcs12Length;
+        Creds.CertificatePkcs12 = &Pkcs12Info;
+        Creds.Type = QUIC_CREDENTIAL_TYPE_CERTIFICATE_PKCS12;
+    } else {
+        Creds.Type = QUIC_CREDENTIAL_TYPE_NONE;
+        Creds.Flags |= QUIC_CREDENTIAL_FLAG_NO_CERTIFICATE_VALIDATION;
+    }
+    RelayConfig = make_unique<MsQuicConfiguration>(Session.GetRegistration(), Alpn, Settings, Creds);
+    if (!RelayConfig->IsValid()) {
+        Log() << "Relay configuration failed to init with: " << hex << RelayConfig->GetInitStatus() << endl;
+        return RelayConfig->GetInitStatus();
+    }
+    Context->Registration = &Session.GetRegistration();
+    Context->RelayConfig = RelayConfig.get();
+    return QUIC_STATUS_SUCCESS;
+}
+
+void
+QcServer::Stop()
+{
+    if (Listener) {
+        Listener->Stop();
+    }
+}
+
+QUIC_STATUS
+QcServer::RunPipe(
+    _In_ QcSource& In,
+    _In_ QcSink& Out
+    )
+{
+    if (!Options.DestinationPath.empty()) {
+        Log() << "Server isn't in stdin/stdout mode!" << endl;
+        return QUIC_STATUS_INVALID_STATE;
+    }
+    if (!Out.Open(In.GetName(), QcUnknownSize)) {
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+    do {
+        QcConnection* Conn = nullptr;
+        while (Conn == nullptr) {
+            {
+                unique_lock<mutex> Lock(Context->ConnectionListMutex);
+                if (!Context->PipeConnections.empty()) {
+                    Conn = Context->PipeConnections.front();
+                    Context->PipeConnections.pop_front();
+                    break;
+                }
+            }
+            CxPlatEventWaitForever(Context->ConnectionReceivedEvent);
+        }
+        Conn->SendBuffer = QcBufferPool::Get().Allocate(DefaultSendBufferSize);
+        if (Conn->SendBuffer == nullptr) {
+            Log() << "Buffer pool is out of memory!" << endl;
+            Conn->Connection->Shutdown((QUIC_UINT62)QUIC_STATUS_OUT_OF_MEMORY);
+        } else {
+            // Start reading from stdin until EOF is read, or the connection
+            // closes first and the reader is stopped. It's joined before
+            // Conn can be freed.
+            Conn->SendQuicBuffer.Buffer = Conn->SendBuffer.get();
+            Conn->PipeSource = &In;
+            thread ReadStdIn(QcReadStdInThread, std::ref(*Conn));
+            QcDrainPipe(*Conn, Out);
+            In.Cancel();
+            ReadStdIn.join();
+            In.Resume();
+        }
+        bool Free;
+        {
+            unique_lock<mutex> Lock(Conn->WorkMutex);
+            Free = --Conn->PendingWork == 0 && Conn->ShutdownComplete;
+        }
+        if (Free) {
+            QcFreeConnection(Conn);
+        }
+    } while (Options.Wait);
+    return Out.Close() ? QUIC_STATUS_SUCCESS : QUIC_STATUS_INTERNAL_ERROR;
+}
+
+QUIC_STATUS
+QcServer::ReceiveDatagrams(
+    _In_ QcSink& Out,
+    _In_ uint32_t RecordSize,
+    _Out_ QcDatagramStatistics& Statistics
+    )
+{
+    Statistics = {};
+    if (!Context->Datagram) {
+        Log() << "Server isn't in datagram mode!" << endl;
+        return QUIC_STATUS_INVALID_STATE;
+    }
+    if (!Out.Open("", QcUnknownSize)) {
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+    bool Success = true;
+    auto Deliver = [&](const uint8_t* Record, uint32_t Length) {
+        if (RecordSize == 0) {
+            uint8_t Prefix[2] = {(uint8_t)(Length >> 8), (uint8_t)Length};
+            Success &= Out.Write(Prefix, sizeof(Prefix));
+        }
+        Success &= Out.Write(Record, Length);
+    };
+    do {
+        QcConnection* Conn = nullptr;
+        while (Conn == nullptr) {
+            {
+                unique_lock<mutex> Lock(Context->ConnectionListMutex);
+                if (!Context->DatagramConnections.empty()) {
+                    Conn = Context->DatagramConnections.front();
+                    Context->DatagramConnections.pop_front();
+                    break;
+                }
+            }
+            CxPlatEventWaitForever(Context->ConnectionReceivedEvent);
+        }
+        // Each connection is its own sequence of records.
+        QcFecDecoder Decoder;
+        deque<vector<uint8_t>> Batch;
+        bool Closed = false;
+        while (!Closed) {
+            {
+                unique_lock<mutex> Lock(Conn->RecvDataMutex);
+                Conn->RecvDataCV.wait(Lock, [Conn]{ return !Conn->Datagrams.empty() || !Conn->RecvData.empty(); });
+                Batch.swap(Conn->Datagrams);
+                Closed = !Conn->RecvData.empty();
+            }
+            for (auto& Datagram : Batch) {
+                Decoder.Receive(Datagram.data(), (uint32_t)Datagram.size(), Deliver);
+            }
+            Batch.clear();
+            Out.Flush();
+        }
+        Decoder.Finish();
+        QcDatagramStatistics ConnStats = {};
+        Decoder.GetStatistics(ConnStats);
+        Decoder.GetStatistics(Statistics);
+        {
+            unique_lock<mutex> Lock(Conn->RecvDataMutex);
+            ConnStats.Dropped = Conn->DatagramsDropped;
+        }
+        Statistics.Dropped += ConnStats.Dropped;
+        if (Options.Wait) {
+            // With Wait this never returns, so report each connection.
+            Log() << "Connection closed: " << ConnStats.Received << " records received, "
+                << ConnStats.Recovered << " recovered, "
+                << ConnStats.Missing << " missing, "
+                << ConnStats.Dropped << " dropped" << endl;
+        }
+        bool Free;
+        {
+            unique_lock<mutex> Lock(Conn->WorkMutex);
+            Free = --Conn->PendingWork == 0 && Conn->ShutdownComplete;
+        }
+        if (Free) {
+            QcFreeConnection(Conn);
+        }
+    } while (Options.Wait);
+    return Out.Close() && Success ? QUIC_STATUS_SUCCESS : QUIC_STATUS_INTERNAL_ERROR;
+}
+
+QUIC_STATUS
+QcServer::RunStripedPipe(
+    _In_ QcSink& Out
+    )
+{
+    if (!Context->StripedPipe) {
+        Log() << "Server isn't in striped pipe mode!" << endl;
+        return QUIC_STATUS_INVALID_STATE;
+    }
+    if (!Out.Open("", QcUnknownSize)) {
+        return QUIC_STATUS_INTERNAL_ERROR;
+    }
+    bool Success = true;
+    do {
+        QcConnection* Conn = nullptr;
+        while (Conn == nullptr) {
+            {
+                unique_lock<mutex> Lock(Context->ConnectionListMutex);
+                if (!Context->PipeConnections.empty()) {
+                    Conn = Context->PipeConnections.front();
+                    Context->PipeConnections.pop_front();
+                    break;
+                }
+            }
+            CxPlatEventWaitForever(Context->ConnectionReceivedEvent);
+        }
+        if (!QcWritePipe(*Conn->Pipe, Out)) {
+            Success = false;
+            Conn->Connection->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+        }
+        Out.Flush();
+        bool Free;
+        {
+            unique_lock<mutex> Lock(Conn->WorkMutex);
+            Free = --Conn->PendingWork == 0 && Conn->ShutdownComplete;
+        }
+        if (Free) {
+            QcFreeConnection(Conn);
+        }
+    } while (Options.Wait);
+    return Out.Close() && Success ? QUIC_STATUS_SUCCESS : QUIC_STATUS_INTERNAL_ERROR;
+}
+
+void
+QcServer::WaitForShutdown()
+{
+    CxPlatEventWaitForever(Context->ConnectionShutdownEvent);
+}
+
+void
+QcServer::WaitForCommits()
+{
+    if (Context->Committer != nullptr) {
+        Context->Committer->Drain();
+    }
+}
+
+uint64_t
+QcServer::GetTotalBytesReceived() const
+{
+    return Context->TotalBytesReceived.Get();
+}
+
+steady_clock::duration
+QcServer::GetTotalDuration() const
+{
+    return steady_clock::duration(Context->TotalDuration.Get());
+}
+
+QcServerStatistics
+QcServer::GetStatistics() const
+{
+    QcServerStatistics Stats{};
+    Stats.ConnectionsAccepted = Context->ConnectionsAccepted.Get();
+    Stats.ConnectionsQueued = Context->ConnectionsQueued.Get();
+    Stats.ConnectionsRefused = Context->ConnectionsRefused.Get();
+    Stats.HandshakesRateLimited = Context->HandshakesRateLimited.Get();
+    Stats.VerificationsPending = Context->PendingVerifications;
+    Stats.VerificationsRejected = Context->VerificationsRejected.Get();
+    Stats.VerificationsFailed = Context->VerificationsFailed.Get();
+    Stats.VerificationsSucceeded = Context->VerificationsSucceeded.Get();
+    Stats.RetryEnforcements = Context->RetryEnforcements.Get();
+    Stats.BytesServed = Context->TotalBytesServed.Get();
+    Stats.BytesDeduplicated = Context->BytesDeduplicated.Get();
+    if (Context->Tunnel != nullptr) {
+        Stats.TunnelConnections = Context->Tunnel->GetChannelsOpened();
+        Stats.TunnelBytesSent = Context->Tunnel->GetBytesSent();
+        Stats.TunnelBytesReceived = Context->Tunnel->GetBytesReceived();
+    }
+    if (Context->Committer != nullptr) {
+        Stats.FilesCommitted = Context->Committer->GetFilesCommitted();
+        Stats.CommitBatches = Context->Committer->GetBatchesCommitted();
+        Stats.CommitFailures = Context->Committer->GetFailures();
+    }
+    unique_lock<mutex> Lock(Context->ConnectionListMutex);
+    Stats.ActiveConnections = Context->ActiveConnections;
+    Stats.QueuedConnections = (uint32_t)Context->AdmissionQueue.size();
+    Stats.ReservedReceiveMemory = Context->ReservedReceiveMemory;
+    return Stats;
+}
@@ -0,0 +1,850 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include "quiccat.h"
+
+const uint32_t DefaultSendBufferSize = 128 * 1024;
+const uint64_t QcUnknownSize = UINT64_MAX;
+// Striped pipes carry stdin over at most this many streams at once.
+const uint16_t QcMaxPipeStreams = 64;
+// Transfers start with a header of the name, size, and flags for the body's
+// encoding (see header.h). Without flags, the body is the file's data.
+
+// The body is a sequence of data extents, each a varint offset and a varint
+// length followed by the data. Everything between extents is a hole.
+const uint8_t QcHeaderFlagSparse = 0x01;
+// The receiver answers on a unidirectional stream with signatures of its
+// existing copy, and the body is delta records (see delta.h).
+const uint8_t QcHeaderFlagDelta = 0x02;
+// A directory tree. The header name is the directory's, and its size is the
+// total size of the files. The body is an entry per file: a varint path
+// length, the path relative to the directory with '/' separators, a varint
+// file size, then the file's data.
+const uint8_t QcHeaderFlagPacked = 0x04;
+const uint32_t MaxPackedNameLength = 4096;
+// One of several connections carrying the file, one per network path (see
+// QcClient::Stripe). The body is a varint transfer ID, the same on every
+// path, then data extents as in sparse transfers but in any order; the
+// receiver writes each where it belongs, and commits the file once the
+// paths between them have covered it.
+const uint8_t QcHeaderFlagStriped = 0x08;
+// Chunks the receiver's chunk store doesn't hold, after a manifest of the
+// file's chunks (see dedup.h). Only offered by servers with a chunk store.
+const uint8_t QcHeaderFlagDedup = 0x10;
+
+//
+// Reported to completion callbacks once a transfer finishes, successfully or not.
+//
+struct QcTransferResult {
+    QUIC_STATUS Status;
+    std::string Name;
+    uint64_t BytesTransferred;
+    std::chrono::steady_clock::duration ElapsedTime;
+    // The server, for fan-out sends.
+    std::string Target;
+    // From starting the connection to the handshake completing; zero if it
+    // never did.
+    std::chrono::steady_clock::duration HandshakeTime{};
+};
+
+typedef std::function<void(const QcTransferResult& Result)> QcCompletionCallback;
+
+//
+// One route to a server for striped sends: the server's address, and the
+// local address to send from, e.g. one network interface's. An empty
+// LocalAddress lets the OS choose.
+//
+struct QcNetworkPath {
+    std::string Target;
+    std::string LocalAddress;
+};
+
+//
+// Data to be sent. File transfers need to know the size up front, so sources
+// which can't know their size (e.g. pipes) return QcUnknownSize and may only
+// be used in pipe mode.
+//
+struct QcSource {
+    virtual ~QcSource() = default;
+    virtual std::string GetName() const = 0;
+    virtual uint64_t GetSize() const = 0;
+    // Reads up to Length bytes. BytesRead of 0 indicates the end of the data.
+    virtual bool Read(
+        _Out_writes_bytes_to_(Length, BytesRead) uint8_t* Buffer,
+        _In_ uint32_t Length,
+        _Out_ uint32_t& BytesRead) = 0;
+    // Sources which know where their holes are return the first data extent,
+    // [Start, End), at or after Offset, with Start == End == GetSize() past
+    // the last one. Returns false if the source can't tell.
+    virtual bool
+    NextDataExtent(
+        _In_ uint64_t /*Offset*/,
+        _Out_ uint64_t& /*Start*/,
+        _Out_ uint64_t& /*End*/) { return false; }
+    // Moves the read position; only needed by sources with extents.
+    virtual bool Seek(_In_ uint64_t /*Offset*/) { return false; }
+    // Header flags for sources which produce a framed body themselves.
+    virtual uint8_t GetTransferFlags() const { return 0; }
+    // Sources read from files keep the kernel reading Window bytes ahead
+    // (see QcReadAhead).
+    virtual void SetReadAhead(_In_ uint64_t /*Window*/) {}
+    // Sources which can block waiting for data (e.g. stdin) make a Read
+    // that's waiting, and those after it, return the end of the data, so a
+    // pipe can stop reading once its connection closes. Resume undoes it.
+    virtual void Cancel() {}
+    virtual void Resume() {}
+};
+
+//
+// Reads a file. Holes in sparse files are found with SEEK_DATA/SEEK_HOLE, or
+// FSCTL_QUERY_ALLOCATED_RANGES on Windows.
+//
+struct QcFileSource : public QcSource {
+    QcFileSource(_In_ const std::filesystem::path& FilePath);
+    ~QcFileSource();
+    bool IsValid() const { return !File.fail(); }
+    std::string GetName() const override { return Path.filename().generic_string(); }
+    uint64_t GetSize() const override { return Size; }
+    bool Read(uint8_t* Buffer, uint32_t Length, uint32_t& BytesRead) override;
+    bool NextDataExtent(uint64_t Offset, uint64_t& Start, uint64_t& End) override;
+    bool Seek(uint64_t Offset) override;
+    void SetReadAhead(uint64_t Window) override;
+
+    std::filesystem::path Path;
+    std::ifstream File;
+    uint64_t Size{0};
+    uint64_t Position{0};
+    QcReadAhead ReadAhead;
+#ifdef _WIN32
+    HANDLE ExtentHandle{INVALID_HANDLE_VALUE};
+#else
+    int ExtentHandle{-1};
+#endif
+};
+
+//
+// Encodes the data extents of another source as a sparse transfer body.
+//
+struct QcSparseSource : public QcSource {
+    QcSparseSource(_In_ QcSource& Inner) : Source(Inner) {}
+    std::string GetName() const override { return Source.GetName(); }
+    uint64_t GetSize() const override { return Source.GetSize(); }
+    bool Read(uint8_t* Buffer, uint32_t Length, uint32_t& BytesRead) override;
+
+    QcSource& Source;
+    uint64_t Position{0};
+    uint64_t ExtentRemaining{0};
+    uint8_t Pending[16];
+    uint8_t PendingLength{0};
+    uint8_t PendingOffset{0};
+    bool Finished{false};
+};
+
+//
+// Encodes another source as delta records against the receiver's block
+// signatures. Blocks are found with the rolling checksum, and confirmed with
+// the strong hash; everything else is sent as literal data.
+//
+struct QcDeltaSource : public QcSource {
+    QcDeltaSource(
+        _In_ QcSource& Inner,
+        _In_ uint32_t BasisBlockSize,
+        _In_ std::vector<QcBlockSignature>&& BasisSignatures);
+    std::string GetName() const override { return Source.GetName(); }
+    uint64_t GetSize() const override { return Source.GetSize(); }
+    bool Read(uint8_t* Buffer, uint32_t Length, uint32_t& BytesRead) override;
+
+    uint64_t LiteralBytes{0};
+    uint64_t MatchedBytes{0};
+
+private:
+    bool Produce();
+    bool Fill();
+    bool FindMatch(_In_ const uint8_t* Block, _Out_ uint32_t& Index);
+    void FlushLiteral();
+    void FlushCopy();
+
+    QcSource& Source;
+    uint32_t BlockSize;
+    std::vector<QcBlockSignature> Signatures;
+    std::unordered_multimap<uint32_t, uint32_t> Index;
+    // Quick rejection of weak checksums, before the hash lookup.
+    std::vector<bool> Filter;
+    // Source data in [WindowStart, WindowEnd); [LiteralStart, Position) is the
+    // pending literal.
+    std::vector<uint8_t> Window;
+    size_t LiteralStart{0};
+    size_t Position{0};
+    size_t WindowEnd{0};
+    bool SourceEnded{false};
+    QcRollingChecksum Checksum;
+    bool ChecksumValid{false};
+    uint64_t CopyStart{0};
+    uint64_t CopyCount{0};
+    std::vector<uint8_t> Output;
+    size_t OutputOffset{0};
+    bool Finished{false};
+};
+
+//
+// Sends the chunks of another source which the receiver asked for, in order,
+// as the body of a deduplicated transfer. The source must be able to seek.
+//
+struct QcDedupSource : public QcSource {
+    QcDedupSource(
+        _In_ QcSource& Inner,
+        _In_ const std::vector<QcDedupChunk>& FileChunks,
+        _In_ std::vector<bool>&& NeededChunks);
+    std::string GetName() const override { return Source.GetName(); }
+    uint64_t GetSize() const override { return Source.GetSize(); }
+    bool Read(uint8_t* Buffer, uint32_t Length, uint32_t& BytesRead) override;
+
+    uint64_t SentBytes{0};
+    uint64_t DeduplicatedBytes{0};
+
+private:
+    QcSource& Source;
+    const std::vector<QcDedupChunk>& Chunks;
+    std::vector<bool> Needed;
+    // The next chunk, where it starts in the file, and how much of the
+    // current chunk is left to read.
+    size_t Current{0};
+    uint64_t ChunkOffset{0};
+    uint64_t ChunkRemaining{0};
+    uint64_t Position{0};
+};
+
+//
+// Packs the regular files under a directory into a single transfer, so many
+// small files don't each pay for a connection. Symbolic links and empty
+// directories are skipped.
+//
+struct QcPackedSource : public QcSource {
+    QcPackedSource(_In_ const std::filesystem::path& Directory);
+    bool IsValid() const { return Valid; }
+    std::string GetName() const override { return Path.filename().generic_string(); }
+    uint64_t GetSize() const override { return Size; }
+    bool Read(uint8_t* Buffer, uint32_t Length, uint32_t& BytesRead) override;
+    uint8_t GetTransferFlags() const override { return QcHeaderFlagPacked; }
+    // Also prefetches each file while the one before it is sent.
+    void SetReadAhead(uint64_t Window) override { ReadAheadWindow = Window; }
+
+    struct Entry {
+        std::string Name;
+        uint64_t Size;
+    };
+
+    std::filesystem::path Path;
+    std::vector<Entry> Entries;
+    uint64_t Size{0};
+    bool Valid{false};
+
+private:
+    size_t Current{0};
+    std::ifstream File;
+    uint64_t FileRemaining{0};
+    std::vector<uint8_t> Pending;
+    size_t PendingOffset{0};
+    uint64_t ReadAheadWindow{0};
+    QcReadAhead ReadAhead;
+};
+
+struct QcBufferSource : public QcSource {
+    QcBufferSource(
+        _In_ const std::string& BufferName,
+        _In_reads_bytes_(BufferLength) const uint8_t* Buffer,
+        _In_ uint64_t BufferLength) :
+        Name(BufferName), Data(Buffer), Length(BufferLength) {}
+    std::string GetName() const override { return Name; }
+    uint64_t GetSize() const override { return Length; }
+    bool Read(uint8_t* Buffer, uint32_t Length, uint32_t& BytesRead) override;
+
+    std::string Name;
+    const uint8_t* Data;
+    uint64_t Length;
+    uint64_t Offset{0};
+};
+
+//
+// Sends Size bytes of filler, without holding them in memory, for load tests.
+//
+struct QcSyntheticSource : public QcSource {
+    QcSyntheticSource(_In_ const std::string& SourceName, _In_ uint64_t SourceSize) :
+        Name(SourceName), Size(SourceSize) {}
+    std::string GetName() const override { return Name; }
+    uint64_t GetSize() const override { return Size; }
+    bool Read(uint8_t* Buffer, uint32_t Length, uint32_t& BytesRead) override;
+
+    std::string Name;
+    uint64_t Size;
+    uint64_t Offset{0};
+};
+
+//
+// Sends the bytes in [First, Last). Forward iterators are required so the
+// size can be computed before the transfer starts.
+//
+template<typename ForwardIt>
+struct QcIteratorSource : public QcSource {
+    QcIteratorSource(
+        _In_ const std::string& SourceName,
+        _In_ ForwardIt First,
+        _In_ ForwardIt Last) :
+        Name(SourceName), Current(First), End(Last), Size((uint64_t)std::distance(First, Last)) {}
+    std::string GetName() const override { return Name; }
+    uint64_t GetSize() const override { return Size; }
+    bool Read(uint8_t* Buffer, uint32_t Length, uint32_t& BytesRead) override {
+        BytesRead = 0;
+        while (BytesRead < Length && Current != End) {
+            Buffer[BytesRead++] = (uint8_t)*Current++;
+        }
+        return true;
+    }
+
+    std::string Name;
+    ForwardIt Current;
+    ForwardIt End;
+    uint64_t Size;
+};
+
+//
+// Reads from a stdio stream, e.g. stdin. Reads a line at a time from a terminal.
+//
+struct QcStdioSource : public QcSource {
+    // Immediate returns whatever a single read of the descriptor does,
+    // instead of filling the buffer (or reading a line from a terminal).
+    QcStdioSource(_In_ FILE* Stream, _In_ bool Immediate = false);
+    ~QcStdioSource();
+    std::string GetName() const override { return ""; }
+    uint64_t GetSize() const override { return QcUnknownSize; }
+    bool Read(uint8_t* Buffer, uint32_t Length, uint32_t& BytesRead) override;
+    void Cancel() override;
+    void Resume() override;
+
+    FILE* File;
+    bool Immediate;
+    std::atomic<bool> Canceled{false};
+#ifdef _WIN32
+    // The thread in Read, whose read Cancel cancels.
+    std::atomic<DWORD> Reader{0};
+#else
+    // Cancel writes to this, to wake a Read polling for input.
+    int CancelPipe[2]{-1, -1};
+    bool WaitForInput();
+#endif
+};
+
+//
+// Destination for received data. Open is called once the transfer header is
+// parsed; Size is QcUnknownSize in pipe mode.
+//
+struct QcSink {
+    virtual ~QcSink() = default;
+    virtual bool Open(_In_ const std::string& Name, _In_ uint64_t Size) = 0;
+    virtual bool Write(_In_reads_bytes_(Length) const uint8_t* Buffer, _In_ uint32_t Length) = 0;
+    // Leaves a hole of Length bytes. Sinks which can't keep holes write zeros.
+    virtual bool Skip(_In_ uint64_t Length);
+    virtual bool Flush() { return true; }
+    virtual bool Close() = 0;
+    // Sinks whose whole destination is addressable in memory after Open (e.g. a
+    // mapped file) return it here, Size bytes long, so received data can be
+    // decrypted straight into place instead of passed to Write.
+    virtual uint8_t* GetDirectBuffer() { return nullptr; }
+};
+
+typedef std::function<std::unique_ptr<QcSink>()> QcSinkFactory;
+
+//
+// Writes each received file into a directory, using the sender's file name.
+// A non-zero DropBehindWindow drops what's written from the page cache as it
+// goes (see QcDropBehind).
+//
+struct QcFileSink : public QcSink {
+    QcFileSink(_In_ const std::filesystem::path& Directory, _In_ uint64_t DropBehindWindow = 0) :
+        DestinationPath(Directory), DropBehindWindow(DropBehindWindow) {}
+    bool Open(const std::string& Name, uint64_t Size) override;
+    bool Write(const uint8_t* Buffer, uint32_t Length) override;
+    bool Skip(uint64_t Length) override;
+    bool Close() override;
+
+    std::filesystem::path DestinationPath;
+    std::filesystem::path FilePath;
+    std::ofstream DestinationFile;
+    uint64_t Position{0};
+    bool Sparse{false};
+    uint64_t DropBehindWindow;
+    QcDropBehind DropBehind;
+};
+
+//
+// Like QcFileSink, but preallocates each file and maps it into memory, so it
+// can be used with QcServerOptions::DirectReceive.
+//
+struct QcMappedFileSink : public QcSink {
+    QcMappedFileSink(_In_ const std::filesystem::path& Directory) : DestinationPath(Directory) {}
+    ~QcMappedFileSink();
+    bool Open(const std::string& Name, uint64_t Size) override;
+    bool Write(const uint8_t* Buffer, uint32_t Length) override;
+    bool Skip(uint64_t Length) override;
+    bool Close() override;
+    uint8_t* GetDirectBuffer() override { return View; }
+
+    std::filesystem::path DestinationPath;
+#ifdef _WIN32
+    HANDLE File{INVALID_HANDLE_VALUE};
+    HANDLE Mapping{nullptr};
+#else
+    int File{-1};
+#endif
+    uint8_t* View{nullptr};
+    uint64_t Size{0};
+    uint64_t Offset{0};
+};
+
+//
+// Like QcFileSink, but bypasses the page cache. Data is gathered into an
+// aligned buffer and written with O_DIRECT (FILE_FLAG_NO_BUFFERING on
+// Windows) in large aligned blocks; the unaligned tail is written at Close.
+// Falls back to buffered writes where the file system doesn't support it.
+//
+struct QcDirectIoFileSink : public QcSink {
+    QcDirectIoFileSink(_In_ const std::filesystem::path& Directory) : DestinationPath(Directory) {}
+    ~QcDirectIoFileSink();
+    bool Open(const std::string& Name, uint64_t Size) override;
+    bool Write(const uint8_t* Buffer, uint32_t Length) override;
+    bool Close() override;
+
+    std::filesystem::path DestinationPath;
+#ifdef _WIN32
+    HANDLE File{INVALID_HANDLE_VALUE};
+#else
+    int File{-1};
+#endif
+    bool Direct{false};
+    uint8_t* Block{nullptr};
+    uint32_t BlockLength{0};
+    uint64_t FileOffset{0};
+
+private:
+    bool WriteBlock(_In_ uint32_t Length);
+};
+
+struct QcBufferSink : public QcSink {
+    bool Open(const std::string& Name, uint64_t Size) override;
+    bool Write(const uint8_t* Buffer, uint32_t Length) override;
+    bool Close() override { return true; }
+
+    std::string Name;
+    std::vector<uint8_t> Data;
+};
+
+struct QcStdioSink : public QcSink {
+    QcStdioSink(_In_ FILE* Stream, _In_ bool Unbuffered = false);
+    bool Open(const std::string& /*Name*/, uint64_t /*Size*/) override { return true; }
+    bool Write(const uint8_t* Buffer, uint32_t Length) override;
+    bool Flush() override {
+        QC_TRACE(QcTraceFlush, 0);
+        return fflush(File) == 0;
+    }
+    bool Close() override { return Flush(); }
+
+    FILE* File;
+};
+
+//
+// Owns the MsQuic registration. One session can be shared by any number of
+// clients, servers and transfers.
+//
+class QcSession {
+public:
+    QcSession(_In_z_ const char* AppName = "quiccat");
+    QUIC_STATUS GetInitStatus() const { return InitStatus; }
+    bool IsValid() const { return QUIC_SUCCEEDED(InitStatus); }
+    const MsQuicRegistration& GetRegistration() const { return *Registration; }
+private:
+    QUIC_STATUS InitStatus;
+    std::unique_ptr<MsQuicRegistration> Registration;
+};
+
+struct QcClientOptions {
+    std::string Target;
+    uint16_t Port{0};
+    // Empty disables password authentication.
+    std::string Password;
+    bool ShowProgress{false};
+    // Send only the data extents of sparse sources; the receiver recreates
+    // the holes.
+    bool Sparse{false};
+    // Send only what differs from the receiver's existing copy of the file.
+    bool Delta{false};
+    // Send only the chunks of the file which the receiver's chunk store
+    // doesn't already hold, from any earlier transfer (see dedup.h).
+    bool Dedup{false};
+    // Have the kernel read files this many bytes ahead of the send position,
+    // and the next file of a directory before it's reached. Zero leaves it
+    // to the kernel's own read-ahead.
+    uint64_t ReadAhead{0};
+    // Tune stdin/stdout and tunnel connections for round trip time over
+    // throughput: prompt acknowledgements and no pacing.
+    bool LowLatency{false};
+    // File transfers running at once on this client share its sending (see
+    // QcTransferScheduler). Schedule is each transfer's default class,
+    // weight and rate limit.
+    QcTransferSchedule Schedule;
+    // Within a class, serve the transfer with the least left to send first,
+    // rather than sharing by weight.
+    bool ShortestFirst{false};
+    // Cap on the client's total send rate, in bytes per second. Zero is
+    // unlimited.
+    uint64_t RateLimit{0};
+    // The newest transfer header version file mode offers (see header.h).
+    // QcHeaderVersion1 offers only "quiccat", as clients did before version 2.
+    uint32_t HeaderVersion{QcHeaderVersion2};
+};
+
+struct QcLatencyStatistics {
+    uint32_t Samples;
+    std::chrono::steady_clock::duration Min;
+    std::chrono::steady_clock::duration P50;
+    std::chrono::steady_clock::duration P99;
+    std::chrono::steady_clock::duration P999;
+    std::chrono::steady_clock::duration Max;
+};
+
+struct QcLoadStatistics {
+    uint32_t Started;
+    uint32_t Completed;
+    // Refused by the server, e.g. by its admission control.
+    uint32_t Refused;
+    uint32_t Failed;
+    // Arrivals which found Concurrency connections already open, and
+    // started late.
+    uint32_t Delayed;
+    uint64_t BytesSent;
+    std::chrono::steady_clock::duration ElapsedTime;
+    // Of the completed transfers, and of every handshake which completed.
+    QcLatencyStatistics Completion;
+    QcLatencyStatistics Handshake;
+};
+
+//
+// Sends to a quiccat server. Each transfer uses its own connection, but the
+// credentials and configuration are created once and shared.
+//
+class QcClient {
+public:
+    QcClient(_In_ QcSession& Session, _In_ const QcClientOptions& Options);
+    ~QcClient();
+    QUIC_STATUS GetInitStatus() const { return InitStatus; }
+    bool IsValid() const { return QUIC_SUCCEEDED(InitStatus); }
+
+    // Sends Source to a server in file mode, and blocks until complete.
+    // Schedule overrides the options' for this transfer.
+    QUIC_STATUS
+    Send(
+        _In_ QcSource& Source,
+        _In_opt_ const QcCompletionCallback& Callback = nullptr,
+        _In_opt_ const QcTransferSchedule* Schedule = nullptr);
+
+    // Sends Source to every server in Targets at once. The source is read
+    // once, into chunks shared by all the connections, and the slowest
+    // receiver paces the reads. Callback is invoked for each target.
+    QUIC_STATUS
+    Fanout(
+        _In_ QcSource& Source,
+        _In_ const std::vector<std::string>& Targets,
+        _In_opt_ const QcCompletionCallback& Callback = nullptr);
+
+    // Sends Source to one server over every path in Paths at once, e.g. from
+    // several local interfaces, with a connection per path. The file is cut
+    // into chunks, each sent on whichever path has room for it next, so
+    // faster paths carry more. If a path fails, the chunks it hadn't
+    // confirmed are sent again on the others; the transfer only fails if
+    // every path does. The server must keep accepting connections (Wait).
+    // Callback is invoked for each path, with the bytes it carried.
+    QUIC_STATUS
+    Stripe(
+        _In_ QcSource& Source,
+        _In_ const std::vector<QcNetworkPath>& Paths,
+        _In_opt_ const QcCompletionCallback& Callback = nullptr);
+
+    // Downloads Name from listeners in serve mode, striping ranges of it
+    // across every server in Sources, into DestinationPath.
+    QUIC_STATUS
+    Fetch(
+        _In_ const std::string& Name,
+        _In_ const std::vector<std::string>& Sources,
+        _In_ const std::filesystem::path& DestinationPath,
+        _In_opt_ const QcCompletionCallback& Callback = nullptr);
+
+    // Sends Source in the background. Callback is invoked when it finishes.
+    QUIC_STATUS
+    SendAsync(
+        _In_ std::unique_ptr<QcSource> Source,
+        _In_opt_ QcCompletionCallback Callback = nullptr,
+        _In_opt_ std::optional<QcTransferSchedule> Schedule = std::nullopt);
+
+    // Blocks until all transfers started with SendAsync complete.
+    void WaitForAll();
+
+    // Connects to a server in stdin/stdout mode. In is sent to the server and
+    // everything the server sends is written to Out, until the connection closes.
+    QUIC_STATUS
+    Pipe(
+        _In_ QcSource& In,
+        _In_ QcSink& Out,
+        _In_opt_ const QcCompletionCallback& Callback = nullptr);
+
+    // Sends In to a server in striped pipe mode, until In ends. In is cut
+    // into sequence numbered chunks, spread over up to StreamCount
+    // unidirectional streams (no more than the server allows), and put back
+    // in order by the server, so one stream's loss recovery or flow control
+    // doesn't hold up the others. Callback reports the bytes sent.
+    QUIC_STATUS
+    StripedPipe(
+        _In_ QcSource& In,
+        _In_ uint16_t StreamCount,
+        _In_opt_ const QcCompletionCallback& Callback = nullptr);
+
+    // Latency benchmark against a server in echo mode. Sends Count messages
+    // of MessageSize bytes, each once the last has come back in full, and
+    // reports the round trip times.
+    QUIC_STATUS
+    PingPong(
+        _In_ uint32_t Count,
+        _In_ uint32_t MessageSize,
+        _Out_ QcLatencyStatistics& Statistics);
+
+    // Load test of a server in file mode, with many connections from this one
+    // client: synthetic transfers arriving as Load describes. Reports
+    // aggregate goodput and the latency of handshakes and transfers.
+    QUIC_STATUS
+    LoadGen(
+        _In_ const QcLoadOptions& Load,
+        _Out_ QcLoadStatistics& Statistics);
+
+    // Sends records read from In as unreliable datagrams to a server in
+    // datagram mode, until In ends. Records are RecordSize bytes, or if zero,
+    // each is prefixed by a 16-bit big endian length. FecGroupSize, up to
+    // QcMaxFecGroupSize, adds a parity datagram after each group of that many
+    // records; zero disables it.
+    QUIC_STATUS
+    SendDatagrams(
+        _In_ QcSource& In,
+        _In_ uint32_t RecordSize,
+        _In_ uint32_t FecGroupSize,
+        _Out_ QcDatagramStatistics& Statistics);
+
+    // Forwards TCP connections accepted on LocalAddress, "host:port", to a
+    // server in tunnel mode; each is carried on its own stream of a single
+    // connection. Blocks until the connection closes.
+    QUIC_STATUS
+    Forward(
+        _In_ const std::string& LocalAddress);
+
+private:
+    QcSession& Session;
+    QcClientOptions Options;
+    QUIC_STATUS InitStatus;
+    std::unique_ptr<uint8_t[]> Pkcs12;
+    std::unique_ptr<MsQuicConfiguration> FileConfig;
+    std::unique_ptr<MsQuicConfiguration> PipeConfig;
+    std::unique_ptr<MsQuicConfiguration> StripedPipeConfig;
+    std::unique_ptr<MsQuicConfiguration> ServeConfig;
+    std::unique_ptr<MsQuicConfiguration> TunnelConfig;
+    std::unique_ptr<MsQuicConfiguration> DatagramConfig;
+    std::unique_ptr<QcTransferScheduler> Scheduler;
+    std::mutex PendingMutex;
+    std::vector<std::thread> Pending;
+};
+
+struct QcServerOptions {
+    std::string ListenAddress;
+    uint16_t Port{0};
+    // Empty disables password authentication.
+    std::string Password;
+    // Files are received into this directory. Empty selects stdin/stdout mode.
+    std::filesystem::path DestinationPath;
+    // Keep accepting connections after the first one completes.
+    bool Wait{false};
+    bool ShowProgress{false};
+    // Admission control for file mode; zero means unlimited.
+    // At most MaxConnections transfers receive at once. Beyond that, up to
+    // MaxQueuedConnections more are accepted with receive paused, and admitted
+    // in arrival order as transfers complete. Everything else is refused.
+    uint32_t MaxConnections{0};
+    uint32_t MaxQueuedConnections{0};
+    // Bound on the flow control windows granted across all accepted
+    // connections, active or queued, in bytes.
+    uint64_t ReceiveMemoryBudget{0};
+    // Connection flow control window, in bytes. Zero uses the MsQuic default.
+    uint32_t ReceiveWindow{0};
+    // Hand MsQuic the destination's own memory as app-owned receive buffers,
+    // so payload is decrypted directly into the file instead of being copied
+    // out of MsQuic's buffers. Requires sinks with a direct buffer; the
+    // default sink becomes QcMappedFileSink.
+    bool DirectReceive{false};
+    // Write received files with direct I/O, keeping them out of the page
+    // cache. The default sink becomes QcDirectIoFileSink.
+    bool DirectIo{false};
+    // Handshake flood protection.
+    // New handshakes accepted per second from each source address, with a
+    // burst allowance. Zero disables the limit.
+    uint32_t HandshakesPerSecond{0};
+    uint32_t HandshakeBurst{0};
+    // Password verifications (PBKDF2) in flight at once. Handshakes beyond
+    // this are rejected. Verification runs on its own VerifierThreads threads,
+    // so MsQuic's workers keep servicing established transfers; zero uses a
+    // quarter of the processors.
+    uint32_t MaxPendingVerifications{64};
+    uint32_t VerifierThreads{0};
+    // Share of memory MsQuic lets handshakes use before it requires stateless
+    // retry. Retry is also required of every handshake while verifications
+    // are backed up. This is a process-wide MsQuic setting.
+    std::optional<uint16_t> RetryMemoryPercent;
+    // Threads creating the small files of packed transfers; zero uses the
+    // default of 8.
+    uint32_t WriterThreads{0};
+    // How received files reach the disk (see QcDurability). Group commits
+    // flush once GroupCommitWindow has passed since a batch's first file, or
+    // it holds GroupCommitBytes; zero uses the defaults of 50ms and 64 MiB.
+    QcDurability Durability{QcDurabilityNone};
+    std::chrono::milliseconds GroupCommitWindow{0};
+    uint64_t GroupCommitBytes{0};
+    // Keeps the chunks of received files here, and offers deduplicated
+    // transfers (see QcClientOptions::Dedup). Empty disables it.
+    std::filesystem::path ChunkStorePath;
+    // Drop received files from the page cache, in windows of this many
+    // bytes, as they're written back, so huge transfers don't evict the
+    // rest of the host's cache. Zero leaves them cached. Applies to the
+    // default buffered sink; direct I/O bypasses the cache already.
+    uint64_t DropBehind{0};
+    // Relay mode: each transfer is forwarded, as it arrives, to the quiccat
+    // server at RelayTarget instead of being written out. RelayPort zero uses
+    // Port. DestinationPath must be empty.
+    std::string RelayTarget;
+    uint16_t RelayPort{0};
+    // Password of the relay target. Empty disables password authentication.
+    std::string RelayPassword;
+    // Serve mode: clients request files under ServePath, by name and byte
+    // range (see QcClient::Fetch). DestinationPath must be empty.
+    std::filesystem::path ServePath;
+    // Tunnel mode: each stream a client opens (see QcClient::Forward) is
+    // connected to the TCP address ExposeAddress, "host:port".
+    // DestinationPath must be empty.
+    std::string ExposeAddress;
+    // Echo mode: whatever a client sends is sent straight back, for
+    // QcClient::PingPong. DestinationPath must be empty.
+    bool Echo{false};
+    // As QcClientOptions::LowLatency.
+    bool LowLatency{false};
+    // Datagram mode: records arrive as datagrams (see
+    // QcClient::SendDatagrams), written out by ReceiveDatagrams.
+    // DestinationPath must be empty.
+    bool Datagram{false};
+    // Striped pipe mode: stdin arrives over up to PipeStreams streams at
+    // once (see QcClient::StripedPipe), and is put back in order by
+    // RunStripedPipe. Up to QcMaxPipeStreams; zero disables it.
+    // DestinationPath must be empty.
+    uint16_t PipeStreams{0};
+    // As QcClientOptions::HeaderVersion, for file mode listeners.
+    uint32_t HeaderVersion{QcHeaderVersion2};
+};
+
+struct QcServerStatistics {
+    uint64_t ConnectionsAccepted;
+    uint64_t ConnectionsQueued;
+    uint64_t ConnectionsRefused;
+    uint32_t ActiveConnections;
+    uint32_t QueuedConnections;
+    uint64_t ReservedReceiveMemory;
+    uint64_t HandshakesRateLimited;
+    uint32_t VerificationsPending;
+    uint64_t VerificationsRejected;
+    uint64_t VerificationsFailed;
+    uint64_t VerificationsSucceeded;
+    uint64_t RetryEnforcements;
+    uint64_t BytesServed;
+    uint64_t TunnelConnections;
+    // From TCP to QUIC, and QUIC to TCP.
+    uint64_t TunnelBytesSent;
+    uint64_t TunnelBytesReceived;
+    // Group durability.
+    uint64_t FilesCommitted;
+    uint64_t CommitBatches;
+    uint64_t CommitFailures;
+    // Deduplicated transfers: bytes copied from the chunk store instead of
+    // received.
+    uint64_t BytesDeduplicated;
+};
+
+struct QcListener;
+
+//
+// Receives files, or runs stdin/stdout mode, for connecting clients.
+//
+class QcServer {
+public:
+    QcServer(_In_ QcSession& Session, _In_ const QcServerOptions& Options);
+    ~QcServer();
+
+    // Replaces the default sink, which writes files into DestinationPath.
+    void SetSinkFactory(_In_ QcSinkFactory Factory);
+    // Invoked as each connection completes.
+    void SetCompletionCallback(_In_ QcCompletionCallback Callback);
+
+    QUIC_STATUS Start();
+    void Stop();
+
+    // Stdin/stdout mode: services one connection at a time, sending In and
+    // writing to Out, until a connection closes and Wait is not set.
+    QUIC_STATUS RunPipe(_In_ QcSource& In, _In_ QcSink& Out);
+
+    // Datagram mode: writes the records received on one connection at a
+    // time to Out, framed as the sender's (see QcClient::SendDatagrams),
+    // until a connection closes and Wait is not set. Statistics totals every
+    // connection's; with Wait, each connection's are logged as it closes.
+    QUIC_STATUS
+    ReceiveDatagrams(
+        _In_ QcSink& Out,
+        _In_ uint32_t RecordSize,
+        _Out_ QcDatagramStatistics& Statistics);
+
+    // Striped pipe mode: writes what each connection sends, in order, to
+    // Out, one connection at a time, until a connection closes and Wait is
+    // not set. At most a window of chunks is held waiting for an earlier
+    // one; past it, the streams are held in flow control.
+    QUIC_STATUS RunStripedPipe(_In_ QcSink& Out);
+
+    // Blocks until the first connection completes. Only valid without Wait.
+    void WaitForShutdown();
+
+    // Blocks until every file received so far is committed into place; only
+    // group durability commits after transfers complete.
+    void WaitForCommits();
+
+    uint64_t GetTotalBytesReceived() const;
+    std::chrono::steady_clock::duration GetTotalDuration() const;
+    QcServerStatistics GetStatistics() const;
+
+private:
+    QcSession& Session;
+    QcServerOptions Options;
+    std::unique_ptr<uint8_t[]> Pkcs12;
+    std::unique_ptr<MsQuicConfiguration> Config;
+    std::unique_ptr<QcListener> Context;
+    std::unique_ptr<MsQuicListener> Listener;
+    std::unique_ptr<uint8_t[]> RelayPkcs12;
+    std::unique_ptr<MsQuicConfiguration> RelayConfig;
+
+    QUIC_STATUS StartRelay();
+};
+
+void
+PrintTransferSummary(
+    _In_ std::chrono::steady_clock::duration ElapsedTime,
+    _In_ const uint64_t BytesTransferred,
+    _In_ const char* DirectionStr
+    );
@@ -0,0 +1,107 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+using namespace std;
+
+//
+// Parses a byte count with an optional K, M or G suffix.
+//
+bool
+QcParseByteCount(
+    _In_ const string& Text,
+    _Out_ uint64_t& Bytes
+    )
+{
+    Bytes = 0;
+    size_t Position = 0;
+    while (Position < Text.size() && isdigit((unsigned char)Text[Position])) {
+        if (Bytes > UINT64_MAX / 10) {
+            return false;
+        }
+        Bytes = Bytes * 10 + (uint64_t)(Text[Position++] - '0');
+    }
+    if (Position == 0) {
+        return false;
+    }
+    if (Position == Text.size()) {
+        return true;
+    }
+    if (Position + 1 != Text.size()) {
+        return false;
+    }
+    uint32_t Shift;
+    switch (toupper((unsigned char)Text[Position])) {
+    case 'K': Shift = 10; break;
+    case 'M': Shift = 20; break;
+    case 'G': Shift = 30; break;
+    default: return false;
+    }
+    if (Bytes > UINT64_MAX >> Shift) {
+        return false;
+    }
+    Bytes <<= Shift;
+    return true;
+}
+
+bool
+QcParseSizeDistribution(
+    _In_ const string& Spec,
+    _Out_ QcSizeDistribution& Distribution
+    )
+{
+    Distribution = {};
+    size_t Colon = Spec.find(':');
+    if (Colon == string::npos) {
+        Distribution.Type = QcSizeDistribution::Fixed;
+        return QcParseByteCount(Spec, Distribution.Size);
+    }
+    string Kind = Spec.substr(0, Colon);
+    string Arguments = Spec.substr(Colon + 1);
+    if (Kind == "exp") {
+        Distribution.Type = QcSizeDistribution::Exponential;
+        return QcParseByteCount(Arguments, Distribution.Size) && Distribution.Size != 0;
+    }
+    if (Kind == "uniform") {
+        Distribution.Type = QcSizeDistribution::Uniform;
+    } else if (Kind == "pareto") {
+        Distribution.Type = QcSizeDistribution::Pareto;
+    } else {
+        return false;
+    }
+    size_t Dash = Arguments.find('-');
+    if (Dash == string::npos ||
+        !QcParseByteCount(Arguments.substr(0, Dash), Distribution.Min) ||
+        !QcParseByteCount(Arguments.substr(Dash + 1), Distribution.Max)) {
+        return false;
+    }
+    if (Distribution.Type == QcSizeDistribution::Pareto && Distribution.Min == 0) {
+        return false;
+    }
+    return Distribution.Min <= Distribution.Max;
+}
+
+uint64_t
+QcSampleSize(
+    _In_ const QcSizeDistribution& Distribution,
+    _Inout_ mt19937_64& Rng
+    )
+{
+    switch (Distribution.Type) {
+    case QcSizeDistribution::Uniform:
+        return uniform_int_distribution<uint64_t>(Distribution.Min, Distribution.Max)(Rng);
+    case QcSizeDistribution::Exponential:
+        return (uint64_t)exponential_distribution<double>(1.0 / (double)Distribution.Size)(Rng);
+    case QcSizeDistribution::Pareto: {
+        // Inverse transform of the bounded Pareto distribution.
+        double Low = pow((double)Distribution.Min, Distribution.Shape);
+        double High = pow((double)Distribution.Max, Distribution.Shape);
+        double U = uniform_real_distribution<double>(0, 1)(Rng);
+        double Sample = pow(-(U * High - U * Low - High) / (High * Low), -1.0 / Distribution.Shape);
+        return clamp((uint64_t)Sample, Distribution.Min, Distribution.Max);
+    }
+    default:
+        return Distribution.Size;
+    }
+}
@@ -0,0 +1,57 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <string>
+
+//
+// Sizes of the synthetic transfers a load generator sends (see
+// QcClient::LoadGen). Sizes are in bytes, with optional K, M or G suffixes
+// (powers of 1024):
+//
+//   N               every transfer is N bytes
+//   uniform:Lo-Hi   uniformly distributed in [Lo, Hi]
+//   exp:Mean        exponentially distributed, with mean Mean
+//   pareto:Lo-Hi    bounded Pareto in [Lo, Hi], shape 1.16: mostly small
+//                   transfers, and a few large ones carrying most of the bytes
+//
+struct QcSizeDistribution {
+    enum Kind : uint8_t {
+        Fixed,
+        Uniform,
+        Exponential,
+        Pareto
+    };
+    Kind Type{Fixed};
+    // The fixed size, or the mean.
+    uint64_t Size{1024 * 1024};
+    uint64_t Min{0};
+    uint64_t Max{0};
+    double Shape{1.16};
+};
+
+bool
+QcParseSizeDistribution(
+    _In_ const std::string& Spec,
+    _Out_ QcSizeDistribution& Distribution);
+
+uint64_t
+QcSampleSize(
+    _In_ const QcSizeDistribution& Distribution,
+    _Inout_ std::mt19937_64& Rng);
+
+struct QcLoadOptions {
+    // Transfers to make, each on its own connection.
+    uint32_t Connections{0};
+    // Connections open at once, each carried by a thread; zero is a default
+    // of 64.
+    uint32_t Concurrency{0};
+    // New connections per second, as a Poisson process. Zero starts each
+    // connection as soon as a slot is free (a closed loop).
+    double ArrivalRate{0};
+    QcSizeDistribution Sizes;
+    uint64_t Seed{1};
+};
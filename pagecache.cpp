@@ -0,0 +1,212 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+using namespace std;
+
+QcReadAhead::~QcReadAhead()
+{
+#ifdef __linux__
+    if (File >= 0) {
+        close(File);
+    }
+#endif
+}
+
+void
+QcReadAhead::Open(
+    _In_ const filesystem::path& Path,
+    _In_ uint64_t FileSize,
+    _In_ uint64_t ReadAheadWindow
+    )
+{
+#ifdef __linux__
+    if (File >= 0) {
+        close(File);
+    }
+    File = open(Path.c_str(), O_RDONLY);
+    if (File < 0) {
+        return;
+    }
+    Size = FileSize;
+    Window = ReadAheadWindow;
+    Start = End = 0;
+    // Also lets the kernel's own read-ahead grow larger.
+    posix_fadvise(File, 0, 0, POSIX_FADV_SEQUENTIAL);
+#else
+    UNREFERENCED_PARAMETER(Path);
+    UNREFERENCED_PARAMETER(FileSize);
+    UNREFERENCED_PARAMETER(ReadAheadWindow);
+#endif
+}
+
+void
+QcReadAhead::Advance(
+    _In_ uint64_t Position
+    )
+{
+#ifdef __linux__
+    if (File < 0 || Window == 0) {
+        return;
+    }
+    if (Position < Start || Position > End) {
+        // A seek; what was requested is no use.
+        Start = End = Position;
+    }
+    if (End >= Size || End - Position > Window / 2) {
+        return;
+    }
+    uint64_t NewEnd = min(Size, Position + Window);
+    posix_fadvise(File, (off_t)End, (off_t)(NewEnd - End), POSIX_FADV_WILLNEED);
+    Start = Position;
+    End = NewEnd;
+#else
+    UNREFERENCED_PARAMETER(Position);
+#endif
+}
+
+void
+QcReadAhead::Prefetch(
+    _In_ const filesystem::path& Path,
+    _In_ uint64_t Window
+    )
+{
+#ifdef __linux__
+    int Prefetched = open(Path.c_str(), O_RDONLY);
+    if (Prefetched < 0) {
+        return;
+    }
+    // The pages stay requested once it's closed.
+    posix_fadvise(Prefetched, 0, (off_t)Window, POSIX_FADV_WILLNEED);
+    close(Prefetched);
+#else
+    UNREFERENCED_PARAMETER(Path);
+    UNREFERENCED_PARAMETER(Window);
+#endif
+}
+
+#ifdef __linux__
+
+//
+// Drop-behind waits for writeback here, rather than on the writer's thread,
+// which is often an MsQuic worker. One thread keeps each file's work in
+// order, up to closing it.
+//
+QcWorkQueue&
+QcDropBehindQueue()
+{
+    static QcWorkQueue Queue(1);
+    return Queue;
+}
+
+//
+// Waits for the writeback of Length bytes at Offset, zero meaning to the
+// end of the file, and drops them from the page cache.
+//
+void
+QcDropRange(
+    _In_ int File,
+    _In_ uint64_t Offset,
+    _In_ uint64_t Length
+    )
+{
+    sync_file_range(
+        File,
+        (off_t)Offset,
+        (off_t)Length,
+        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(File, (off_t)Offset, (off_t)Length, POSIX_FADV_DONTNEED);
+}
+
+//
+// Closes File once the work already queued for it is done.
+//
+void
+QcCloseDropBehindFile(
+    _In_ int File
+    )
+{
+    QcDropBehindQueue().Post([File]() { close(File); });
+}
+
+#endif
+
+QcDropBehind::~QcDropBehind()
+{
+#ifdef __linux__
+    if (File >= 0) {
+        QcCloseDropBehindFile(File);
+    }
+#endif
+}
+
+void
+QcDropBehind::Open(
+    _In_ const filesystem::path& Path,
+    _In_ uint64_t DropWindow
+    )
+{
+#ifdef __linux__
+    if (File >= 0) {
+        QcCloseDropBehindFile(File);
+    }
+    Dropped = Started = 0;
+    Next = UINT64_MAX;
+    if (DropWindow == 0) {
+        File = -1;
+        return;
+    }
+    File = open(Path.c_str(), O_RDONLY);
+    if (File >= 0) {
+        Window = DropWindow;
+        Next = Window;
+    }
+#else
+    UNREFERENCED_PARAMETER(Path);
+    UNREFERENCED_PARAMETER(DropWindow);
+#endif
+}
+
+void
+QcDropBehind::Advance(
+    _In_ uint64_t Position
+    )
+{
+#ifdef __linux__
+    if (File < 0 || Position <= Started) {
+        return;
+    }
+    sync_file_range(File, (off_t)Started, (off_t)(Position - Started), SYNC_FILE_RANGE_WRITE);
+    if (Started > Dropped) {
+        int DropFile = File;
+        uint64_t Offset = Dropped;
+        uint64_t Length = Started - Dropped;
+        QcDropBehindQueue().Post([DropFile, Offset, Length]() { QcDropRange(DropFile, Offset, Length); });
+        Dropped = Started;
+    }
+    Started = Position;
+    Next = Position + Window;
+#else
+    UNREFERENCED_PARAMETER(Position);
+#endif
+}
+
+void
+QcDropBehind::Close()
+{
+#ifdef __linux__
+    if (File < 0) {
+        return;
+    }
+    // Zero lengths run to the end of the file.
+    int DropFile = File;
+    uint64_t Offset = Dropped;
+    QcDropBehindQueue().Post([DropFile, Offset]() {
+        QcDropRange(DropFile, Offset, 0);
+        close(DropFile);
+    });
+    File = -1;
+    Next = UINT64_MAX;
+#endif
+}
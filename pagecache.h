@@ -0,0 +1,93 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+//
+// Page cache management for transfers much larger than memory. Left alone,
+// the kernel's read-ahead is too short to keep a fast link busy from cold
+// storage, and every page read or written stays cached until it's evicted,
+// taking everything else on the host with it.
+//
+// Both only act on Linux; elsewhere they do nothing.
+//
+
+//
+// Keeps the kernel reading Window bytes ahead of a reader (posix_fadvise
+// WILLNEED), topping the window up once half of it has been read. Seeks
+// restart the window at the new position.
+//
+class QcReadAhead {
+public:
+    QcReadAhead() = default;
+    QcReadAhead(const QcReadAhead&) = delete;
+    QcReadAhead& operator=(const QcReadAhead&) = delete;
+    ~QcReadAhead();
+
+    void
+    Open(
+        _In_ const std::filesystem::path& Path,
+        _In_ uint64_t Size,
+        _In_ uint64_t Window);
+
+    // The reader is about to read from Position.
+    void Advance(_In_ uint64_t Position);
+
+    // Starts reading the first Window bytes of a file which will be read
+    // soon, e.g. the next one in a directory.
+    static
+    void
+    Prefetch(
+        _In_ const std::filesystem::path& Path,
+        _In_ uint64_t Window);
+
+private:
+    int File{-1};
+    uint64_t Size{0};
+    uint64_t Window{0};
+    // Read-ahead has been requested for [Start, End).
+    uint64_t Start{0};
+    uint64_t End{0};
+};
+
+//
+// Drops a file from the page cache behind a sequential writer. Once a window
+// of new data has been written, writeback of it is started
+// (sync_file_range), and the window before it, whose writeback should be
+// done by then, is waited for and dropped (posix_fadvise DONTNEED) on a
+// background thread, so the writer never waits on the disk.
+//
+class QcDropBehind {
+public:
+    QcDropBehind() = default;
+    QcDropBehind(const QcDropBehind&) = delete;
+    QcDropBehind& operator=(const QcDropBehind&) = delete;
+    ~QcDropBehind();
+
+    void
+    Open(
+        _In_ const std::filesystem::path& Path,
+        _In_ uint64_t Window);
+
+    // Where the writer should next call Advance, once everything before it
+    // has reached the file (e.g. a stream has been flushed).
+    uint64_t GetNextPosition() const { return Next; }
+
+    // Everything before Position has been written to the file.
+    void Advance(_In_ uint64_t Position);
+
+    // Writes back and drops the rest of the file, in the background.
+    void Close();
+
+private:
+    int File{-1};
+    uint64_t Window{0};
+    // Writeback has been started up to Started; before Dropped, it has been
+    // waited for and the pages dropped.
+    uint64_t Dropped{0};
+    uint64_t Started{0};
+    uint64_t Next{UINT64_MAX};
+};
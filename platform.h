@@ -5,4 +5,11 @@
 #else
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifndef O_DIRECT
+// Not available everywhere (e.g. macOS); direct I/O falls back to buffered.
+#define O_DIRECT 0
+#endif
 #endif
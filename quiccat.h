@@ -3,6 +3,9 @@
 #define _CRT_NONSTDC_NO_WARNINGS 1
 #define _CRT_SECURE_NO_WARNINGS 1
 #include <fcntl.h>
+#include <algorithm>
+#include <iomanip>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -10,10 +13,20 @@
 #include <filesystem>
 #include <chrono>
 #include <vector>
+#include <list>
+#include <deque>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <optional>
+#include <atomic>
 #include <mutex>
 #include <utility>
 #include <thread>
 #include <condition_variable>
+#include <bit>
+#include <cmath>
+#include <random>
 
 #ifndef _WIN32
 #define CX_PLATFORM_LINUX 1
@@ -24,5 +37,19 @@
 #include <quic_var_int.h>
 
 #include "log.h"
+#include "trace.h"
 #include "auth.h"
 #include "platform.h"
+#include "counters.h"
+#include "ratelimit.h"
+#include "scheduler.h"
+#include "workqueue.h"
+#include "delta.h"
+#include "tunnel.h"
+#include "datagram.h"
+#include "loadgen.h"
+#include "durability.h"
+#include "header.h"
+#include "dedup.h"
+#include "pagecache.h"
+#include "bufferpool.h"
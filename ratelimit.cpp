@@ -0,0 +1,106 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+using namespace std;
+using namespace std::chrono;
+
+void
+QcTokenBucket::Initialize(
+    _In_ double TokensPerSecond,
+    _In_ double MaxBurst,
+    _In_ steady_clock::time_point Now
+    )
+{
+    Rate = TokensPerSecond;
+    Burst = MaxBurst;
+    Tokens = MaxBurst;
+    Last = Now;
+}
+
+void
+QcTokenBucket::Refill(
+    _In_ steady_clock::time_point Now
+    )
+{
+    if (Now > Last) {
+        Tokens = min(Burst, Tokens + duration<double>(Now - Last).count() * Rate);
+        Last = Now;
+    }
+}
+
+bool
+QcTokenBucket::TryConsume(
+    _In_ double Count,
+    _In_ steady_clock::time_point Now
+    )
+{
+    Refill(Now);
+    if (Tokens < Count) {
+        return false;
+    }
+    Tokens -= Count;
+    return true;
+}
+
+steady_clock::duration
+QcTokenBucket::TimeUntilAvailable(
+    _In_ double Count,
+    _In_ steady_clock::time_point Now
+    )
+{
+    Refill(Now);
+    if (Tokens >= Count || Rate <= 0) {
+        return steady_clock::duration(0);
+    }
+    return duration_cast<steady_clock::duration>(duration<double>((Count - Tokens) / Rate));
+}
+
+bool
+QcTokenBucket::IsFull(
+    _In_ steady_clock::time_point Now
+    ) const
+{
+    return Tokens + duration<double>(Now - Last).count() * Rate >= Burst;
+}
+
+QcAddressRateLimiter::QcAddressRateLimiter(
+    _In_ double PerAddressRate,
+    _In_ double PerAddressBurst,
+    _In_ size_t MaxAddresses
+    ) :
+    Rate(PerAddressRate),
+    Burst(max(PerAddressBurst, 1.0)),
+    MaxEntries(MaxAddresses)
+{
+}
+
+bool
+QcAddressRateLimiter::Allow(
+    _In_ const QUIC_ADDR* Address
+    )
+{
+    // Key on the IP address alone; the port is trivially varied by the peer.
+    string Key;
+    if (Address->Ip.sa_family == QUIC_ADDRESS_FAMILY_INET) {
+        Key.assign((const char*)&Address->Ipv4.sin_addr, sizeof(Address->Ipv4.sin_addr));
+    } else {
+        Key.assign((const char*)&Address->Ipv6.sin6_addr, sizeof(Address->Ipv6.sin6_addr));
+    }
+    auto Now = steady_clock::now();
+    unique_lock<mutex> Guard(Lock);
+    auto Entry = Buckets.find(Key);
+    if (Entry == Buckets.end()) {
+        if (Buckets.size() >= MaxEntries) {
+            // Addresses whose buckets refilled completely are idle.
+            erase_if(Buckets, [&](const auto& Item) { return Item.second.IsFull(Now); });
+            if (Buckets.size() >= MaxEntries) {
+                return false;
+            }
+        }
+        Entry = Buckets.emplace(Key, QcTokenBucket{}).first;
+        Entry->second.Initialize(Rate, Burst, Now);
+    }
+    return Entry->second.TryConsume(1, Now);
+}
@@ -0,0 +1,66 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+//
+// Classic token bucket. Tokens accrue at Rate per second, up to Burst.
+//
+struct QcTokenBucket {
+    double Rate{0};
+    double Burst{0};
+    double Tokens{0};
+    std::chrono::steady_clock::time_point Last;
+
+    void
+    Initialize(
+        _In_ double TokensPerSecond,
+        _In_ double MaxBurst,
+        _In_ std::chrono::steady_clock::time_point Now);
+
+    bool
+    TryConsume(
+        _In_ double Count,
+        _In_ std::chrono::steady_clock::time_point Now);
+
+    // How long until Count tokens will be available.
+    std::chrono::steady_clock::duration
+    TimeUntilAvailable(
+        _In_ double Count,
+        _In_ std::chrono::steady_clock::time_point Now);
+
+    // Whether the bucket would be full at Now, i.e. unused for a while.
+    bool
+    IsFull(
+        _In_ std::chrono::steady_clock::time_point Now) const;
+
+private:
+    void Refill(_In_ std::chrono::steady_clock::time_point Now);
+};
+
+//
+// Token bucket per peer IP address, for limiting new handshakes. The table is
+// bounded; idle addresses are pruned when it fills, and if it's still full,
+// unknown addresses are treated as over their limit.
+//
+class QcAddressRateLimiter {
+public:
+    QcAddressRateLimiter(
+        _In_ double PerAddressRate,
+        _In_ double PerAddressBurst,
+        _In_ size_t MaxAddresses = 65536);
+
+    bool Allow(_In_ const QUIC_ADDR* Address);
+
+private:
+    std::mutex Lock;
+    std::unordered_map<std::string, QcTokenBucket> Buckets;
+    double Rate;
+    double Burst;
+    size_t MaxEntries;
+};
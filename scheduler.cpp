@@ -0,0 +1,179 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Rate limited grants are about 50ms of sending, but never tiny.
+const uint32_t MinRateGrant = 16 * 1024;
+
+double
+QcRateBurst(
+    _In_ uint64_t RateLimit
+    )
+{
+    return max<double>(MinRateGrant, RateLimit / 20.0);
+}
+
+QcTransferScheduler::QcTransferScheduler(
+    _In_ bool ShortestRemainingFirst,
+    _In_ uint64_t RateLimit,
+    _In_ uint64_t MaxInFlight
+    ) :
+    ShortestFirst(ShortestRemainingFirst),
+    Window(MaxInFlight)
+{
+    if (RateLimit != 0) {
+        Rate.Initialize((double)RateLimit, QcRateBurst(RateLimit), steady_clock::now());
+    }
+}
+
+QcTransferScheduler::Transfer*
+QcTransferScheduler::Register(
+    _In_ const QcTransferSchedule& Schedule,
+    _In_ uint64_t Size
+    )
+{
+    unique_lock<mutex> Guard(Lock);
+    Transfers.emplace_back();
+    auto& Entry = Transfers.back();
+    Entry.Schedule = Schedule;
+    Entry.Schedule.Priority = min(Schedule.Priority, QcMaxPriority);
+    Entry.Schedule.Weight = max<uint32_t>(Schedule.Weight, 1);
+    Entry.Remaining = Size;
+    // A newcomer starts level with everyone else, with no credit or debt.
+    Entry.Finish = VirtualTime;
+    Entry.Order = NextOrder++;
+    if (Schedule.RateLimit != 0) {
+        Entry.Rate.Initialize((double)Schedule.RateLimit, QcRateBurst(Schedule.RateLimit), steady_clock::now());
+    }
+    return &Entry;
+}
+
+void
+QcTransferScheduler::Unregister(
+    _In_ Transfer* Entry
+    )
+{
+    unique_lock<mutex> Guard(Lock);
+    Transfers.remove_if([Entry](const Transfer& Item) { return &Item == Entry; });
+    Changed.notify_all();
+}
+
+uint32_t
+QcTransferScheduler::GetMaxGrant(
+    _In_ const Transfer* Entry,
+    _In_ uint32_t Preferred
+    ) const
+{
+    uint32_t Grant = Preferred;
+    if (Rate.Rate > 0) {
+        Grant = min(Grant, (uint32_t)Rate.Burst);
+    }
+    if (Entry->Rate.Rate > 0) {
+        Grant = min(Grant, (uint32_t)Entry->Rate.Burst);
+    }
+    return Grant;
+}
+
+QcTransferScheduler::Transfer*
+QcTransferScheduler::Next(
+    _In_ steady_clock::time_point Now,
+    _Inout_ steady_clock::time_point& Ready
+    )
+{
+    Transfer* Best = nullptr;
+    double BestTag = 0;
+    for (auto& Entry : Transfers) {
+        // A transfer with a send in flight will be back for more as soon as
+        // it completes, so it still counts; otherwise whoever else is waiting
+        // at that moment would take its turn.
+        if (!Entry.Waiting && (Entry.InFlight == 0 || Entry.Remaining == 0)) {
+            continue;
+        }
+        auto Wait = Entry.Rate.TimeUntilAvailable(min<double>(Entry.Request, Entry.Rate.Burst), Now);
+        if (Wait > steady_clock::duration(0)) {
+            if (Entry.Waiting) {
+                Ready = min(Ready, Now + Wait);
+            }
+            continue;
+        }
+        // Fair queueing serves the earliest start tag, fixed when the request
+        // is made; one yet to be made would start now.
+        double Tag = Entry.Waiting ? Entry.Start : max(VirtualTime, Entry.Finish);
+        if (Best != nullptr) {
+            if (Entry.Schedule.Priority != Best->Schedule.Priority) {
+                if (Entry.Schedule.Priority < Best->Schedule.Priority) {
+                    continue;
+                }
+            } else if (ShortestFirst) {
+                if (Entry.Remaining > Best->Remaining ||
+                    (Entry.Remaining == Best->Remaining && Entry.Order > Best->Order)) {
+                    continue;
+                }
+            } else if (Tag > BestTag || (Tag == BestTag && Entry.Order > Best->Order)) {
+                continue;
+            }
+        }
+        Best = &Entry;
+        BestTag = Tag;
+    }
+    return Best;
+}
+
+void
+QcTransferScheduler::Acquire(
+    _In_ Transfer* Entry,
+    _In_ uint32_t Bytes
+    )
+{
+    unique_lock<mutex> Guard(Lock);
+    Entry->Waiting = true;
+    Entry->Request = Bytes;
+    Entry->Start = max(VirtualTime, Entry->Finish);
+    while (true) {
+        auto Now = steady_clock::now();
+        auto Ready = steady_clock::time_point::max();
+        if (Next(Now, Ready) == Entry && (InFlight == 0 || InFlight + Bytes <= Window)) {
+            auto Wait = Rate.TimeUntilAvailable(min<double>(Bytes, Rate.Burst), Now);
+            if (Wait == steady_clock::duration(0)) {
+                break;
+            }
+            Ready = min(Ready, Now + Wait);
+        }
+        if (Ready == steady_clock::time_point::max()) {
+            Changed.wait(Guard);
+        } else {
+            Changed.wait_until(Guard, Ready);
+        }
+    }
+    auto Now = steady_clock::now();
+    if (Rate.Rate > 0) {
+        Rate.TryConsume(min<double>(Bytes, Rate.Burst), Now);
+    }
+    if (Entry->Rate.Rate > 0) {
+        Entry->Rate.TryConsume(min<double>(Bytes, Entry->Rate.Burst), Now);
+    }
+    VirtualTime = max(VirtualTime, Entry->Start);
+    Entry->Finish = Entry->Start + (double)Bytes / Entry->Schedule.Weight;
+    Entry->Remaining -= min<uint64_t>(Entry->Remaining, Bytes);
+    Entry->Waiting = false;
+    Entry->InFlight += Bytes;
+    InFlight += Bytes;
+    // The next in line may be someone else now.
+    Changed.notify_all();
+}
+
+void
+QcTransferScheduler::Release(
+    _In_ Transfer* Entry,
+    _In_ uint32_t Bytes
+    )
+{
+    unique_lock<mutex> Guard(Lock);
+    Entry->InFlight -= min<uint64_t>(Entry->InFlight, Bytes);
+    InFlight -= min<uint64_t>(InFlight, Bytes);
+    Changed.notify_all();
+}
@@ -0,0 +1,107 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+
+const uint8_t QcMaxPriority = 7;
+const uint8_t QcDefaultPriority = 4;
+
+// MsQuic stream priority for a class, where higher is sent first. The top
+// class has MsQuic's default.
+inline uint16_t QcStreamPriority(_In_ uint8_t Priority) {
+    return (uint16_t)(std::min(Priority, QcMaxPriority) << 12 | 0xFFF);
+}
+
+struct QcTransferSchedule {
+    // Transfers of a higher class are always served before lower ones.
+    uint8_t Priority{QcDefaultPriority};
+    // Share of the bandwidth relative to the other transfers in its class.
+    uint32_t Weight{1};
+    // Cap on this transfer alone, in bytes per second. Zero is unlimited.
+    uint64_t RateLimit{0};
+};
+
+//
+// Shares sending between concurrent transfers. Each send is granted before
+// it's made, and released once it completes; at most Window bytes are in
+// flight across all transfers, so whoever is granted next gets the link.
+//
+// Among the transfers waiting, the highest priority class goes first. Within
+// a class, transfers share by weight (start-time fair queueing), or with
+// ShortestFirst, the one with the least left to send goes first, which
+// minimizes the mean completion time. Rate limits are token buckets, filled
+// in bursts of at most GetMaxGrant bytes, which senders should not exceed.
+//
+class QcTransferScheduler {
+public:
+    struct Transfer {
+        QcTransferSchedule Schedule;
+        uint64_t Remaining;
+        // Virtual times at which the pending request starts, and the last
+        // grant finishes.
+        double Start{0};
+        double Finish;
+        uint64_t Order;
+        bool Waiting{false};
+        // Size of the pending request, or else the last one.
+        uint32_t Request{0};
+        uint64_t InFlight{0};
+        QcTokenBucket Rate;
+    };
+
+    QcTransferScheduler(
+        _In_ bool ShortestFirst,
+        _In_ uint64_t RateLimit,
+        _In_ uint64_t Window);
+
+    // Size is the number of bytes the transfer will send, for ShortestFirst.
+    Transfer*
+    Register(
+        _In_ const QcTransferSchedule& Schedule,
+        _In_ uint64_t Size);
+
+    void Unregister(_In_ Transfer* Entry);
+
+    // Largest grant Entry should ask for, so rate limited sends stay smooth.
+    uint32_t
+    GetMaxGrant(
+        _In_ const Transfer* Entry,
+        _In_ uint32_t Preferred) const;
+
+    // Blocks until Entry may send Bytes.
+    void
+    Acquire(
+        _In_ Transfer* Entry,
+        _In_ uint32_t Bytes);
+
+    // The send of Bytes granted to Entry has completed.
+    void
+    Release(
+        _In_ Transfer* Entry,
+        _In_ uint32_t Bytes);
+
+private:
+    // The waiting transfer to serve next, if any isn't held back by its own
+    // rate limit. Ready is lowered to when the next held back one could go.
+    Transfer*
+    Next(
+        _In_ std::chrono::steady_clock::time_point Now,
+        _Inout_ std::chrono::steady_clock::time_point& Ready);
+
+    std::mutex Lock;
+    std::condition_variable Changed;
+    std::list<Transfer> Transfers;
+    bool ShortestFirst;
+    uint64_t Window;
+    uint64_t InFlight{0};
+    // Virtual time of fair queueing: the latest start tag granted.
+    double VirtualTime{0};
+    uint64_t NextOrder{0};
+    QcTokenBucket Rate;
+};
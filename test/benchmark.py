@@ -0,0 +1,310 @@
+"""
+Throughput regression suite. Runs the real quiccat binary over a matrix of
+file sizes, modes (file, pipe, directory) and emulated network paths (see
+netem.py), and records throughput, CPU time and time to first byte to JSON.
+
+    python test/benchmark.py -output:results.json
+    python test/benchmark.py -baseline:baseline.json -threshold:0.15
+
+Given a baseline, each result is compared with the baseline's: the run
+fails if throughput falls, or CPU per byte or time to first byte rises, by
+more than the threshold. -save:path writes the results as a new baseline.
+Baselines are only meaningful on the machine they were recorded on.
+"""
+import glob
+import json
+import os
+import platform
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+try:
+    import resource
+except ImportError:
+    resource = None
+
+from netem import PROFILES, Relay
+
+SERVER_PORT = 8890
+RELAY_PORT = 8889
+DEFAULT_SIZES = [10000000, 100000000]
+DEFAULT_MODES = ['file', 'pipe', 'directory']
+DEFAULT_PROFILES = ['loopback', 'wan', 'lossy']
+# Directory mode splits the size into files of this size.
+DIRECTORY_FILE_SIZE = 64 * 1024
+# Time to first byte is noisy at the millisecond scale; only rises beyond
+# this much are counted against the threshold.
+TTFB_SLACK = 0.005
+TIMEOUT = 600
+
+def create_file(Filename: str, Size: int):
+    with open(Filename, 'wb') as File:
+        Remaining = Size
+        while Remaining > 0:
+            Chunk = min(Remaining, 1024 * 1024)
+            File.write(os.urandom(Chunk))
+            Remaining -= Chunk
+
+def create_source(Dir: str, Mode: str, Size: int) -> str:
+    if Mode != 'directory':
+        Path = os.path.join(Dir, 'Bench_' + str(Size) + '.tmp')
+        create_file(Path, Size)
+        return Path
+    Path = os.path.join(Dir, 'Bench_' + str(Size))
+    os.mkdir(Path)
+    Index = 0
+    Remaining = Size
+    while Remaining > 0:
+        create_file(os.path.join(Path, str(Index) + '.tmp'), min(Remaining, DIRECTORY_FILE_SIZE))
+        Remaining -= DIRECTORY_FILE_SIZE
+        Index += 1
+    return Path
+
+def wait_for_listener(Port: int, Timeout: float = 5):
+    """Waits until something is bound to the UDP port, instead of a fixed sleep."""
+    Deadline = time.monotonic() + Timeout
+    while time.monotonic() < Deadline:
+        Probe = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        try:
+            Probe.bind(('0.0.0.0', Port))
+        except OSError:
+            return
+        finally:
+            Probe.close()
+        time.sleep(0.01)
+    raise TimeoutError('Nothing listened on port ' + str(Port) + ' within ' + str(Timeout) + 's')
+
+def wait_process(Process: subprocess.Popen) -> float:
+    """
+    Waits for Process, killing it if it takes longer than TIMEOUT, and returns
+    the CPU time it used, where known. Only this thread reaps children, so the
+    growth of their total usage over the wait is Process's.
+    """
+    Before = resource.getrusage(resource.RUSAGE_CHILDREN) if resource else None
+    try:
+        Process.wait(TIMEOUT)
+    except subprocess.TimeoutExpired:
+        Process.kill()
+        Process.wait()
+    if Before is None:
+        return None
+    After = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return (After.ru_utime - Before.ru_utime) + (After.ru_stime - Before.ru_stime)
+
+def tree_size(Path: str) -> int:
+    if os.path.isfile(Path):
+        return os.path.getsize(Path)
+    Total = 0
+    for Root, _, Files in os.walk(Path):
+        for Name in Files:
+            try:
+                Total += os.path.getsize(os.path.join(Root, Name))
+            except OSError:
+                pass
+    return Total
+
+def watch_first_byte(Path: str, Started: float, Done: threading.Event, Result: dict):
+    # Files are received under a partial name, unique to the transfer, and
+    # renamed once complete.
+    Partials = glob.escape(Path) + '.*.quiccat-partial'
+    while not Done.is_set():
+        if (os.path.exists(Path) and tree_size(Path) > 0) or \
+           any(tree_size(Partial) > 0 for Partial in glob.glob(Partials)):
+            Result['first_byte'] = time.monotonic() - Started
+            return
+        time.sleep(0.001)
+
+def drain_pipe(Pipe, Started: float, Result: dict):
+    Received = 0
+    while True:
+        Data = Pipe.read(1024 * 1024)
+        if not Data:
+            break
+        if Received == 0:
+            Result['first_byte'] = time.monotonic() - Started
+        Received += len(Data)
+    Result['received'] = Received
+
+def run_case(Binary: str, Mode: str, Size: int, ProfileName: str) -> dict:
+    with tempfile.TemporaryDirectory(prefix='bench') as Temp:
+        SrcDir = os.path.join(Temp, 'src')
+        DestDir = os.path.join(Temp, 'dest')
+        os.mkdir(SrcDir)
+        os.mkdir(DestDir)
+        Source = create_source(SrcDir, Mode, Size)
+        Dest = os.path.join(DestDir, os.path.basename(Source))
+
+        ServerArgs = [Binary, '-listen:*', '-port:' + str(SERVER_PORT)]
+        ClientArgs = [Binary, '-target:127.0.0.1', '-port:' + str(RELAY_PORT)]
+        # Progress output could fill a pipe while we wait, so logs go to files.
+        ServerLog = open(os.path.join(Temp, 'server.log'), 'w+b')
+        ClientLog = open(os.path.join(Temp, 'client.log'), 'w+b')
+        if Mode == 'pipe':
+            Server = subprocess.Popen(ServerArgs, stdout=subprocess.PIPE, stderr=ServerLog)
+        else:
+            Server = subprocess.Popen(ServerArgs + ['-destination:' + DestDir], stderr=ServerLog)
+            ClientArgs.append('-file:' + Source)
+        try:
+            wait_for_listener(SERVER_PORT)
+        except TimeoutError:
+            Server.kill()
+            Server.wait()
+            raise
+        Emulator = Relay(RELAY_PORT, '127.0.0.1', SERVER_PORT, PROFILES[ProfileName])
+        Emulator.start()
+
+        Result = {}
+        Done = threading.Event()
+        Started = time.monotonic()
+        if Mode == 'pipe':
+            with open(Source, 'rb') as In:
+                Client = subprocess.Popen(ClientArgs, stdin=In, stderr=ClientLog)
+            Watcher = threading.Thread(target=drain_pipe, args=(Server.stdout, Started, Result))
+        else:
+            Client = subprocess.Popen(ClientArgs, stderr=ClientLog)
+            Watcher = threading.Thread(target=watch_first_byte, args=(Dest, Started, Done, Result))
+        Watcher.start()
+        ClientCpu = wait_process(Client)
+        ServerCpu = wait_process(Server)
+        Elapsed = time.monotonic() - Started
+        Done.set()
+        Watcher.join()
+        Emulator.stop()
+
+        ClientLog.seek(0)
+        ServerLog.seek(0)
+        ClientErr = ClientLog.read().decode(errors='replace')
+        ServerErr = ServerLog.read().decode(errors='replace')
+        ClientLog.close()
+        ServerLog.close()
+        Received = Result.get('received') if Mode == 'pipe' else tree_size(Dest)
+        Case = {
+            'mode': Mode,
+            'size': Size,
+            'profile': ProfileName,
+            'ok': Client.returncode == 0 and Server.returncode == 0 and Received == Size,
+            'seconds': Elapsed,
+            'throughput_mbps': Size * 8 / Elapsed / 1000000,
+            'first_byte_seconds': Result.get('first_byte'),
+            'client_cpu_seconds': ClientCpu,
+            'server_cpu_seconds': ServerCpu,
+            'relay': Emulator.stats()}
+        if ClientCpu is not None and ServerCpu is not None:
+            Case['cpu_seconds_per_gb'] = (ClientCpu + ServerCpu) / (Size / 1000000000)
+        if not Case['ok']:
+            Case['client_stderr'] = ClientErr[-2000:]
+            Case['server_stderr'] = ServerErr[-2000:]
+        return Case
+
+def case_key(Case: dict) -> str:
+    return Case['mode'] + '/' + str(Case['size']) + '/' + Case['profile']
+
+def median_case(Runs: list) -> dict:
+    Runs = sorted(Runs, key=lambda Run: Run['throughput_mbps'])
+    Case = dict(Runs[len(Runs) // 2])
+    Case['runs'] = len(Runs)
+    Case['ok'] = all(Run['ok'] for Run in Runs)
+    return Case
+
+def compare(Results: list, Baseline: dict, Threshold: float) -> list:
+    """Returns a description of each regression against Baseline."""
+    Previous = {case_key(Case): Case for Case in Baseline['results']}
+    Regressions = []
+    for Case in Results:
+        Old = Previous.get(case_key(Case))
+        if Old is None or not Old['ok']:
+            continue
+        if Case['throughput_mbps'] < Old['throughput_mbps'] * (1 - Threshold):
+            Regressions.append(case_key(Case) + ': throughput {:.1f} Mbit/s, was {:.1f}'.format(
+                Case['throughput_mbps'], Old['throughput_mbps']))
+        if Case.get('cpu_seconds_per_gb') and Old.get('cpu_seconds_per_gb') and \
+           Case['cpu_seconds_per_gb'] > Old['cpu_seconds_per_gb'] * (1 + Threshold):
+            Regressions.append(case_key(Case) + ': {:.2f} CPU seconds per GB, was {:.2f}'.format(
+                Case['cpu_seconds_per_gb'], Old['cpu_seconds_per_gb']))
+        if Case.get('first_byte_seconds') is not None and Old.get('first_byte_seconds') is not None and \
+           Case['first_byte_seconds'] > Old['first_byte_seconds'] * (1 + Threshold) + TTFB_SLACK:
+            Regressions.append(case_key(Case) + ': first byte after {:.3f}s, was {:.3f}s'.format(
+                Case['first_byte_seconds'], Old['first_byte_seconds']))
+    return Regressions
+
+def parse_args(Args: list) -> dict:
+    Options = {
+        'binary': '.' + os.path.sep + 'quiccat',
+        'sizes': DEFAULT_SIZES,
+        'modes': DEFAULT_MODES,
+        'profiles': DEFAULT_PROFILES,
+        'repeat': 1,
+        'threshold': 0.1,
+        'output': None,
+        'baseline': None,
+        'save': None}
+    for Arg in Args:
+        if not Arg.startswith('-') or ':' not in Arg:
+            sys.exit('Arguments are -name:value; see the top of benchmark.py')
+        Name, Value = Arg[1:].split(':', 1)
+        if Name not in Options:
+            sys.exit('Unknown argument -' + Name)
+        if Name == 'sizes':
+            Options[Name] = [int(Size) for Size in Value.split(',')]
+        elif Name in ('modes', 'profiles'):
+            Options[Name] = Value.split(',')
+        elif Name == 'repeat':
+            Options[Name] = int(Value)
+        elif Name == 'threshold':
+            Options[Name] = float(Value)
+        else:
+            Options[Name] = Value
+    for Mode in Options['modes']:
+        if Mode not in DEFAULT_MODES:
+            sys.exit('Unknown mode ' + Mode)
+    for Profile in Options['profiles']:
+        if Profile not in PROFILES:
+            sys.exit('Unknown profile ' + Profile + '; one of ' + ', '.join(PROFILES))
+    return Options
+
+if __name__ == '__main__':
+    Options = parse_args(sys.argv[1:])
+    if shutil.which(Options['binary']) is None and not os.path.exists(Options['binary']):
+        sys.exit(Options['binary'] + " doesn't exist!")
+    Results = []
+    Failed = False
+    for Profile in Options['profiles']:
+        for Mode in Options['modes']:
+            for Size in Options['sizes']:
+                print('Benchmarking ' + Mode + ' mode, ' + str(Size) + ' bytes, ' + Profile + ' path...', end='', flush=True)
+                Case = median_case([run_case(Options['binary'], Mode, Size, Profile) for _ in range(Options['repeat'])])
+                Results.append(Case)
+                if Case['ok']:
+                    print(' {:.1f} Mbit/s'.format(Case['throughput_mbps']))
+                else:
+                    print(' Failed!')
+                    print(Case.get('client_stderr', ''))
+                    print(Case.get('server_stderr', ''))
+                    Failed = True
+    Report = {
+        'machine': platform.node(),
+        'platform': platform.platform(),
+        'time': time.strftime('%Y-%m-%dT%H:%M:%S'),
+        'results': Results}
+    if Options['output']:
+        with open(Options['output'], 'w') as File:
+            json.dump(Report, File, indent=2)
+    if Options['save']:
+        with open(Options['save'], 'w') as File:
+            json.dump(Report, File, indent=2)
+    if Options['baseline']:
+        with open(Options['baseline']) as File:
+            Baseline = json.load(File)
+        Regressions = compare(Results, Baseline, Options['threshold'])
+        for Regression in Regressions:
+            print('Regression: ' + Regression)
+        if Regressions:
+            Failed = True
+        else:
+            print('No regressions beyond ' + str(int(Options['threshold'] * 100)) + '% of the baseline.')
+    if Failed:
+        sys.exit(1)
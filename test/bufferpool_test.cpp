@@ -0,0 +1,170 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "libquiccat.h"
+
+using namespace std;
+
+//
+// Checks of QcBufferPool's accounting and cap (see bufferpool.h), run by
+// end2end.py. Returns non-zero if any fails.
+//
+
+const size_t Small = 64 * 1024;
+const size_t Large = 8 * 1024 * 1024;
+const uint64_t Cap = 1024 * 1024;
+
+uint32_t Failures = 0;
+
+void
+Check(
+    _In_ bool Condition,
+    _In_ const string& What
+    )
+{
+    if (!Condition) {
+        Log() << "FAILED: " << What << endl;
+        Failures++;
+    }
+}
+
+//
+// Buffers are counted in flight while held, and in the pool's memory until
+// it releases them; sizes past the classes are taken and released exactly.
+//
+void
+TestAccounting()
+{
+    auto& Pool = QcBufferPool::Get();
+    auto Before = Pool.GetStatistics();
+    {
+        vector<QcBuffer> Buffers;
+        for (int i = 0; i < 3; ++i) {
+            Buffers.push_back(Pool.Allocate(Small));
+        }
+        auto Held = Pool.GetStatistics();
+        Check(Held.BytesInFlight == Before.BytesInFlight + 3 * Small, "bytes in flight while held");
+        Check(Held.BytesInFlightHighWater >= Held.BytesInFlight, "in flight high water");
+        Check(Held.BytesAllocated == Before.BytesAllocated + 3 * Small, "bytes allocated for new buffers");
+        Check(Held.BytesAllocatedHighWater >= Held.BytesAllocated, "allocated high water");
+    }
+    auto Freed = Pool.GetStatistics();
+    Check(Freed.BytesInFlight == Before.BytesInFlight, "bytes in flight once freed");
+    Check(Freed.BytesAllocated == Before.BytesAllocated + 3 * Small, "freed buffers kept for reuse");
+
+    // An odd size takes its whole class.
+    {
+        auto Buffer = Pool.Allocate(Small + 1);
+        Check(Pool.GetStatistics().BytesInFlight == Freed.BytesInFlight + 2 * Small, "odd size rounded to its class");
+    }
+
+    Before = Pool.GetStatistics();
+    {
+        auto Buffer = Pool.Allocate(Large);
+        auto Held = Pool.GetStatistics();
+        Check(Held.BytesAllocated == Before.BytesAllocated + Large, "large buffer allocated exactly");
+        Check(Held.BytesAllocatedHighWater >= Before.BytesAllocated + Large, "large buffer raised the high water");
+    }
+    Check(Pool.GetStatistics().BytesAllocated == Before.BytesAllocated, "large buffer released on free");
+}
+
+//
+// Once warmed up, allocating and freeing as a transfer does takes nothing
+// new from the system.
+//
+void
+TestSteadyState()
+{
+    auto& Pool = QcBufferPool::Get();
+    auto Cycle = [&Pool]() {
+        vector<QcBuffer> Buffers;
+        for (size_t Length : {(size_t)4096, Small, (size_t)1024 * 1024}) {
+            for (int i = 0; i < 4; ++i) {
+                Buffers.push_back(Pool.Allocate(Length));
+            }
+        }
+    };
+    Cycle();
+    auto Warm = Pool.GetStatistics();
+    for (int i = 0; i < 1000; ++i) {
+        Cycle();
+    }
+    auto After = Pool.GetStatistics();
+    Check(After.BytesAllocated == Warm.BytesAllocated, "no new memory in steady state");
+    Check(After.BytesAllocatedHighWater == Warm.BytesAllocatedHighWater, "no new high water in steady state");
+    Check(After.AllocationsFailed == Warm.AllocationsFailed, "no failures in steady state");
+}
+
+//
+// Under the cap, buffers not in use are released to make room, and
+// allocations fail only once everything counted is held.
+//
+void
+TestCap()
+{
+    auto& Pool = QcBufferPool::Get();
+    Pool.SetLimit(Cap);
+    auto Before = Pool.GetStatistics();
+    vector<QcBuffer> Buffers;
+    while (Buffers.size() <= Cap / Small) {
+        auto Buffer = Pool.Allocate(Small);
+        if (!Buffer) {
+            break;
+        }
+        Buffers.push_back(move(Buffer));
+    }
+    auto Full = Pool.GetStatistics();
+    Check(Buffers.size() == Cap / Small, "filled the cap with " + to_string(Buffers.size()) + " buffers");
+    Check(Full.AllocationsFailed == Before.AllocationsFailed + 1, "allocation past the cap failed");
+    Check(Full.BytesAllocated <= Cap, "allocated memory kept under the cap");
+    Check(!Pool.Allocate(Large), "large allocation past the cap failed");
+    Buffers.clear();
+
+    // Buffers freed on a thread which never allocates, as MsQuic's workers
+    // free sends, are still given back under the cap while it lives.
+    for (size_t i = 0; i < Cap / Small; ++i) {
+        Buffers.push_back(Pool.Allocate(Small));
+    }
+    mutex Lock;
+    condition_variable Changed;
+    bool Freed = false, Done = false;
+    thread Freer([&]() {
+        Buffers.clear();
+        unique_lock<mutex> Guard(Lock);
+        Freed = true;
+        Changed.notify_all();
+        Changed.wait(Guard, [&Done]{ return Done; });
+    });
+    {
+        unique_lock<mutex> Guard(Lock);
+        Changed.wait(Guard, [&Freed]{ return Freed; });
+    }
+    vector<QcBuffer> Others;
+    for (size_t i = 0; i < Cap / (4 * Small); ++i) {
+        Others.push_back(Pool.Allocate(4 * Small));
+    }
+    Check(
+        all_of(Others.begin(), Others.end(), [](const QcBuffer& Buffer) { return (bool)Buffer; }),
+        "buffers cached by another thread released under the cap");
+    {
+        unique_lock<mutex> Guard(Lock);
+        Done = true;
+    }
+    Changed.notify_all();
+    Freer.join();
+    Others.clear();
+    Pool.SetLimit(0);
+}
+
+int
+main()
+{
+    TestAccounting();
+    TestSteadyState();
+    TestCap();
+    if (Failures != 0) {
+        Log() << Failures << " buffer pool checks failed!" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -1,12 +1,18 @@
 import subprocess
 import random
+import re
+import selectors
 import tempfile
 import os
+import socket
 import sys
+import threading
 import time
 
 BLOCK_SIZE = 100000
 QUICCAT_BLOCK_SIZE = 131072
+# Allowance for file systems allocating sparse files' data differently.
+SPARSE_SLACK = 1024 * 1024
 RESULT_CLIENT_RETURN = 'client_return'
 RESULT_CLIENT_STDOUT = 'client_stdout'
 RESULT_CLIENT_STDERR = 'client_strerr'
@@ -17,12 +23,12 @@ RESULT_SERVER_RETURN = 'server_return'
 RESULT_SERVER_STDOUT = 'server_stdout'
 RESULT_SERVER_STDERR = 'server_stderr'
 
-def run_transfer(File: str, Dest: str) -> dict:
+def run_transfer(File: str, Dest: str, ClientArgs: list = [], ServerArgs: list = []) -> dict:
     server = subprocess.Popen(
-        ["./quiccat", "-listen:*", "-port:8888", "-destination:" + Dest], stderr=subprocess.PIPE)
+        ["./quiccat", "-listen:*", "-port:8888", "-destination:" + Dest] + ServerArgs, stderr=subprocess.PIPE)
     time.sleep(1)
     client = subprocess.Popen(
-        ["./quiccat", "-target:127.0.0.1", "-port:8888", "-file:" + File], stderr=subprocess.PIPE)
+        ["./quiccat", "-target:127.0.0.1", "-port:8888", "-file:" + File] + ClientArgs, stderr=subprocess.PIPE)
     server.wait()
     client.wait()
     result = dict()
@@ -32,9 +38,9 @@ def run_transfer(File: str, Dest: str) -> dict:
     result[RESULT_SERVER_STDERR] = server.stderr.read()
     return result
 
-def run_multi_transfer(File1: str, File2: str, Dest: str) -> dict:
+def run_multi_transfer(File1: str, File2: str, Dest: str, ServerArgs: list = []) -> dict:
     server = subprocess.Popen(
-        ["./quiccat", "-listen:*", "-port:8888", "-wait:1", "-destination:" + Dest], stderr=subprocess.PIPE, stdin=subprocess.PIPE)
+        ["./quiccat", "-listen:*", "-port:8888", "-wait:1", "-destination:" + Dest] + ServerArgs, stderr=subprocess.PIPE, stdin=subprocess.PIPE)
     time.sleep(1)
     client = subprocess.Popen(
         ["./quiccat", "-target:127.0.0.1", "-port:8888", "-file:" + File1], stderr=subprocess.PIPE)
@@ -52,6 +58,73 @@ def run_multi_transfer(File1: str, File2: str, Dest: str) -> dict:
     result[RESULT_SERVER_STDERR] = server_result[1]
     return result
 
+def run_fanout_transfer(File: str, Dests: list) -> list:
+    # One server per loopback address, all on the same port.
+    servers = []
+    for i, Dest in enumerate(Dests):
+        servers.append(subprocess.Popen(
+            ["./quiccat", "-listen:127.0.0." + str(i + 1), "-port:8888", "-destination:" + Dest], stderr=subprocess.PIPE))
+    time.sleep(1)
+    targets = ','.join("127.0.0." + str(i + 1) for i in range(len(Dests)))
+    client = subprocess.Popen(
+        ["./quiccat", "-target:" + targets, "-port:8888", "-file:" + File], stderr=subprocess.PIPE)
+    client.wait()
+    results = []
+    for server in servers:
+        server.wait()
+        result = dict()
+        result[RESULT_CLIENT_RETURN] = client.returncode
+        result[RESULT_SERVER_RETURN] = server.returncode
+        result[RESULT_SERVER_STDERR] = server.stderr.read()
+        results.append(result)
+    client_stderr = client.stderr.read()
+    for result in results:
+        result[RESULT_CLIENT_STDERR] = client_stderr
+    return results
+
+def run_relay_transfer(File: str, Dest: str) -> dict:
+    server = subprocess.Popen(
+        ["./quiccat", "-listen:*", "-port:8889", "-destination:" + Dest], stderr=subprocess.PIPE)
+    relay = subprocess.Popen(
+        ["./quiccat", "-listen:*", "-port:8888", "-relay:127.0.0.1", "-relayport:8889"], stderr=subprocess.PIPE)
+    time.sleep(1)
+    client = subprocess.Popen(
+        ["./quiccat", "-target:127.0.0.1", "-port:8888", "-file:" + File], stderr=subprocess.PIPE)
+    client.wait()
+    relay.wait()
+    server.wait()
+    result = dict()
+    result[RESULT_CLIENT_RETURN] = client.returncode
+    result[RESULT_CLIENT_STDERR] = client.stderr.read()
+    result[RESULT_SERVER_RETURN] = server.returncode
+    result[RESULT_SERVER_STDERR] = server.stderr.read() + relay.stderr.read()
+    if relay.returncode != 0:
+        result[RESULT_SERVER_RETURN] = relay.returncode
+    return result
+
+def run_fetch_transfer(Name: str, ServeDir: str, Dest: str, Sources: int) -> dict:
+    # One serving listener per loopback address, all on the same port.
+    servers = []
+    for i in range(Sources):
+        servers.append(subprocess.Popen(
+            ["./quiccat", "-listen:127.0.0." + str(i + 1), "-port:8888", "-serve:" + ServeDir], stderr=subprocess.PIPE))
+    time.sleep(1)
+    targets = ','.join("127.0.0." + str(i + 1) for i in range(Sources))
+    client = subprocess.Popen(
+        ["./quiccat", "-target:" + targets, "-port:8888", "-fetch:" + Name, "-destination:" + Dest], stderr=subprocess.PIPE)
+    client.wait()
+    result = dict()
+    result[RESULT_CLIENT_RETURN] = client.returncode
+    result[RESULT_CLIENT_STDERR] = client.stderr.read()
+    result[RESULT_SERVER_RETURN] = 0
+    result[RESULT_SERVER_STDERR] = b""
+    for server in servers:
+        server.wait()
+        result[RESULT_SERVER_STDERR] += server.stderr.read()
+        if server.returncode != 0:
+            result[RESULT_SERVER_RETURN] = server.returncode
+    return result
+
 def run_stdout_transfer(File: str, Dest: str) -> dict:
     server = subprocess.Popen(
         ' '.join(["{}quiccat".format('.' + os.path.sep), "-listen:*", "-port:8888", ">", Dest]),
@@ -171,14 +244,220 @@ def compare_files(File1: str, File2: str) -> bool:
                 f2Bytes = f2.read(BLOCK_SIZE)
             return True
 
-def transfer_test(Size: int):
-    print('Testing transfer of a ' + str(Size) + ' byte file...', end='', flush=True)
+def transfer_test(Size: int, ClientArgs: list = [], ServerArgs: list = []):
+    print('Testing transfer of a ' + str(Size) + ' byte file' + ''.join(' ' + Arg for Arg in ClientArgs + ServerArgs) + '...', end='', flush=True)
     with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
         with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
             srcFileName = "Test_" + str(Size) + ".tmp"
             srcFilePath = srcTemp + os.path.sep + srcFileName
             create_file(srcFilePath, Size)
-            results = run_transfer(srcFilePath, destTemp)
+            results = run_transfer(srcFilePath, destTemp, ClientArgs, ServerArgs)
+            if results[RESULT_CLIENT_RETURN] != 0:
+                print(results[RESULT_CLIENT_STDERR])
+                sys.exit("Client return was non-zero! " + str(results[RESULT_CLIENT_RETURN]))
+            if results[RESULT_SERVER_RETURN] != 0:
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Server return was non-zero! " + str(results[RESULT_SERVER_RETURN]))
+            if not compare_files(srcFilePath, destTemp + os.path.sep + srcFileName):
+                print(results[RESULT_CLIENT_STDERR])
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Transferred file was not identical!")
+            print(' Success!')
+
+def header_parser_test():
+    print('Testing transfer header parsing...', end='', flush=True)
+    checks = subprocess.run(["./header_test"], stderr=subprocess.PIPE)
+    if checks.returncode != 0:
+        print(checks.stderr)
+        sys.exit("Header checks failed!")
+    print(' Success!')
+
+def scheduler_test():
+    print('Testing transfer scheduling...', end='', flush=True)
+    checks = subprocess.run(["./scheduler_test"], stderr=subprocess.PIPE)
+    if checks.returncode != 0:
+        print(checks.stderr)
+        sys.exit("Scheduler checks failed!")
+    print(' Success!')
+
+def bufferpool_test():
+    print('Testing the buffer pool...', end='', flush=True)
+    checks = subprocess.run(["./bufferpool_test"], stderr=subprocess.PIPE)
+    if checks.returncode != 0:
+        print(checks.stderr)
+        sys.exit("Buffer pool checks failed!")
+    print(' Success!')
+
+def create_sparse_file(Filename: str, Size: int):
+    # Data at the start and in the middle, with a trailing hole.
+    r = random.Random()
+    with open(Filename, "wb") as file:
+        file.write(r.randbytes(BLOCK_SIZE))
+        file.seek(Size // 2)
+        file.write(r.randbytes(BLOCK_SIZE))
+        file.truncate(Size)
+
+def sparse_transfer_test(Size: int):
+    print('Testing sparse transfer of a ' + str(Size) + ' byte file...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            srcFileName = "Sparse_" + str(Size) + ".tmp"
+            srcFilePath = srcTemp + os.path.sep + srcFileName
+            create_sparse_file(srcFilePath, Size)
+            results = run_transfer(srcFilePath, destTemp, ["-sparse:1"])
+            if results[RESULT_CLIENT_RETURN] != 0:
+                print(results[RESULT_CLIENT_STDERR])
+                sys.exit("Client return was non-zero! " + str(results[RESULT_CLIENT_RETURN]))
+            if results[RESULT_SERVER_RETURN] != 0:
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Server return was non-zero! " + str(results[RESULT_SERVER_RETURN]))
+            destFilePath = destTemp + os.path.sep + srcFileName
+            if not compare_files(srcFilePath, destFilePath):
+                print(results[RESULT_CLIENT_STDERR])
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Transferred file was not identical!")
+            # The holes must stay holes, give or take the file systems'
+            # allocation granularity. Only checked where the source is sparse.
+            srcAllocated = os.stat(srcFilePath).st_blocks * 512
+            destAllocated = os.stat(destFilePath).st_blocks * 512
+            if srcAllocated < Size // 2 and destAllocated > srcAllocated + SPARSE_SLACK:
+                sys.exit("Transferred file isn't sparse! " + str(destAllocated) + " bytes allocated, source has " + str(srcAllocated))
+            print(' Success!')
+
+def delta_transfer_test(Size: int):
+    print('Testing delta transfer of a ' + str(Size) + ' byte file...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            srcFileName = "Delta_" + str(Size) + ".tmp"
+            srcFilePath = srcTemp + os.path.sep + srcFileName
+            create_file(srcFilePath, Size)
+            # The destination has an older copy: same data, with a changed
+            # region and a shifted tail.
+            with open(srcFilePath, "rb") as src:
+                data = src.read()
+            with open(destTemp + os.path.sep + srcFileName, "wb") as dest:
+                dest.write(data[:Size // 3] + random.Random().randbytes(1000) + data[Size // 2:])
+            results = run_transfer(srcFilePath, destTemp, ["-delta:1"])
+            if results[RESULT_CLIENT_RETURN] != 0:
+                print(results[RESULT_CLIENT_STDERR])
+                sys.exit("Client return was non-zero! " + str(results[RESULT_CLIENT_RETURN]))
+            if results[RESULT_SERVER_RETURN] != 0:
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Server return was non-zero! " + str(results[RESULT_SERVER_RETURN]))
+            if not compare_files(srcFilePath, destTemp + os.path.sep + srcFileName):
+                print(results[RESULT_CLIENT_STDERR])
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Transferred file was not identical!")
+            # Most of the file matches the old copy, so most of it mustn't be
+            # sent.
+            sent = [int(line.split()[0]) for line in results[RESULT_CLIENT_STDERR].decode().splitlines()
+                    if 'bytes sent in' in line]
+            if not sent or sent[0] >= Size // 2:
+                print(results[RESULT_CLIENT_STDERR])
+                sys.exit("Delta transfer didn't save any bytes!")
+            print(' Success!')
+
+def dedup_transfer_test(Size: int):
+    print('Testing deduplicated transfers of ' + str(Size) + ' byte files...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            with tempfile.TemporaryDirectory(prefix='chunks') as storeTemp:
+                # The second file is the first with a changed region and a
+                # shifted tail, so most of its chunks are already stored.
+                firstPath = srcTemp + os.path.sep + "Dedup_1.tmp"
+                secondPath = srcTemp + os.path.sep + "Dedup_2.tmp"
+                create_file(firstPath, Size)
+                with open(firstPath, "rb") as src:
+                    data = src.read()
+                with open(secondPath, "wb") as dest:
+                    dest.write(data[:Size // 3] + random.Random().randbytes(1000) + data[Size // 2:])
+                server = subprocess.Popen(
+                    ["./quiccat", "-listen:*", "-port:8888", "-wait:1", "-destination:" + destTemp,
+                     "-chunkstore:" + storeTemp], stderr=subprocess.PIPE, stdin=subprocess.PIPE)
+                time.sleep(1)
+                outputs = []
+                for path in [firstPath, secondPath]:
+                    client = subprocess.Popen(
+                        ["./quiccat", "-target:127.0.0.1", "-port:8888", "-file:" + path, "-dedup:1"],
+                        stderr=subprocess.PIPE)
+                    outputs.append(client.communicate()[1])
+                    if client.returncode != 0:
+                        print(outputs[-1])
+                        server.kill()
+                        sys.exit("Client return was non-zero! " + str(client.returncode))
+                server_result = server.communicate(input=b"\n", timeout=5)
+                if server.returncode != 0:
+                    print(server_result[1])
+                    sys.exit("Server return was non-zero! " + str(server.returncode))
+                for path in [firstPath, secondPath]:
+                    if not compare_files(path, destTemp + os.path.sep + os.path.basename(path)):
+                        print(outputs)
+                        print(server_result[1])
+                        sys.exit("Transferred file was not identical!")
+                deduplicated = [int(line.split()[0]) for line in outputs[1].decode().splitlines()
+                                if 'bytes deduplicated' in line]
+                if not deduplicated or deduplicated[0] == 0:
+                    print(outputs[1])
+                    sys.exit("Second transfer wasn't deduplicated!")
+                print(' Success!')
+
+def packed_transfer_test(FileCount: int):
+    print('Testing packed transfer of a directory of ' + str(FileCount) + ' files...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            srcDir = srcTemp + os.path.sep + "Packed"
+            names = []
+            for i in range(FileCount):
+                # Mostly small files, a few large enough to be written as they arrive.
+                name = os.path.join("d" + str(i % 7), "s" + str(i % 3), "f" + str(i) + ".tmp")
+                os.makedirs(os.path.dirname(srcDir + os.path.sep + name), exist_ok=True)
+                create_file(srcDir + os.path.sep + name, 3000000 if i % 100 == 0 else i * 37)
+                names.append(name)
+            results = run_transfer(srcDir, destTemp)
+            if results[RESULT_CLIENT_RETURN] != 0:
+                print(results[RESULT_CLIENT_STDERR])
+                sys.exit("Client return was non-zero! " + str(results[RESULT_CLIENT_RETURN]))
+            if results[RESULT_SERVER_RETURN] != 0:
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Server return was non-zero! " + str(results[RESULT_SERVER_RETURN]))
+            for name in names:
+                if not compare_files(srcDir + os.path.sep + name, destTemp + os.path.sep + "Packed" + os.path.sep + name):
+                    print(results[RESULT_CLIENT_STDERR])
+                    print(results[RESULT_SERVER_STDERR])
+                    sys.exit("Transferred file " + name + " was not identical!")
+            print(' Success!')
+
+def fanout_transfer_test(Size: int, Targets: int):
+    print('Testing fan-out of a ' + str(Size) + ' byte file to ' + str(Targets) + ' servers...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        destTemps = [tempfile.TemporaryDirectory(prefix='dest') for i in range(Targets)]
+        srcFileName = "Fanout_" + str(Size) + ".tmp"
+        srcFilePath = srcTemp + os.path.sep + srcFileName
+        create_file(srcFilePath, Size)
+        results = run_fanout_transfer(srcFilePath, [d.name for d in destTemps])
+        for destTemp, result in zip(destTemps, results):
+            if result[RESULT_CLIENT_RETURN] != 0:
+                print(result[RESULT_CLIENT_STDERR])
+                sys.exit("Client return was non-zero! " + str(result[RESULT_CLIENT_RETURN]))
+            if result[RESULT_SERVER_RETURN] != 0:
+                print(result[RESULT_SERVER_STDERR])
+                sys.exit("Server return was non-zero! " + str(result[RESULT_SERVER_RETURN]))
+            if not compare_files(srcFilePath, destTemp.name + os.path.sep + srcFileName):
+                print(result[RESULT_CLIENT_STDERR])
+                print(result[RESULT_SERVER_STDERR])
+                sys.exit("Transferred file was not identical!")
+        for destTemp in destTemps:
+            destTemp.cleanup()
+        print(' Success!')
+
+def relay_transfer_test(Size: int):
+    print('Testing relayed transfer of a ' + str(Size) + ' byte file...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            srcFileName = "Relay_" + str(Size) + ".tmp"
+            srcFilePath = srcTemp + os.path.sep + srcFileName
+            create_file(srcFilePath, Size)
+            results = run_relay_transfer(srcFilePath, destTemp)
             if results[RESULT_CLIENT_RETURN] != 0:
                 print(results[RESULT_CLIENT_STDERR])
                 sys.exit("Client return was non-zero! " + str(results[RESULT_CLIENT_RETURN]))
@@ -191,10 +470,152 @@ def transfer_test(Size: int):
                 sys.exit("Transferred file was not identical!")
             print(' Success!')
 
-def multitransfer_test():
+def fetch_transfer_test(Size: int, Sources: int):
+    print('Testing fetch of a ' + str(Size) + ' byte file from ' + str(Sources) + ' servers...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            srcFileName = "Fetch_" + str(Size) + ".tmp"
+            srcFilePath = srcTemp + os.path.sep + srcFileName
+            create_file(srcFilePath, Size)
+            results = run_fetch_transfer(srcFileName, srcTemp, destTemp, Sources)
+            if results[RESULT_CLIENT_RETURN] != 0:
+                print(results[RESULT_CLIENT_STDERR])
+                sys.exit("Client return was non-zero! " + str(results[RESULT_CLIENT_RETURN]))
+            if results[RESULT_SERVER_RETURN] != 0:
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Server return was non-zero! " + str(results[RESULT_SERVER_RETURN]))
+            if not compare_files(srcFilePath, destTemp + os.path.sep + srcFileName):
+                print(results[RESULT_CLIENT_STDERR])
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Fetched file was not identical!")
+            print(' Success!')
+
+def serve_escape_test():
+    print('Testing fetches from outside the served directory...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            serveDir = srcTemp + os.path.sep + "Served"
+            os.mkdir(serveDir)
+            secretPath = srcTemp + os.path.sep + "Secret.tmp"
+            create_file(secretPath, 100000)
+            os.symlink(secretPath, serveDir + os.path.sep + "Link.tmp")
+            for name in ["Link.tmp", "../Secret.tmp"]:
+                results = run_fetch_transfer(name, serveDir, destTemp, 1)
+                if results[RESULT_CLIENT_RETURN] == 0:
+                    print(results[RESULT_SERVER_STDERR])
+                    sys.exit("Fetch of " + name + " succeeded!")
+                destPath = destTemp + os.path.sep + os.path.basename(name)
+                if os.path.exists(destPath) and os.path.getsize(destPath) != 0:
+                    sys.exit("Fetch of " + name + " received data!")
+            print(' Success!')
+
+def run_echo_server(Listener: socket.socket):
+    def echo(conn: socket.socket):
+        with conn:
+            while True:
+                data = conn.recv(65536)
+                if not data:
+                    break
+                conn.sendall(data)
+    while True:
+        try:
+            conn, _ = Listener.accept()
+        except OSError:
+            return
+        threading.Thread(target=echo, args=(conn,), daemon=True).start()
+
+def tunnel_test(Size: int, Connections: int):
+    print('Testing ' + str(Connections) + ' tunnelled TCP connections of ' + str(Size) + ' bytes...', end='', flush=True)
+    listener = socket.create_server(("127.0.0.1", 9000))
+    threading.Thread(target=run_echo_server, args=(listener,), daemon=True).start()
+    server = subprocess.Popen(
+        ["./quiccat", "-listen:*", "-port:8888", "-expose:127.0.0.1:9000"], stderr=subprocess.PIPE)
+    time.sleep(1)
+    client = subprocess.Popen(
+        ["./quiccat", "-target:127.0.0.1", "-port:8888", "-forward:127.0.0.1:9001"], stderr=subprocess.PIPE)
+    time.sleep(1)
+    failures = []
+    def exchange(index: int):
+        payload = random.randbytes(Size)
+        with socket.create_connection(("127.0.0.1", 9001)) as conn:
+            sender = threading.Thread(target=lambda: (conn.sendall(payload), conn.shutdown(socket.SHUT_WR)))
+            sender.start()
+            echoed = bytearray()
+            while True:
+                data = conn.recv(65536)
+                if not data:
+                    break
+                echoed += data
+            sender.join()
+        if echoed != payload:
+            failures.append(index)
+    threads = [threading.Thread(target=exchange, args=(i,)) for i in range(Connections)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    client.kill()
+    server.kill()
+    listener.close()
+    if failures:
+        print(client.stderr.read())
+        print(server.stderr.read())
+        sys.exit("Tunnelled data was not identical on " + str(len(failures)) + " connections!")
+    print(' Success!')
+
+def pingpong_test(Count: int):
+    print('Testing ' + str(Count) + ' ping-pong round trips...', end='', flush=True)
+    server = subprocess.Popen(
+        ["./quiccat", "-listen:*", "-port:8888", "-echo:1", "-latency:1"], stderr=subprocess.PIPE)
+    time.sleep(1)
+    client = subprocess.Popen(
+        ["./quiccat", "-target:127.0.0.1", "-port:8888", "-pingpong:" + str(Count), "-latency:1"], stderr=subprocess.PIPE)
+    client.wait()
+    server.wait()
+    clientErr = client.stderr.read()
+    if client.returncode != 0 or server.returncode != 0:
+        print(clientErr)
+        print(server.stderr.read())
+        sys.exit("Ping-pong return was non-zero! " + str(client.returncode) + ", " + str(server.returncode))
+    if (str(Count) + " round trips").encode() not in clientErr:
+        print(clientErr)
+        sys.exit("Ping-pong didn't complete every round trip!")
+    print(' Success!')
+
+def same_name_test(ServerArgs: list):
+    print('Testing two transfers of one name' + ''.join(' ' + Arg for Arg in ServerArgs) + '...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            srcFileName = "Same.tmp"
+            os.mkdir(srcTemp + os.path.sep + "1")
+            os.mkdir(srcTemp + os.path.sep + "2")
+            srcFilePath1 = srcTemp + os.path.sep + "1" + os.path.sep + srcFileName
+            srcFilePath2 = srcTemp + os.path.sep + "2" + os.path.sep + srcFileName
+            create_file(srcFilePath1, 10000000)
+            create_file(srcFilePath2, 20000000)
+            results = run_multi_transfer(srcFilePath1, srcFilePath2, destTemp, ServerArgs)
+            if results[RESULT_CLIENT_RETURN] != 0 or results[RESULT_CLIENT2_RETURN] != 0:
+                print(results[RESULT_CLIENT_STDERR])
+                print(results[RESULT_CLIENT2_STDERR])
+                sys.exit("Client return was non-zero!")
+            if results[RESULT_SERVER_RETURN] != 0:
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Server return was non-zero! " + str(results[RESULT_SERVER_RETURN]))
+            # Whichever was committed last wins, but whole.
+            destFilePath = destTemp + os.path.sep + srcFileName
+            expected = srcFilePath1 if os.path.getsize(destFilePath) == 10000000 else srcFilePath2
+            if not compare_files(expected, destFilePath):
+                print(results[RESULT_SERVER_STDERR])
+                sys.exit("Received file matches neither transfer!")
+            if os.listdir(destTemp) != [srcFileName]:
+                print(os.listdir(destTemp))
+                sys.exit("Partial files were left in the destination!")
+            print(' Success!')
+
+def multitransfer_test(ServerArgs: list = []):
     Size1 = 1000000
     Size2 = 100000000
-    print('Testing transfer of a ' + str(Size1) + ' and ' + str(Size2) + ' byte file...', end='', flush=True)
+    print('Testing transfer of a ' + str(Size1) + ' and ' + str(Size2) + ' byte file' + ''.join(' ' + Arg for Arg in ServerArgs) + '...', end='', flush=True)
     with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
         with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
             srcFileName1 = "Test_" + str(Size1) + ".tmp"
@@ -203,7 +624,7 @@ def multitransfer_test():
             srcFilePath2 = srcTemp + os.path.sep + srcFileName2
             create_file(srcFilePath1, Size1)
             create_file(srcFilePath2, Size2)
-            results = run_multi_transfer(srcFilePath1, srcFilePath2, destTemp)
+            results = run_multi_transfer(srcFilePath1, srcFilePath2, destTemp, ServerArgs)
             if results[RESULT_CLIENT_RETURN] != 0:
                 print(results[RESULT_CLIENT_STDERR])
                 sys.exit("Client1 return was non-zero! " + str(results[RESULT_CLIENT_RETURN]))
@@ -223,8 +644,206 @@ def multitransfer_test():
                 print(results[RESULT_CLIENT2_STDERR])
                 print(results[RESULT_SERVER_STDERR])
                 sys.exit("Transferred file2 was not identical!")
+            if sorted(os.listdir(destTemp)) != sorted([srcFileName1, srcFileName2]):
+                print(os.listdir(destTemp))
+                sys.exit("Partial files were left in the destination!")
+            print(' Success!')
+
+def handshake_flood_test(Clients: int):
+    print('Testing ' + str(Clients) + ' password handshakes at once with -maxverifications:2...', end='', flush=True)
+    Size = 100000
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            srcFileNames = ["Test_" + str(i) + ".tmp" for i in range(Clients)]
+            for Name in srcFileNames:
+                create_file(srcTemp + os.path.sep + Name, Size)
+            # Any pending verification is half of the limit, which forces
+            # Retry of every handshake until the backlog drains.
+            server = subprocess.Popen(
+                ["./quiccat", "-listen:*", "-port:8888", "-wait:1", "-destination:" + destTemp,
+                 "-password:flood", "-maxverifications:2"],
+                stderr=subprocess.PIPE, stdin=subprocess.PIPE)
+            time.sleep(1)
+            clients = [subprocess.Popen(
+                ["./quiccat", "-target:127.0.0.1", "-port:8888", "-password:flood", "-file:" + srcTemp + os.path.sep + Name],
+                stderr=subprocess.PIPE) for Name in srcFileNames]
+            for client in clients:
+                client.wait()
+            serverErr = server.communicate(input=b"\n", timeout=5)[1]
+            if server.returncode != 0:
+                print(serverErr)
+                sys.exit("Server return was non-zero! " + str(server.returncode))
+            # Handshakes past the limit are refused; the rest must complete.
+            succeeded = [Name for client, Name in zip(clients, srcFileNames) if client.returncode == 0]
+            if not succeeded:
+                print(serverErr)
+                sys.exit("No client got through the handshake limit!")
+            for Name in succeeded:
+                if not compare_files(srcTemp + os.path.sep + Name, destTemp + os.path.sep + Name):
+                    print(serverErr)
+                    sys.exit("Transferred file " + Name + " was not identical!")
+            if re.search(rb"[1-9][0-9]* retry enforcements", serverErr) is None:
+                print(serverErr)
+                sys.exit("Server didn't force Retry while verifications were pending!")
+            print(' Success!')
+
+def scheduled_transfer_test(ClientArgs: list):
+    Sizes = [100000, 10000000]
+    print('Testing ' + str(len(Sizes)) + ' files from one client' + ''.join(' ' + Arg for Arg in ClientArgs) + '...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            # Names with commas in them are still one file each.
+            srcFilePaths = [srcTemp + os.path.sep + "Test,_" + str(Size) + ".tmp" for Size in Sizes]
+            for Path, Size in zip(srcFilePaths, Sizes):
+                create_file(Path, Size)
+            server = subprocess.Popen(
+                ["./quiccat", "-listen:*", "-port:8888", "-wait:1", "-destination:" + destTemp], stderr=subprocess.PIPE, stdin=subprocess.PIPE)
+            time.sleep(1)
+            client = subprocess.Popen(
+                ["./quiccat", "-target:127.0.0.1", "-port:8888"] + ["-file:" + Path for Path in srcFilePaths] + ClientArgs, stderr=subprocess.PIPE)
+            client.wait()
+            serverErr = server.communicate(input=b"\n", timeout=5)[1]
+            if client.returncode != 0:
+                print(client.stderr.read())
+                sys.exit("Client return was non-zero! " + str(client.returncode))
+            if server.returncode != 0:
+                print(serverErr)
+                sys.exit("Server return was non-zero! " + str(server.returncode))
+            for Path in srcFilePaths:
+                if not compare_files(Path, destTemp + os.path.sep + os.path.basename(Path)):
+                    print(client.stderr.read())
+                    print(serverErr)
+                    sys.exit("Transferred " + os.path.basename(Path) + " was not identical!")
             print(' Success!')
 
+def stripe_transfer_test(Size: int, ClientArgs: list):
+    print('Testing striped transfer of a ' + str(Size) + ' byte file' + ''.join(' ' + Arg for Arg in ClientArgs) + '...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            srcFileName = "Stripe_" + str(Size) + ".tmp"
+            srcFilePath = srcTemp + os.path.sep + srcFileName
+            create_file(srcFilePath, Size)
+            # Each path is a connection of its own.
+            server = subprocess.Popen(
+                ["./quiccat", "-listen:*", "-port:8888", "-wait:1", "-destination:" + destTemp], stderr=subprocess.PIPE, stdin=subprocess.PIPE)
+            time.sleep(1)
+            client = subprocess.Popen(
+                ["./quiccat", "-port:8888", "-file:" + srcFilePath] + ClientArgs, stderr=subprocess.PIPE)
+            client.wait()
+            serverErr = server.communicate(input=b"\n", timeout=5)[1]
+            if client.returncode != 0:
+                print(client.stderr.read())
+                sys.exit("Client return was non-zero! " + str(client.returncode))
+            if server.returncode != 0:
+                print(serverErr)
+                sys.exit("Server return was non-zero! " + str(server.returncode))
+            if not compare_files(srcFilePath, destTemp + os.path.sep + srcFileName):
+                print(client.stderr.read())
+                print(serverErr)
+                sys.exit("Transferred file was not identical!")
+            if os.listdir(destTemp) != [srcFileName]:
+                print(os.listdir(destTemp))
+                sys.exit("Partial files were left in the destination!")
+            print(' Success!')
+
+def run_path_dropper(Listener: socket.socket, TargetPort: int, DropAfter: int, Stop: threading.Event):
+    # Relays each client address to the server from a socket of its own, and
+    # after DropAfter bytes from the first client, drops its path both ways.
+    selector = selectors.DefaultSelector()
+    selector.register(Listener, selectors.EVENT_READ, None)
+    upstreams = {}
+    first = None
+    relayed = 0
+    while not Stop.is_set():
+        for key, _ in selector.select(0.1):
+            client = key.data
+            data = key.fileobj.recv(65536) if client else None
+            if client is None:
+                data, client = Listener.recvfrom(65536)
+                if first is None:
+                    first = client
+                if client not in upstreams:
+                    upstream = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+                    upstream.connect(("127.0.0.1", TargetPort))
+                    selector.register(upstream, selectors.EVENT_READ, client)
+                    upstreams[client] = upstream
+                if client == first:
+                    relayed += len(data)
+                    if relayed > DropAfter:
+                        continue
+                upstreams[client].send(data)
+            elif client != first or relayed <= DropAfter:
+                Listener.sendto(data, client)
+    for upstream in upstreams.values():
+        upstream.close()
+    selector.close()
+
+def stripe_path_drop_test(Size: int):
+    print('Testing striped transfer of a ' + str(Size) + ' byte file losing a path...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='src') as srcTemp:
+        with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+            srcFileName = "StripeDrop_" + str(Size) + ".tmp"
+            srcFilePath = srcTemp + os.path.sep + srcFileName
+            create_file(srcFilePath, Size)
+            server = subprocess.Popen(
+                ["./quiccat", "-listen:*", "-port:8888", "-wait:1", "-destination:" + destTemp], stderr=subprocess.PIPE, stdin=subprocess.PIPE)
+            listener = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            listener.bind(("127.0.0.1", 8887))
+            stop = threading.Event()
+            dropper = threading.Thread(target=run_path_dropper, args=(listener, 8888, Size // 8, stop))
+            dropper.start()
+            time.sleep(1)
+            # Both paths go through the dropper; the first goes dark a little
+            # way in, so its chunks have to be resent on the other.
+            client = subprocess.Popen(
+                ["./quiccat", "-target:127.0.0.1,127.0.0.1", "-stripe:1", "-port:8887", "-file:" + srcFilePath], stderr=subprocess.PIPE)
+            client.wait(timeout=120)
+            serverErr = server.communicate(input=b"\n", timeout=30)[1]
+            stop.set()
+            dropper.join()
+            listener.close()
+            if client.returncode != 0:
+                print(client.stderr.read())
+                sys.exit("Client return was non-zero! " + str(client.returncode))
+            if server.returncode != 0:
+                print(serverErr)
+                sys.exit("Server return was non-zero! " + str(server.returncode))
+            if not compare_files(srcFilePath, destTemp + os.path.sep + srcFileName):
+                print(client.stderr.read())
+                print(serverErr)
+                sys.exit("Transferred file was not identical!")
+            print(' Success!')
+
+def loadgen_test(Connections: int, ClientArgs: list):
+    print('Testing ' + str(Connections) + ' connections from one load generator' + ''.join(' ' + Arg for Arg in ClientArgs) + '...', end='', flush=True)
+    with tempfile.TemporaryDirectory(prefix='dest') as destTemp:
+        server = subprocess.Popen(
+            ["./quiccat", "-listen:*", "-port:8888", "-wait:1", "-destination:" + destTemp], stderr=subprocess.PIPE, stdin=subprocess.PIPE)
+        time.sleep(1)
+        client = subprocess.Popen(
+            ["./quiccat", "-target:127.0.0.1", "-port:8888", "-loadgen:" + str(Connections), "-sizes:100000"] + ClientArgs, stderr=subprocess.PIPE)
+        client.wait()
+        serverErr = server.communicate(input=b"\n", timeout=5)[1]
+        clientErr = client.stderr.read()
+        if client.returncode != 0:
+            print(clientErr)
+            sys.exit("Client return was non-zero! " + str(client.returncode))
+        if server.returncode != 0:
+            print(serverErr)
+            sys.exit("Server return was non-zero! " + str(server.returncode))
+        if (str(Connections) + " connections: " + str(Connections) + " completed").encode() not in clientErr:
+            print(clientErr)
+            sys.exit("Not every connection completed!")
+        if b"Handshakes of " + str(Connections).encode() not in clientErr:
+            print(clientErr)
+            sys.exit("Handshake latency wasn't reported!")
+        for Index in range(Connections):
+            Path = destTemp + os.path.sep + "loadgen-" + str(Index)
+            if not os.path.exists(Path) or os.path.getsize(Path) != 100000:
+                print(serverErr)
+                sys.exit("loadgen-" + str(Index) + " wasn't received in full!")
+        print(' Success!')
+
 def stdinout_transfer_test(Size: int):
     print('Testing transfer of a ' + str(Size) + ' byte file via stdout...', end='', flush=True)
     with tempfile.TemporaryDirectory() as tempDir:
@@ -246,10 +865,122 @@ def stdinout_transfer_test(Size: int):
             sys.exit("Transferred file was not identical!")
         print(' Success!')
 
+def datagram_test(Size: int, Record: int):
+    print('Testing ' + str(Size) + ' bytes as ' + str(Record) + ' byte datagrams...', end='', flush=True)
+    with tempfile.TemporaryDirectory() as tempDir:
+        srcFilePath = tempDir + os.path.sep + "Src_" + str(Size) + ".tmp"
+        destFilePath = tempDir + os.path.sep + "Dest_" + str(Size) + ".tmp"
+        create_file(srcFilePath, Size)
+        with open(srcFilePath, 'rb') as src, open(destFilePath, 'wb') as dest:
+            server = subprocess.Popen(
+                ["./quiccat", "-listen:*", "-port:8888", "-datagram:1", "-record:" + str(Record)],
+                stdout=dest, stderr=subprocess.PIPE)
+            time.sleep(1)
+            client = subprocess.Popen(
+                ["./quiccat", "-target:127.0.0.1", "-port:8888", "-datagram:1", "-record:" + str(Record), "-fec:8"],
+                stdin=src, stderr=subprocess.PIPE)
+            client.wait()
+            server.wait()
+        serverErr = server.stderr.read()
+        if client.returncode != 0 or server.returncode != 0:
+            print(client.stderr.read())
+            print(serverErr)
+            sys.exit("Datagram return was non-zero! " + str(client.returncode) + ", " + str(server.returncode))
+        # Datagrams are unreliable, so every record that arrived must be
+        # whole and from the source, but some may be missing.
+        with open(srcFilePath, 'rb') as src, open(destFilePath, 'rb') as dest:
+            source = src.read()
+            records = set(source[i:i + Record] for i in range(0, len(source), Record))
+            received = dest.read()
+        if len(received) % Record != 0 or \
+           any(received[i:i + Record] not in records for i in range(0, len(received), Record)):
+            print(serverErr)
+            sys.exit("Received datagrams were corrupt!")
+        if b"records received" not in serverErr:
+            print(serverErr)
+            sys.exit("Datagram server didn't report statistics!")
+        print(' Success!')
+
+def striped_pipe_test(Size: int, Streams: int, ServerArgs: list = []):
+    print('Testing ' + str(Size) + ' bytes of stdin striped over ' + str(Streams) + ' streams...', end='', flush=True)
+    with tempfile.TemporaryDirectory() as tempDir:
+        srcFilePath = tempDir + os.path.sep + "Src_" + str(Size) + ".tmp"
+        destFilePath = tempDir + os.path.sep + "Dest_" + str(Size) + ".tmp"
+        create_file(srcFilePath, Size)
+        with open(srcFilePath, 'rb') as src, open(destFilePath, 'wb') as dest:
+            server = subprocess.Popen(
+                ["./quiccat", "-listen:*", "-port:8888", "-streams:" + str(Streams)] + ServerArgs,
+                stdout=dest, stderr=subprocess.PIPE)
+            time.sleep(1)
+            client = subprocess.Popen(
+                ["./quiccat", "-target:127.0.0.1", "-port:8888", "-streams:" + str(Streams)],
+                stdin=src, stderr=subprocess.PIPE)
+            client.wait()
+            server.wait()
+        if client.returncode != 0 or server.returncode != 0:
+            print(client.stderr.read())
+            print(server.stderr.read())
+            sys.exit("Striped pipe return was non-zero! " + str(client.returncode) + ", " + str(server.returncode))
+        if not compare_files(srcFilePath, destFilePath):
+            print(client.stderr.read())
+            print(server.stderr.read())
+            sys.exit("Striped pipe output was not identical!")
+        print(' Success!')
+
 if __name__ == '__main__':
+    header_parser_test()
+    scheduler_test()
+    bufferpool_test()
     run_stdinout_close()
     run_stdout_handles()
     for size in [1000, 100000, 200000, 1000000, 100000000]:
         transfer_test(size)
         # stdinout_transfer_test(size)
+    # A client or server offering only version 1 headers, as older ones do,
+    # against one offering both.
+    transfer_test(1000000, ["-headerversion:1"])
+    transfer_test(1000000, [], ["-headerversion:1"])
+    # Kernel read-ahead on the sender, and page cache drop-behind on the
+    # receiver, over several windows.
+    transfer_test(100000000, ["-readahead:4"])
+    transfer_test(100000000, [], ["-dropbehind:4"])
     multitransfer_test()
+    # Second client waits in the admission queue until the first completes.
+    multitransfer_test(["-maxconnections:1", "-maxqueued:1"])
+    # Receive straight into mapped destination files.
+    multitransfer_test(["-directrecv:1"])
+    # Write received files with direct I/O.
+    multitransfer_test(["-directio:1"])
+    # Flush each file before renaming it into place, or in batches.
+    multitransfer_test(["-durability:fsync"])
+    multitransfer_test(["-durability:group", "-commitwindow:20"])
+    # Both wait in one batch, and mustn't share a partial file.
+    same_name_test(["-durability:group", "-commitwindow:1000"])
+    # Password handshakes past the verification backlog force Retry.
+    handshake_flood_test(8)
+    # Several files from one client, sharing its sends.
+    scheduled_transfer_test(["-weight:2"])
+    scheduled_transfer_test(["-srpt:1", "-rate:400"])
+    # Send buffers from a buffer pool capped well above what they need.
+    scheduled_transfer_test(["-poolmemory:16"])
+    loadgen_test(50, ["-concurrency:10"])
+    loadgen_test(20, ["-arrivalrate:50"])
+    sparse_transfer_test(100000000)
+    delta_transfer_test(10000000)
+    dedup_transfer_test(10000000)
+    packed_transfer_test(1000)
+    fanout_transfer_test(100000000, 3)
+    stripe_transfer_test(100000000, ["-target:127.0.0.1", "-bind:127.0.0.1,127.0.0.1,127.0.0.1"])
+    stripe_transfer_test(100000000, ["-target:127.0.0.1,127.0.0.1", "-stripe:1"])
+    stripe_path_drop_test(100000000)
+    relay_transfer_test(100000000)
+    fetch_transfer_test(100000000, 3)
+    # A symlink or ../ mustn't reach files outside -serve.
+    serve_escape_test()
+    tunnel_test(10000000, 8)
+    pingpong_test(1000)
+    datagram_test(1000000, 1000)
+    striped_pipe_test(100000000, 8)
+    # A receive window far smaller than the pipe's reorder window, spread
+    # over many streams.
+    striped_pipe_test(100000000, 32, ["-recvwindow:512"])
@@ -0,0 +1,310 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "libquiccat.h"
+
+using namespace std;
+
+//
+// Checks of the transfer header encoder and QcHeaderParser (see header.h),
+// run by end2end.py. Returns non-zero if any fails.
+//
+
+uint32_t Failures = 0;
+
+void
+Check(
+    _In_ bool Condition,
+    _In_ const string& What
+    )
+{
+    if (!Condition) {
+        Log() << "FAILED: " << What << endl;
+        Failures++;
+    }
+}
+
+bool
+SameHeader(
+    _In_ const QcTransferHeader& A,
+    _In_ const QcTransferHeader& B
+    )
+{
+    return
+        A.Version == B.Version &&
+        A.Flags == B.Flags &&
+        A.Name == B.Name &&
+        A.Size == B.Size &&
+        A.Options.ChunkSize == B.Options.ChunkSize &&
+        A.Options.Encodings == B.Options.Encodings &&
+        A.Options.Compression == B.Options.Compression &&
+        A.Options.Hash == B.Options.Hash &&
+        A.Options.MaxStreams == B.Options.MaxStreams &&
+        A.Options.Resume == B.Options.Resume;
+}
+
+string
+Describe(
+    _In_ const QcTransferHeader& Header
+    )
+{
+    return "v" + to_string(Header.Version) + " header for " + Header.Name + " of " + to_string(Header.Size) + " bytes";
+}
+
+//
+// Feeds Data to a parser of Version in the pieces Splits gives, and returns
+// what it made of them. Body bytes after the header mustn't be consumed.
+//
+QcHeaderParser::Result
+FeedHeader(
+    _In_ uint32_t Version,
+    _In_ const vector<uint8_t>& Data,
+    _In_ const vector<uint32_t>& Splits,
+    _Out_ QcTransferHeader& Header,
+    _Out_ uint32_t& Consumed
+    )
+{
+    QcHeaderParser Parser;
+    Parser.Reset(Version);
+    auto Result = QcHeaderParser::NeedMore;
+    uint32_t Start = 0;
+    Consumed = 0;
+    for (size_t i = 0; i <= Splits.size() && Result == QcHeaderParser::NeedMore; ++i) {
+        uint32_t End = i < Splits.size() ? Splits[i] : (uint32_t)Data.size();
+        uint32_t Used = 0;
+        Result = Parser.Feed(Data.data() + Start, End - Start, Used);
+        Consumed += Used;
+        Start = End;
+    }
+    Header = Parser.GetHeader();
+    return Result;
+}
+
+vector<uint8_t>
+Encode(
+    _In_ const QcTransferHeader& Header
+    )
+{
+    vector<uint8_t> Data(MaxHeaderLength);
+    Data.resize(QcEncodeTransferHeader(Header, Data.data()));
+    return Data;
+}
+
+//
+// Every header round trips whole, split in two at every byte, and a byte at
+// a time, without touching the body after it.
+//
+void
+TestRoundTrip(
+    _In_ const QcTransferHeader& Header
+    )
+{
+    auto Data = Encode(Header);
+    uint32_t HeaderLength = (uint32_t)Data.size();
+    const uint8_t Body[] = {0x00, 0x40, 0xFF, 'b', 'o', 'd', 'y'};
+    Data.insert(Data.end(), Body, Body + sizeof(Body));
+
+    QcTransferHeader Parsed;
+    uint32_t Consumed;
+    auto Result = FeedHeader(Header.Version, Data, {}, Parsed, Consumed);
+    Check(Result == QcHeaderParser::Complete && SameHeader(Header, Parsed), "round trip of " + Describe(Header));
+    Check(Consumed == HeaderLength, "length of " + Describe(Header));
+
+    for (uint32_t Split = 0; Split <= HeaderLength; ++Split) {
+        Result = FeedHeader(Header.Version, Data, {Split}, Parsed, Consumed);
+        Check(
+            Result == QcHeaderParser::Complete && SameHeader(Header, Parsed) && Consumed == HeaderLength,
+            Describe(Header) + " split at " + to_string(Split));
+    }
+
+    vector<uint32_t> Bytes;
+    for (uint32_t i = 1; i < (uint32_t)Data.size(); ++i) {
+        Bytes.push_back(i);
+    }
+    Result = FeedHeader(Header.Version, Data, Bytes, Parsed, Consumed);
+    Check(
+        Result == QcHeaderParser::Complete && SameHeader(Header, Parsed) && Consumed == HeaderLength,
+        Describe(Header) + " a byte at a time");
+
+    // Anything short of the whole header needs more.
+    Data.resize(HeaderLength - 1);
+    Result = FeedHeader(Header.Version, Data, {}, Parsed, Consumed);
+    Check(Result == QcHeaderParser::NeedMore, "truncated " + Describe(Header));
+}
+
+void
+TestRoundTrips()
+{
+    // Sizes either side of each varint length.
+    const uint64_t Sizes[] = {0, 63, 64, 16383, 16384, (1ull << 30) - 1, 1ull << 30, (1ull << 62) - 1};
+    for (auto Size : Sizes) {
+        for (uint32_t Version : {QcHeaderVersion1, QcHeaderVersion2}) {
+            QcTransferHeader Header;
+            Header.Version = Version;
+            Header.Name = "file.bin";
+            Header.Size = Size;
+            TestRoundTrip(Header);
+        }
+    }
+
+    QcTransferHeader Header;
+    Header.Version = QcHeaderVersion1;
+    Header.Flags = QcHeaderFlagSparse;
+    Header.Name = string(MaxFileNameLength, 'n');
+    Header.Size = 123456789;
+    TestRoundTrip(Header);
+
+    Header.Version = QcHeaderVersion2;
+    Header.Flags = QcHeaderFlagStriped;
+    Header.Options.ChunkSize = 1024 * 1024;
+    Header.Options.Encodings = QcHeaderFlagStriped;
+    Header.Options.MaxStreams = 8;
+    Header.Options.Resume = true;
+    TestRoundTrip(Header);
+}
+
+//
+// Builds a version 2 header by hand, with Options as its capability records.
+//
+vector<uint8_t>
+EncodeWithOptions(
+    _In_ const vector<uint8_t>& Options,
+    _In_ const string& Name,
+    _In_ uint64_t Size
+    )
+{
+    vector<uint8_t> Data(MaxHeaderLength + Options.size());
+    uint8_t* Cursor = Data.data();
+    Cursor = QuicVarIntEncode(QcHeaderVersion2, Cursor);
+    Cursor = QuicVarIntEncode(0, Cursor);
+    Cursor = QuicVarIntEncode(Options.size(), Cursor);
+    memcpy(Cursor, Options.data(), Options.size());
+    Cursor += Options.size();
+    Cursor = QuicVarIntEncode(Name.size(), Cursor);
+    memcpy(Cursor, Name.data(), Name.size());
+    Cursor = QuicVarIntEncode(Size, Cursor + Name.size());
+    Data.resize(Cursor - Data.data());
+    return Data;
+}
+
+void
+AppendRecord(
+    _In_ uint64_t Id,
+    _In_ const vector<uint8_t>& Value,
+    _Inout_ vector<uint8_t>& Buffer
+    )
+{
+    uint8_t Encoded[16];
+    uint8_t* End = QuicVarIntEncode(Id, Encoded);
+    End = QuicVarIntEncode(Value.size(), End);
+    Buffer.insert(Buffer.end(), Encoded, End);
+    Buffer.insert(Buffer.end(), Value.begin(), Value.end());
+}
+
+//
+// Capability records from later versions are skipped, wherever they fall,
+// but must still be well formed.
+//
+void
+TestUnknownCapabilities()
+{
+    vector<uint8_t> Options;
+    AppendRecord(0x3F, {1, 2, 3}, Options);
+    AppendRecord(QcCapabilityEncodings, {QcHeaderFlagDelta}, Options);
+    AppendRecord(0x1234, {}, Options);
+    AppendRecord(QcCapabilityMaxStreams, {4}, Options);
+    AppendRecord(0x40, vector<uint8_t>(20, 0xEE), Options);
+
+    QcCapabilities Capabilities;
+    Check(
+        QcDecodeCapabilities(Options.data(), (uint32_t)Options.size(), Capabilities) &&
+        Capabilities.Encodings == QcHeaderFlagDelta &&
+        Capabilities.MaxStreams == 4 &&
+        Capabilities.ChunkSize == 0 &&
+        !Capabilities.Resume,
+        "decode around unknown capabilities");
+
+    auto Data = EncodeWithOptions(Options, "unknown", 5000);
+    QcTransferHeader Parsed;
+    uint32_t Consumed;
+    for (uint32_t Split = 0; Split <= (uint32_t)Data.size(); ++Split) {
+        auto Result = FeedHeader(QcHeaderVersion2, Data, {Split}, Parsed, Consumed);
+        Check(
+            Result == QcHeaderParser::Complete &&
+            Parsed.Name == "unknown" &&
+            Parsed.Size == 5000 &&
+            Parsed.Options.Encodings == QcHeaderFlagDelta &&
+            Parsed.Options.MaxStreams == 4 &&
+            Consumed == Data.size(),
+            "header with unknown capabilities split at " + to_string(Split));
+    }
+
+    // A record running past the end of the options is malformed, known or
+    // not.
+    vector<uint8_t> Overrun;
+    AppendRecord(0x3F, {1, 2, 3}, Overrun);
+    Overrun.pop_back();
+    Check(
+        !QcDecodeCapabilities(Overrun.data(), (uint32_t)Overrun.size(), Capabilities),
+        "decode of an overrunning unknown capability");
+    Data = EncodeWithOptions(Overrun, "overrun", 1);
+    Check(
+        FeedHeader(QcHeaderVersion2, Data, {}, Parsed, Consumed) == QcHeaderParser::Invalid,
+        "header with an overrunning unknown capability");
+
+    // Options beyond the limit are refused before they're gathered.
+    vector<uint8_t> Long;
+    AppendRecord(0x3F, vector<uint8_t>(QcMaxHeaderOptionsLength, 0), Long);
+    Data = EncodeWithOptions(Long, "long", 1);
+    Check(
+        FeedHeader(QcHeaderVersion2, Data, {}, Parsed, Consumed) == QcHeaderParser::Invalid,
+        "header with too many options");
+}
+
+//
+// A header is only parsed as the version its connection negotiated.
+//
+void
+TestVersionMismatch()
+{
+    QcTransferHeader Header;
+    Header.Name = "file.bin";
+    Header.Size = 1000;
+    QcTransferHeader Parsed;
+    uint32_t Consumed;
+
+    Header.Version = QcHeaderVersion1;
+    Check(
+        FeedHeader(QcHeaderVersion2, Encode(Header), {}, Parsed, Consumed) == QcHeaderParser::Invalid,
+        "v1 header on a v2 connection");
+
+    Header.Version = QcHeaderVersion2;
+    auto Data = Encode(Header);
+    Data[0] = 3;
+    Check(
+        FeedHeader(QcHeaderVersion2, Data, {}, Parsed, Consumed) == QcHeaderParser::Invalid,
+        "v3 header on a v2 connection");
+
+    // Zero length names are refused in either version.
+    Data = {0, QcHeaderFlagSparse, 0, 1};
+    Check(
+        FeedHeader(QcHeaderVersion1, Data, {}, Parsed, Consumed) == QcHeaderParser::Invalid,
+        "v1 header with an empty name");
+    Data = EncodeWithOptions({}, "", 1);
+    Check(
+        FeedHeader(QcHeaderVersion2, Data, {}, Parsed, Consumed) == QcHeaderParser::Invalid,
+        "v2 header with an empty name");
+}
+
+int
+main()
+{
+    TestRoundTrips();
+    TestUnknownCapabilities();
+    TestVersionMismatch();
+    if (Failures != 0) {
+        Log() << Failures << " header checks failed!" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,187 @@
+"""
+Userspace UDP relay which emulates a network path between a quiccat client
+and server, without root or netem. Each direction has its own delay, jitter,
+loss, reordering and bandwidth limit.
+
+Point the client at the relay's port, and the relay at the server:
+
+    python test/netem.py -listen:9000 -target:127.0.0.1:8888 -delay:20 -loss:0.01 -rate:100
+
+Delays are one way, in milliseconds; rates are in megabits per second.
+The relay is plain Python, so it tops out at a few hundred Mbit/s; results
+are only comparable with runs under the same profile.
+"""
+import heapq
+import random
+import selectors
+import socket
+import sys
+import threading
+import time
+
+# Path profiles for the benchmark; anything not set is unimpaired.
+PROFILES = {
+    'loopback': {},
+    'lan': {'delay': 0.25, 'rate': 1000},
+    'wan': {'delay': 20, 'jitter': 2, 'rate': 100},
+    'lossy': {'delay': 30, 'jitter': 5, 'loss': 0.01, 'reorder': 0.01, 'rate': 50},
+    'satellite': {'delay': 300, 'loss': 0.001, 'rate': 20},
+}
+
+MAX_DATAGRAM = 65535
+
+class Direction:
+    def __init__(self, Profile: dict, Rng: random.Random):
+        self.Delay = Profile.get('delay', 0) / 1000
+        self.Jitter = Profile.get('jitter', 0) / 1000
+        self.Loss = Profile.get('loss', 0)
+        self.Reorder = Profile.get('reorder', 0)
+        # Reordered packets are held back this much longer than the rest.
+        self.ReorderGap = Profile.get('reordergap', max(1, Profile.get('delay', 0) / 2)) / 1000
+        # Bytes per second; zero is unlimited.
+        self.Rate = Profile.get('rate', 0) * 1000000 / 8
+        # Packets which would wait longer than this for the link are dropped.
+        self.QueueLimit = Profile.get('queue', 50) / 1000
+        self.Rng = Rng
+        self.LinkFree = 0.0
+        self.LastDelivery = 0.0
+        self.Forwarded = 0
+        self.Lost = 0
+        self.QueueDrops = 0
+        self.Reordered = 0
+
+    def schedule(self, Now: float, Length: int):
+        """Returns when the packet should be delivered, or None to drop it."""
+        if self.Loss and self.Rng.random() < self.Loss:
+            self.Lost += 1
+            return None
+        Depart = Now
+        if self.Rate:
+            Depart = max(Now, self.LinkFree)
+            if Depart - Now > self.QueueLimit:
+                self.QueueDrops += 1
+                return None
+            self.LinkFree = Depart + Length / self.Rate
+            Depart = self.LinkFree
+        Delivery = Depart + self.Delay
+        if self.Jitter:
+            Delivery += self.Rng.uniform(-self.Jitter, self.Jitter)
+        if self.Reorder and self.Rng.random() < self.Reorder:
+            self.Reordered += 1
+            Delivery += self.ReorderGap
+        else:
+            # Jitter alone doesn't reorder, as on most real paths.
+            Delivery = max(Delivery, self.LastDelivery)
+            self.LastDelivery = Delivery
+        self.Forwarded += 1
+        return Delivery
+
+    def stats(self) -> dict:
+        return {
+            'forwarded': self.Forwarded,
+            'lost': self.Lost,
+            'queue_drops': self.QueueDrops,
+            'reordered': self.Reordered}
+
+class Relay:
+    """Relays one client's datagrams to Target, and the replies back."""
+
+    def __init__(self, ListenPort: int, TargetHost: str, TargetPort: int, Profile: dict, Seed: int = 1):
+        Rng = random.Random(Seed)
+        self.Up = Direction(Profile, Rng)
+        self.Down = Direction(Profile, Rng)
+        self.Listen = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.Listen.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+        self.Listen.bind(('127.0.0.1', ListenPort))
+        self.Listen.setblocking(False)
+        self.Upstream = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.Upstream.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4 * 1024 * 1024)
+        self.Upstream.connect((TargetHost, TargetPort))
+        self.Upstream.setblocking(False)
+        self.Client = None
+        self.Pending = []
+        self.Sequence = 0
+        self.Stopping = False
+        self.Thread = None
+
+    def start(self):
+        self.Thread = threading.Thread(target=self.run, daemon=True)
+        self.Thread.start()
+
+    def stop(self):
+        self.Stopping = True
+        if self.Thread:
+            self.Thread.join()
+        self.Listen.close()
+        self.Upstream.close()
+
+    def stats(self) -> dict:
+        return {'up': self.Up.stats(), 'down': self.Down.stats()}
+
+    def receive(self, Sock: socket.socket, Path: Direction, ToServer: bool):
+        while True:
+            try:
+                Data, Address = Sock.recvfrom(MAX_DATAGRAM)
+            except (BlockingIOError, ConnectionRefusedError):
+                return
+            Now = time.monotonic()
+            if ToServer:
+                self.Client = Address
+            Delivery = Path.schedule(Now, len(Data))
+            if Delivery is not None:
+                heapq.heappush(self.Pending, (Delivery, self.Sequence, ToServer, Data))
+                self.Sequence += 1
+
+    def run(self):
+        Selector = selectors.DefaultSelector()
+        Selector.register(self.Listen, selectors.EVENT_READ, (self.Up, True))
+        Selector.register(self.Upstream, selectors.EVENT_READ, (self.Down, False))
+        while not self.Stopping:
+            Now = time.monotonic()
+            while self.Pending and self.Pending[0][0] <= Now:
+                _, _, ToServer, Data = heapq.heappop(self.Pending)
+                try:
+                    if ToServer:
+                        self.Upstream.send(Data)
+                    elif self.Client is not None:
+                        self.Listen.sendto(Data, self.Client)
+                except (BlockingIOError, ConnectionRefusedError):
+                    # A full socket buffer is just more loss.
+                    pass
+            Timeout = 0.1
+            if self.Pending:
+                Timeout = max(0, min(Timeout, self.Pending[0][0] - Now))
+            for Key, _ in Selector.select(Timeout):
+                Path, ToServer = Key.data
+                self.receive(Key.fileobj, Path, ToServer)
+        Selector.close()
+
+def parse_args(Args: list) -> tuple:
+    Values = {}
+    for Arg in Args:
+        if not Arg.startswith('-') or ':' not in Arg:
+            sys.exit('Arguments are -name:value, e.g. -delay:20')
+        Name, Value = Arg[1:].split(':', 1)
+        Values[Name] = Value
+    if 'listen' not in Values or 'target' not in Values:
+        sys.exit('Usage: netem.py -listen:port -target:host:port [-profile:name] '
+                 '[-delay:ms] [-jitter:ms] [-loss:p] [-reorder:p] [-rate:mbps] [-queue:ms] [-seed:n]')
+    Host, Port = Values.pop('target').rsplit(':', 1)
+    Profile = dict(PROFILES[Values.pop('profile')]) if 'profile' in Values else {}
+    ListenPort = int(Values.pop('listen'))
+    Seed = int(Values.pop('seed', 1))
+    for Name, Value in Values.items():
+        Profile[Name] = float(Value)
+    return ListenPort, Host, int(Port), Profile, Seed
+
+if __name__ == '__main__':
+    ListenPort, Host, Port, Profile, Seed = parse_args(sys.argv[1:])
+    Emulator = Relay(ListenPort, Host, Port, Profile, Seed)
+    Emulator.start()
+    print('Relaying 127.0.0.1:' + str(ListenPort) + ' to ' + Host + ':' + str(Port) + ' with ' + str(Profile), flush=True)
+    try:
+        while True:
+            time.sleep(1)
+    except KeyboardInterrupt:
+        Emulator.stop()
+        print(Emulator.stats())
@@ -0,0 +1,292 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "libquiccat.h"
+
+using namespace std;
+using namespace std::chrono;
+
+//
+// Checks of QcTransferScheduler's ordering and bandwidth shares (see
+// scheduler.h), run by end2end.py. Returns non-zero if any fails.
+//
+
+const uint32_t Chunk = 64 * 1024;
+
+uint32_t Failures = 0;
+
+void
+Check(
+    _In_ bool Condition,
+    _In_ const string& What
+    )
+{
+    if (!Condition) {
+        Log() << "FAILED: " << What << endl;
+        Failures++;
+    }
+}
+
+//
+// Stands in for the link: completes the sends granted, in order, each after
+// Delay, so senders compete for the window as they would for a real one.
+//
+class TestLink {
+public:
+    TestLink(
+        _In_ QcTransferScheduler& Target,
+        _In_ microseconds SendDelay
+        ) :
+        Scheduler(Target),
+        Delay(SendDelay),
+        Worker([this]{ Run(); })
+    {
+    }
+
+    ~TestLink() {
+        {
+            unique_lock<mutex> Guard(Lock);
+            Stop = true;
+        }
+        Changed.notify_all();
+        Worker.join();
+    }
+
+    // Records the grant, and queues its completion.
+    void
+    Send(
+        _In_ QcTransferScheduler::Transfer* Entry,
+        _In_ uint32_t Bytes
+        )
+    {
+        unique_lock<mutex> Guard(Lock);
+        Grants.push_back(Entry);
+        Sends.push_back({Entry, Bytes});
+        Changed.notify_all();
+    }
+
+    // Who each grant went to, in order.
+    vector<QcTransferScheduler::Transfer*>
+    GetGrants()
+    {
+        unique_lock<mutex> Guard(Lock);
+        return Grants;
+    }
+
+private:
+    void
+    Run()
+    {
+        unique_lock<mutex> Guard(Lock);
+        while (true) {
+            Changed.wait(Guard, [this]{ return Stop || !Sends.empty(); });
+            if (Sends.empty()) {
+                return;
+            }
+            auto Send = Sends.front();
+            Sends.pop_front();
+            Guard.unlock();
+            this_thread::sleep_for(Delay);
+            Scheduler.Release(Send.first, Send.second);
+            Guard.lock();
+        }
+    }
+
+    QcTransferScheduler& Scheduler;
+    microseconds Delay;
+    mutex Lock;
+    condition_variable Changed;
+    deque<pair<QcTransferScheduler::Transfer*, uint32_t>> Sends;
+    vector<QcTransferScheduler::Transfer*> Grants;
+    bool Stop{false};
+    thread Worker;
+};
+
+//
+// Sends Size bytes on Entry as a transfer does: asking for the next grant as
+// soon as the last is made, without waiting for it to complete.
+//
+void
+SendAll(
+    _In_ QcTransferScheduler& Scheduler,
+    _In_ QcTransferScheduler::Transfer* Entry,
+    _In_ uint64_t Size,
+    _In_ TestLink& Link
+    )
+{
+    while (Size != 0) {
+        uint32_t Bytes = (uint32_t)min<uint64_t>(Size, Scheduler.GetMaxGrant(Entry, Chunk));
+        Scheduler.Acquire(Entry, Bytes);
+        Link.Send(Entry, Bytes);
+        Size -= Bytes;
+    }
+}
+
+//
+// Runs a transfer of each size and schedule at once, over a link with room
+// for two chunks in flight, and returns who got each grant.
+//
+vector<QcTransferScheduler::Transfer*>
+RunTransfers(
+    _In_ bool ShortestFirst,
+    _In_ const vector<QcTransferSchedule>& Schedules,
+    _In_ const vector<uint64_t>& Sizes,
+    _Out_ vector<QcTransferScheduler::Transfer*>& Entries
+    )
+{
+    QcTransferScheduler Scheduler(ShortestFirst, 0, 2 * Chunk);
+    vector<QcTransferScheduler::Transfer*> Grants;
+    {
+        TestLink Link(Scheduler, microseconds(500));
+        Entries.clear();
+        for (size_t i = 0; i < Schedules.size(); ++i) {
+            Entries.push_back(Scheduler.Register(Schedules[i], Sizes[i]));
+        }
+        vector<thread> Senders;
+        for (size_t i = 0; i < Entries.size(); ++i) {
+            Senders.emplace_back(SendAll, ref(Scheduler), Entries[i], Sizes[i], ref(Link));
+        }
+        for (auto& Sender : Senders) {
+            Sender.join();
+        }
+        Grants = Link.GetGrants();
+    }
+    for (auto Entry : Entries) {
+        Scheduler.Unregister(Entry);
+    }
+    return Grants;
+}
+
+//
+// How many of the grants in [Start, End) went to Entry.
+//
+size_t
+CountGrants(
+    _In_ const vector<QcTransferScheduler::Transfer*>& Grants,
+    _In_ size_t Start,
+    _In_ size_t End,
+    _In_ const QcTransferScheduler::Transfer* Entry
+    )
+{
+    return count(Grants.begin() + Start, Grants.begin() + End, Entry);
+}
+
+//
+// A higher class takes the whole link while it has something to send.
+// Senders start at slightly different times, so the first couple of grants
+// can go either way.
+//
+void
+TestPriority()
+{
+    QcTransferSchedule Low, High;
+    Low.Priority = 1;
+    High.Priority = 6;
+    vector<QcTransferScheduler::Transfer*> Entries;
+    auto Grants = RunTransfers(false, {Low, High}, {100 * Chunk, 100 * Chunk}, Entries);
+    Check(Grants.size() == 200, "every grant of the priority transfers made");
+    Check(CountGrants(Grants, 0, 100, Entries[0]) <= 3, "low priority kept off the link by high");
+    Check(CountGrants(Grants, 100, 200, Entries[0]) >= 97, "low priority sent once high finished");
+}
+
+//
+// Within a class, transfers share by weight.
+//
+void
+TestWeight()
+{
+    QcTransferSchedule Light, Heavy;
+    Light.Weight = 1;
+    Heavy.Weight = 3;
+    vector<QcTransferScheduler::Transfer*> Entries;
+    auto Grants = RunTransfers(false, {Light, Heavy}, {200 * Chunk, 200 * Chunk}, Entries);
+    Check(Grants.size() == 400, "every grant of the weighted transfers made");
+    // While both have plenty left, skipping the start.
+    double Share = (double)CountGrants(Grants, 10, 130, Entries[1]) / 120;
+    Check(Share > 0.65 && Share < 0.85, "weight 3 against 1 got " + to_string(Share) + " of the link");
+
+    QcTransferSchedule Equal;
+    Grants = RunTransfers(false, {Equal, Equal}, {200 * Chunk, 200 * Chunk}, Entries);
+    Share = (double)CountGrants(Grants, 10, 130, Entries[1]) / 120;
+    Check(Share > 0.4 && Share < 0.6, "equal weights got " + to_string(Share) + " of the link");
+}
+
+//
+// With ShortestFirst, the transfer with the least left goes first, whatever
+// its weight.
+//
+void
+TestShortestFirst()
+{
+    QcTransferSchedule Short, Long;
+    Long.Weight = 4;
+    vector<QcTransferScheduler::Transfer*> Entries;
+    auto Grants = RunTransfers(true, {Short, Long}, {40 * Chunk, 200 * Chunk}, Entries);
+    Check(Grants.size() == 240, "every grant of the shortest first transfers made");
+    Check(CountGrants(Grants, 0, 40, Entries[0]) >= 37, "shortest transfer sent first");
+}
+
+//
+// Rate limits hold a transfer, or the whole scheduler, to their rate after
+// the first burst, without holding back others.
+//
+void
+TestRate()
+{
+    const uint64_t Rate = 4 * 1024 * 1024;
+    const uint64_t Size = Rate / 2;
+    for (bool PerTransfer : {true, false}) {
+        QcTransferScheduler Scheduler(false, PerTransfer ? 0 : Rate, 2 * Chunk);
+        QcTransferSchedule Limited;
+        if (PerTransfer) {
+            Limited.RateLimit = Rate;
+        }
+        auto Entry = Scheduler.Register(Limited, Size);
+        Check(
+            Scheduler.GetMaxGrant(Entry, 16 * Chunk) < 16 * Chunk,
+            "rate limited grants are cut to the burst");
+        auto Start = steady_clock::now();
+        {
+            TestLink Link(Scheduler, microseconds(0));
+            SendAll(Scheduler, Entry, Size, Link);
+        }
+        double Seconds = duration<double>(steady_clock::now() - Start).count();
+        // Half a second of sending, less the burst it starts with.
+        string What = string(PerTransfer ? "transfer" : "scheduler") + " rate limit took " + to_string(Seconds) + "s";
+        Check(Seconds > 0.35 && Seconds < 1.0, What);
+        Scheduler.Unregister(Entry);
+    }
+
+    // One transfer's limit leaves the rest of the link to another.
+    QcTransferScheduler Scheduler(false, 0, 2 * Chunk);
+    QcTransferSchedule Limited, Unlimited;
+    Limited.RateLimit = Rate;
+    auto Slow = Scheduler.Register(Limited, Size);
+    auto Fast = Scheduler.Register(Unlimited, 8 * Size);
+    auto Start = steady_clock::now();
+    double FastSeconds;
+    {
+        TestLink Link(Scheduler, microseconds(0));
+        thread SlowSender(SendAll, ref(Scheduler), Slow, Size, ref(Link));
+        SendAll(Scheduler, Fast, 8 * Size, Link);
+        FastSeconds = duration<double>(steady_clock::now() - Start).count();
+        SlowSender.join();
+    }
+    Check(FastSeconds < 0.35, "unlimited transfer beside a limited one took " + to_string(FastSeconds) + "s");
+    Scheduler.Unregister(Slow);
+    Scheduler.Unregister(Fast);
+}
+
+int
+main()
+{
+    TestPriority();
+    TestWeight();
+    TestShortestFirst();
+    TestRate();
+    if (Failures != 0) {
+        Log() << Failures << " scheduler checks failed!" << endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,224 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+#ifdef QUICCAT_TRACE_USDT
+#include <sys/sdt.h>
+#endif
+
+using namespace std;
+using namespace std::chrono;
+
+#ifdef QUICCAT_TRACE
+
+const char* TraceEventNames[QcTraceEventCount] = {"read", "send complete", "write", "flush", "verify"};
+// Histogram buckets are powers of two nanoseconds.
+const uint32_t TraceBuckets = 40;
+
+struct QcTraceRecord {
+    // Nanoseconds since recording started.
+    uint64_t Start;
+    uint64_t Duration;
+    uint64_t Bytes;
+    QcTraceEvent Event;
+};
+
+struct QcTraceRing {
+    uint32_t ThreadId;
+    // Records written so far. Only the owning thread writes; readers take
+    // the newest QcTraceRingSize before Head.
+    atomic<uint64_t> Head{0};
+    QcTraceRecord Records[QcTraceRingSize];
+    atomic<uint64_t> Histogram[QcTraceEventCount][TraceBuckets]{};
+};
+
+atomic<bool> QcTraceRecording{false};
+steady_clock::time_point TraceEpoch;
+// Every thread's ring, in creation order. They're never freed, as MsQuic's
+// threads may still be tracing while the process exits.
+mutex TraceRingsLock;
+vector<QcTraceRing*> TraceRings;
+
+QcTraceRing*
+QcTraceThreadRing()
+{
+    static thread_local QcTraceRing* Ring = nullptr;
+    if (Ring == nullptr) {
+        Ring = new QcTraceRing;
+        lock_guard<mutex> Guard(TraceRingsLock);
+        Ring->ThreadId = (uint32_t)TraceRings.size() + 1;
+        TraceRings.push_back(Ring);
+    }
+    return Ring;
+}
+
+void
+QcTraceScope::End()
+{
+    uint64_t Duration = (uint64_t)duration_cast<nanoseconds>(steady_clock::now() - Start).count();
+#ifdef QUICCAT_TRACE_USDT
+    DTRACE_PROBE4(
+        quiccat,
+        trace,
+        (int)Event,
+        (uint64_t)duration_cast<nanoseconds>(Start.time_since_epoch()).count(),
+        Duration,
+        Bytes);
+    if (!QcTraceRecording.load(memory_order_relaxed)) {
+        return;
+    }
+#endif
+    auto Ring = QcTraceThreadRing();
+    uint64_t Head = Ring->Head.load(memory_order_relaxed);
+    auto& Record = Ring->Records[Head % QcTraceRingSize];
+    Record.Start = Start > TraceEpoch ? (uint64_t)duration_cast<nanoseconds>(Start - TraceEpoch).count() : 0;
+    Record.Duration = Duration;
+    Record.Bytes = Bytes;
+    Record.Event = Event;
+    Ring->Head.store(Head + 1, memory_order_release);
+    auto& Count = Ring->Histogram[Event][min<uint32_t>((uint32_t)bit_width(Duration), TraceBuckets - 1)];
+    Count.store(Count.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+bool
+QcTraceStart()
+{
+    TraceEpoch = steady_clock::now();
+    QcTraceRecording.store(true, memory_order_release);
+    return true;
+}
+
+bool
+QcTraceWriteJson(
+    _In_ const string& Path
+    )
+{
+    ofstream Out(Path, ios::trunc);
+    if (!Out) {
+        Log() << "Failed to open " << Path << " for the trace!" << endl;
+        return false;
+    }
+    Out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+    Out << fixed << setprecision(3);
+    bool First = true;
+    // New scopes stop recording, but ones already running still finish into
+    // their rings while they're read.
+    QcTraceRecording.store(false, memory_order_relaxed);
+    lock_guard<mutex> Guard(TraceRingsLock);
+    vector<QcTraceRecord> Records;
+    for (auto Ring : TraceRings) {
+        uint64_t Head = Ring->Head.load(memory_order_acquire);
+        uint64_t Begin = Head > QcTraceRingSize ? Head - QcTraceRingSize : 0;
+        Records.clear();
+        for (uint64_t i = Begin; i < Head; ++i) {
+            Records.push_back(Ring->Records[i % QcTraceRingSize]);
+        }
+        // Drop any record the owner overwrote, or was overwriting, while it
+        // was copied.
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t Newest = Ring->Head.load(memory_order_relaxed);
+        uint64_t Valid = Newest + 1 > QcTraceRingSize ? Newest + 1 - QcTraceRingSize : 0;
+        for (uint64_t i = max(Begin, Valid); i < Head; ++i) {
+            auto& Record = Records[i - Begin];
+            Out << (First ? "" : ",\n")
+                << "{\"name\":\"" << TraceEventNames[Record.Event]
+                << "\",\"cat\":\"quiccat\",\"ph\":\"X\",\"pid\":1,\"tid\":" << Ring->ThreadId
+                << ",\"ts\":" << Record.Start / 1000.0
+                << ",\"dur\":" << Record.Duration / 1000.0
+                << ",\"args\":{\"bytes\":" << Record.Bytes << "}}";
+            First = false;
+        }
+    }
+    Out << "\n]}\n";
+    return !Out.fail();
+}
+
+string
+QcFormatNanoseconds(
+    _In_ uint64_t Nanoseconds
+    )
+{
+    static const char* Units[] = {"ns", "us", "ms", "s"};
+    uint32_t Unit = 0;
+    while (Nanoseconds >= 1000 && Unit < 3) {
+        Nanoseconds /= 1000;
+        Unit++;
+    }
+    return to_string(Nanoseconds) + Units[Unit];
+}
+
+void
+QcTraceLogSummary()
+{
+    uint64_t Histogram[QcTraceEventCount][TraceBuckets]{};
+    {
+        lock_guard<mutex> Guard(TraceRingsLock);
+        for (auto Ring : TraceRings) {
+            for (uint32_t Event = 0; Event < QcTraceEventCount; ++Event) {
+                for (uint32_t Bucket = 0; Bucket < TraceBuckets; ++Bucket) {
+                    Histogram[Event][Bucket] += Ring->Histogram[Event][Bucket].load(memory_order_relaxed);
+                }
+            }
+        }
+    }
+    // Each bucket is reported by its upper bound.
+    auto Bound = [](uint32_t Bucket) { return QcFormatNanoseconds(1ull << Bucket); };
+    for (uint32_t Event = 0; Event < QcTraceEventCount; ++Event) {
+        uint64_t Total = 0;
+        uint32_t Last = 0;
+        for (uint32_t Bucket = 0; Bucket < TraceBuckets; ++Bucket) {
+            Total += Histogram[Event][Bucket];
+            if (Histogram[Event][Bucket] != 0) {
+                Last = Bucket;
+            }
+        }
+        if (Total == 0) {
+            continue;
+        }
+        uint64_t Seen = 0;
+        uint32_t P50 = 0, P99 = 0;
+        for (uint32_t Bucket = 0; Bucket <= Last; ++Bucket) {
+            Seen += Histogram[Event][Bucket];
+            if (Seen * 2 < Total) {
+                P50 = Bucket + 1;
+            }
+            if (Seen * 100 < Total * 99) {
+                P99 = Bucket + 1;
+            }
+        }
+        Log() << TraceEventNames[Event] << ": " << Total << " samples, p50 <= " << Bound(P50)
+            << ", p99 <= " << Bound(P99) << ", max <= " << Bound(Last) << endl;
+        for (uint32_t Bucket = 0; Bucket <= Last; ++Bucket) {
+            if (Histogram[Event][Bucket] == 0) {
+                continue;
+            }
+            uint32_t Width = (uint32_t)(Histogram[Event][Bucket] * 40 / Total);
+            Log() << "  <= " << setw(6) << Bound(Bucket) << " " << setw(10) << Histogram[Event][Bucket]
+                << " " << string(max<uint32_t>(Width, 1), '#') << endl;
+        }
+    }
+}
+
+#else
+
+bool
+QcTraceStart()
+{
+    return false;
+}
+
+bool
+QcTraceWriteJson(
+    _In_ const string& /*Path*/
+    )
+{
+    return false;
+}
+
+void
+QcTraceLogSummary()
+{
+}
+
+#endif
@@ -0,0 +1,90 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+//
+// Per-chunk timeline tracing, for finding where a slow transfer's time goes.
+// Trace points time a scope on the data path and, once recording is started,
+// keep a record of it in a ring of the thread's own, with no locks or
+// sharing. At exit the rings are written as Chrome trace-event JSON, for
+// chrome://tracing or Perfetto, and summarized as latency histograms.
+//
+// Trace points are compiled in with QUICCAT_TRACE, and are
+// nothing at all otherwise. Built with USDT support (QUICCAT_TRACE_USDT), each
+// also fires the quiccat:trace probe, whether recording or not, with the
+// event, start and duration in nanoseconds, and byte count.
+//
+enum QcTraceEvent : uint8_t {
+    // Source reads.
+    QcTraceRead,
+    // Waiting for MsQuic to complete a send.
+    QcTraceSendComplete,
+    // Sink writes.
+    QcTraceWrite,
+    // Sink flushes, e.g. stdout.
+    QcTraceFlush,
+    // Password verification: PBKDF2 and the signature check.
+    QcTraceVerify,
+    QcTraceEventCount
+};
+
+const uint32_t QcTraceRingSize = 16384;
+
+// Starts recording. Returns false if trace points weren't compiled in.
+bool QcTraceStart();
+
+// Stops recording and writes the records in every thread's ring as Chrome
+// trace-event JSON. Only the newest QcTraceRingSize records of each thread
+// are kept.
+bool QcTraceWriteJson(_In_ const std::string& Path);
+
+// Logs a latency histogram of each kind of trace point recorded.
+void QcTraceLogSummary();
+
+#ifdef QUICCAT_TRACE
+
+extern std::atomic<bool> QcTraceRecording;
+
+class QcTraceScope {
+public:
+    QcTraceScope(_In_ QcTraceEvent TraceEvent, _In_ uint64_t TraceBytes) :
+        Event(TraceEvent),
+        Bytes(TraceBytes)
+    {
+#ifndef QUICCAT_TRACE_USDT
+        if (!QcTraceRecording.load(std::memory_order_relaxed)) {
+            return;
+        }
+#endif
+        Start = std::chrono::steady_clock::now();
+    }
+    ~QcTraceScope() {
+        if (Start != std::chrono::steady_clock::time_point()) {
+            End();
+        }
+    }
+
+private:
+    void End();
+
+    QcTraceEvent Event;
+    uint64_t Bytes;
+    std::chrono::steady_clock::time_point Start{};
+};
+
+#define QC_TRACE_NAME2(Line) QcTrace##Line
+#define QC_TRACE_NAME(Line) QC_TRACE_NAME2(Line)
+// Times the rest of the enclosing scope as Event, of Bytes bytes.
+#define QC_TRACE(Event, Bytes) QcTraceScope QC_TRACE_NAME(__LINE__)((Event), (Bytes))
+
+#else
+
+#define QC_TRACE(Event, Bytes) ((void)0)
+
+#endif
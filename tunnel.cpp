@@ -0,0 +1,637 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+#ifdef __linux__
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#endif
+
+using namespace std;
+
+// Each channel reads up to this much from its socket per stream send.
+const uint32_t TunnelBufferSize = 256 * 1024;
+const uint32_t MaxTunnelEvents = 64;
+// Received buffers written by one sendmsg.
+const uint32_t MaxTunnelWriteBuffers = 64;
+
+struct QcTunnelChannel {
+    QcTunnel* Tunnel;
+    // Protects everything below, and calls on Stream.
+    mutex Lock;
+    // Auto-deleted; null once the stream has shut down.
+    MsQuicStream* Stream{nullptr};
+    int Socket{-1};
+    bool Connecting{false};
+    bool Connected{false};
+    // Latched from edge-triggered events until a read or write would block.
+    bool Readable{false};
+    bool Writable{false};
+    // In the tunnel's ready list.
+    bool Queued{false};
+    bool Aborted{false};
+    bool StreamClosed{false};
+    // TCP to QUIC. One send is in flight at a time; reads pause meanwhile.
+    QcBuffer SendBuffer;
+    QUIC_BUFFER SendQuicBuffer{};
+    bool SendInFlight{false};
+    bool SocketEof{false};
+    // QUIC to TCP. Received buffers stay MsQuic's until ReceiveComplete.
+    vector<QUIC_BUFFER> Received;
+    size_t ReceivedIndex{0};
+    uint32_t ReceivedOffset{0};
+    uint64_t ReceivedLength{0};
+    bool PeerFin{false};
+    bool WriteShutdown{false};
+};
+
+#ifdef __linux__
+
+//
+// Splits "host:port", allowing a bracketed IPv6 host.
+//
+bool
+QcSplitHostPort(
+    _In_ const string& Address,
+    _Out_ string& Host,
+    _Out_ string& Port
+    )
+{
+    size_t Colon = Address.rfind(':');
+    if (Colon == string::npos || Colon + 1 == Address.size()) {
+        return false;
+    }
+    Host = Address.substr(0, Colon);
+    Port = Address.substr(Colon + 1);
+    if (Host.size() >= 2 && Host.front() == '[' && Host.back() == ']') {
+        Host = Host.substr(1, Host.size() - 2);
+    }
+    return true;
+}
+
+addrinfo*
+QcResolve(
+    _In_ const string& Address,
+    _In_ bool Passive
+    )
+{
+    string Host, Port;
+    if (!QcSplitHostPort(Address, Host, Port)) {
+        Log() << "Expected host:port, not " << Address << endl;
+        return nullptr;
+    }
+    addrinfo Hints{};
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_STREAM;
+    Hints.ai_flags = Passive ? AI_PASSIVE : 0;
+    addrinfo* Result = nullptr;
+    int Error = getaddrinfo(Host.empty() ? nullptr : Host.c_str(), Port.c_str(), &Hints, &Result);
+    if (Error != 0) {
+        Log() << "Failed to resolve " << Address << ": " << gai_strerror(Error) << endl;
+        return nullptr;
+    }
+    return Result;
+}
+
+QUIC_STATUS
+QcTunnelStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event
+    )
+{
+    auto Channel = (QcTunnelChannel*)Context;
+    QUIC_STATUS Status = QUIC_STATUS_SUCCESS;
+    unique_lock<mutex> Lock(Channel->Lock);
+    if (Channel->Tunnel == nullptr) {
+        // Orphaned by the tunnel going away; the stream is being aborted.
+        if (Event->Type == QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE) {
+            Lock.unlock();
+            delete Channel;
+        }
+        return QUIC_STATUS_SUCCESS;
+    }
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE:
+        if (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) {
+            Channel->PeerFin = true;
+        }
+        if (Event->RECEIVE.TotalBufferLength != 0) {
+            // Held until the loop has written it all to the socket, which
+            // is what pushes back on the sender.
+            Channel->Received.insert(
+                Channel->Received.end(),
+                Event->RECEIVE.Buffers,
+                Event->RECEIVE.Buffers + Event->RECEIVE.BufferCount);
+            Channel->ReceivedLength += Event->RECEIVE.TotalBufferLength;
+            Status = QUIC_STATUS_PENDING;
+        }
+        Channel->Tunnel->Post(Channel);
+        break;
+    case QUIC_STREAM_EVENT_PEER_SEND_SHUTDOWN:
+        Channel->PeerFin = true;
+        Channel->Tunnel->Post(Channel);
+        break;
+    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+        Channel->SendInFlight = false;
+        Channel->Tunnel->Post(Channel);
+        break;
+    case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
+    case QUIC_STREAM_EVENT_PEER_RECEIVE_ABORTED:
+        // The other end's socket failed; pass the reset on. MsQuic may
+        // deliver SHUTDOWN_COMPLETE inline, which takes the lock again, and
+        // the stream outlives this callback either way.
+        Channel->Aborted = true;
+        Lock.unlock();
+        Channel->Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        Channel->StreamClosed = true;
+        Channel->Stream = nullptr;
+        Channel->Received.clear();
+        Channel->Tunnel->Post(Channel);
+        break;
+    default:
+        break;
+    }
+    return Status;
+}
+
+QcTunnel::~QcTunnel()
+{
+    if (Loop.joinable()) {
+        {
+            unique_lock<mutex> Lock(ReadyLock);
+            Stopping = true;
+        }
+        uint64_t Value = 1;
+        (void)!write(Wakeup, &Value, sizeof(Value));
+        Loop.join();
+    }
+    // Channels never serviced are only in the ready list.
+    Channels.insert(Ready.begin(), Ready.end());
+    for (auto Channel : Channels) {
+        unique_lock<mutex> Lock(Channel->Lock);
+        if (Channel->Socket >= 0) {
+            close(Channel->Socket);
+        }
+        if (Channel->StreamClosed) {
+            Lock.unlock();
+            delete Channel;
+        } else {
+            // Left for the stream's callback to free.
+            Channel->Tunnel = nullptr;
+            Channel->Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+        }
+    }
+    if (ListenSocket >= 0) {
+        close(ListenSocket);
+    }
+    if (Wakeup >= 0) {
+        close(Wakeup);
+    }
+    if (Epoll >= 0) {
+        close(Epoll);
+    }
+}
+
+bool
+QcTunnel::Start()
+{
+    Epoll = epoll_create1(EPOLL_CLOEXEC);
+    Wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (Epoll < 0 || Wakeup < 0) {
+        Log() << "Failed to create epoll: " << errno << endl;
+        return false;
+    }
+    epoll_event Event{};
+    Event.events = EPOLLIN;
+    Event.data.ptr = &Wakeup;
+    if (epoll_ctl(Epoll, EPOLL_CTL_ADD, Wakeup, &Event) < 0) {
+        Log() << "Failed to add wakeup to epoll: " << errno << endl;
+        return false;
+    }
+    Loop = thread(&QcTunnel::Run, this);
+    return true;
+}
+
+bool
+QcTunnel::Expose(
+    _In_ const string& Address
+    )
+{
+    auto Result = QcResolve(Address, false);
+    if (Result == nullptr) {
+        return false;
+    }
+    auto Begin = (const uint8_t*)Result->ai_addr;
+    Target.assign(Begin, Begin + Result->ai_addrlen);
+    freeaddrinfo(Result);
+    return Start();
+}
+
+bool
+QcTunnel::Forward(
+    _In_ const string& Address,
+    _In_ MsQuicConnection* TunnelConnection
+    )
+{
+    Connection = TunnelConnection;
+    auto Result = QcResolve(Address, true);
+    if (Result == nullptr) {
+        return false;
+    }
+    ListenSocket = socket(Result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int On = 1;
+    if (ListenSocket < 0 ||
+        setsockopt(ListenSocket, SOL_SOCKET, SO_REUSEADDR, &On, sizeof(On)) < 0 ||
+        ::bind(ListenSocket, Result->ai_addr, Result->ai_addrlen) < 0 ||
+        listen(ListenSocket, SOMAXCONN) < 0) {
+        Log() << "Failed to listen on " << Address << ": " << errno << endl;
+        freeaddrinfo(Result);
+        return false;
+    }
+    freeaddrinfo(Result);
+    if (!Start()) {
+        return false;
+    }
+    epoll_event Event{};
+    Event.events = EPOLLIN;
+    Event.data.ptr = &ListenSocket;
+    if (epoll_ctl(Epoll, EPOLL_CTL_ADD, ListenSocket, &Event) < 0) {
+        Log() << "Failed to add listener to epoll: " << errno << endl;
+        return false;
+    }
+    return true;
+}
+
+QUIC_STATUS
+QcTunnel::AcceptStream(
+    _In_ HQUIC Handle
+    )
+{
+    auto Channel = new(nothrow) QcTunnelChannel;
+    if (Channel == nullptr) {
+        return QUIC_STATUS_OUT_OF_MEMORY;
+    }
+    Channel->Tunnel = this;
+    auto Stream = new(nothrow) MsQuicStream(Handle, CleanUpAutoDelete, QcTunnelStreamCallback, Channel);
+    if (Stream == nullptr || !Stream->IsValid()) {
+        delete Stream;
+        delete Channel;
+        return QUIC_STATUS_OUT_OF_MEMORY;
+    }
+    // The loop connects the socket. Anything received meanwhile is held.
+    Channel->Stream = Stream;
+    Post(Channel);
+    return QUIC_STATUS_SUCCESS;
+}
+
+void
+QcTunnel::Post(
+    _In_ QcTunnelChannel* Channel
+    )
+{
+    // Called with Channel->Lock held.
+    if (Channel->Queued) {
+        return;
+    }
+    Channel->Queued = true;
+    bool Wake;
+    {
+        unique_lock<mutex> Lock(ReadyLock);
+        Wake = Ready.empty();
+        Ready.push_back(Channel);
+    }
+    if (Wake) {
+        uint64_t Value = 1;
+        (void)!write(Wakeup, &Value, sizeof(Value));
+    }
+}
+
+void
+QcTunnel::Run()
+{
+    epoll_event Events[MaxTunnelEvents];
+    vector<QcTunnelChannel*> Work;
+    bool Stop = false;
+    while (!Stop) {
+        int Count = epoll_wait(Epoll, Events, MaxTunnelEvents, -1);
+        if (Count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            Log() << "epoll_wait failed: " << errno << endl;
+            break;
+        }
+        for (int i = 0; i < Count; ++i) {
+            void* Tag = Events[i].data.ptr;
+            if (Tag == &Wakeup) {
+                uint64_t Value;
+                (void)!read(Wakeup, &Value, sizeof(Value));
+            } else if (Tag == &ListenSocket) {
+                Accept();
+            } else {
+                Service((QcTunnelChannel*)Tag, Events[i].events);
+            }
+        }
+        {
+            unique_lock<mutex> Lock(ReadyLock);
+            Work.swap(Ready);
+            Stop = Stopping;
+        }
+        // Channels are only freed here, after their stream's final post, so
+        // nothing else can still refer to them.
+        for (auto Channel : Work) {
+            Service(Channel, 0);
+        }
+        Work.clear();
+    }
+}
+
+void
+QcTunnel::Accept()
+{
+    while (true) {
+        int Socket = accept4(ListenSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (Socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+                errno != ECONNABORTED) {
+                Log() << "accept failed: " << errno << endl;
+            }
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        auto Channel = new QcTunnelChannel;
+        Channel->Tunnel = this;
+        Channel->Socket = Socket;
+        Channel->Connected = true;
+        auto Stream =
+            new(nothrow) MsQuicStream(
+                *Connection,
+                QUIC_STREAM_OPEN_FLAG_NONE,
+                CleanUpAutoDelete,
+                QcTunnelStreamCallback,
+                Channel);
+        if (Stream == nullptr || !Stream->IsValid()) {
+            Log() << "Failed to open a stream for a tunnel connection" << endl;
+            delete Stream;
+            close(Socket);
+            delete Channel;
+            continue;
+        }
+        {
+            unique_lock<mutex> Lock(Channel->Lock);
+            Channel->Stream = Stream;
+            // Waits in MsQuic for stream credit, if the peer's limit is reached.
+            if (QUIC_FAILED(Stream->Start(QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL | QUIC_STREAM_START_FLAG_IMMEDIATE))) {
+                Log() << "Failed to start a stream for a tunnel connection" << endl;
+                Lock.unlock();
+                delete Stream;
+                close(Socket);
+                delete Channel;
+                continue;
+            }
+        }
+        int On = 1;
+        setsockopt(Socket, IPPROTO_TCP, TCP_NODELAY, &On, sizeof(On));
+        epoll_event Event{};
+        Event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        Event.data.ptr = Channel;
+        epoll_ctl(Epoll, EPOLL_CTL_ADD, Socket, &Event);
+        Channels.insert(Channel);
+        ChannelsOpened++;
+    }
+}
+
+void
+QcTunnel::Close(
+    _In_ QcTunnelChannel* Channel
+    )
+{
+    if (Channel->Socket >= 0) {
+        epoll_ctl(Epoll, EPOLL_CTL_DEL, Channel->Socket, nullptr);
+        if (Channel->Aborted) {
+            // Reset, rather than a clean close, so the TCP peer sees the failure.
+            linger Linger{1, 0};
+            setsockopt(Channel->Socket, SOL_SOCKET, SO_LINGER, &Linger, sizeof(Linger));
+        }
+        close(Channel->Socket);
+    }
+    Channels.erase(Channel);
+    delete Channel;
+}
+
+void
+QcTunnel::Service(
+    _In_ QcTunnelChannel* Channel,
+    _In_ uint32_t Events
+    )
+{
+    unique_lock<mutex> Lock(Channel->Lock);
+    if (Events == 0) {
+        Channel->Queued = false;
+        if (Channel->StreamClosed) {
+            // The stream's final post; no callback can follow it.
+            Lock.unlock();
+            Close(Channel);
+            return;
+        }
+    }
+    if (Channel->StreamClosed || Channel->Aborted) {
+        return;
+    }
+    if (Events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        Channel->Readable = true;
+    }
+    if (Events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+        Channel->Writable = true;
+    }
+    auto Abort = [&](QUIC_STATUS Status) {
+        Channel->Aborted = true;
+        Channel->Stream->Shutdown((QUIC_UINT62)Status);
+    };
+
+    if (Channel->Socket < 0) {
+        // A new stream in expose mode.
+        Channel->Socket = socket(((sockaddr*)Target.data())->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (Channel->Socket < 0) {
+            Abort(QUIC_STATUS_OUT_OF_MEMORY);
+            return;
+        }
+        int On = 1;
+        setsockopt(Channel->Socket, IPPROTO_TCP, TCP_NODELAY, &On, sizeof(On));
+        if (connect(Channel->Socket, (sockaddr*)Target.data(), (socklen_t)Target.size()) == 0) {
+            Channel->Connected = true;
+        } else if (errno == EINPROGRESS) {
+            Channel->Connecting = true;
+        } else {
+            Abort(QUIC_STATUS_CONNECTION_REFUSED);
+            return;
+        }
+        epoll_event Event{};
+        Event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        Event.data.ptr = Channel;
+        epoll_ctl(Epoll, EPOLL_CTL_ADD, Channel->Socket, &Event);
+        Channels.insert(Channel);
+        ChannelsOpened++;
+    }
+    if (Channel->Connecting) {
+        if (!Channel->Writable) {
+            return;
+        }
+        int Error = 0;
+        socklen_t Length = sizeof(Error);
+        getsockopt(Channel->Socket, SOL_SOCKET, SO_ERROR, &Error, &Length);
+        if (Error != 0) {
+            Log() << "Failed to connect tunnel: " << Error << endl;
+            Abort(QUIC_STATUS_CONNECTION_REFUSED);
+            return;
+        }
+        Channel->Connecting = false;
+        Channel->Connected = true;
+    }
+
+    // QUIC to TCP, as much as the socket takes in one call.
+    while (Channel->Writable && Channel->ReceivedIndex < Channel->Received.size()) {
+        iovec Vectors[MaxTunnelWriteBuffers];
+        size_t Count = 0;
+        for (size_t i = Channel->ReceivedIndex;
+             i < Channel->Received.size() && Count < MaxTunnelWriteBuffers;
+             ++i, ++Count) {
+            uint32_t Skip = i == Channel->ReceivedIndex ? Channel->ReceivedOffset : 0;
+            Vectors[Count].iov_base = Channel->Received[i].Buffer + Skip;
+            Vectors[Count].iov_len = Channel->Received[i].Length - Skip;
+        }
+        msghdr Message{};
+        Message.msg_iov = Vectors;
+        Message.msg_iovlen = Count;
+        ssize_t Written = sendmsg(Channel->Socket, &Message, MSG_NOSIGNAL);
+        if (Written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                Channel->Writable = false;
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            Abort(QUIC_STATUS_ABORTED);
+            return;
+        }
+        BytesReceived += (uint64_t)Written;
+        size_t Left = (size_t)Written;
+        while (Left > 0) {
+            auto& Buffer = Channel->Received[Channel->ReceivedIndex];
+            size_t Available = Buffer.Length - Channel->ReceivedOffset;
+            if (Left < Available) {
+                Channel->ReceivedOffset += (uint32_t)Left;
+                break;
+            }
+            Left -= Available;
+            Channel->ReceivedIndex++;
+            Channel->ReceivedOffset = 0;
+        }
+    }
+    if (!Channel->Received.empty() && Channel->ReceivedIndex == Channel->Received.size()) {
+        Channel->Stream->ReceiveComplete(Channel->ReceivedLength);
+        Channel->Received.clear();
+        Channel->ReceivedIndex = 0;
+        Channel->ReceivedLength = 0;
+    }
+    if (Channel->PeerFin && Channel->Received.empty() && !Channel->WriteShutdown) {
+        shutdown(Channel->Socket, SHUT_WR);
+        Channel->WriteShutdown = true;
+    }
+
+    // TCP to QUIC, batching reads into one send.
+    if (Channel->Readable && !Channel->SendInFlight && !Channel->SocketEof) {
+        if (Channel->SendBuffer == nullptr) {
+            Channel->SendBuffer = QcBufferPool::Get().Allocate(TunnelBufferSize);
+            if (Channel->SendBuffer == nullptr) {
+                Abort(QUIC_STATUS_OUT_OF_MEMORY);
+                return;
+            }
+        }
+        uint32_t Length = 0;
+        while (Length < TunnelBufferSize) {
+            ssize_t Read = recv(Channel->Socket, Channel->SendBuffer.get() + Length, TunnelBufferSize - Length, 0);
+            if (Read > 0) {
+                Length += (uint32_t)Read;
+            } else if (Read == 0) {
+                Channel->SocketEof = true;
+                break;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                Channel->Readable = false;
+                break;
+            } else if (errno != EINTR) {
+                Abort(QUIC_STATUS_ABORTED);
+                return;
+            }
+        }
+        if (Length != 0 || Channel->SocketEof) {
+            Channel->SendQuicBuffer.Buffer = Channel->SendBuffer.get();
+            Channel->SendQuicBuffer.Length = Length;
+            Channel->SendInFlight = true;
+            QUIC_STATUS Status =
+                Channel->Stream->Send(
+                    &Channel->SendQuicBuffer,
+                    1,
+                    Channel->SocketEof ? QUIC_SEND_FLAG_FIN : QUIC_SEND_FLAG_NONE);
+            if (QUIC_FAILED(Status)) {
+                Channel->SendInFlight = false;
+                Abort(Status);
+                return;
+            }
+            BytesSent += Length;
+        }
+    }
+}
+
+#else
+
+QcTunnel::~QcTunnel()
+{
+}
+
+bool
+QcTunnel::Expose(
+    _In_ const string& /*Address*/
+    )
+{
+    Log() << "TCP tunnels aren't supported on this platform." << endl;
+    return false;
+}
+
+bool
+QcTunnel::Forward(
+    _In_ const string& /*Address*/,
+    _In_ MsQuicConnection* /*TunnelConnection*/
+    )
+{
+    Log() << "TCP tunnels aren't supported on this platform." << endl;
+    return false;
+}
+
+QUIC_STATUS
+QcTunnel::AcceptStream(
+    _In_ HQUIC /*Handle*/
+    )
+{
+    return QUIC_STATUS_NOT_SUPPORTED;
+}
+
+void
+QcTunnel::Post(
+    _In_ QcTunnelChannel* /*Channel*/
+    )
+{
+}
+
+#endif
@@ -0,0 +1,74 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+struct QcTunnelChannel;
+
+//
+// TCP port forwarding over QUIC. Every TCP connection is carried on a
+// bidirectional stream of its own, all sharing one QUIC connection, so a
+// stalled TCP peer only holds up its own stream.
+//
+// The sockets are non-blocking and serviced by a single epoll thread. Reads
+// are batched into large stream sends, and received data is written out with
+// one sendmsg per wakeup, held in MsQuic's buffers until the socket takes it.
+// Linux only; elsewhere Expose and Forward fail.
+//
+class QcTunnel {
+public:
+    QcTunnel() = default;
+    // Stops the thread and resets any sockets still open.
+    ~QcTunnel();
+
+    // Connects each stream given to AcceptStream to Address, "host:port".
+    bool Expose(_In_ const std::string& Address);
+
+    // Accepts TCP connections on Address, "host:port" where an empty host
+    // means every interface, and opens a stream on Connection for each.
+    bool
+    Forward(
+        _In_ const std::string& Address,
+        _In_ MsQuicConnection* Connection);
+
+    // Takes a peer's stream in expose mode.
+    QUIC_STATUS AcceptStream(_In_ HQUIC Stream);
+
+    uint64_t GetChannelsOpened() const { return ChannelsOpened; }
+    // From TCP to QUIC, and QUIC to TCP.
+    uint64_t GetBytesSent() const { return BytesSent; }
+    uint64_t GetBytesReceived() const { return BytesReceived; }
+
+    // Called on MsQuic's threads; queues Channel to be serviced.
+    void Post(_In_ QcTunnelChannel* Channel);
+
+private:
+    bool Start();
+    void Run();
+    void Accept();
+    void Service(_In_ QcTunnelChannel* Channel, _In_ uint32_t Events);
+    void Close(_In_ QcTunnelChannel* Channel);
+
+    int Epoll{-1};
+    int Wakeup{-1};
+    int ListenSocket{-1};
+    MsQuicConnection* Connection{nullptr};
+    // Resolved sockaddr of the expose target.
+    std::vector<uint8_t> Target;
+    std::thread Loop;
+    std::mutex ReadyLock;
+    std::vector<QcTunnelChannel*> Ready;
+    bool Stopping{false};
+    // Only touched by the loop.
+    std::unordered_set<QcTunnelChannel*> Channels;
+    std::atomic<uint64_t> ChannelsOpened{0};
+    std::atomic<uint64_t> BytesSent{0};
+    std::atomic<uint64_t> BytesReceived{0};
+};
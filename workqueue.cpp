@@ -0,0 +1,76 @@
+/*
+    Licensed under the MIT License.
+*/
+#include "quiccat.h"
+
+using namespace std;
+
+QcWorkQueue::QcWorkQueue(
+    _In_ uint32_t ThreadCount
+    )
+{
+    ThreadCount = max(ThreadCount, 1u);
+    for (uint32_t i = 0; i < ThreadCount; ++i) {
+        Threads.emplace_back(&QcWorkQueue::Run, this);
+    }
+}
+
+QcWorkQueue::~QcWorkQueue()
+{
+    {
+        unique_lock<mutex> Guard(Lock);
+        ShuttingDown = true;
+    }
+    WorkAvailable.notify_all();
+    for (auto& Thread : Threads) {
+        Thread.join();
+    }
+}
+
+void
+QcWorkQueue::Post(
+    _In_ function<void()> Work
+    )
+{
+    {
+        unique_lock<mutex> Guard(Lock);
+        Queue.push_back(std::move(Work));
+    }
+    WorkAvailable.notify_one();
+}
+
+void
+QcWorkQueue::Drain()
+{
+    unique_lock<mutex> Guard(Lock);
+    WorkDone.wait(Guard, [this]{ return Queue.empty() && Running == 0; });
+}
+
+size_t
+QcWorkQueue::GetDepth()
+{
+    unique_lock<mutex> Guard(Lock);
+    return Queue.size() + Running;
+}
+
+void
+QcWorkQueue::Run()
+{
+    unique_lock<mutex> Guard(Lock);
+    while (true) {
+        WorkAvailable.wait(Guard, [this]{ return !Queue.empty() || ShuttingDown; });
+        if (Queue.empty()) {
+            return;
+        }
+        auto Work = std::move(Queue.front());
+        Queue.pop_front();
+        Running++;
+        Guard.unlock();
+        Work();
+        Guard.lock();
+        Running--;
+        if (Queue.empty() && Running == 0) {
+            WorkDone.notify_all();
+        }
+    }
+}
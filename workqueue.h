@@ -0,0 +1,38 @@
+/*
+    Licensed under the MIT License.
+*/
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//
+// Fixed pool of threads running posted work in FIFO order. Used to keep slow
+// work (key derivation, file system metadata, syncs) off MsQuic's workers.
+//
+class QcWorkQueue {
+public:
+    QcWorkQueue(_In_ uint32_t ThreadCount);
+    // Runs all posted work, then joins the threads.
+    ~QcWorkQueue();
+
+    void Post(_In_ std::function<void()> Work);
+    // Blocks until all work posted so far has run.
+    void Drain();
+    size_t GetDepth();
+
+private:
+    void Run();
+
+    std::mutex Lock;
+    std::condition_variable WorkAvailable;
+    std::condition_variable WorkDone;
+    std::deque<std::function<void()>> Queue;
+    std::vector<std::thread> Threads;
+    size_t Running{0};
+    bool ShuttingDown{false};
+};